@@ -0,0 +1,173 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <assert.h>
+#include <map>
+
+#define MIN_TRANSACTION_SIZE (::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION))
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) : nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+                                                                          header(block.GetBlockHeader()),
+                                                                          vchBlockSig(block.vchBlockSig)
+{
+    FillShortTxIDSelector();
+    // The coinbase, and the coinstake of a proof-of-stake block, are never in a mempool
+    size_t nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    nPrefilled = std::min(nPrefilled, block.vtx.size());
+    for (size_t i = 0; i < nPrefilled; i++)
+        prefilledtxn.push_back(PrefilledTransaction(i, block.vtx[i]));
+    for (size_t i = nPrefilled; i < block.vtx.size(); i++)
+        shorttxids.push_back(GetShortID(block.vtx[i].GetWitnessHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    CSHA256 hasher;
+    hasher.Write((unsigned char*)&(*stream.begin()), stream.end() - stream.begin());
+    uint256 shorttxidhash;
+    hasher.Finalize(shorttxidhash.begin());
+    shorttxidk0 = ReadLE64(shorttxidhash.begin());
+    shorttxidk1 = ReadLE64(shorttxidhash.begin() + 8);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& wtxhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, wtxhash) & 0xffffffffffffL;
+}
+
+void CBlockHeaderAndShortTxIDs::GetBlockStart(CBlock& block) const
+{
+    block = CBlock(header);
+    block.vchBlockSig = vchBlockSig;
+    for (size_t i = 0; i < prefilledtxn.size() && prefilledtxn[i].index == i; i++)
+        block.vtx.push_back(prefilledtxn[i].tx);
+}
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE_CURRENT / MIN_TRANSACTION_SIZE)
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty());
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.resize(cmpctblock.BlockTxCount());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        const PrefilledTransaction& prefilled = cmpctblock.prefilledtxn[i];
+        if (prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        // Indexes are in increasing order, so with i prefilled before this one,
+        // one past all the short IDs is the furthest it can be
+        if ((size_t)prefilled.index > cmpctblock.shorttxids.size() + i)
+            return READ_STATUS_INVALID;
+        if (i > 0 && prefilled.index <= cmpctblock.prefilledtxn[i - 1].index)
+            return READ_STATUS_INVALID;
+        txn_available[prefilled.index] = prefilled.tx;
+        vHave[prefilled.index] = true;
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    // The short IDs fill the places the prefilled transactions left
+    std::map<uint64_t, uint16_t> mapShortIDs;
+    uint16_t index_offset = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (vHave[i + index_offset])
+            index_offset++;
+        mapShortIDs[cmpctblock.shorttxids[i]] = i + index_offset;
+    }
+    // Two transactions of the block with the same short ID: neither can be
+    // told apart in the mempool, so ask for the whole block
+    if (mapShortIDs.size() != cmpctblock.shorttxids.size())
+        return READ_STATUS_FAILED;
+
+    std::vector<bool> have_txn(txn_available.size());
+    {
+        LOCK(pool->cs);
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = pool->mapTx.begin(); it != pool->mapTx.end(); ++it) {
+            const CTransaction& tx = it->second.GetTx();
+            std::map<uint64_t, uint16_t>::const_iterator idit = mapShortIDs.find(cmpctblock.GetShortID(tx.GetWitnessHash()));
+            if (idit == mapShortIDs.end())
+                continue;
+            if (!have_txn[idit->second]) {
+                txn_available[idit->second] = tx;
+                vHave[idit->second] = true;
+                have_txn[idit->second] = true;
+                mempool_count++;
+            } else if (vHave[idit->second]) {
+                // Two mempool transactions match the short ID: ask for it instead
+                txn_available[idit->second] = CTransaction();
+                vHave[idit->second] = false;
+                mempool_count--;
+            }
+            // With every short ID matched exactly once there's no collision to find
+            if (mempool_count == mapShortIDs.size())
+                break;
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n",
+        cmpctblock.header.GetHash().ToString(), ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < vHave.size());
+    return vHave[index];
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing)
+{
+    assert(!header.IsNull());
+    block = CBlock(header);
+    block.vtx.resize(txn_available.size());
+
+    size_t tx_missing_offset = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (vHave[i]) {
+            block.vtx[i] = txn_available[i];
+            continue;
+        }
+        if (vtx_missing.size() <= tx_missing_offset)
+            return READ_STATUS_INVALID;
+        block.vtx[i] = vtx_missing[tx_missing_offset++];
+    }
+    if (vtx_missing.size() != tx_missing_offset)
+        return READ_STATUS_INVALID;
+    block.vchBlockSig = vchBlockSig;
+
+    // A partial block is filled only once
+    header.SetNull();
+    txn_available.clear();
+    vHave.clear();
+
+    // A short ID collision puts the wrong transaction in the block; that is
+    // no fault of the peer, which will send the full block when asked
+    bool mutated;
+    if (block.BuildMerkleTree(&mutated) != block.hashMerkleRoot || mutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool and %lu txn requested\n",
+        block.GetHash().ToString(), prefilled_count, mempool_count, vtx_missing.size());
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,240 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+
+#include <ios>
+#include <limits>
+#include <stdint.h>
+#include <vector>
+
+class CTxMemPool;
+
+/** The cmpctblock version we speak: short IDs are made from witness transaction
+ *  hashes, so a transaction found in the mempool always has the witness the
+ *  block commits to. */
+static const uint64_t CMPCTBLOCKS_VERSION = 2;
+
+/** Write transaction positions as the differences BIP 152 sends: each one is
+ *  sent as how far past the one before it, plus one, it is. */
+template <typename Stream>
+void WriteDifferentialIndexes(Stream& s, const std::vector<uint16_t>& indexes)
+{
+    WriteCompactSize(s, indexes.size());
+    for (size_t i = 0; i < indexes.size(); i++)
+        WriteCompactSize(s, indexes[i] - (i == 0 ? 0 : indexes[i - 1] + 1));
+}
+
+/** A transaction of a compact block sent along in full, at its position in the block */
+struct PrefilledTransaction {
+    uint16_t index;
+    CTransaction tx;
+
+    PrefilledTransaction() : index(0) {}
+    PrefilledTransaction(uint16_t indexIn, const CTransaction& txIn) : index(indexIn), tx(txIn) {}
+};
+
+/** Asks for transactions of a compact block that couldn't be found in the mempool */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    //! positions in the block, in increasing order
+    std::vector<uint16_t> indexes;
+
+    // Indexes are read and written differently, so this doesn't use ADD_SERIALIZE_METHODS
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, blockhash, nType, nVersion);
+        WriteDifferentialIndexes(s, indexes);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, blockhash, nType, nVersion);
+        uint64_t nCount = ReadCompactSize(s);
+        indexes.clear();
+        uint32_t nNext = 0;
+        while (indexes.size() < nCount) {
+            uint64_t nIndex = nNext + ReadCompactSize(s);
+            if (nIndex > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("indexes overflowed 16 bits");
+            indexes.push_back(nIndex);
+            nNext = nIndex + 1;
+        }
+    }
+};
+
+/** The transactions a getblocktxn asked for, in the order it asked for them */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    explicit BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A block as the cmpctblock message sends it (BIP 152): the header, 6-byte short
+ *  IDs of the transactions the receiver likely has in its mempool, and the rest in
+ *  full. The coinbase is always sent in full, and so is the coinstake of a
+ *  proof-of-stake block, which never goes through the mempool. The block signature
+ *  follows, as it isn't part of the header. */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    //! in increasing order of index
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() : shorttxidk0(0), shorttxidk1(0), nonce(0) {}
+
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& wtxhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+    size_t GetPrefilledCount() const { return prefilledtxn.size(); }
+
+    /** The block as far as its header, signature and the transactions sent in
+     *  full at its start go: the coinbase, and the coinstake of a proof-of-stake
+     *  block. Enough to check the proof of work or stake. */
+    void GetBlockStart(CBlock& block) const;
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, nonce, nType, nVersion);
+        WriteCompactSize(s, shorttxids.size());
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb = shorttxids[i] & 0xffffffff;
+            uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+            ::Serialize(s, lsb, nType, nVersion);
+            ::Serialize(s, msb, nType, nVersion);
+        }
+        WriteCompactSize(s, prefilledtxn.size());
+        for (size_t i = 0; i < prefilledtxn.size(); i++) {
+            WriteCompactSize(s, prefilledtxn[i].index - (i == 0 ? 0 : prefilledtxn[i - 1].index + 1));
+            ::Serialize(s, prefilledtxn[i].tx, nType, nVersion);
+        }
+        ::Serialize(s, vchBlockSig, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, nonce, nType, nVersion);
+        uint64_t nShortIDs = ReadCompactSize(s);
+        shorttxids.clear();
+        while (shorttxids.size() < nShortIDs) {
+            uint32_t lsb = 0;
+            uint16_t msb = 0;
+            ::Unserialize(s, lsb, nType, nVersion);
+            ::Unserialize(s, msb, nType, nVersion);
+            shorttxids.push_back((uint64_t(msb) << 32) | uint64_t(lsb));
+        }
+        uint64_t nPrefilled = ReadCompactSize(s);
+        prefilledtxn.clear();
+        uint32_t nNext = 0;
+        while (prefilledtxn.size() < nPrefilled) {
+            uint64_t nIndex = nNext + ReadCompactSize(s);
+            if (nIndex > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("indexes overflowed 16 bits");
+            prefilledtxn.push_back(PrefilledTransaction(nIndex, CTransaction()));
+            ::Unserialize(s, prefilledtxn.back().tx, nType, nVersion);
+            nNext = nIndex + 1;
+        }
+        ::Unserialize(s, vchBlockSig, nType, nVersion);
+
+        if (BlockTxCount() > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("indexes overflowed 16 bits");
+        FillShortTxIDSelector();
+    }
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    //! the peer sent something invalid
+    READ_STATUS_INVALID,
+    //! we couldn't make sense of it, probably a short ID collision; ask for the full block
+    READ_STATUS_FAILED,
+};
+
+/** A block being put back together from a cmpctblock, with the transactions
+ *  found in the mempool, and then those the peer sends in a blocktxn */
+class PartiallyDownloadedBlock
+{
+protected:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vHave;
+    size_t prefilled_count;
+    size_t mempool_count;
+    CTxMemPool* pool;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    explicit PartiallyDownloadedBlock(CTxMemPool* poolIn) : prefilled_count(0), mempool_count(0), pool(poolIn) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
+    bool IsTxAvailable(size_t index) const;
+    size_t GetTxCount() const { return txn_available.size(); }
+    size_t GetPrefilledCount() const { return prefilled_count; }
+    size_t GetMempoolCount() const { return mempool_count; }
+
+    /** Put the block together with the missing transactions, in order. Fails
+     *  if the merkle root doesn't match, as after a short ID collision. */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing);
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
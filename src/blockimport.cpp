@@ -0,0 +1,234 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+
+#include "blockstorage.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include <boost/bind.hpp>
+
+const int CBlockImportPipeline::MAX_WORKERS;
+const size_t CBlockImportPipeline::DEFAULT_MAX_QUEUED_BYTES;
+
+CBlockImportPipeline::CBlockImportPipeline(const std::vector<CImportFile>& vFilesIn, int nWorkersIn, size_t nMaxQueuedBytesIn) : vFiles(vFilesIn), nWorkers(std::max(1, std::min(nWorkersIn, MAX_WORKERS))), nMaxQueuedBytes(nMaxQueuedBytesIn), nQueuedBytes(0), nSeqRead(0), nSeqNext(0), fReadDone(false), fStop(false), nReadResumed(0)
+{
+    threadRead = boost::thread(boost::bind(&CBlockImportPipeline::ThreadRead, this));
+    for (int i = 0; i < nWorkers; i++)
+        threadsDecode.create_thread(boost::bind(&CBlockImportPipeline::ThreadDecode, this));
+}
+
+CBlockImportPipeline::~CBlockImportPipeline()
+{
+    // this also runs while unwinding from an interrupted import, so don't be interrupted again
+    boost::this_thread::disable_interruption di;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        cond.notify_all();
+    }
+    threadRead.join();
+    threadsDecode.join_all();
+
+    // close the files the reader didn't get to
+    for (std::vector<CImportFile>::iterator it = vFiles.begin(); it != vFiles.end(); ++it) {
+        if (it->file)
+            fclose(it->file);
+    }
+}
+
+bool CBlockImportPipeline::Push(CRecord& record)
+{
+    int64_t nNow = GetTimeMicros();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    stats.nReadMicros += nNow - nReadResumed;
+    // always let one block through, however large, so the reader can't stall for good
+    while (!fStop && nQueuedBytes > 0 && nQueuedBytes + record.vch.size() > nMaxQueuedBytes)
+        cond.wait(lock);
+    if (fStop)
+        return false;
+    record.nSeq = nSeqRead++;
+    nQueuedBytes += record.vch.size();
+    queueRead.push_back(CRecord());
+    CRecord& queued = queueRead.back();
+    queued.nSeq = record.nSeq;
+    queued.nFileIndex = record.nFileIndex;
+    queued.pos = record.pos;
+    queued.vch.swap(record.vch);
+    cond.notify_all();
+    nReadResumed = GetTimeMicros();
+    return true;
+}
+
+bool CBlockImportPipeline::ReadFile(size_t nFileIndex, FILE* file)
+{
+    const int nFile = vFiles[nFileIndex].nFile;
+    try {
+        // This takes over file and calls fclose() on it in the CBufferedFile destructor
+        CBufferedFile blkdat(file, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION);
+        uint64_t nRewind = blkdat.GetPos();
+        while (!blkdat.eof()) {
+            blkdat.SetPos(nRewind);
+            nRewind++;         // start one byte further next time, in case of failure
+            blkdat.SetLimit(); // remove former limit
+            unsigned int nSize = 0;
+            try {
+                // locate a header
+                unsigned char buf[MESSAGE_START_SIZE];
+                blkdat.FindByte(Params().MessageStart()[0]);
+                nRewind = blkdat.GetPos() + 1;
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                    continue;
+                // read size
+                blkdat >> nSize;
+                if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
+                    continue;
+            } catch (const std::exception&) {
+                // no valid block header found; don't complain
+                break;
+            }
+            try {
+                // read block
+                uint64_t nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(nBlockPos + nSize);
+                blkdat.SetPos(nBlockPos);
+                CRecord record;
+                record.vch.resize(nSize);
+                blkdat.read(&record.vch[0], nSize);
+
+                // Only hand on bytes that hold a block. Anything else is scanned
+                // again from one byte past the magic, as a block that fails to
+                // deserialize always was.
+                CBlockSpan span;
+                span.Swap(record.vch);
+                bool fBlock = CLazyBlock(span).Parse();
+                span.Swap(record.vch);
+                if (!fBlock)
+                    continue;
+                nRewind = blkdat.GetPos();
+
+                record.nFileIndex = nFileIndex;
+                if (nFile >= 0)
+                    record.pos = CDiskBlockPos(nFile, nBlockPos);
+                if (!Push(record))
+                    return false;
+            } catch (const std::exception& e) {
+                LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        strError = e.what();
+        return false;
+    }
+    return true;
+}
+
+void CBlockImportPipeline::ThreadRead()
+{
+    RenameThread("stakecubecoin-loadread");
+    nReadResumed = GetTimeMicros();
+    for (size_t i = 0; i < vFiles.size(); i++) {
+        FILE* file = vFiles[i].file;
+        vFiles[i].file = NULL;
+        if (!file)
+            file = fopen(vFiles[i].path.string().c_str(), "rb");
+        if (!file) {
+            LogPrintf("Unable to open file %s\n", vFiles[i].path.string());
+            continue;
+        }
+        if (!ReadFile(i, file))
+            break;
+    }
+
+    int64_t nNow = GetTimeMicros();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    stats.nReadMicros += nNow - nReadResumed;
+    fReadDone = true;
+    cond.notify_all();
+}
+
+void CBlockImportPipeline::ThreadDecode()
+{
+    RenameThread("stakecubecoin-loaddec");
+    while (true) {
+        CRecord record;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && queueRead.empty() && !fReadDone)
+                cond.wait(lock);
+            if (fStop || queueRead.empty())
+                return;
+            CRecord& front = queueRead.front();
+            record.nSeq = front.nSeq;
+            record.nFileIndex = front.nFileIndex;
+            record.pos = front.pos;
+            record.vch.swap(front.vch);
+            queueRead.pop_front();
+        }
+
+        int64_t nTimeStart = GetTimeMicros();
+        boost::shared_ptr<CImportedBlock> imported(new CImportedBlock());
+        imported->pos = record.pos;
+        imported->nFileIndex = record.nFileIndex;
+        imported->nSize = record.vch.size();
+        try {
+            CSpanStream s(&record.vch[0], &record.vch[0] + record.vch.size(), SER_DISK, CLIENT_VERSION);
+            s >> imported->block;
+            // the header hash is cached in the block, so the connecting thread doesn't redo it
+            imported->block.GetHash();
+        } catch (const std::exception& e) {
+            imported->block.SetNull();
+            imported->strError = e.what();
+        }
+        int64_t nTimeDecode = GetTimeMicros() - nTimeStart;
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        stats.nDecodeMicros += nTimeDecode;
+        mapDecoded[record.nSeq] = imported;
+        cond.notify_all();
+    }
+}
+
+bool CBlockImportPipeline::Next(boost::shared_ptr<CImportedBlock>& block)
+{
+    int64_t nTimeStart = GetTimeMicros();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while ((mapDecoded.empty() || mapDecoded.begin()->first != nSeqNext) && !(fReadDone && nSeqNext == nSeqRead))
+        cond.wait(lock);
+    stats.nWaitMicros += GetTimeMicros() - nTimeStart;
+    if (mapDecoded.empty() || mapDecoded.begin()->first != nSeqNext)
+        return false;
+
+    block = mapDecoded.begin()->second;
+    mapDecoded.erase(mapDecoded.begin());
+    nSeqNext++;
+    nQueuedBytes -= block->nSize;
+    stats.nBlocks++;
+    stats.nBytes += block->nSize;
+    if (!block->strError.empty())
+        stats.nErrors++;
+    cond.notify_all();
+    return true;
+}
+
+CBlockImportStats CBlockImportPipeline::GetStats()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return stats;
+}
+
+std::string CBlockImportPipeline::GetError()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return strError;
+}
@@ -0,0 +1,131 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKIMPORT_H
+#define BITCOIN_BLOCKIMPORT_H
+
+#include "chain.h"
+#include "primitives/block.h"
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/** A file to import blocks from */
+struct CImportFile {
+    boost::filesystem::path path;
+    //! an already opened file, which the import takes over; NULL to open path when its turn comes
+    FILE* file;
+    //! number of the blk?????.dat file when reindexing, so block positions are recorded against it; -1 otherwise
+    int nFile;
+
+    CImportFile(const boost::filesystem::path& pathIn, FILE* fileIn = NULL, int nFileIn = -1) : path(pathIn), file(fileIn), nFile(nFileIn) {}
+};
+
+/** A block found in an import file, deserialized and hashed */
+struct CImportedBlock {
+    CBlock block;
+    //! where the block is stored; null unless reindexing
+    CDiskBlockPos pos;
+    //! index into the list of files being imported
+    size_t nFileIndex;
+    size_t nSize;
+    //! why the block couldn't be deserialized, if it couldn't
+    std::string strError;
+
+    CImportedBlock() : nFileIndex(0), nSize(0) {}
+};
+
+struct CBlockImportStats {
+    uint64_t nBlocks;
+    uint64_t nBytes;
+    //! blocks that were found but didn't deserialize
+    uint64_t nErrors;
+    //! time the reader spent reading and locating blocks, not waiting for room in the queue
+    int64_t nReadMicros;
+    //! time spent deserializing and hashing, summed over the workers
+    int64_t nDecodeMicros;
+    //! time the connecting thread spent waiting for the next block
+    int64_t nWaitMicros;
+
+    CBlockImportStats() : nBlocks(0), nBytes(0), nErrors(0), nReadMicros(0), nDecodeMicros(0), nWaitMicros(0) {}
+};
+
+/** Imports blocks from a list of files in three stages. A reader thread reads
+ *  the files ahead and locates the blocks in them, worker threads deserialize
+ *  and hash the blocks, and the caller takes them from Next() in file order,
+ *  to connect them one at a time as before. */
+class CBlockImportPipeline
+{
+public:
+    static const int MAX_WORKERS = 8;
+    //! how many bytes of read but not yet connected blocks to hold at most
+    static const size_t DEFAULT_MAX_QUEUED_BYTES = 64 << 20;
+
+private:
+    struct CRecord {
+        uint64_t nSeq;
+        size_t nFileIndex;
+        CDiskBlockPos pos;
+        std::vector<char> vch;
+    };
+
+    std::vector<CImportFile> vFiles;
+    int nWorkers;
+    size_t nMaxQueuedBytes;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    //! blocks read but not yet deserialized, in file order
+    std::deque<CRecord> queueRead;
+    //! blocks deserialized, by sequence number, until the caller takes them in order
+    std::map<uint64_t, boost::shared_ptr<CImportedBlock> > mapDecoded;
+    size_t nQueuedBytes;
+    uint64_t nSeqRead;
+    uint64_t nSeqNext;
+    bool fReadDone;
+    bool fStop;
+    std::string strError;
+    CBlockImportStats stats;
+    //! when the reader last went back to reading after handing on a block
+    int64_t nReadResumed;
+
+    boost::thread threadRead;
+    boost::thread_group threadsDecode;
+
+    void ThreadRead();
+    void ThreadDecode();
+    //! Queue a block for the workers, waiting for room first; false once stopped
+    bool Push(CRecord& record);
+    //! Locate the blocks in one file and queue them; false once stopped
+    bool ReadFile(size_t nFileIndex, FILE* file);
+
+public:
+    /** Start importing vFilesIn with nWorkers threads deserializing */
+    CBlockImportPipeline(const std::vector<CImportFile>& vFilesIn, int nWorkersIn, size_t nMaxQueuedBytesIn = DEFAULT_MAX_QUEUED_BYTES);
+    ~CBlockImportPipeline();
+
+    /** Wait for the next block in file order; false once all files are done */
+    bool Next(boost::shared_ptr<CImportedBlock>& block);
+
+    int GetWorkers() const { return nWorkers; }
+
+    const boost::filesystem::path& GetPath(size_t nFileIndex) const { return vFiles[nFileIndex].path; }
+
+    CBlockImportStats GetStats();
+
+    //! A system error that stopped the reader, if any
+    std::string GetError();
+};
+
+#endif // BITCOIN_BLOCKIMPORT_H
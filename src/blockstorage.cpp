@@ -0,0 +1,290 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstorage.h"
+
+#include "clientversion.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "util.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+
+CBlockFileCache blockFileCache;
+
+const size_t CBlockFileCache::MAX_OPEN_FILES;
+
+CBlockFileMapping::~CBlockFileMapping()
+{
+#ifndef WIN32
+    munmap((void*)pBegin, nSize);
+#endif
+}
+
+CBlockFileHandle::~CBlockFileHandle()
+{
+    fclose(file);
+}
+
+size_t CBlockFileHandle::Read(uint64_t nPos, char* pch, size_t nSize)
+{
+    size_t nRead = 0;
+#ifdef WIN32
+    LOCK(cs);
+    if (fseek(file, nPos, SEEK_SET))
+        return 0;
+    nRead = fread(pch, 1, nSize, file);
+#else
+    int fd = fileno(file);
+    while (nRead < nSize) {
+        ssize_t n = pread(fd, pch + nRead, nSize - nRead, nPos + nRead);
+        if (n <= 0)
+            break;
+        nRead += n;
+    }
+#endif
+    return nRead;
+}
+
+boost::shared_ptr<const CBlockFileMapping> CBlockFileHandle::Map(uint64_t nEnd)
+{
+#ifdef WIN32
+    return boost::shared_ptr<const CBlockFileMapping>();
+#else
+    // a few hundred megabytes of block files would exhaust a 32-bit address space
+    if (sizeof(void*) < 8)
+        return boost::shared_ptr<const CBlockFileMapping>();
+
+    LOCK(cs);
+    if (mapping && mapping->size() >= nEnd)
+        return mapping;
+
+    // The file grew since it was last mapped. Blocks are only ever appended, and a
+    // finalized file is only truncated behind its last block, so the bytes below
+    // nEnd stay valid for as long as the mapping lives.
+    int fd = fileno(file);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size < nEnd)
+        return boost::shared_ptr<const CBlockFileMapping>();
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        LogPrintf("%s : mmap failed: %s\n", __func__, strerror(errno));
+        return boost::shared_ptr<const CBlockFileMapping>();
+    }
+    mapping.reset(new CBlockFileMapping((const char*)p, st.st_size));
+    return mapping;
+#endif
+}
+
+bool CBlockSpan::Load(CBlockFileHandle& handle, uint64_t nPos, size_t nSizeIn)
+{
+    mapping = handle.Map(nPos + nSizeIn);
+    std::vector<char>().swap(vchCopy);
+    if (mapping) {
+        pBegin = mapping->begin() + nPos;
+        nSize = nSizeIn;
+        return true;
+    }
+
+    // no mapping, so copy the bytes out instead
+    vchCopy.resize(nSizeIn);
+    if (nSizeIn > 0 && handle.Read(nPos, &vchCopy[0], nSizeIn) != nSizeIn) {
+        std::vector<char>().swap(vchCopy);
+        pBegin = NULL;
+        nSize = 0;
+        return false;
+    }
+    pBegin = vchCopy.empty() ? NULL : &vchCopy[0];
+    nSize = nSizeIn;
+    return true;
+}
+
+void CBlockSpan::Swap(std::vector<char>& vch)
+{
+    mapping.reset();
+    vchCopy.swap(vch);
+    pBegin = vchCopy.empty() ? NULL : &vchCopy[0];
+    nSize = vchCopy.size();
+}
+
+static void SkipCompactBytes(CSpanStream& s)
+{
+    s.ignore(ReadCompactSize(s));
+}
+
+bool CLazyBlock::Parse()
+{
+    vTxRange.clear();
+    fWitness = false;
+    try {
+        CSpanStream s(span.begin(), span.end(), SER_DISK, CLIENT_VERSION);
+        s.ignore(CBlockHeader::HEADER_SIZE);
+        uint64_t nTx = ReadCompactSize(s);
+        // Walk each transaction the way SerializeTransaction reads it, skipping
+        // over scripts and witness items instead of copying them
+        for (uint64_t i = 0; i < nTx; i++) {
+            const char* pStart = s.GetPos();
+            s.ignore(4); // nVersion
+            uint64_t nIn = ReadCompactSize(s);
+            unsigned char flags = 0;
+            bool fOutputs = true;
+            if (nIn == 0) {
+                s >> flags;
+                if (flags != 0)
+                    nIn = ReadCompactSize(s);
+                else
+                    fOutputs = false;
+            }
+            for (uint64_t j = 0; j < nIn; j++) {
+                s.ignore(36); // prevout
+                SkipCompactBytes(s);
+                s.ignore(4); // nSequence
+            }
+            if (fOutputs) {
+                uint64_t nOut = ReadCompactSize(s);
+                for (uint64_t j = 0; j < nOut; j++) {
+                    s.ignore(8); // nValue
+                    SkipCompactBytes(s);
+                }
+            }
+            if (flags & 1) {
+                flags ^= 1;
+                fWitness = true;
+                for (uint64_t j = 0; j < nIn; j++) {
+                    uint64_t nItems = ReadCompactSize(s);
+                    for (uint64_t k = 0; k < nItems; k++)
+                        SkipCompactBytes(s);
+                }
+            }
+            if (flags)
+                throw std::ios_base::failure("Unknown transaction optional data");
+            s.ignore(4); // nLockTime
+            vTxRange.push_back(std::make_pair((size_t)(pStart - span.begin()), (size_t)(s.GetPos() - pStart)));
+        }
+
+        // proof-of-stake blocks end with the staker's signature
+        if (vTxRange.size() > 1) {
+            CTransaction tx;
+            GetTransaction(1, tx);
+            if (tx.IsCoinStake())
+                SkipCompactBytes(s);
+        }
+        if (!s.empty())
+            throw std::ios_base::failure("trailing data");
+    } catch (const std::exception&) {
+        vTxRange.clear();
+        fWitness = false;
+        return false;
+    }
+    return true;
+}
+
+CBlockHeader CLazyBlock::GetHeader() const
+{
+    CSpanStream s(span.begin(), span.end(), SER_DISK, CLIENT_VERSION);
+    CBlockHeader header;
+    s >> header;
+    return header;
+}
+
+void CLazyBlock::GetTransaction(size_t n, CTransaction& tx) const
+{
+    const char* pBegin = span.begin() + vTxRange.at(n).first;
+    CSpanStream s(pBegin, pBegin + vTxRange[n].second, SER_DISK, CLIENT_VERSION);
+    s >> tx;
+}
+
+boost::shared_ptr<CBlockFileHandle> CBlockFileCache::Get(int nFile)
+{
+    LOCK(cs);
+    nUses++;
+    for (std::vector<CEntry>::iterator it = vEntries.begin(); it != vEntries.end(); ++it) {
+        if (it->nFile == nFile) {
+            it->nLastUsed = nUses;
+            return it->handle;
+        }
+    }
+
+    boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file) {
+        LogPrintf("Unable to open file %s\n", path.string());
+        return boost::shared_ptr<CBlockFileHandle>();
+    }
+    nOpened++;
+
+    CEntry entry;
+    entry.nFile = nFile;
+    entry.handle.reset(new CBlockFileHandle(file));
+    entry.nLastUsed = nUses;
+    if (vEntries.size() < MAX_OPEN_FILES) {
+        vEntries.push_back(entry);
+    } else {
+        // replace the least recently used one; it closes once its readers are done
+        std::vector<CEntry>::iterator itOldest = vEntries.begin();
+        for (std::vector<CEntry>::iterator it = vEntries.begin(); it != vEntries.end(); ++it) {
+            if (it->nLastUsed < itOldest->nLastUsed)
+                itOldest = it;
+        }
+        *itOldest = entry;
+    }
+    return entry.handle;
+}
+
+void CBlockFileCache::Clear()
+{
+    LOCK(cs);
+    vEntries.clear();
+}
+
+size_t CBlockFileCache::size() const
+{
+    LOCK(cs);
+    return vEntries.size();
+}
+
+void CBlockFileCache::GetCounters(uint64_t& nUsesOut, uint64_t& nOpenedOut) const
+{
+    LOCK(cs);
+    nUsesOut = nUses;
+    nOpenedOut = nOpened;
+}
+
+CBlockFileStream::CBlockFileStream(const CDiskBlockPos& pos, int nTypeIn, int nVersionIn, size_t nReadAheadIn) : nType(nTypeIn), nVersion(nVersionIn), nReadPos(pos.nPos), nBufPos(pos.nPos), nReadAhead(nReadAheadIn)
+{
+    if (!pos.IsNull())
+        handle = blockFileCache.Get(pos.nFile);
+}
+
+CBlockFileStream& CBlockFileStream::read(char* pch, size_t nSize)
+{
+    if (!handle)
+        throw std::ios_base::failure("CBlockFileStream::read : file handle is NULL");
+    while (nSize > 0) {
+        if (nReadPos < nBufPos || nReadPos >= nBufPos + vchBuf.size()) {
+            // refill the buffer at the read position
+            vchBuf.resize(std::max(nSize, nReadAhead));
+            nBufPos = nReadPos;
+            vchBuf.resize(handle->Read(nBufPos, &vchBuf[0], vchBuf.size()));
+            if (vchBuf.empty())
+                throw std::ios_base::failure("CBlockFileStream::read : end of file");
+        }
+        size_t nOffset = nReadPos - nBufPos;
+        size_t nNow = std::min(nSize, vchBuf.size() - nOffset);
+        memcpy(pch, &vchBuf[nOffset], nNow);
+        pch += nNow;
+        nSize -= nNow;
+        nReadPos += nNow;
+    }
+    return (*this);
+}
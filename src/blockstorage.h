@@ -0,0 +1,269 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKSTORAGE_H
+#define BITCOIN_BLOCKSTORAGE_H
+
+#include "chain.h"
+#include "serialize.h"
+#include "sync.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+class CBlockFileCache;
+class CBlockHeader;
+class CTransaction;
+
+extern CBlockFileCache blockFileCache;
+
+/** A read-only memory mapping of the first nSize bytes of a block file */
+class CBlockFileMapping
+{
+private:
+    const char* pBegin;
+    size_t nSize;
+
+    CBlockFileMapping(const CBlockFileMapping&);
+    void operator=(const CBlockFileMapping&);
+
+public:
+    CBlockFileMapping(const char* pBeginIn, size_t nSizeIn) : pBegin(pBeginIn), nSize(nSizeIn) {}
+    ~CBlockFileMapping();
+
+    const char* begin() const { return pBegin; }
+    size_t size() const { return nSize; }
+};
+
+/** A read-only handle to a block file, shared by any number of readers */
+class CBlockFileHandle
+{
+private:
+    FILE* file;
+    CCriticalSection cs;
+    //! the current mapping of the file; readers keep older ones alive as long as they need them
+    boost::shared_ptr<const CBlockFileMapping> mapping;
+
+    CBlockFileHandle(const CBlockFileHandle&);
+    void operator=(const CBlockFileHandle&);
+
+public:
+    explicit CBlockFileHandle(FILE* fileIn) : file(fileIn) {}
+    ~CBlockFileHandle();
+
+    /** Read up to nSize bytes at position nPos, returning how many were read */
+    size_t Read(uint64_t nPos, char* pch, size_t nSize);
+
+    /** Return a mapping of the file that covers its first nEnd bytes. The file is
+     *  mapped again if it grew past the current mapping. Returns an empty pointer
+     *  if the file is shorter or can't be mapped, as on Windows and 32-bit systems. */
+    boost::shared_ptr<const CBlockFileMapping> Map(uint64_t nEnd);
+};
+
+/** The raw bytes of a stored block. They are mapped from the block file where
+ *  possible and read into memory otherwise. Serializing a span writes the bytes
+ *  as they are. */
+class CBlockSpan
+{
+private:
+    boost::shared_ptr<const CBlockFileMapping> mapping;
+    std::vector<char> vchCopy;
+    const char* pBegin;
+    size_t nSize;
+
+    CBlockSpan(const CBlockSpan&);
+    void operator=(const CBlockSpan&);
+
+public:
+    CBlockSpan() : pBegin(NULL), nSize(0) {}
+
+    /** Point the span at nSize bytes at position nPos of a block file */
+    bool Load(CBlockFileHandle& handle, uint64_t nPos, size_t nSize);
+
+    /** Point the span at bytes already in memory by swapping them with its own
+     *  copy; swapping again hands them back */
+    void Swap(std::vector<char>& vch);
+
+    const char* begin() const { return pBegin; }
+    const char* end() const { return pBegin + nSize; }
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    //! whether the bytes are mapped from the file instead of copied
+    bool IsMapped() const { return mapping != NULL; }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return nSize;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        s.write(pBegin, nSize);
+    }
+};
+
+/** Deserializes from a range of memory it doesn't own */
+class CSpanStream
+{
+private:
+    int nType;
+    int nVersion;
+    const char* pCur;
+    const char* pEnd;
+
+public:
+    CSpanStream(const char* pBegin, const char* pEndIn, int nTypeIn, int nVersionIn) : nType(nTypeIn), nVersion(nVersionIn), pCur(pBegin), pEnd(pEndIn) {}
+
+    const char* GetPos() const { return pCur; }
+    bool empty() const { return pCur == pEnd; }
+
+    //
+    // Stream subset
+    //
+    int GetType() { return nType; }
+    int GetVersion() { return nVersion; }
+
+    CSpanStream& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pEnd - pCur))
+            throw std::ios_base::failure("CSpanStream::read : end of data");
+        memcpy(pch, pCur, nSize);
+        pCur += nSize;
+        return (*this);
+    }
+
+    CSpanStream& ignore(size_t nSize)
+    {
+        if (nSize > (size_t)(pEnd - pCur))
+            throw std::ios_base::failure("CSpanStream::ignore : end of data");
+        pCur += nSize;
+        return (*this);
+    }
+
+    template <typename T>
+    CSpanStream& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+/** A view of a stored block that finds where its transactions start and end
+ *  without deserializing them. The header and single transactions are only
+ *  deserialized when asked for. The span must outlive the view. */
+class CLazyBlock
+{
+private:
+    const CBlockSpan& span;
+    //! offset and size of each transaction in the span
+    std::vector<std::pair<size_t, size_t> > vTxRange;
+    bool fWitness;
+
+public:
+    explicit CLazyBlock(const CBlockSpan& spanIn) : span(spanIn), fWitness(false) {}
+
+    /** Walk the transactions; false if the bytes don't hold a well-formed block */
+    bool Parse();
+
+    CBlockHeader GetHeader() const;
+    size_t GetTxCount() const { return vTxRange.size(); }
+    //! whether any transaction carries witness data
+    bool HasWitness() const { return fWitness; }
+    void GetTransaction(size_t n, CTransaction& tx) const;
+};
+
+/** Keeps the most recently used block files open for reading, so looking up a
+ *  transaction or a block doesn't open and close its file every time. */
+class CBlockFileCache
+{
+public:
+    static const size_t MAX_OPEN_FILES = 16;
+
+private:
+    struct CEntry {
+        int nFile;
+        boost::shared_ptr<CBlockFileHandle> handle;
+        uint64_t nLastUsed;
+    };
+
+    mutable CCriticalSection cs;
+    std::vector<CEntry> vEntries;
+    uint64_t nUses;
+    uint64_t nOpened;
+
+public:
+    CBlockFileCache() : nUses(0), nOpened(0) {}
+
+    /** Return a handle to blk?????.dat number nFile, or an empty pointer if it can't be opened */
+    boost::shared_ptr<CBlockFileHandle> Get(int nFile);
+
+    /** Close the handles. Readers holding one keep it until they let go. */
+    void Clear();
+
+    size_t size() const;
+
+    //! How many handles were asked for, and how many of those had to open the file
+    void GetCounters(uint64_t& nUsesOut, uint64_t& nOpenedOut) const;
+};
+
+/** Deserializes from a block file through a handle of blockFileCache. It reads
+ *  ahead in chunks with positioned reads instead of seeking a FILE* of its own. */
+class CBlockFileStream
+{
+private:
+    CBlockFileStream(const CBlockFileStream&);
+    CBlockFileStream& operator=(const CBlockFileStream&);
+
+    int nType;
+    int nVersion;
+
+    boost::shared_ptr<CBlockFileHandle> handle;
+    //! position in the file of the next byte to deserialize
+    uint64_t nReadPos;
+    //! position in the file of vchBuf[0]
+    uint64_t nBufPos;
+    size_t nReadAhead;
+    std::vector<char> vchBuf;
+
+public:
+    CBlockFileStream(const CDiskBlockPos& pos, int nTypeIn, int nVersionIn, size_t nReadAheadIn = 4096);
+
+    bool IsNull() const { return !handle; }
+
+    uint64_t GetPos() const { return nReadPos; }
+
+    //
+    // Stream subset
+    //
+    int GetType() { return nType; }
+    int GetVersion() { return nVersion; }
+
+    CBlockFileStream& read(char* pch, size_t nSize);
+
+    //! Skip nSize bytes without reading them
+    CBlockFileStream& ignore(size_t nSize)
+    {
+        nReadPos += nSize;
+        return (*this);
+    }
+
+    template <typename T>
+    CBlockFileStream& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        if (!handle)
+            throw std::ios_base::failure("CBlockFileStream::operator>> : file handle is NULL");
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+#endif // BITCOIN_BLOCKSTORAGE_H
@@ -7,6 +7,39 @@
 
 using namespace std;
 
+/**
+ * CBlockIndexArena implementation
+ */
+CBlockIndex* CBlockIndexArena::Allocate(const CBlockIndex& index)
+{
+    if (vChunks.empty() || vChunks.back().size() == CHUNK_SIZE) {
+        vChunks.push_back(std::vector<CBlockIndex>());
+        vChunks.back().reserve(CHUNK_SIZE);
+    }
+    vChunks.back().push_back(index);
+    return &vChunks.back().back();
+}
+
+size_t CBlockIndexArena::size() const
+{
+    return vChunks.empty() ? 0 : (vChunks.size() - 1) * CHUNK_SIZE + vChunks.back().size();
+}
+
+size_t CBlockIndexArena::DynamicMemoryUsage() const
+{
+    return vChunks.size() * CHUNK_SIZE * sizeof(CBlockIndex) + vChunks.capacity() * sizeof(std::vector<CBlockIndex>);
+}
+
+void CBlockIndexArena::Swap(CBlockIndexArena& other)
+{
+    vChunks.swap(other.vChunks);
+}
+
+void CBlockIndexArena::Clear()
+{
+    vChunks.clear();
+}
+
 /**
  * CChain implementation
  */
@@ -23,6 +56,39 @@ void CChain::SetTip(CBlockIndex* pindex)
     }
 }
 
+void CChainHashes::SetTip(const CBlockIndex* pindex)
+{
+    LOCK(cs);
+    if (pindex == NULL) {
+        vHashes.clear();
+        return;
+    }
+    vHashes.resize(pindex->nHeight + 1);
+    while (pindex && vHashes[pindex->nHeight] != pindex->GetBlockHash()) {
+        vHashes[pindex->nHeight] = pindex->GetBlockHash();
+        pindex = pindex->pprev;
+    }
+}
+
+int CChainHashes::Height() const
+{
+    LOCK(cs);
+    return (int)vHashes.size() - 1;
+}
+
+bool CChainHashes::GetHash(int nHeight, uint256& hash, int* pnHeight) const
+{
+    LOCK(cs);
+    if (nHeight < 0)
+        nHeight += vHashes.size();
+    if (nHeight < 0 || nHeight >= (int)vHashes.size())
+        return false;
+    hash = vHashes[nHeight];
+    if (pnHeight)
+        *pnHeight = nHeight;
+    return true;
+}
+
 CBlockLocator CChain::GetLocator(const CBlockIndex* pindex) const
 {
     int nStep = 1;
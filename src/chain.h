@@ -9,6 +9,7 @@
 
 #include "pow.h"
 #include "primitives/block.h"
+#include "sync.h"
 #include "tinyformat.h"
 #include "uint256.h"
 #include "util.h"
@@ -107,24 +108,42 @@ enum BlockStatus {
 class CBlockIndex
 {
 public:
+    // Fields read by chain walks (GetAncestor, FindMostWorkChain, CheckBlockIndex, ...) come
+    // first, so a walk only touches the head of each entry.
+
     //! pointer to the hash of the block, if any. memory is owned by this CBlockIndex
     const uint256* phashBlock;
 
     //! pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
-    //! pointer to the index of the next block
-    CBlockIndex* pnext;
-
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
-    //ppcoin: trust score of block chain
-    uint256 bnChainTrust;
-
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
+    //! Verification status of this block. See enum BlockStatus
+    unsigned int nStatus;
+
+    //! block header time and difficulty
+    unsigned int nTime;
+    unsigned int nBits;
+
+    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
+    uint32_t nSequenceId;
+
+    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
+    uint256 nChainWork;
+
+    // Everything below is only read once an entry has been found.
+
+    //! pointer to the index of the next block
+    CBlockIndex* pnext;
+
+    //! (memory only) pointer to the nearest block at or before this one that generated a stake modifier
+    const CBlockIndex* pstakeModifier;
+
     //! Which # file this block is stored in (blk?????.dat)
     int nFile;
 
@@ -134,9 +153,6 @@ public:
     //! Byte offset within rev?????.dat where this block's undo data is stored
     unsigned int nUndoPos;
 
-    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
-    uint256 nChainWork;
-
     //! Number of transactions in this block.
     //! Note: in a potential headers-first mode, this number cannot be relied upon
     unsigned int nTx;
@@ -146,9 +162,6 @@ public:
     //! Change to 64-bit type when necessary; won't happen before 2030
     unsigned int nChainTx;
 
-    //! Verification status of this block. See enum BlockStatus
-    unsigned int nStatus;
-
     unsigned int nFlags; // ppcoin: block index flags
     enum {
         BLOCK_PROOF_OF_STAKE = (1 << 0), // is proof-of-stake block
@@ -156,31 +169,28 @@ public:
         BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
     };
 
+    //! rest of the block header
+    int nVersion;
+    unsigned int nNonce;
+    uint256 hashMerkleRoot;
+
     // proof-of-stake specific fields
     uint256 GetBlockTrust() const;
     uint64_t nStakeModifier;             // hash modifier for proof-of-stake
     unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
-    COutPoint prevoutStake;
     unsigned int nStakeTime;
+    COutPoint prevoutStake;
     uint256 hashProofOfStake;
     int64_t nMint;
     int64_t nMoneySupply;
-
-    //! block header
-    int nVersion;
-    uint256 hashMerkleRoot;
-    unsigned int nTime;
-    unsigned int nBits;
-    unsigned int nNonce;
-
-    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
-    uint32_t nSequenceId;
     
     void SetNull()
     {
         phashBlock = NULL;
         pprev = NULL;
+        pnext = NULL;
         pskip = NULL;
+        pstakeModifier = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -222,7 +232,6 @@ public:
         nNonce = block.nNonce;
 
         //Proof of Stake
-        bnChainTrust = uint256();
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -344,6 +353,15 @@ public:
             nFlags |= BLOCK_STAKE_MODIFIER;
     }
 
+    //! Link this entry to the block that generated its stake modifier. Requires pprev to be linked already.
+    void BuildStakeModifierLink()
+    {
+        if (GeneratedStakeModifier())
+            pstakeModifier = this;
+        else
+            pstakeModifier = pprev ? pprev->pstakeModifier : NULL;
+    }
+
     /**
      * Returns true if there are nRequired or more blocks of minVersion or above
      * in the last Params().ToCheckBlockUpgradeMajority() blocks, starting at pstart 
@@ -451,7 +469,15 @@ public:
 
     }
 
+    //! The hash of the index this was built from; only deserialized entries have to rebuild it from the header
     uint256 GetBlockHash() const
+    {
+        if (phashBlock)
+            return *phashBlock;
+        return ConstructBlockHash();
+    }
+
+    uint256 ConstructBlockHash() const
     {
         CBlockHeader block;
         block.nVersion = nVersion;
@@ -475,6 +501,28 @@ public:
     }
 };
 
+/**
+ * Storage for the block index. Entries are allocated in contiguous chunks and
+ * live until Clear(), so there is no per-entry heap overhead and blocks that
+ * were added together (in practice, consecutive heights) share pages and cache
+ * lines when the chain is walked. Guarded by cs_main, like mapBlockIndex.
+ */
+class CBlockIndexArena
+{
+private:
+    static const size_t CHUNK_SIZE = 4096;
+
+    // each chunk is reserved up front and never grows past it, so entries don't move
+    std::vector<std::vector<CBlockIndex> > vChunks;
+
+public:
+    CBlockIndex* Allocate(const CBlockIndex& index = CBlockIndex());
+    size_t size() const;
+    size_t DynamicMemoryUsage() const;
+    void Swap(CBlockIndexArena& other);
+    void Clear();
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain
 {
@@ -549,4 +597,28 @@ public:
     const CBlockIndex* FindFork(const CBlockIndex* pindex) const;
 };
 
+/**
+ * Height -> hash view of a CChain that can be read without holding cs_main.
+ * SetTip follows the chain it shadows and, like CChain::SetTip, only rewrites
+ * the heights a reorganization changed.
+ */
+class CChainHashes
+{
+private:
+    mutable CCriticalSection cs;
+    std::vector<uint256> vHashes;
+
+public:
+    void SetTip(const CBlockIndex* pindex);
+
+    /** Height of the tip, or -1 if the chain is empty. */
+    int Height() const;
+
+    /**
+     * Hash of the block at nHeight. A negative nHeight counts back from the tip,
+     * -1 being the tip itself. pnHeight, if given, receives the resolved height.
+     */
+    bool GetHash(int nHeight, uint256& hash, int* pnHeight = NULL) const;
+};
+
 #endif // BITCOIN_CHAIN_H
@@ -5,70 +5,23 @@
 
 #include "coins.h"
 
+#include "primitives/block.h"
 #include "random.h"
+#include "version.h"
 
 #include <assert.h>
+#include <stdexcept>
 
-/**
- * calculate number of bytes for the bitmask, and its number of non-zero bytes
- * each bit in the bitmask represents the availability of one output, but the
- * availabilities of the first two outputs are encoded separately
- */
-void CCoins::CalcMaskSize(unsigned int& nBytes, unsigned int& nNonzeroBytes) const
-{
-    unsigned int nLastUsedByte = 0;
-    for (unsigned int b = 0; 2 + b * 8 < vout.size(); b++) {
-        bool fZero = true;
-        for (unsigned int i = 0; i < 8 && 2 + b * 8 + i < vout.size(); i++) {
-            if (!vout[2 + b * 8 + i].IsNull()) {
-                fZero = false;
-                continue;
-            }
-        }
-        if (!fZero) {
-            nLastUsedByte = b + 1;
-            nNonzeroBytes++;
-        }
-    }
-    nBytes += nLastUsedByte;
-}
-
-bool CCoins::Spend(const COutPoint& out, CTxInUndo& undo)
-{
-    if (out.n >= vout.size())
-        return false;
-    if (vout[out.n].IsNull())
-        return false;
-    undo = CTxInUndo(vout[out.n]);
-    vout[out.n].SetNull();
-    Cleanup();
-    if (vout.size() == 0) {
-        undo.nHeight = nHeight;
-        undo.fCoinBase = fCoinBase;
-        undo.fCoinStake = fCoinStake;
-        undo.nVersion = this->nVersion;
-    }
-    return true;
-}
-
-bool CCoins::Spend(int nPos)
-{
-    CTxInUndo undo;
-    COutPoint out(0, nPos);
-    return Spend(out, undo);
-}
-
-
-bool CCoinsView::GetCoins(const uint256& txid, CCoins& coins) const { return false; }
-bool CCoinsView::HaveCoins(const uint256& txid) const { return false; }
+bool CCoinsView::GetCoin(const COutPoint& outpoint, Coin& coin) const { return false; }
+bool CCoinsView::HaveCoin(const COutPoint& outpoint) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
 bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
 bool CCoinsView::GetStats(CCoinsStats& stats) const { return false; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView* viewIn) : base(viewIn) {}
-bool CCoinsViewBacked::GetCoins(const uint256& txid, CCoins& coins) const { return base->GetCoins(txid, coins); }
-bool CCoinsViewBacked::HaveCoins(const uint256& txid) const { return base->HaveCoins(txid); }
+bool CCoinsViewBacked::GetCoin(const COutPoint& outpoint, Coin& coin) const { return base->GetCoin(outpoint, coin); }
+bool CCoinsViewBacked::HaveCoin(const COutPoint& outpoint) const { return base->HaveCoin(outpoint); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView& viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
@@ -76,78 +29,120 @@ bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStat
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hashBlock(0), cachedCoinsUsage(0) {}
 
-CCoinsViewCache::~CCoinsViewCache()
+size_t CCoinsViewCache::DynamicMemoryUsage() const
 {
-    assert(!hasModifier);
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
 }
 
-CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
+CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint& outpoint) const
 {
-    CCoinsMap::iterator it = cacheCoins.find(txid);
-    if (it != cacheCoins.end())
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
+    if (it != cacheCoins.end()) {
+        counters.nHits++;
+        it->second.flags |= CCoinsCacheEntry::RECENT;
         return it;
-    CCoins tmp;
-    if (!base->GetCoins(txid, tmp))
+    }
+    counters.nMisses++;
+    Coin tmp;
+    if (!base->GetCoin(outpoint, tmp))
         return cacheCoins.end();
-    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
-    tmp.swap(ret->second.coins);
-    if (ret->second.coins.IsPruned()) {
-        // The parent only has an empty entry for this txid; we can consider our
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry())).first;
+    tmp.swap(ret->second.coin);
+    ret->second.flags = CCoinsCacheEntry::RECENT;
+    if (ret->second.coin.IsSpent()) {
+        // The parent only has an empty entry for this outpoint; we can consider our
         // version as fresh.
-        ret->second.flags = CCoinsCacheEntry::FRESH;
+        ret->second.flags |= CCoinsCacheEntry::FRESH;
     }
+    cachedCoinsUsage += ret->second.coin.DynamicMemoryUsage();
     return ret;
 }
 
-bool CCoinsViewCache::GetCoins(const uint256& txid, CCoins& coins) const
+bool CCoinsViewCache::GetCoin(const COutPoint& outpoint, Coin& coin) const
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
     if (it != cacheCoins.end()) {
-        coins = it->second.coins;
-        return true;
+        coin = it->second.coin;
+        return !coin.IsSpent();
     }
     return false;
 }
 
-CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
+void CCoinsViewCache::AddCoin(const COutPoint& outpoint, const Coin& coin, bool fPossibleOverwrite)
 {
-    assert(!hasModifier);
-    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
-    if (ret.second) {
-        if (!base->GetCoins(txid, ret.first->second.coins)) {
-            // The parent view does not have this entry; mark it as fresh.
-            ret.first->second.coins.Clear();
-            ret.first->second.flags = CCoinsCacheEntry::FRESH;
-        } else if (ret.first->second.coins.IsPruned()) {
-            // The parent view only has a pruned entry for this; mark it as fresh.
-            ret.first->second.flags = CCoinsCacheEntry::FRESH;
-        }
+    assert(!coin.IsSpent());
+    if (coin.out.scriptPubKey.IsUnspendable()) return;
+    CCoinsMap::iterator it = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry())).first;
+    bool fresh = false;
+    if (!fPossibleOverwrite) {
+        if (!it->second.coin.IsSpent())
+            throw std::logic_error("Adding new coin that replaces non-pruned entry");
+        // If the coin exists in this cache as a spent coin and is DIRTY, the
+        // spentness may not have been flushed to the parent yet, so the new
+        // version can't be FRESH.
+        fresh = !(it->second.flags & CCoinsCacheEntry::DIRTY);
+    }
+    cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+    it->second.coin = coin;
+    cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
+    it->second.flags |= CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::RECENT | (fresh ? CCoinsCacheEntry::FRESH : 0);
+}
+
+void AddCoins(CCoinsViewCache& cache, const CTransaction& tx, int nHeight, bool check)
+{
+    bool fCoinbase = tx.IsCoinBase();
+    bool fCoinstake = tx.IsCoinStake();
+    const uint256& txid = tx.GetHash();
+    for (size_t i = 0; i < tx.vout.size(); ++i) {
+        bool overwrite = check ? cache.HaveCoin(COutPoint(txid, i)) : fCoinbase;
+        // Always set the possible_overwrite flag to AddCoin for coinbase txn, in
+        // order to correctly deal with the pre-BIP30 occurrences of duplicate
+        // coinbase transactions.
+        cache.AddCoin(COutPoint(txid, i), Coin(tx.vout[i], nHeight, fCoinbase, fCoinstake), overwrite);
     }
-    // Assume that whenever ModifyCoins is called, the entry will be modified.
-    ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
 }
 
-const CCoins* CCoinsViewCache::AccessCoins(const uint256& txid) const
+bool CCoinsViewCache::SpendCoin(const COutPoint& outpoint, Coin* moveout)
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
+    CCoinsMap::iterator it = FetchCoin(outpoint);
+    if (it == cacheCoins.end() || it->second.coin.IsSpent())
+        return false;
+    cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+    if (moveout)
+        it->second.coin.swap(*moveout);
+    if (it->second.flags & CCoinsCacheEntry::FRESH) {
+        cacheCoins.erase(it);
+    } else {
+        it->second.flags |= CCoinsCacheEntry::DIRTY;
+        it->second.coin.Clear();
+    }
+    return true;
+}
+
+static const Coin coinEmpty;
+
+const Coin& CCoinsViewCache::AccessCoin(const COutPoint& outpoint) const
+{
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
     if (it == cacheCoins.end()) {
-        return NULL;
+        return coinEmpty;
     } else {
-        return &it->second.coins;
+        return it->second.coin;
     }
 }
 
-bool CCoinsViewCache::HaveCoins(const uint256& txid) const
+bool CCoinsViewCache::HaveCoin(const COutPoint& outpoint) const
+{
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
+}
+
+bool CCoinsViewCache::HaveCoinInCache(const COutPoint& outpoint) const
 {
-    CCoinsMap::const_iterator it = FetchCoins(txid);
-    // We're using vtx.empty() instead of IsPruned here for performance reasons,
-    // as we only care about the case where a transaction was replaced entirely
-    // in a reorganization (which wipes vout entirely, as opposed to spending
-    // which just cleans individual outputs).
-    return (it != cacheCoins.end() && !it->second.coins.vout.empty());
+    CCoinsMap::const_iterator it = cacheCoins.find(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
 }
 
 uint256 CCoinsViewCache::GetBestBlock() const
@@ -164,31 +159,48 @@ void CCoinsViewCache::SetBestBlock(const uint256& hashBlockIn)
 
 bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn)
 {
-    assert(!hasModifier);
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
             CCoinsMap::iterator itUs = cacheCoins.find(it->first);
             if (itUs == cacheCoins.end()) {
-                if (!it->second.coins.IsPruned()) {
-                    // The parent cache does not have an entry, while the child
-                    // cache does have (a non-pruned) one. Move the data up, and
-                    // mark it as fresh (if the grandparent did have it, we
-                    // would have pulled it in at first GetCoins).
-                    assert(it->second.flags & CCoinsCacheEntry::FRESH);
+                // The parent cache does not have an entry, while the child
+                // cache does. We can ignore it if it's both FRESH and spent in
+                // the child, as that means the grandparent never had it either.
+                if (!(it->second.flags & CCoinsCacheEntry::FRESH && it->second.coin.IsSpent())) {
+                    // Otherwise move the data up, keeping FRESH so a later
+                    // spend in this cache can drop it without a parent write.
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
-                    entry.coins.swap(it->second.coins);
-                    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                    entry.coin.swap(it->second.coin);
+                    cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
+                    entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::RECENT;
+                    if (it->second.flags & CCoinsCacheEntry::FRESH)
+                        entry.flags |= CCoinsCacheEntry::FRESH;
                 }
             } else {
-                if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
+                // Assert that the child cache entry was not marked FRESH if the
+                // parent cache entry has unspent outputs. If this ever happens,
+                // it means the FRESH flag was misapplied and there is a logic
+                // error in the calling code.
+                if ((it->second.flags & CCoinsCacheEntry::FRESH) && !itUs->second.coin.IsSpent())
+                    throw std::logic_error("FRESH flag misapplied to cache entry for base transaction with spendable outputs");
+
+                if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent()) {
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
+                    cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
-                    itUs->second.coins.swap(it->second.coins);
-                    itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
+                    itUs->second.coin.swap(it->second.coin);
+                    cachedCoinsUsage += itUs->second.coin.DynamicMemoryUsage();
+                    itUs->second.flags |= CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::RECENT;
+                    // NOTE: It is possible the child has a FRESH flag here in
+                    // the event the entry we found in the parent is pruned. But
+                    // we must not copy that FRESH flag to the parent as that
+                    // pruned state likely still needs to be communicated to the
+                    // grandparent.
                 }
             }
         }
@@ -203,9 +215,65 @@ bool CCoinsViewCache::Flush()
 {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
+    cachedCoinsUsage = 0;
     return fOk;
 }
 
+bool CCoinsViewCache::Sync()
+{
+    CCoinsMap mapDirty;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
+            ++it;
+            continue;
+        }
+        CCoinsCacheEntry& entry = mapDirty[it->first];
+        entry.flags = it->second.flags;
+        if (it->second.coin.IsSpent()) {
+            // Once the base has seen the spend there is nothing left to keep,
+            // so the entry moves to the batch.
+            cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+            entry.coin.swap(it->second.coin);
+            CCoinsMap::iterator itOld = it++;
+            cacheCoins.erase(itOld);
+        } else {
+            // The cache keeps its copy; the batch's is freed once the base has
+            // written it (see CCoinsViewDB::PendingMemoryUsage).
+            entry.coin = it->second.coin;
+            it->second.flags &= ~(CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH);
+            ++it;
+        }
+    }
+    return base->BatchWrite(mapDirty, hashBlock);
+}
+
+size_t CCoinsViewCache::Trim(size_t nTargetUsage)
+{
+    size_t nEvicted = 0;
+    CCoinsMap::iterator it = cacheCoins.find(clockHand);
+    // Every entry is visited at most twice: once to clear its RECENT flag and
+    // once more to evict it.
+    for (size_t nSteps = 2 * cacheCoins.size(); nSteps > 0 && !cacheCoins.empty() && DynamicMemoryUsage() > nTargetUsage; nSteps--) {
+        if (it == cacheCoins.end())
+            it = cacheCoins.begin();
+        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            ++it;
+        } else if (it->second.flags & CCoinsCacheEntry::RECENT) {
+            it->second.flags &= ~CCoinsCacheEntry::RECENT;
+            ++it;
+        } else {
+            // The base holds the same data, so the entry can be dropped.
+            cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+            CCoinsMap::iterator itOld = it++;
+            cacheCoins.erase(itOld);
+            nEvicted++;
+        }
+    }
+    clockHand = it != cacheCoins.end() ? it->first : COutPoint();
+    counters.nEvicted += nEvicted;
+    return nEvicted;
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const
 {
     return cacheCoins.size();
@@ -213,9 +281,9 @@ unsigned int CCoinsViewCache::GetCacheSize() const
 
 const CTxOut& CCoinsViewCache::GetOutputFor(const CTxIn& input) const
 {
-    const CCoins* coins = AccessCoins(input.prevout.hash);
-    assert(coins && coins->IsAvailable(input.prevout.n));
-    return coins->vout[input.prevout.n];
+    const Coin& coin = AccessCoin(input.prevout);
+    assert(!coin.IsSpent());
+    return coin.out;
 }
 
 CAmount CCoinsViewCache::GetValueIn(const CTransaction& tx) const
@@ -234,9 +302,7 @@ bool CCoinsViewCache::HaveInputs(const CTransaction& tx) const
 {
     if (!tx.IsCoinBase()) {
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
-            const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = AccessCoins(prevout.hash);
-            if (!coins || !coins->IsAvailable(prevout.n)) {
+            if (!HaveCoin(tx.vin[i].prevout)) {
                 return false;
             }
         }
@@ -250,28 +316,24 @@ double CCoinsViewCache::GetPriority(const CTransaction& tx, int nHeight) const
         return 0.0;
     double dResult = 0.0;
     for (const CTxIn& txin:  tx.vin) {
-        const CCoins* coins = AccessCoins(txin.prevout.hash);
-        assert(coins);
-        if (!coins->IsAvailable(txin.prevout.n)) continue;
-        if (coins->nHeight < nHeight) {
-            dResult += coins->vout[txin.prevout.n].nValue * (nHeight - coins->nHeight); // value * age
+        const Coin& coin = AccessCoin(txin.prevout);
+        if (coin.IsSpent()) continue;
+        if ((int)coin.nHeight < nHeight) {
+            dResult += coin.out.nValue * (nHeight - coin.nHeight); // value * age
         }
     }
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_)
-{
-    assert(!cache.hasModifier);
-    cache.hasModifier = true;
-}
+static const size_t MAX_OUTPUTS_PER_BLOCK = MAX_BLOCK_SIZE_CURRENT / ::GetSerializeSize(CTxOut(), SER_NETWORK, PROTOCOL_VERSION);
 
-CCoinsModifier::~CCoinsModifier()
+const Coin& AccessByTxid(const CCoinsViewCache& view, const uint256& txid)
 {
-    assert(cache.hasModifier);
-    cache.hasModifier = false;
-    it->second.coins.Cleanup();
-    if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
-        cache.cacheCoins.erase(it);
+    COutPoint iter(txid, 0);
+    while (iter.n < MAX_OUTPUTS_PER_BLOCK) {
+        const Coin& alternate = view.AccessCoin(iter);
+        if (!alternate.IsSpent()) return alternate;
+        ++iter.n;
     }
+    return coinEmpty;
 }
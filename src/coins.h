@@ -7,280 +7,130 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "memusage.h"
 #include "script/standard.h"
 #include "serialize.h"
 #include "uint256.h"
-#include "undo.h"
 
 #include <assert.h>
 #include <stdint.h>
 
 #include <boost/unordered_map.hpp>
 
-/** 
-
-    ****Note - for StakeCubeCoin we added fCoinStake to the 2nd bit. Keep in mind when reading the following and adjust as needed.
- * Pruned version of CTransaction: only retains metadata and unspent transaction outputs
+/**
+ * A UTXO entry.
  *
  * Serialized format:
- * - VARINT(nVersion)
- * - VARINT(nCode)
- * - unspentness bitvector, for vout[2] and further; least significant byte first
- * - the non-spent CTxOuts (via CTxOutCompressor)
- * - VARINT(nHeight)
- *
- * The nCode value consists of:
- * - bit 1: IsCoinBase()
- * - bit 2: vout[0] is not spent
- * - bit 4: vout[1] is not spent
- * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
- *   - In case both bit 2 and bit 4 are unset, they encode N-1, as there must be at
- *     least one non-spent output).
- *
- * Example: 0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e
- *          <><><--------------------------------------------><---->
- *          |  \                  |                             /
- *    version   code             vout[1]                  height
- *
- *    - version = 1
- *    - code = 4 (vout[1] is not spent, and 0 non-zero bytes of bitvector follow)
- *    - unspentness bitvector: as 0 non-zero bytes follow, it has length 0
- *    - vout[1]: 835800816115944e077fe7c803cfa57f29b36bf87c1d35
- *               * 8358: compact amount representation for 60000000000 (600 BTC)
- *               * 00: special txout type pay-to-pubkey-hash
- *               * 816115944e077fe7c803cfa57f29b36bf87c1d35: address uint160
- *    - height = 203998
- *
- *
- * Example: 0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b
- *          <><><--><--------------------------------------------------><----------------------------------------------><---->
- *         /  \   \                     |                                                           |                     /
- *  version  code  unspentness       vout[4]                                                     vout[16]           height
- *
- *  - version = 1
- *  - code = 9 (coinbase, neither vout[0] or vout[1] are unspent, 2 (1, +1 because both bit 2 and bit 4 are unset) non-zero bitvector bytes follow)
- *  - unspentness bitvector: bits 2 (0x04) and 14 (0x4000) are set, so vout[2+2] and vout[14+2] are unspent
- *  - vout[4]: 86ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4ee
- *             * 86ef97d579: compact amount representation for 234925952 (2.35 BTC)
- *             * 00: special txout type pay-to-pubkey-hash
- *             * 61b01caab50f1b8e9c50a5057eb43c2d9563a4ee: address uint160
- *  - vout[16]: bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4
- *              * bbd123: compact amount representation for 110397 (0.001 BTC)
- *              * 00: special txout type pay-to-pubkey-hash
- *              * 8c988f1a4a4de2161e0f50aac7f17e7f9555caa4: address uint160
- *  - height = 120891
+ * - VARINT((nHeight << 2) + (fCoinBase << 1) + fCoinStake)
+ * - the non-spent CTxOut (via CTxOutCompressor)
  */
-class CCoins
+class Coin
 {
 public:
-    //! whether transaction is a coinbase
-    bool fCoinBase;
-    bool fCoinStake;
+    //! unspent transaction output
+    CTxOut out;
 
-    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
-    std::vector<CTxOut> vout;
+    //! whether containing transaction was a coinbase
+    unsigned int fCoinBase : 1;
 
-    //! at which height this transaction was included in the active block chain
-    int nHeight;
+    //! whether containing transaction was a coinstake
+    unsigned int fCoinStake : 1;
 
-    //! version of the CTransaction; accesses to this value should probably check for nHeight as well,
-    //! as new tx version will probably only be introduced at certain heights
-    int nVersion;
+    //! at which height this containing transaction was included in the active block chain
+    uint32_t nHeight : 30;
 
-    void FromTx(const CTransaction& tx, int nHeightIn)
-    {
-        fCoinBase = tx.IsCoinBase();
-        fCoinStake = tx.IsCoinStake();
-        vout = tx.vout;
-        nHeight = nHeightIn;
-        nVersion = tx.nVersion;
-        ClearUnspendable();
-    }
+    //! construct a Coin from a CTxOut and height/coinbase/coinstake information.
+    Coin(const CTxOut& outIn, int nHeightIn, bool fCoinBaseIn, bool fCoinStakeIn) : out(outIn), fCoinBase(fCoinBaseIn), fCoinStake(fCoinStakeIn), nHeight(nHeightIn) {}
 
-    //! construct a CCoins from a CTransaction, at a given height
-    CCoins(const CTransaction& tx, int nHeightIn)
-    {
-        FromTx(tx, nHeightIn);
-    }
+    //! empty constructor
+    Coin() : fCoinBase(false), fCoinStake(false), nHeight(0) {}
 
     void Clear()
     {
+        out.SetNull();
+        // give the script buffer back too, a spent coin takes no dynamic memory
+        std::vector<unsigned char>().swap(out.scriptPubKey);
         fCoinBase = false;
         fCoinStake = false;
-        std::vector<CTxOut>().swap(vout);
         nHeight = 0;
-        nVersion = 0;
     }
 
-    //! empty constructor
-    CCoins() : fCoinBase(false), fCoinStake(false), vout(0), nHeight(0), nVersion(0) {}
+    bool IsCoinBase() const
+    {
+        return fCoinBase;
+    }
 
-    //!remove spent outputs at the end of vout
-    void Cleanup()
+    bool IsCoinStake() const
     {
-        while (vout.size() > 0 && vout.back().IsNull())
-            vout.pop_back();
-        if (vout.empty())
-            std::vector<CTxOut>().swap(vout);
+        return fCoinStake;
     }
 
-    void ClearUnspendable()
+    //! whether this entry has been spent (or was never there); only unspent coins can be serialized
+    bool IsSpent() const
     {
-        for (CTxOut& txout : vout) {
-            if (txout.scriptPubKey.IsUnspendable())
-                txout.SetNull();
-        }
-        Cleanup();
+        return out.IsNull();
     }
 
-    void swap(CCoins& to)
+    void swap(Coin& to)
     {
-        std::swap(to.fCoinBase, fCoinBase);
-        std::swap(to.fCoinStake, fCoinStake);
-        to.vout.swap(vout);
-        std::swap(to.nHeight, nHeight);
-        std::swap(to.nVersion, nVersion);
+        std::swap(to.out, out);
+        bool fTmp = to.fCoinBase;
+        to.fCoinBase = fCoinBase;
+        fCoinBase = fTmp;
+        fTmp = to.fCoinStake;
+        to.fCoinStake = fCoinStake;
+        fCoinStake = fTmp;
+        uint32_t nTmp = to.nHeight;
+        to.nHeight = nHeight;
+        nHeight = nTmp;
     }
 
     //! equality test
-    friend bool operator==(const CCoins& a, const CCoins& b)
+    friend bool operator==(const Coin& a, const Coin& b)
     {
-        // Empty CCoins objects are always equal.
-        if (a.IsPruned() && b.IsPruned())
+        // Empty Coin objects are always equal.
+        if (a.IsSpent() && b.IsSpent())
             return true;
         return a.fCoinBase == b.fCoinBase &&
                a.fCoinStake == b.fCoinStake &&
                a.nHeight == b.nHeight &&
-               a.nVersion == b.nVersion &&
-               a.vout == b.vout;
+               a.out == b.out;
     }
-    friend bool operator!=(const CCoins& a, const CCoins& b)
+    friend bool operator!=(const Coin& a, const Coin& b)
     {
         return !(a == b);
     }
 
-    void CalcMaskSize(unsigned int& nBytes, unsigned int& nNonzeroBytes) const;
-
-    bool IsCoinBase() const
-    {
-        return fCoinBase;
-    }
-
-    bool IsCoinStake() const
-    {
-        return fCoinStake;
-    }
-
     unsigned int GetSerializeSize(int nType, int nVersion) const
     {
-        unsigned int nSize = 0;
-        unsigned int nMaskSize = 0, nMaskCode = 0;
-        CalcMaskSize(nMaskSize, nMaskCode);
-        bool fFirst = vout.size() > 0 && !vout[0].IsNull();
-        bool fSecond = vout.size() > 1 && !vout[1].IsNull();
-        assert(fFirst || fSecond || nMaskCode);
-        unsigned int nCode = 8 * (nMaskCode - (fFirst || fSecond ? 0 : 1)) + (fCoinBase ? 1 : 0) + (fCoinStake ? 2 : 0) + (fFirst ? 4 : 0) + (fSecond ? 8 : 0);
-        // version
-        nSize += ::GetSerializeSize(VARINT(this->nVersion), nType, nVersion);
-        // size of header code
-        nSize += ::GetSerializeSize(VARINT(nCode), nType, nVersion);
-        // spentness bitmask
-        nSize += nMaskSize;
-        // txouts themself
-        for (unsigned int i = 0; i < vout.size(); i++)
-            if (!vout[i].IsNull())
-                nSize += ::GetSerializeSize(CTxOutCompressor(REF(vout[i])), nType, nVersion);
-        // height
-        nSize += ::GetSerializeSize(VARINT(nHeight), nType, nVersion);
-        return nSize;
+        uint32_t nCode = (nHeight << 2) + (fCoinBase ? 2 : 0) + (fCoinStake ? 1 : 0);
+        return ::GetSerializeSize(VARINT(nCode), nType, nVersion) +
+               ::GetSerializeSize(CTxOutCompressor(REF(out)), nType, nVersion);
     }
 
     template <typename Stream>
     void Serialize(Stream& s, int nType, int nVersion) const
     {
-        unsigned int nMaskSize = 0, nMaskCode = 0;
-        CalcMaskSize(nMaskSize, nMaskCode);
-        bool fFirst = vout.size() > 0 && !vout[0].IsNull();
-        bool fSecond = vout.size() > 1 && !vout[1].IsNull();
-        assert(fFirst || fSecond || nMaskCode);
-        unsigned int nCode = 16 * (nMaskCode - (fFirst || fSecond ? 0 : 1)) + (fCoinBase ? 1 : 0) + (fCoinStake ? 2 : 0) + (fFirst ? 4 : 0) + (fSecond ? 8 : 0);
-        // version
-        ::Serialize(s, VARINT(this->nVersion), nType, nVersion);
-        // header code
+        assert(!IsSpent());
+        uint32_t nCode = (nHeight << 2) + (fCoinBase ? 2 : 0) + (fCoinStake ? 1 : 0);
         ::Serialize(s, VARINT(nCode), nType, nVersion);
-        // spentness bitmask
-        for (unsigned int b = 0; b < nMaskSize; b++) {
-            unsigned char chAvail = 0;
-            for (unsigned int i = 0; i < 8 && 2 + b * 8 + i < vout.size(); i++)
-                if (!vout[2 + b * 8 + i].IsNull())
-                    chAvail |= (1 << i);
-            ::Serialize(s, chAvail, nType, nVersion);
-        }
-        // txouts themself
-        for (unsigned int i = 0; i < vout.size(); i++) {
-            if (!vout[i].IsNull())
-                ::Serialize(s, CTxOutCompressor(REF(vout[i])), nType, nVersion);
-        }
-        // coinbase height
-        ::Serialize(s, VARINT(nHeight), nType, nVersion);
+        ::Serialize(s, CTxOutCompressor(REF(out)), nType, nVersion);
     }
 
     template <typename Stream>
     void Unserialize(Stream& s, int nType, int nVersion)
     {
-        unsigned int nCode = 0;
-        // version
-        ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
-        // header code
+        uint32_t nCode = 0;
         ::Unserialize(s, VARINT(nCode), nType, nVersion);
-        fCoinBase = nCode & 1;         //0001 - means coinbase
-        fCoinStake = (nCode & 2) != 0; //0010 coinstake
-        std::vector<bool> vAvail(2, false);
-        vAvail[0] = (nCode & 4) != 0; // 0100
-        vAvail[1] = (nCode & 8) != 0; // 1000
-        unsigned int nMaskCode = (nCode / 16) + ((nCode & 12) != 0 ? 0 : 1);
-        // spentness bitmask
-        while (nMaskCode > 0) {
-            unsigned char chAvail = 0;
-            ::Unserialize(s, chAvail, nType, nVersion);
-            for (unsigned int p = 0; p < 8; p++) {
-                bool f = (chAvail & (1 << p)) != 0;
-                vAvail.push_back(f);
-            }
-            if (chAvail != 0)
-                nMaskCode--;
-        }
-        // txouts themself
-        vout.assign(vAvail.size(), CTxOut());
-        for (unsigned int i = 0; i < vAvail.size(); i++) {
-            if (vAvail[i])
-                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
-        }
-        // coinbase height
-        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
-        Cleanup();
-    }
-
-    //! mark an outpoint spent, and construct undo information
-    bool Spend(const COutPoint& out, CTxInUndo& undo);
-
-    //! mark a vout spent
-    bool Spend(int nPos);
-
-    //! check whether a particular output is still available
-    bool IsAvailable(unsigned int nPos) const
-    {
-        return (nPos < vout.size() && !vout[nPos].IsNull());
+        nHeight = nCode >> 2;
+        fCoinBase = (nCode & 2) != 0;
+        fCoinStake = (nCode & 1) != 0;
+        ::Unserialize(s, REF(CTxOutCompressor(out)), nType, nVersion);
     }
 
-    //! check whether the entire CCoins is spent
-    //! note that only !IsPruned() CCoins can be serialized
-    bool IsPruned() const
+    size_t DynamicMemoryUsage() const
     {
-        for (const CTxOut& out : vout)
-            if (!out.IsNull())
-                return false;
-        return true;
+        return memusage::DynamicUsage(out.scriptPubKey);
     }
 };
 
@@ -297,25 +147,36 @@ public:
      * unordered_map will behave unpredictably if the custom hasher returns a
      * uint64_t, resulting in failures when syncing the chain (#4634).
      */
-    size_t operator()(const uint256& key) const
+    size_t operator()(const COutPoint& key) const
     {
-        return key.GetHash(salt);
+        // outputs of one transaction share the txid part; spread them by index
+        return key.hash.GetHash(salt) ^ (key.n * 0x9E3779B97F4A7C15ULL);
     }
 };
 
 struct CCoinsCacheEntry {
-    CCoins coins; // The actual cached data.
+    Coin coin; // The actual cached data.
     unsigned char flags;
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
+        RECENT = (1 << 2), // This cache entry was used since the eviction sweep last passed it.
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    CCoinsCacheEntry() : coin(), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+typedef boost::unordered_map<COutPoint, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+
+/** Lookup and eviction counters of a CCoinsViewCache */
+struct CCoinsCacheCounters {
+    uint64_t nHits;    //! lookups answered by the cache itself
+    uint64_t nMisses;  //! lookups passed on to the backing view
+    uint64_t nEvicted; //! unmodified entries dropped by Trim()
+
+    CCoinsCacheCounters() : nHits(0), nMisses(0), nEvicted(0) {}
+};
 
 struct CCoinsStats {
     int nHeight;
@@ -334,17 +195,17 @@ struct CCoinsStats {
 class CCoinsView
 {
 public:
-    //! Retrieve the CCoins (unspent transaction outputs) for a given txid
-    virtual bool GetCoins(const uint256& txid, CCoins& coins) const;
+    //! Retrieve the Coin (unspent transaction output) for a given outpoint.
+    //! Returns true only when an unspent coin was found.
+    virtual bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
 
-    //! Just check whether we have data for a given txid.
-    //! This may (but cannot always) return true for fully spent transactions
-    virtual bool HaveCoins(const uint256& txid) const;
+    //! Just check whether a given outpoint is unspent.
+    virtual bool HaveCoin(const COutPoint& outpoint) const;
 
     //! Retrieve the block hash whose state this CCoinsView currently represents
     virtual uint256 GetBestBlock() const;
 
-    //! Do a bulk modification (multiple CCoins changes + BestBlock change).
+    //! Do a bulk modification (multiple Coin changes + BestBlock change).
     //! The passed mapCoins can be modified.
     virtual bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
 
@@ -364,8 +225,8 @@ protected:
 
 public:
     CCoinsViewBacked(CCoinsView* viewIn);
-    bool GetCoins(const uint256& txid, CCoins& coins) const;
-    bool HaveCoins(const uint256& txid) const;
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
     uint256 GetBestBlock() const;
     void SetBackend(CCoinsView& viewIn);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
@@ -387,32 +248,10 @@ enum {
 static const unsigned int STANDARD_LOCKTIME_VERIFY_FLAGS = LOCKTIME_VERIFY_SEQUENCE |
                                                            LOCKTIME_MEDIAN_TIME_PAST;
 
-/** 
- * A reference to a mutable cache entry. Encapsulating it allows us to run
- *  cleanup code after the modification is finished, and keeping track of
- *  concurrent modifications. 
- */
-class CCoinsModifier
-{
-private:
-    CCoinsViewCache& cache;
-    CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
-
-public:
-    CCoins* operator->() { return &it->second.coins; }
-    CCoins& operator*() { return it->second.coins; }
-    ~CCoinsModifier();
-    friend class CCoinsViewCache;
-};
-
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
 class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
-    /* Whether this cache has an active modifier. */
-    bool hasModifier;
-
     /**
      * Make mutable so that we can "fill the cache" even from Get-methods
      * declared as "const".  
@@ -420,30 +259,51 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner Coin objects. */
+    mutable size_t cachedCoinsUsage;
+
+    /* Where the last Trim() stopped, so the next sweep carries on from there. */
+    COutPoint clockHand;
+
+    mutable CCoinsCacheCounters counters;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
-    ~CCoinsViewCache();
 
     // Standard CCoinsView methods
-    bool GetCoins(const uint256& txid, CCoins& coins) const;
-    bool HaveCoins(const uint256& txid) const;
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256& hashBlock);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
 
     /**
-     * Return a pointer to CCoins in the cache, or NULL if not found. This is
-     * more efficient than GetCoins. Modifications to other cache entries are
-     * allowed while accessing the returned pointer.
+     * Check if we have the given utxo already loaded in this cache.
+     * The semantics are the same as HaveCoin(), but no calls to
+     * the backing CCoinsView are made.
      */
-    const CCoins* AccessCoins(const uint256& txid) const;
+    bool HaveCoinInCache(const COutPoint& outpoint) const;
 
     /**
-     * Return a modifiable reference to a CCoins. If no entry with the given
-     * txid exists, a new one is created. Simultaneous modifications are not
-     * allowed.
+     * Return a reference to Coin in the cache, or a pruned one if not found. This is
+     * more efficient than GetCoin. Modifications to other cache entries are
+     * allowed while accessing the returned reference, but the reference is
+     * invalidated by adding or spending the same outpoint.
      */
-    CCoinsModifier ModifyCoins(const uint256& txid);
+    const Coin& AccessCoin(const COutPoint& outpoint) const;
+
+    /**
+     * Add a coin. Set fPossibleOverwrite to true if an unspent version may
+     * already exist in the cache.
+     */
+    void AddCoin(const COutPoint& outpoint, const Coin& coin, bool fPossibleOverwrite);
+
+    /**
+     * Spend a coin. Pass moveto in order to get the deleted data.
+     * If no unspent output exists for the passed outpoint, this call
+     * has no effect.
+     */
+    bool SpendCoin(const COutPoint& outpoint, Coin* moveto = NULL);
 
     /**
      * Push the modifications applied to this cache to its base.
@@ -452,9 +312,31 @@ public:
      */
     bool Flush();
 
-    //! Calculate the size of the cache (in number of transactions)
+    /**
+     * Push the modifications applied to this cache to its base, like Flush(),
+     * but keep the cached entries as unmodified copies of what the base now
+     * holds, so lookups keep hitting the cache. Spent entries are moved to the
+     * base rather than copied. Until the base has written the batch, the copies
+     * of the unspent ones take memory outside DynamicMemoryUsage().
+     */
+    bool Sync();
+
+    /**
+     * Evict unmodified entries until the memory usage of the cache drops to
+     * nTargetUsage, or only modified entries are left. Entries are picked with
+     * the CLOCK algorithm: an entry used since the last sweep gets a second
+     * chance. Returns the number of entries evicted.
+     */
+    size_t Trim(size_t nTargetUsage);
+
+    //! Calculate the size of the cache (in number of transaction outputs)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
+    const CCoinsCacheCounters& GetCounters() const { return counters; }
+
     /** 
      * Amount of stakecubecoin coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
@@ -473,11 +355,20 @@ public:
 
     const CTxOut& GetOutputFor(const CTxIn& input) const;
 
-    friend class CCoinsModifier;
-
 private:
-    CCoinsMap::iterator FetchCoins(const uint256& txid);
-    CCoinsMap::const_iterator FetchCoins(const uint256& txid) const;
+    CCoinsMap::iterator FetchCoin(const COutPoint& outpoint) const;
 };
 
+//! Utility function to add all of a transaction's outputs to a cache.
+// When check is false, this assumes that overwrites are only possible for coinbase transactions.
+// When check is true, the underlying view may be queried to determine whether an addition is
+// an overwrite.
+void AddCoins(CCoinsViewCache& cache, const CTransaction& tx, int nHeight, bool check = false);
+
+//! Utility function to find any unspent output with a given txid.
+// This function can be quite expensive because in the event of a transaction
+// which is not found in the cache, it can cause up to MAX_OUTPUTS_PER_TX
+// lookups to database, so it should be used with care.
+const Coin& AccessByTxid(const CCoinsViewCache& cache, const uint256& txid);
+
 #endif // BITCOIN_COINS_H
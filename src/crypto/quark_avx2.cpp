@@ -0,0 +1,271 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/quark_avx2.h"
+
+#include "crypto/common.h"
+
+#include <assert.h>
+#include <string.h>
+
+// The kernels are compiled for AVX2 on their own, with the target attribute, so
+// the rest of the build keeps running on CPUs without it; which one runs is
+// decided at runtime.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__amd64__))
+#define QUARK_AVX2 1
+#include <immintrin.h>
+#endif
+
+#ifdef QUARK_AVX2
+
+namespace
+{
+#define QUARK_AVX2_TARGET __attribute__((target("avx2")))
+
+QUARK_AVX2_TARGET inline __m256i Rotr64(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - n));
+}
+
+template <int n>
+QUARK_AVX2_TARGET inline __m256i Rotl64(__m256i x)
+{
+    return _mm256_or_si256(_mm256_slli_epi64(x, n), _mm256_srli_epi64(x, 64 - n));
+}
+
+template <>
+QUARK_AVX2_TARGET inline __m256i Rotl64<0>(__m256i x)
+{
+    return x;
+}
+
+/// BLAKE-512, one compression per lane.
+namespace blake512
+{
+const uint64_t IV[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL};
+
+const uint64_t C[16] = {
+    0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+    0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL, 0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL,
+    0x9216D5D98979FB1BULL, 0xD1310BA698DFB5ACULL, 0x2FFD72DBD01ADFB7ULL, 0xB8E1AFED6A267E96ULL,
+    0xBA7C9045F12C7F99ULL, 0x24A19947B3916CF7ULL, 0x0801F2E2858EFC16ULL, 0x636920D871574E69ULL};
+
+const unsigned char SIGMA[10][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0}};
+
+QUARK_AVX2_TARGET inline void G(__m256i* v, const __m256i* m, const unsigned char* s, int i, int a, int b, int c, int d)
+{
+    v[a] = _mm256_add_epi64(_mm256_add_epi64(v[a], v[b]), _mm256_xor_si256(m[s[2 * i]], _mm256_set1_epi64x(C[s[2 * i + 1]])));
+    v[d] = _mm256_shuffle_epi32(_mm256_xor_si256(v[d], v[a]), 0xB1);
+    v[c] = _mm256_add_epi64(v[c], v[d]);
+    v[b] = Rotr64(_mm256_xor_si256(v[b], v[c]), 25);
+    v[a] = _mm256_add_epi64(_mm256_add_epi64(v[a], v[b]), _mm256_xor_si256(m[s[2 * i + 1]], _mm256_set1_epi64x(C[s[2 * i]])));
+    v[d] = Rotr64(_mm256_xor_si256(v[d], v[a]), 16);
+    v[c] = _mm256_add_epi64(v[c], v[d]);
+    v[b] = Rotr64(_mm256_xor_si256(v[b], v[c]), 11);
+}
+} // namespace blake512
+
+/// Keccak-f[1600], with the rate of Keccak-512.
+namespace keccak512
+{
+const uint64_t RC[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+    0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+    0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL};
+
+#define XOR5(a, b, c, d, e) _mm256_xor_si256(_mm256_xor_si256(_mm256_xor_si256(a, b), _mm256_xor_si256(c, d)), e)
+
+// Written out in full so every rotation is by an immediate; loops over the
+// lanes with table-driven rotations come out slower than sph's scalar code.
+QUARK_AVX2_TARGET void Permute(__m256i* a)
+{
+    __m256i b[25], c[5], d[5];
+    for (int round = 0; round < 24; round++) {
+        // Theta
+        c[0] = XOR5(a[0], a[5], a[10], a[15], a[20]);
+        c[1] = XOR5(a[1], a[6], a[11], a[16], a[21]);
+        c[2] = XOR5(a[2], a[7], a[12], a[17], a[22]);
+        c[3] = XOR5(a[3], a[8], a[13], a[18], a[23]);
+        c[4] = XOR5(a[4], a[9], a[14], a[19], a[24]);
+        d[0] = _mm256_xor_si256(c[4], Rotl64<1>(c[1]));
+        d[1] = _mm256_xor_si256(c[0], Rotl64<1>(c[2]));
+        d[2] = _mm256_xor_si256(c[1], Rotl64<1>(c[3]));
+        d[3] = _mm256_xor_si256(c[2], Rotl64<1>(c[4]));
+        d[4] = _mm256_xor_si256(c[3], Rotl64<1>(c[0]));
+        // Rho and pi
+        b[0] = Rotl64<0>(_mm256_xor_si256(a[0], d[0]));
+        b[10] = Rotl64<1>(_mm256_xor_si256(a[1], d[1]));
+        b[20] = Rotl64<62>(_mm256_xor_si256(a[2], d[2]));
+        b[5] = Rotl64<28>(_mm256_xor_si256(a[3], d[3]));
+        b[15] = Rotl64<27>(_mm256_xor_si256(a[4], d[4]));
+        b[16] = Rotl64<36>(_mm256_xor_si256(a[5], d[0]));
+        b[1] = Rotl64<44>(_mm256_xor_si256(a[6], d[1]));
+        b[11] = Rotl64<6>(_mm256_xor_si256(a[7], d[2]));
+        b[21] = Rotl64<55>(_mm256_xor_si256(a[8], d[3]));
+        b[6] = Rotl64<20>(_mm256_xor_si256(a[9], d[4]));
+        b[7] = Rotl64<3>(_mm256_xor_si256(a[10], d[0]));
+        b[17] = Rotl64<10>(_mm256_xor_si256(a[11], d[1]));
+        b[2] = Rotl64<43>(_mm256_xor_si256(a[12], d[2]));
+        b[12] = Rotl64<25>(_mm256_xor_si256(a[13], d[3]));
+        b[22] = Rotl64<39>(_mm256_xor_si256(a[14], d[4]));
+        b[23] = Rotl64<41>(_mm256_xor_si256(a[15], d[0]));
+        b[8] = Rotl64<45>(_mm256_xor_si256(a[16], d[1]));
+        b[18] = Rotl64<15>(_mm256_xor_si256(a[17], d[2]));
+        b[3] = Rotl64<21>(_mm256_xor_si256(a[18], d[3]));
+        b[13] = Rotl64<8>(_mm256_xor_si256(a[19], d[4]));
+        b[14] = Rotl64<18>(_mm256_xor_si256(a[20], d[0]));
+        b[24] = Rotl64<2>(_mm256_xor_si256(a[21], d[1]));
+        b[9] = Rotl64<61>(_mm256_xor_si256(a[22], d[2]));
+        b[19] = Rotl64<56>(_mm256_xor_si256(a[23], d[3]));
+        b[4] = Rotl64<14>(_mm256_xor_si256(a[24], d[4]));
+        // Chi
+        a[0] = _mm256_xor_si256(b[0], _mm256_andnot_si256(b[1], b[2]));
+        a[1] = _mm256_xor_si256(b[1], _mm256_andnot_si256(b[2], b[3]));
+        a[2] = _mm256_xor_si256(b[2], _mm256_andnot_si256(b[3], b[4]));
+        a[3] = _mm256_xor_si256(b[3], _mm256_andnot_si256(b[4], b[0]));
+        a[4] = _mm256_xor_si256(b[4], _mm256_andnot_si256(b[0], b[1]));
+        a[5] = _mm256_xor_si256(b[5], _mm256_andnot_si256(b[6], b[7]));
+        a[6] = _mm256_xor_si256(b[6], _mm256_andnot_si256(b[7], b[8]));
+        a[7] = _mm256_xor_si256(b[7], _mm256_andnot_si256(b[8], b[9]));
+        a[8] = _mm256_xor_si256(b[8], _mm256_andnot_si256(b[9], b[5]));
+        a[9] = _mm256_xor_si256(b[9], _mm256_andnot_si256(b[5], b[6]));
+        a[10] = _mm256_xor_si256(b[10], _mm256_andnot_si256(b[11], b[12]));
+        a[11] = _mm256_xor_si256(b[11], _mm256_andnot_si256(b[12], b[13]));
+        a[12] = _mm256_xor_si256(b[12], _mm256_andnot_si256(b[13], b[14]));
+        a[13] = _mm256_xor_si256(b[13], _mm256_andnot_si256(b[14], b[10]));
+        a[14] = _mm256_xor_si256(b[14], _mm256_andnot_si256(b[10], b[11]));
+        a[15] = _mm256_xor_si256(b[15], _mm256_andnot_si256(b[16], b[17]));
+        a[16] = _mm256_xor_si256(b[16], _mm256_andnot_si256(b[17], b[18]));
+        a[17] = _mm256_xor_si256(b[17], _mm256_andnot_si256(b[18], b[19]));
+        a[18] = _mm256_xor_si256(b[18], _mm256_andnot_si256(b[19], b[15]));
+        a[19] = _mm256_xor_si256(b[19], _mm256_andnot_si256(b[15], b[16]));
+        a[20] = _mm256_xor_si256(b[20], _mm256_andnot_si256(b[21], b[22]));
+        a[21] = _mm256_xor_si256(b[21], _mm256_andnot_si256(b[22], b[23]));
+        a[22] = _mm256_xor_si256(b[22], _mm256_andnot_si256(b[23], b[24]));
+        a[23] = _mm256_xor_si256(b[23], _mm256_andnot_si256(b[24], b[20]));
+        a[24] = _mm256_xor_si256(b[24], _mm256_andnot_si256(b[20], b[21]));
+        // Iota
+        a[0] = _mm256_xor_si256(a[0], _mm256_set1_epi64x(RC[round]));
+    }
+}
+
+#undef XOR5
+} // namespace keccak512
+
+} // namespace
+
+bool QuarkAVX2Available()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+QUARK_AVX2_TARGET void Blake512_4way_AVX2(const unsigned char* const pin[QUARK_AVX2_LANES], size_t nLen, unsigned char* const pout[QUARK_AVX2_LANES])
+{
+    using namespace blake512;
+    assert(nLen <= QUARK_AVX2_BLAKE_MAX_LEN);
+
+    // The one padded block of each input, as big-endian words
+    uint64_t w[16][QUARK_AVX2_LANES];
+    for (size_t l = 0; l < QUARK_AVX2_LANES; l++) {
+        unsigned char block[128] = {0};
+        memcpy(block, pin[l], nLen);
+        block[nLen] = 0x80;
+        block[111] |= 0x01;
+        WriteBE64(block + 120, (uint64_t)nLen * 8);
+        for (int i = 0; i < 16; i++)
+            w[i][l] = ReadBE64(block + 8 * i);
+    }
+    __m256i m[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = _mm256_loadu_si256((const __m256i*)w[i]);
+
+    __m256i v[16];
+    for (int i = 0; i < 8; i++)
+        v[i] = _mm256_set1_epi64x(IV[i]);
+    for (int i = 0; i < 4; i++)
+        v[8 + i] = _mm256_set1_epi64x(C[i]);
+    v[12] = _mm256_set1_epi64x((nLen * 8) ^ C[4]);
+    v[13] = _mm256_set1_epi64x((nLen * 8) ^ C[5]);
+    v[14] = _mm256_set1_epi64x(C[6]);
+    v[15] = _mm256_set1_epi64x(C[7]);
+
+    for (int r = 0; r < 16; r++) {
+        const unsigned char* s = SIGMA[r % 10];
+        G(v, m, s, 0, 0, 4, 8, 12);
+        G(v, m, s, 1, 1, 5, 9, 13);
+        G(v, m, s, 2, 2, 6, 10, 14);
+        G(v, m, s, 3, 3, 7, 11, 15);
+        G(v, m, s, 4, 0, 5, 10, 15);
+        G(v, m, s, 5, 1, 6, 11, 12);
+        G(v, m, s, 6, 2, 7, 8, 13);
+        G(v, m, s, 7, 3, 4, 9, 14);
+    }
+
+    uint64_t h[8][QUARK_AVX2_LANES];
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i*)h[i], _mm256_xor_si256(_mm256_set1_epi64x(IV[i]), _mm256_xor_si256(v[i], v[i + 8])));
+    for (size_t l = 0; l < QUARK_AVX2_LANES; l++) {
+        for (int i = 0; i < 8; i++)
+            WriteBE64(pout[l] + 8 * i, h[i][l]);
+    }
+}
+
+QUARK_AVX2_TARGET void Keccak512_64_4way_AVX2(const unsigned char* const pin[QUARK_AVX2_LANES], unsigned char* const pout[QUARK_AVX2_LANES])
+{
+    using namespace keccak512;
+
+    // 64 bytes fill eight of the nine words of the rate; the padding, 0x01
+    // through 0x80 as in the original Keccak, takes the ninth
+    __m256i a[25];
+    for (int i = 0; i < 8; i++)
+        a[i] = _mm256_set_epi64x(ReadLE64(pin[3] + 8 * i), ReadLE64(pin[2] + 8 * i), ReadLE64(pin[1] + 8 * i), ReadLE64(pin[0] + 8 * i));
+    a[8] = _mm256_set1_epi64x(0x8000000000000001ULL);
+    for (int i = 9; i < 25; i++)
+        a[i] = _mm256_setzero_si256();
+
+    Permute(a);
+
+    uint64_t h[8][QUARK_AVX2_LANES];
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i*)h[i], a[i]);
+    for (size_t l = 0; l < QUARK_AVX2_LANES; l++) {
+        for (int i = 0; i < 8; i++)
+            WriteLE64(pout[l] + 8 * i, h[i][l]);
+    }
+}
+
+#else // QUARK_AVX2
+
+bool QuarkAVX2Available()
+{
+    return false;
+}
+
+void Blake512_4way_AVX2(const unsigned char* const pin[QUARK_AVX2_LANES], size_t nLen, unsigned char* const pout[QUARK_AVX2_LANES])
+{
+    assert(!"no AVX2 kernels in this build");
+}
+
+void Keccak512_64_4way_AVX2(const unsigned char* const pin[QUARK_AVX2_LANES], unsigned char* const pout[QUARK_AVX2_LANES])
+{
+    assert(!"no AVX2 kernels in this build");
+}
+
+#endif // QUARK_AVX2
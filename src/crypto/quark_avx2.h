@@ -0,0 +1,28 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_QUARK_AVX2_H
+#define BITCOIN_CRYPTO_QUARK_AVX2_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Inputs hashed at once by the kernels below, one per 64-bit lane of an AVX2 register. */
+static const size_t QUARK_AVX2_LANES = 4;
+
+/** Longest input Blake512_4way_AVX2 takes: one that still fits a single block with its padding. */
+static const size_t QUARK_AVX2_BLAKE_MAX_LEN = 111;
+
+/** Whether this build and the CPU it runs on can use the kernels below. */
+bool QuarkAVX2Available();
+
+/** BLAKE-512 of four inputs of nLen <= QUARK_AVX2_BLAKE_MAX_LEN bytes each, the
+ *  same as sph_blake512 gives. Input and output may be the same buffers. */
+void Blake512_4way_AVX2(const unsigned char* const pin[QUARK_AVX2_LANES], size_t nLen, unsigned char* const pout[QUARK_AVX2_LANES]);
+
+/** Keccak-512 of four 64-byte inputs, the same as sph_keccak512 gives. Input
+ *  and output may be the same buffers. */
+void Keccak512_64_4way_AVX2(const unsigned char* const pin[QUARK_AVX2_LANES], unsigned char* const pout[QUARK_AVX2_LANES]);
+
+#endif // BITCOIN_CRYPTO_QUARK_AVX2_H
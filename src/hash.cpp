@@ -3,9 +3,13 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "crypto/common.h"
 #include "crypto/hmac_sha512.h"
+#include "crypto/quark_avx2.h"
 #include "crypto/scrypt.h"
 
+#include <algorithm>
+
 inline uint32_t ROTL32(uint32_t x, int8_t r)
 {
     return (x << r) | (x >> (32 - r));
@@ -79,6 +83,235 @@ void BIP32Hash(const unsigned char chainCode[32], unsigned int nChild, unsigned
     CHMAC_SHA512(chainCode, 32).Write(&header, 1).Write(data, 32).Write(num, 4).Finalize(output);
 }
 
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                   \
+    do {                           \
+        v0 += v1;                  \
+        v1 = ROTL(v1, 13);         \
+        v1 ^= v0;                  \
+        v0 = ROTL(v0, 32);         \
+        v2 += v3;                  \
+        v3 = ROTL(v3, 16);         \
+        v3 ^= v2;                  \
+        v0 += v3;                  \
+        v3 = ROTL(v3, 21);         \
+        v3 ^= v0;                  \
+        v2 += v1;                  \
+        v1 = ROTL(v1, 17);         \
+        v1 ^= v2;                  \
+        v2 = ROTL(v2, 32);         \
+    } while (0)
+
+CSipHasher::CSipHasher(uint64_t k0, uint64_t k1)
+{
+    v[0] = 0x736f6d6570736575ULL ^ k0;
+    v[1] = 0x646f72616e646f6dULL ^ k1;
+    v[2] = 0x6c7967656e657261ULL ^ k0;
+    v[3] = 0x7465646279746573ULL ^ k1;
+    count = 0;
+}
+
+CSipHasher& CSipHasher::Write(uint64_t data)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+    v3 ^= data;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= data;
+
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+    v[3] = v3;
+    count++;
+    return *this;
+}
+
+uint64_t CSipHasher::Finalize() const
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+    uint64_t t = ((uint64_t)count * 8) << 56;
+    v3 ^= t;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= t;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
+{
+    /* Specialized implementation for efficiency */
+    uint64_t d = ReadLE64(val.begin());
+
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1 ^ d;
+
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = ReadLE64(val.begin() + 8);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = ReadLE64(val.begin() + 16);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = ReadLE64(val.begin() + 24);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    v3 ^= ((uint64_t)4) << 59;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= ((uint64_t)4) << 59;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+namespace
+{
+/** Freshly initialised contexts for every algorithm in the quark chain; copying one is cheaper than re-running init. */
+struct CQuarkContexts {
+    sph_blake512_context blake;
+    sph_bmw512_context bmw;
+    sph_groestl512_context groestl;
+    sph_jh512_context jh;
+    sph_keccak512_context keccak;
+    sph_skein512_context skein;
+    //! whether the CPU can run the 4-way kernels of crypto/quark_avx2
+    bool fAVX2;
+
+    CQuarkContexts() : fAVX2(QuarkAVX2Available())
+    {
+        sph_blake512_init(&blake);
+        sph_bmw512_init(&bmw);
+        sph_groestl512_init(&groestl);
+        sph_jh512_init(&jh);
+        sph_keccak512_init(&keccak);
+        sph_skein512_init(&skein);
+    }
+};
+
+const CQuarkContexts& QuarkInitialContexts()
+{
+    static const CQuarkContexts contexts;
+    return contexts;
+}
+
+template <typename Context>
+inline void QuarkRound(const Context& ctxInit, void (*update)(void*, const void*, size_t), void (*close)(void*, void*), const void* pin, size_t nLen, unsigned char* pout)
+{
+    Context ctx = ctxInit;
+    update(&ctx, pin, nLen);
+    close(&ctx, pout);
+}
+
+/** Rounds 3, 6 and 9 pick their algorithm from bit 3 of the previous 512-bit result. */
+inline bool QuarkBranch(const unsigned char* phash)
+{
+    return (phash[0] & 8) != 0;
+}
+
+/** Headers hashed per pass; keeps the intermediate state for a pass inside L1. */
+const size_t QUARK_BATCH_SIZE = 32;
+
+/** BLAKE-512 of n inputs, four at a time on CPUs with AVX2. */
+void QuarkBlake(const CQuarkContexts& z, const unsigned char* const* pin, size_t nLen, unsigned char* const* pout, size_t n)
+{
+    size_t i = 0;
+    if (z.fAVX2 && nLen <= QUARK_AVX2_BLAKE_MAX_LEN) {
+        for (; i + QUARK_AVX2_LANES <= n; i += QUARK_AVX2_LANES)
+            Blake512_4way_AVX2(pin + i, nLen, pout + i);
+    }
+    for (; i < n; i++)
+        QuarkRound(z.blake, sph_blake512, sph_blake512_close, pin[i], nLen, pout[i]);
+}
+
+/** Keccak-512 of n 64-byte inputs, four at a time on CPUs with AVX2. */
+void QuarkKeccak(const CQuarkContexts& z, const unsigned char* const* pin, unsigned char* const* pout, size_t n)
+{
+    size_t i = 0;
+    if (z.fAVX2) {
+        for (; i + QUARK_AVX2_LANES <= n; i += QUARK_AVX2_LANES)
+            Keccak512_64_4way_AVX2(pin + i, pout + i);
+    }
+    for (; i < n; i++)
+        QuarkRound(z.keccak, sph_keccak512, sph_keccak512_close, pin[i], 64, pout[i]);
+}
+}
+
+void HashQuarkBatch(const unsigned char* pin, size_t nLen, size_t nCount, uint256* pout)
+{
+    const CQuarkContexts& z = QuarkInitialContexts();
+    unsigned char vHash[QUARK_BATCH_SIZE][64];
+    unsigned char* vpHash[QUARK_BATCH_SIZE];
+    for (size_t i = 0; i < QUARK_BATCH_SIZE; i++)
+        vpHash[i] = vHash[i];
+    // The results a branch round hashes with BLAKE or Keccak, gathered so the 4-way kernels see full groups
+    unsigned char* vpBranch[QUARK_BATCH_SIZE];
+
+    for (size_t nStart = 0; nStart < nCount; nStart += QUARK_BATCH_SIZE) {
+        const size_t n = std::min(QUARK_BATCH_SIZE, nCount - nStart);
+        const unsigned char* vpIn[QUARK_BATCH_SIZE];
+        for (size_t i = 0; i < n; i++)
+            vpIn[i] = pin + (nStart + i) * nLen;
+
+        // Each round reads a result and writes the next one in place; sph and the kernels consume their input before writing.
+        QuarkBlake(z, vpIn, nLen, vpHash, n);
+        for (size_t i = 0; i < n; i++)
+            QuarkRound(z.bmw, sph_bmw512, sph_bmw512_close, vHash[i], 64, vHash[i]);
+        for (size_t i = 0; i < n; i++) {
+            if (QuarkBranch(vHash[i]))
+                QuarkRound(z.groestl, sph_groestl512, sph_groestl512_close, vHash[i], 64, vHash[i]);
+            else
+                QuarkRound(z.skein, sph_skein512, sph_skein512_close, vHash[i], 64, vHash[i]);
+        }
+        for (size_t i = 0; i < n; i++)
+            QuarkRound(z.groestl, sph_groestl512, sph_groestl512_close, vHash[i], 64, vHash[i]);
+        for (size_t i = 0; i < n; i++)
+            QuarkRound(z.jh, sph_jh512, sph_jh512_close, vHash[i], 64, vHash[i]);
+        size_t nBranch = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (QuarkBranch(vHash[i]))
+                vpBranch[nBranch++] = vHash[i];
+            else
+                QuarkRound(z.bmw, sph_bmw512, sph_bmw512_close, vHash[i], 64, vHash[i]);
+        }
+        QuarkBlake(z, vpBranch, 64, vpBranch, nBranch);
+        QuarkKeccak(z, vpHash, vpHash, n);
+        for (size_t i = 0; i < n; i++)
+            QuarkRound(z.skein, sph_skein512, sph_skein512_close, vHash[i], 64, vHash[i]);
+        nBranch = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (QuarkBranch(vHash[i]))
+                vpBranch[nBranch++] = vHash[i];
+            else
+                QuarkRound(z.jh, sph_jh512, sph_jh512_close, vHash[i], 64, vHash[i]);
+        }
+        QuarkKeccak(z, vpBranch, vpBranch, nBranch);
+        for (size_t i = 0; i < n; i++)
+            memcpy(pout[nStart + i].begin(), vHash[i], 32);
+    }
+}
+
 void scrypt_hash(const char* pass, unsigned int pLen, const char* salt, unsigned int sLen, char* output, unsigned int N, unsigned int r, unsigned int p, unsigned int dkLen)
 {
     scrypt(pass, pLen, salt, sLen, output, N, r, p, dkLen);
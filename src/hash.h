@@ -323,94 +323,45 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
 void BIP32Hash(const unsigned char chainCode[32], unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
+/** SipHash-2-4, keyed by k0 and k1, over a whole number of 64-bit words */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    int count;
+
+public:
+    CSipHasher(uint64_t k0, uint64_t k1);
+    /** Hash a 64-bit integer worth of data, as 8 little-endian bytes */
+    CSipHasher& Write(uint64_t data);
+    uint64_t Finalize() const;
+};
+
+/** SipHash-2-4 of a 256-bit value, as CSipHasher would compute it over its four
+ *  words, but faster. Short transaction IDs of compact blocks are made with it. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 //int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
 //int HMAC_SHA512_Update(HMAC_SHA512_CTX *pctx, const void *pdata, size_t len);
 //int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx);
 
 /* ----------- Quark Hash ------------------------------------------------ */
+/**
+ * Quark-hash nCount inputs of nLen bytes each, stored back to back at pin, into pout[0..nCount).
+ * The nine-round chain is run one round at a time across the whole batch, starting each round
+ * from a context initialised once per process, so hashing many block headers (nLen == 80)
+ * costs noticeably less per header than calling HashQuark in a loop. On CPUs with AVX2 the
+ * BLAKE-512 and Keccak-512 rounds hash four inputs at once (see crypto/quark_avx2.h).
+ */
+void HashQuarkBatch(const unsigned char* pin, size_t nLen, size_t nCount, uint256* pout);
+
 template <typename T1>
 inline uint256 HashQuark(const T1 pbegin, const T1 pend)
-
 {
-    sph_blake512_context ctx_blake;
-    sph_bmw512_context ctx_bmw;
-    sph_groestl512_context ctx_groestl;
-    sph_jh512_context ctx_jh;
-    sph_keccak512_context ctx_keccak;
-    sph_skein512_context ctx_skein;
-    static unsigned char pblank[1];
-
-    uint512 mask = 8;
-    uint512 zero = 0;
-
-    uint512 hash[9];
-
-    sph_blake512_init(&ctx_blake);
-    // ZBLAKE;
-    sph_blake512(&ctx_blake, (pbegin == pend ? pblank : static_cast<const void*>(&pbegin[0])), (pend - pbegin) * sizeof(pbegin[0]));
-    sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[0]));
-
-    sph_bmw512_init(&ctx_bmw);
-    // ZBMW;
-    sph_bmw512(&ctx_bmw, static_cast<const void*>(&hash[0]), 64);
-    sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[1]));
-
-    if ((hash[1] & mask) != zero) {
-        sph_groestl512_init(&ctx_groestl);
-        // ZGROESTL;
-        sph_groestl512(&ctx_groestl, static_cast<const void*>(&hash[1]), 64);
-        sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[2]));
-    } else {
-        sph_skein512_init(&ctx_skein);
-        // ZSKEIN;
-        sph_skein512(&ctx_skein, static_cast<const void*>(&hash[1]), 64);
-        sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[2]));
-    }
-
-    sph_groestl512_init(&ctx_groestl);
-    // ZGROESTL;
-    sph_groestl512(&ctx_groestl, static_cast<const void*>(&hash[2]), 64);
-    sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[3]));
-
-    sph_jh512_init(&ctx_jh);
-    // ZJH;
-    sph_jh512(&ctx_jh, static_cast<const void*>(&hash[3]), 64);
-    sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[4]));
-
-    if ((hash[4] & mask) != zero) {
-        sph_blake512_init(&ctx_blake);
-        // ZBLAKE;
-        sph_blake512(&ctx_blake, static_cast<const void*>(&hash[4]), 64);
-        sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[5]));
-    } else {
-        sph_bmw512_init(&ctx_bmw);
-        // ZBMW;
-        sph_bmw512(&ctx_bmw, static_cast<const void*>(&hash[4]), 64);
-        sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[5]));
-    }
-
-    sph_keccak512_init(&ctx_keccak);
-    // ZKECCAK;
-    sph_keccak512(&ctx_keccak, static_cast<const void*>(&hash[5]), 64);
-    sph_keccak512_close(&ctx_keccak, static_cast<void*>(&hash[6]));
-
-    sph_skein512_init(&ctx_skein);
-    // SKEIN;
-    sph_skein512(&ctx_skein, static_cast<const void*>(&hash[6]), 64);
-    sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[7]));
-
-    if ((hash[7] & mask) != zero) {
-        sph_keccak512_init(&ctx_keccak);
-        // ZKECCAK;
-        sph_keccak512(&ctx_keccak, static_cast<const void*>(&hash[7]), 64);
-        sph_keccak512_close(&ctx_keccak, static_cast<void*>(&hash[8]));
-    } else {
-        sph_jh512_init(&ctx_jh);
-        // ZJH;
-        sph_jh512(&ctx_jh, static_cast<const void*>(&hash[7]), 64);
-        sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[8]));
-    }
-    return hash[8].trim256();
+    static const unsigned char pblank[1] = {0};
+    uint256 hash;
+    HashQuarkBatch((pbegin == pend ? pblank : reinterpret_cast<const unsigned char*>(&pbegin[0])), (pend - pbegin) * sizeof(pbegin[0]), 1, &hash);
+    return hash;
 }
 
 void scrypt_hash(const char* pass, unsigned int pLen, const char* salt, unsigned int sLen, char* output, unsigned int N, unsigned int r, unsigned int p, unsigned int dkLen);
@@ -15,6 +15,7 @@
 #include "masternode/activemasternode.h"
 #include "addrman.h"
 #include "amount.h"
+#include "blockimport.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "consensus/validation.h"
@@ -23,12 +24,15 @@
 #include "key.h"
 #include "main.h"
 #include "masternode/masternode-budget.h"
+#include "masternode/masternode-collateral.h"
 #include "masternode/masternode-payments.h"
 #include "masternode/masternodeconfig.h"
 #include "masternode/masternodeman.h"
 #include "masternode/messagesigner.h"
 #include "miner.h"
 #include "net.h"
+#include "netpoll.h"
+#include "netscheduler.h"
 #include "rpc/server.h"
 #include "script/standard.h"
 #include "scheduler.h"
@@ -41,6 +45,7 @@
 #include "utilmoneystr.h"
 #include "validationinterface.h"
 #ifdef ENABLE_WALLET
+#include "kernel.h"
 #include "wallet/db.h"
 #include "wallet/wallet.h"
 #include "wallet/walletdb.h"
@@ -146,10 +151,10 @@ class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch (const std::runtime_error& e) {
             uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
             LogPrintf("Error reading from database: %s\n", e.what());
@@ -163,7 +168,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB* pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher* pcoinscatcher = NULL;
 
 void Interrupt(boost::thread_group& threadGroup)
@@ -356,6 +360,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxreorg=<n>", strprintf(_("Set the Maximum reorg depth (default: %u)"), Params(CBaseChainParams::MAIN).MaxReorganizationDepth()));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-parmempoolinputs=<n>", strprintf(_("Check the scripts of transactions with at least <n> inputs on the script verification threads before accepting them to the memory pool (default: %u)"), DEFAULT_MEMPOOL_PARALLEL_INPUTS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "stakecubecoind.pid"));
 #endif
@@ -378,6 +383,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-discover", _("Discover own IP address (default: 1 when listening and no -externalip)"));
     strUsage += HelpMessageOpt("-dns", _("Allow DNS lookups for -addnode, -seednode and -connect") + " " + _("(default: 1)"));
     strUsage += HelpMessageOpt("-dnsseed", _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)"));
+    strUsage += HelpMessageOpt("-epoll", strprintf(_("Wait for peer sockets with epoll instead of select(), where the system has it. This lifts the limit of about %u connections (default: %u)"), FD_SETSIZE, DEFAULT_EPOLL));
     strUsage += HelpMessageOpt("-externalip=<ip>", _("Specify your own public address"));
     strUsage += HelpMessageOpt("-forcednsseed", strprintf(_("Always query for peer addresses via DNS lookup (default: %u)"), 0));
     strUsage += HelpMessageOpt("-listen", _("Accept connections from outside (default: 1 if no -proxy or -connect)"));
@@ -385,6 +391,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125));
     strUsage += HelpMessageOpt("-maxreceivebuffer=<n>", strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000));
     strUsage += HelpMessageOpt("-maxsendbuffer=<n>", strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000));
+    strUsage += HelpMessageOpt("-msgthreads=<n>", strprintf(_("Number of threads processing messages from peers, besides the one for masternode, budget and spork messages (1 to %d, default: %d)"), MAX_MESSAGE_THREADS, DEFAULT_MESSAGE_THREADS));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), 1));
@@ -486,7 +493,7 @@ std::string HelpMessage(HelpMessageMode mode)
     if (GetBoolArg("-help-debug", false)) {
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf(_("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:%u)"), 15));
         strUsage += HelpMessageOpt("-relaypriority", strprintf(_("Require high priority for relaying free or low-fee transactions (default:%u)"), 1));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf(_("Limit size of signature cache to <n> entries (default: %u)"), 50000));
+        strUsage += HelpMessageOpt("-sigcachesize=<n>", strprintf(_("Limit size of signature cache to <n> megabytes (default: %u)"), DEFAULT_SIG_CACHE_SIZE));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in SCC/Kb) smaller than this are considered zero fee for relaying (default: %s)"), FormatMoney(::minRelayTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-printtoconsole", strprintf(_("Send trace/debug info to console instead of debug.log file (default: %u)"), 0));
@@ -505,6 +512,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageGroup(_("Staking options:"));
     strUsage += HelpMessageOpt("-staking=<n>", strprintf(_("Enable staking functionality (0-1, default: %u)"), 1));
     strUsage += HelpMessageOpt("-reservebalance=<amt>", _("Keep the specified amount available for spending at all times (default: 0)"));
+    strUsage += HelpMessageOpt("-stakethreads=<n>", strprintf(_("Set the number of threads for the stake kernel search (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_STAKE_THREADS, DEFAULT_STAKE_THREADS));
     if (GetBoolArg("-help-debug", false)) {
         strUsage += HelpMessageOpt("-printstakemodifier", _("Display the stake modifier calculations in the debug.log file."));
         strUsage += HelpMessageOpt("-printcoinstake", _("Display verbose coin stake messages in the debug.log file."));
@@ -623,18 +631,15 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
+        // Hand all block files to one import, so reading runs ahead across files
+        std::vector<CImportFile> vFiles;
+        for (int nFile = 0; ; nFile++) {
+            boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+            if (!boost::filesystem::exists(path))
                 break; // No block files left to reindex
-            FILE* file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
-            nFile++;
+            vFiles.push_back(CImportFile(path, NULL, nFile));
         }
+        LoadExternalBlockFiles(vFiles);
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -852,7 +857,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler, const std
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    // select() can't wait for descriptors from FD_SETSIZE up, epoll can
+    fNetEpoll = HaveEpoll() && GetBoolArg("-epoll", DEFAULT_EPOLL);
+    if (!fNetEpoll)
+        nMaxConnections = std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS));
+    nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -883,6 +892,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler, const std
     if (GetBoolArg("-benchmark", false))
         InitWarning(_("Warning: Unsupported argument -benchmark ignored, use -debug=bench."));
 
+    if (mapArgs.count("-maxsigcachesize"))
+        InitWarning(_("Warning: Deprecated argument -maxsigcachesize counts signature cache entries, use -sigcachesize to give its size in megabytes."));
+
     // Checkmempool and checkblockindex default to true in testnet + regtest mode
     mempool.setSanityCheck(GetBoolArg("-checkmempool", Params().NetworkID() != CBaseChainParams::MAIN));
     fCheckBlockIndex = GetBoolArg("-checkblockindex", Params().DefaultConsistencyChecks());
@@ -896,6 +908,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler, const std
         nScriptCheckThreads = 0;
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    nMempoolParallelInputs = GetArg("-parmempoolinputs", DEFAULT_MEMPOOL_PARALLEL_INPUTS);
 
     fServer = GetBoolArg("-server", false);
     setvbuf(stdout, NULL, _IOLBF, 0); /// ***TODO*** do we still need this after -printtoconsole is gone?
@@ -1026,6 +1039,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler, const std
     std::ostringstream strErrors;
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+    CSignatureCacheStats sigcachestats = GetSignatureCacheStats();
+    LogPrintf("Using %u MB for the signature cache (%u entries)\n", sigcachestats.nBytes >> 20, sigcachestats.nCapacity);
     if (nScriptCheckThreads) {
         for (int i = 0; i < nScriptCheckThreads - 1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
@@ -1368,7 +1383,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler, const std
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest goes to the in-memory coins cache
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1391,6 +1406,18 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler, const std
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+
+                // Rewrite a coin database from before the per-outpoint layout
+                if (!pcoinsdbview->Upgrade()) {
+                    // an interrupted upgrade picks up where it stopped on the next start
+                    if (ShutdownRequested()) {
+                        LogPrintf("Shutdown requested. Exiting.\n");
+                        return false;
+                    }
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
@@ -1691,6 +1718,9 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler, const std
 
     // ********************************************************* Step 10: setup ObfuScation
 
+    // track masternode collaterals from transaction notifications instead of polling the mempool
+    RegisterValidationInterface(&mnCollaterals);
+
     uiInterface.InitMessage(_("Loading masternode cache..."));
 
     CMasternodeDB mndb;
@@ -5,10 +5,14 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <atomic>
+
 #include <boost/assign/list_of.hpp>
+#include <boost/thread.hpp>
 
 #include "wallet/db.h"
 #include "kernel.h"
+#include "crypto/common.h"
 #include "script/interpreter.h"
 #include "timedata.h"
 #include "util.h"
@@ -44,6 +48,8 @@ static bool GetLastStakeModifier(const CBlockIndex* pindex, uint64_t& nStakeModi
 {
     if (!pindex)
         return error("GetLastStakeModifier: null pindex");
+    if (pindex->pstakeModifier)
+        pindex = pindex->pstakeModifier;
     while (pindex && pindex->pprev && !pindex->GeneratedStakeModifier())
         pindex = pindex->pprev;
     if (!pindex->GeneratedStakeModifier())
@@ -71,11 +77,27 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
+// A candidate block for the stake modifier selection, ordered by (time, hash)
+struct CStakeModifierCandidate {
+    int64_t nTime;
+    uint256 hash;
+    const CBlockIndex* pindex;
+
+    CStakeModifierCandidate(const CBlockIndex* pindexIn) : nTime(pindexIn->GetBlockTime()), hash(pindexIn->GetBlockHash()), pindex(pindexIn) {}
+
+    bool operator<(const CStakeModifierCandidate& other) const
+    {
+        if (nTime != other.nTime)
+            return nTime < other.nTime;
+        return hash < other.hash;
+    }
+};
+
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
 // already selected blocks in vSelectedBlocks, and with timestamp up to
 // nSelectionIntervalStop.
 static bool SelectBlockFromCandidates(
-    vector<pair<int64_t, uint256> >& vSortedByTimestamp,
+    const vector<CStakeModifierCandidate>& vSortedByTimestamp,
     map<uint256, const CBlockIndex*>& mapSelectedBlocks,
     int64_t nSelectionIntervalStop,
     uint64_t nStakeModifierPrev,
@@ -86,11 +108,8 @@ static bool SelectBlockFromCandidates(
     bool fSelected = false;
     uint256 hashBest = 0;
     *pindexSelected = (const CBlockIndex*)0;
-    for (const PAIRTYPE(int64_t, uint256) & item : vSortedByTimestamp) {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString().c_str());
-
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
+    for (const CStakeModifierCandidate& item : vSortedByTimestamp) {
+        const CBlockIndex* pindex = item.pindex;
         if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
             break;
 
@@ -134,6 +153,56 @@ static bool SelectBlockFromCandidates(
     return fSelected;
 }
 
+// Candidate window of the last ComputeNextStakeModifier call. Calls along the
+// same branch share all but a few blocks of their window, so the sorted window
+// is updated in place instead of being collected and sorted again every time.
+static CCriticalSection cs_stakeModifierCandidates;
+static const CBlockIndex* pindexCandidatesTop = NULL;
+static int nCandidatesFirstHeight = 0;
+static vector<CStakeModifierCandidate> vCandidatesCache;
+
+// Collect the blocks at the top of the chain ending at pindexPrev whose time is at
+// least nSelectionIntervalStart, sorted by timestamp.
+static void GetStakeModifierCandidates(const CBlockIndex* pindexPrev, int64_t nSelectionIntervalStart, vector<CStakeModifierCandidate>& vSortedByTimestamp, int& nHeightFirstCandidate)
+{
+    LOCK(cs_stakeModifierCandidates);
+    bool fExtend = pindexCandidatesTop && pindexCandidatesTop->nHeight < pindexPrev->nHeight &&
+                   pindexPrev->GetAncestor(pindexCandidatesTop->nHeight) == pindexCandidatesTop;
+
+    // Only blocks above or below the cached window have to be added, the rest is already there
+    vector<const CBlockIndex*> vAdd;
+    const CBlockIndex* pindex = pindexPrev;
+    while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart) {
+        if (!fExtend || pindex->nHeight > pindexCandidatesTop->nHeight || pindex->nHeight < nCandidatesFirstHeight)
+            vAdd.push_back(pindex);
+        pindex = pindex->pprev;
+    }
+    nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
+
+    if (fExtend) {
+        vector<CStakeModifierCandidate>::iterator itEnd = vCandidatesCache.begin();
+        for (vector<CStakeModifierCandidate>::iterator it = vCandidatesCache.begin(); it != vCandidatesCache.end(); ++it) {
+            if (it->pindex->nHeight >= nHeightFirstCandidate)
+                *itEnd++ = *it;
+        }
+        vCandidatesCache.erase(itEnd, vCandidatesCache.end());
+        for (const CBlockIndex* pindexAdd : vAdd) {
+            CStakeModifierCandidate candidate(pindexAdd);
+            vCandidatesCache.insert(std::upper_bound(vCandidatesCache.begin(), vCandidatesCache.end(), candidate), candidate);
+        }
+    } else {
+        vCandidatesCache.clear();
+        vCandidatesCache.reserve(64 * getIntervalVersion(fTestNet) / nStakeTargetSpacing);
+        for (const CBlockIndex* pindexAdd : vAdd)
+            vCandidatesCache.push_back(CStakeModifierCandidate(pindexAdd));
+        sort(vCandidatesCache.begin(), vCandidatesCache.end());
+    }
+
+    pindexCandidatesTop = pindexPrev;
+    nCandidatesFirstHeight = nHeightFirstCandidate;
+    vSortedByTimestamp = vCandidatesCache;
+}
+
 // Stake Modifier (hash modifier of proof-of-stake):
 // The purpose of stake modifier is to prevent a txout (coin) owner from
 // computing future proof-of-stake generated by this txout at the time
@@ -175,20 +244,12 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
         return true;
 
     // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
-    vSortedByTimestamp.reserve(64 * getIntervalVersion(fTestNet) / nStakeTargetSpacing);
+    vector<CStakeModifierCandidate> vSortedByTimestamp;
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / getIntervalVersion(fTestNet)) * getIntervalVersion(fTestNet) - nSelectionInterval;
-    const CBlockIndex* pindex = pindexPrev;
-
-    while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart) {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
-        pindex = pindex->pprev;
-    }
-
-    int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
-    reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
-    sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+    int nHeightFirstCandidate = 0;
+    GetStakeModifierCandidates(pindexPrev, nSelectionIntervalStart, vSortedByTimestamp, nHeightFirstCandidate);
+    const CBlockIndex* pindex = NULL;
 
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
@@ -240,17 +301,113 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+CStakeModifierIndex stakeModifierIndex;
+
+void CStakeModifierIndex::PushBack(const CBlockIndex* pindex)
+{
+    Entry entry;
+    entry.pindex = pindex;
+    entry.nMaxTime = pindex->GetBlockTime();
+    if (!vEntries.empty())
+        entry.nMaxTime = std::max(entry.nMaxTime, vEntries.back().nMaxTime);
+    vEntries.push_back(entry);
+}
+
+void CStakeModifierIndex::BlockConnected(const CBlockIndex* pindex)
+{
+    LOCK(cs);
+    if (pindex->pprev != pindexTip) {
+        // missed an update, start over from the active chain
+        RebuildLocked(chainActive);
+        return;
+    }
+    if (pindex->GeneratedStakeModifier())
+        PushBack(pindex);
+    pindexTip = pindex;
+}
+
+void CStakeModifierIndex::BlockDisconnected(const CBlockIndex* pindex)
+{
+    LOCK(cs);
+    if (pindex != pindexTip) {
+        RebuildLocked(chainActive);
+        return;
+    }
+    while (!vEntries.empty() && vEntries.back().pindex->nHeight >= pindex->nHeight)
+        vEntries.pop_back();
+    pindexTip = pindex->pprev;
+}
+
+void CStakeModifierIndex::Rebuild(const CChain& chain)
+{
+    LOCK(cs);
+    RebuildLocked(chain);
+}
+
+void CStakeModifierIndex::RebuildLocked(const CChain& chain)
+{
+    vEntries.clear();
+    for (int nHeight = 0; nHeight <= chain.Height(); nHeight++) {
+        if (chain[nHeight]->GeneratedStakeModifier())
+            PushBack(chain[nHeight]);
+    }
+    pindexTip = chain.Tip();
+}
+
+void CStakeModifierIndex::Clear()
+{
+    LOCK(cs);
+    vEntries.clear();
+    pindexTip = NULL;
+
+    LOCK(cs_stakeModifierCandidates);
+    vCandidatesCache.clear();
+    pindexCandidatesTop = NULL;
+}
+
+bool CStakeModifierIndex::FindModifierBlock(int nHeightFrom, int64_t nTimeTarget, const CBlockIndex*& pindexFound) const
+{
+    LOCK(cs);
+    pindexFound = NULL;
+    if (!pindexTip || pindexTip != chainActive.Tip())
+        return false;
+
+    std::vector<Entry>::const_iterator it = std::upper_bound(vEntries.begin(), vEntries.end(), nHeightFrom,
+        [](int nHeight, const Entry& entry) { return nHeight < entry.pindex->nHeight; });
+    if (it != vEntries.begin() && (it - 1)->nMaxTime >= nTimeTarget)
+        return false;
+
+    // nothing before it reaches nTimeTarget, so the first running maximum that
+    // does belongs to the first block with a late enough timestamp
+    it = std::lower_bound(it, vEntries.end(), nTimeTarget,
+        [](const Entry& entry, int64_t nTime) { return entry.nMaxTime < nTime; });
+    if (it != vEntries.end())
+        pindexFound = it->pindex;
+    return true;
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+static bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
+    if (!pindexFrom)
         return error("GetKernelStakeModifier() : block not indexed");
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
+
+    // look the modifier block up in the index, fall back to walking the chain if it can't tell
+    const CBlockIndex* pindexModifier = NULL;
+    if (stakeModifierIndex.FindModifierBlock(pindexFrom->nHeight, pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval, pindexModifier)) {
+        if (!pindexModifier)
+            return error("Null pindexNext\n");
+        nStakeModifierHeight = pindexModifier->nHeight;
+        nStakeModifierTime = pindexModifier->GetBlockTime();
+        nStakeModifier = pindexModifier->nStakeModifier;
+        return true;
+    }
+
     const CBlockIndex* pindex = pindexFrom;
     CBlockIndex* pindexNext = chainActive[pindexFrom->nHeight + 1];
 
@@ -290,11 +447,13 @@ bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTarget
 }
 
 //instead of looping outside and reinitializing variables many times, we will give a nTimeTx and also search interval so that we can do all the hashing here
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTransaction txPrev, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, const CAmount nValueIn, const COutPoint& prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake)
 {
+    if (!pindexFrom)
+        return error("CheckStakeKernelHash() : null pindexFrom");
+
     //assign new variables to make it easier to read
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
+    unsigned int nTimeBlockFrom = pindexFrom->GetBlockTime();
 
     if (nTimeTx < nTimeBlockFrom) // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
@@ -317,7 +476,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
     uint64_t nStakeModifier = 0;
     int nStakeModifierHeight = 0;
     int64_t nStakeModifierTime = 0;
-    if (!GetKernelStakeModifier(blockFrom.GetHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake)) {
+    if (!GetKernelStakeModifier(pindexFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake)) {
         LogPrintf("CheckStakeKernelHash(): failed to get kernel stake modifier \n");
         return false;
     }
@@ -357,8 +516,8 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
             LogPrintf("CheckStakeKernelHash() : using modifier %s at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
                 std::to_string(nStakeModifier).c_str(), nStakeModifierHeight,
                 DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nStakeModifierTime).c_str(),
-                mapBlockIndex[blockFrom.GetHash()]->nHeight,
-                DateTimeStrFormat("%Y-%m-%d %H:%M:%S", blockFrom.GetBlockTime()).c_str());
+                pindexFrom->nHeight,
+                DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nTimeBlockFrom).c_str());
             LogPrintf("CheckStakeKernelHash() : pass protocol=%s modifier=%s nTimeBlockFrom=%u prevoutHash=%s nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
                 "0.3",
                 std::to_string(nStakeModifier).c_str(),
@@ -373,45 +532,261 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
     return fSuccess;
 }
 
+// Kernel preimage: nStakeModifier, nTimeBlockFrom, prevout.n, prevout.hash, nTimeTx.
+// Laid out exactly as stakeHash() serializes it, so only nTimeTx changes per try.
+static const size_t KERNEL_PREIMAGE_SIZE = 8 + 4 + 4 + 32 + 4;
+
+struct CStakeKernelJob {
+    unsigned char preimage[KERNEL_PREIMAGE_SIZE];
+    unsigned int nTimeBlockFrom;
+    uint256 bnTarget;
+    bool fValid;
+};
+
+// Stake modifiers of the source blocks seen by the search, valid for one tip only
+static CCriticalSection cs_stakeModifierCache;
+static const CBlockIndex* pindexStakeModifierCacheTip = NULL;
+static std::map<const CBlockIndex*, uint64_t> mapStakeModifierCache;
+
+static bool GetCachedKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier)
+{
+    LOCK(cs_stakeModifierCache);
+    if (pindexStakeModifierCacheTip != chainActive.Tip()) {
+        mapStakeModifierCache.clear();
+        pindexStakeModifierCacheTip = chainActive.Tip();
+    }
+    std::map<const CBlockIndex*, uint64_t>::const_iterator it = mapStakeModifierCache.find(pindexFrom);
+    if (it != mapStakeModifierCache.end()) {
+        nStakeModifier = it->second;
+        return true;
+    }
+
+    int nStakeModifierHeight = 0;
+    int64_t nStakeModifierTime = 0;
+    if (!GetKernelStakeModifier(pindexFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false))
+        return false;
+    mapStakeModifierCache.insert(std::make_pair(pindexFrom, nStakeModifier));
+    return true;
+}
+
+static std::atomic<uint64_t> nLastSearchHashes(0);
+static std::atomic<int64_t> nLastSearchMicros(0);
+
+double GetStakeKernelHashRate()
+{
+    int64_t nMicros = nLastSearchMicros.load();
+    if (nMicros <= 0)
+        return 0;
+    return nLastSearchHashes.load() * 1000000.0 / nMicros;
+}
+
+// State shared by the threads of one kernel search
+struct CStakeKernelSearch {
+    std::vector<CStakeKernelJob> vJobs;
+    std::vector<unsigned int> vTimeFound;
+    std::vector<uint256> vHashFound;
+    std::atomic<size_t> nNextJob;
+    std::atomic<size_t> nBestJob;
+    std::atomic<uint64_t> nHashes;
+    unsigned int nTimeTx;
+    unsigned int nHashDrift;
+    unsigned int nTimeMin;
+    int nHeightStart;
+};
+
+static void StakeKernelSearchWorker(CStakeKernelSearch* search)
+{
+    const std::vector<CStakeKernelJob>& vJobs = search->vJobs;
+    uint64_t nHashesLocal = 0;
+    while (true) {
+        size_t nJob = search->nNextJob.fetch_add(1);
+        // jobs are claimed in order, so anything past a found kernel can be skipped
+        if (nJob >= vJobs.size() || nJob > search->nBestJob.load())
+            break;
+        //new block came in, move on
+        if (chainActive.Height() != search->nHeightStart)
+            break;
+
+        const CStakeKernelJob& job = vJobs[nJob];
+        if (!job.fValid)
+            continue;
+
+        unsigned char preimage[KERNEL_PREIMAGE_SIZE];
+        memcpy(preimage, job.preimage, sizeof(preimage));
+        for (unsigned int i = 0; i < search->nHashDrift; i++) {
+            unsigned int nTryTime = search->nTimeTx + search->nHashDrift - i;
+            if (nTryTime <= search->nTimeMin)
+                break;
+
+            WriteLE32(preimage + KERNEL_PREIMAGE_SIZE - 4, nTryTime);
+            uint256 hashProofOfStake;
+            CHash256().Write(preimage, sizeof(preimage)).Finalize(hashProofOfStake.begin());
+            nHashesLocal++;
+
+            if (!(hashProofOfStake < job.bnTarget))
+                continue;
+
+            search->vTimeFound[nJob] = nTryTime;
+            search->vHashFound[nJob] = hashProofOfStake;
+            size_t nBest = search->nBestJob.load();
+            while (nJob < nBest && !search->nBestJob.compare_exchange_weak(nBest, nJob)) {}
+            break;
+        }
+    }
+    search->nHashes += nHashesLocal;
+}
+
+int SearchStakeKernels(unsigned int nBits, const std::vector<CStakeKernelInput>& vInputs, unsigned int& nTimeTx, unsigned int nHashDrift, unsigned int nTimeMin, uint256& hashProofOfStake)
+{
+    int64_t nTimeStart = GetTimeMicros();
+
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    // Build the kernel preimage of every input once, outside the hashing loop
+    CStakeKernelSearch search;
+    std::vector<CStakeKernelJob>& vJobs = search.vJobs;
+    vJobs.resize(vInputs.size());
+    {
+        LOCK(cs_main);
+        search.nHeightStart = chainActive.Height();
+        bool fEnforceMinStake = search.nHeightStart >= Params().TieredCoinbaseMaturityBlock();
+        for (size_t i = 0; i < vInputs.size(); i++) {
+            const CStakeKernelInput& input = vInputs[i];
+            CStakeKernelJob& job = vJobs[i];
+            job.fValid = false;
+            if (!input.pindexFrom)
+                continue;
+
+            job.nTimeBlockFrom = input.pindexFrom->GetBlockTime();
+            if (nTimeTx < job.nTimeBlockFrom || job.nTimeBlockFrom + nStakeMinAge > nTimeTx)
+                continue;
+            if (fEnforceMinStake && input.nValue < Params().MinStakeValue() * COIN)
+                continue;
+
+            uint64_t nStakeModifier = 0;
+            if (!GetCachedKernelStakeModifier(input.pindexFrom, nStakeModifier))
+                continue;
+
+            WriteLE64(job.preimage, nStakeModifier);
+            WriteLE32(job.preimage + 8, job.nTimeBlockFrom);
+            WriteLE32(job.preimage + 12, input.prevout.n);
+            memcpy(job.preimage + 16, input.prevout.hash.begin(), 32);
+            job.bnTarget = (uint256(input.nValue) / 100) * bnTargetPerCoinDay;
+            job.fValid = true;
+        }
+    }
+
+    int nThreads = GetArg("-stakethreads", DEFAULT_STAKE_THREADS);
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, MAX_STAKE_THREADS));
+    nThreads = std::min<int>(nThreads, std::max<size_t>(vJobs.size(), 1));
+
+    search.vTimeFound.resize(vJobs.size(), 0);
+    search.vHashFound.resize(vJobs.size());
+    search.nNextJob = 0;
+    search.nBestJob = vJobs.size();
+    search.nHashes = 0;
+    search.nTimeTx = nTimeTx;
+    search.nHashDrift = nHashDrift;
+    search.nTimeMin = nTimeMin;
+
+    boost::thread_group workers;
+    for (int i = 1; i < nThreads; i++)
+        workers.create_thread(boost::bind(&StakeKernelSearchWorker, &search));
+    StakeKernelSearchWorker(&search);
+    workers.join_all();
+
+    int64_t nElapsed = GetTimeMicros() - nTimeStart;
+    nLastSearchHashes = search.nHashes.load();
+    nLastSearchMicros = nElapsed;
+    LogPrint("staking", "SearchStakeKernels() : %u inputs, %u kernels hashed on %d threads in %.2fms (%.0f kernels/s)\n",
+        vJobs.size(), search.nHashes.load(), nThreads, nElapsed * 0.001, GetStakeKernelHashRate());
+
+    {
+        LOCK(cs_main);
+        mapHashedBlocks.clear();
+        mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
+        if (chainActive.Height() != search.nHeightStart)
+            return -1;
+    }
+
+    size_t nBest = search.nBestJob.load();
+    if (nBest >= vJobs.size())
+        return -1;
+
+    nTimeTx = search.vTimeFound[nBest];
+    hashProofOfStake = search.vHashFound[nBest];
+    return (int)nBest;
+}
+
+// Locate the kernel input in the UTXO set. Everything the kernel needs (value,
+// script and the time of the block that created the output) is available from
+// pcoinsTip and the block index, so no block file has to be read.
+static bool GetStakeInputFromCoins(const COutPoint& prevout, CTxOut& txoutPrev, const CBlockIndex*& pindexFrom)
+{
+    LOCK(cs_main);
+    const Coin& coin = pcoinsTip->AccessCoin(prevout);
+    if (coin.IsSpent())
+        return false;
+    if (coin.nHeight <= 0 || (int)coin.nHeight > chainActive.Height())
+        return false;
+
+    txoutPrev = coin.out;
+    pindexFrom = chainActive[coin.nHeight];
+    return pindexFrom != NULL;
+}
+
+// Slow path for inputs that are no longer in the UTXO set (e.g. a competing
+// block on a fork that spends the same output): look up the transaction itself.
+static bool GetStakeInputFromTransaction(const COutPoint& prevout, CTxOut& txoutPrev, const CBlockIndex*& pindexFrom)
+{
+    uint256 hashBlock;
+    CTransaction txPrev;
+    if (!GetTransaction(prevout.hash, txPrev, hashBlock, true))
+        return error("CheckProofOfStake() : INFO: read txPrev failed");
+    if (prevout.n >= txPrev.vout.size())
+        return error("CheckProofOfStake() : invalid prevout index %u", prevout.n);
+
+    LOCK(cs_main);
+    BlockMap::iterator it = mapBlockIndex.find(hashBlock);
+    if (it == mapBlockIndex.end() || !it->second)
+        return error("CheckProofOfStake() : read block failed");
+
+    txoutPrev = txPrev.vout[prevout.n];
+    pindexFrom = it->second;
+    return true;
+}
+
 // Check kernel hash target and coinstake signature
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake)
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake)
 {
-    const CTransaction tx = block.vtx[1];
+    const CTransaction& tx = block.vtx[1];
     if (!tx.IsCoinStake())
         return error("CheckProofOfStake() : called on non-coinstake %s", tx.GetHash().ToString().c_str());
 
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // First try finding the previous transaction in database
-    uint256 hashBlock;
-    CTransaction txPrev;
-    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
-        return error("CheckProofOfStake() : INFO: read txPrev failed");
+    // Resolve the kernel input from the UTXO set, falling back to the transaction lookup
+    CTxOut txoutPrev;
+    const CBlockIndex* pindex = NULL;
+    if (!GetStakeInputFromCoins(txin.prevout, txoutPrev, pindex) &&
+        !GetStakeInputFromTransaction(txin.prevout, txoutPrev, pindex))
+        return false;
 
     //verify signature and script
-    if (!VerifyScript(txin.scriptSig, txPrev.vout[txin.prevout.n].scriptPubKey,
-        tx.wit.vtxinwit.size() > 0 ? &tx.wit.vtxinwit[0].scriptWitness : NULL, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0, txPrev.vout[txin.prevout.n].nValue)))
+    if (!VerifyScript(txin.scriptSig, txoutPrev.scriptPubKey,
+        tx.wit.vtxinwit.size() > 0 ? &tx.wit.vtxinwit[0].scriptWitness : NULL, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0, txoutPrev.nValue)))
         return error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString().c_str());
 
-    CBlockIndex* pindex = NULL;
-    BlockMap::iterator it = mapBlockIndex.find(hashBlock);
-    if (it != mapBlockIndex.end())
-        pindex = it->second;
-    else
-        return error("CheckProofOfStake() : read block failed");
-
-    // Read block header
-    CBlock blockprev;
-    if (!ReadBlockFromDisk(blockprev, pindex->GetBlockPos()))
-        return error("CheckProofOfStake(): INFO: failed to find block");
-
     unsigned int nInterval = 0;
     unsigned int nTime = block.nTime;
 
     if (pindex->nHeight >= Params().TieredCoinbaseMaturityBlock())
     {
-        if (!CheckStakeKernelHash(block.nBits, blockprev, txPrev, txin.prevout, nTime, nInterval, true, hashProofOfStake, fDebug))
+        if (!CheckStakeKernelHash(block.nBits, pindex, txoutPrev.nValue, txin.prevout, nTime, nInterval, true, hashProofOfStake, fDebug))
         {
             return error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s \n", tx.GetHash().ToString().c_str(), hashProofOfStake.ToString().c_str()); // may occur during initial download or if behind on block chain sync
         }
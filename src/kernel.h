@@ -14,10 +14,51 @@ static const unsigned int MODIFIER_INTERVAL_TESTNET = 60;
 extern unsigned int nModifierInterval;
 extern unsigned int getIntervalVersion(bool fTestNet);
 
+// Default and maximum number of threads used by the stake kernel search
+static const int DEFAULT_STAKE_THREADS = 0;
+static const int MAX_STAKE_THREADS = 64;
+
 // MODIFIER_INTERVAL_RATIO:
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+/** Stake modifier generating blocks of the active chain ordered by height, so the
+ *  modifier used by a kernel can be found by binary search instead of a chain walk.
+ *  Kept in step with chainActive by ConnectTip/DisconnectTip and rebuilt from the
+ *  block index (nFlags/nStakeModifier) when it is loaded.
+ */
+class CStakeModifierIndex
+{
+private:
+    struct Entry {
+        const CBlockIndex* pindex;
+        int64_t nMaxTime; // highest block time of this and all earlier entries
+    };
+
+    mutable CCriticalSection cs;
+    std::vector<Entry> vEntries;
+    const CBlockIndex* pindexTip;
+
+    void PushBack(const CBlockIndex* pindex);
+    void RebuildLocked(const CChain& chain);
+
+public:
+    CStakeModifierIndex() : pindexTip(NULL) {}
+
+    void BlockConnected(const CBlockIndex* pindex);
+    void BlockDisconnected(const CBlockIndex* pindex);
+    void Rebuild(const CChain& chain);
+    void Clear();
+
+    // Find the first generating block above nHeightFrom whose time is at least nTimeTarget.
+    // Returns false if the index cannot answer (out of sync with chainActive, or an earlier
+    // block carries a later timestamp) and the caller has to walk the chain instead.
+    // pindexFound is NULL if no such block exists yet.
+    bool FindModifierBlock(int nHeightFrom, int64_t nTimeTarget, const CBlockIndex*& pindexFound) const;
+};
+
+extern CStakeModifierIndex stakeModifierIndex;
+
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
@@ -25,11 +66,31 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 // Sets hashProofOfStake on success return
 uint256 stakeHash(unsigned int nTimeTx, CDataStream ss, unsigned int prevoutIndex, uint256 prevoutHash, unsigned int nTimeBlockFrom);
 bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay);
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTransaction txPrev, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake = false);
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, const CAmount nValueIn, const COutPoint& prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake = false);
+
+// A stake input handed to the kernel search engine
+struct CStakeKernelInput {
+    COutPoint prevout;
+    CAmount nValue;
+    const CBlockIndex* pindexFrom;
+
+    CStakeKernelInput(const COutPoint& prevoutIn, CAmount nValueIn, const CBlockIndex* pindexFromIn)
+        : prevout(prevoutIn), nValue(nValueIn), pindexFrom(pindexFromIn) {}
+};
+
+// Search the nHashDrift window of every input for a kernel on -stakethreads workers.
+// Only kernel times above nTimeMin are accepted. Returns the position in vInputs of the
+// first input that hits the target (the same one a serial search would find), or -1 if
+// there is none or the tip changed. Sets nTimeTx and hashProofOfStake on success.
+int SearchStakeKernels(unsigned int nBits, const std::vector<CStakeKernelInput>& vInputs, unsigned int& nTimeTx, unsigned int nHashDrift, unsigned int nTimeMin, uint256& hashProofOfStake);
+
+// Kernels hashed per second by the last kernel search
+double GetStakeKernelHashRate();
 
 // Check kernel hash target and coinstake signature
+// The kernel input is resolved from the UTXO set and block index, not the block files
 // Sets hashProofOfStake on success return
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake);
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake);
 
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
@@ -31,8 +31,11 @@ class CLevelDBBatch
 
 private:
     leveldb::WriteBatch batch;
+    size_t nSizeEstimate;
 
 public:
+    CLevelDBBatch() : nSizeEstimate(0) {}
+
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
@@ -47,6 +50,13 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        nSizeEstimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
     }
 
     template <typename K>
@@ -58,7 +68,15 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        nSizeEstimate += 2 + (slKey.size() > 127) + slKey.size();
     }
+
+    //! Approximate number of bytes the batch adds to the database log
+    size_t SizeEstimate() const { return nSizeEstimate; }
 };
 
 class CLevelDBWrapper
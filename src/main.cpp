@@ -14,11 +14,15 @@
 #include "alert.h"
 #include "banned.h"
 #include "base58.h"
+#include "blockencodings.h"
+#include "blockimport.h"
+#include "blockstorage.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
 #include "init.h"
 #include "kernel.h"
 #include "masternode/masternode-budget.h"
@@ -26,9 +30,11 @@
 #include "masternode/masternodeman.h"
 #include "merkleblock.h"
 #include "net.h"
+#include "netscheduler.h"
 #include "obfuscation.h"
 #include "protocol.h"
 #include "pow.h"
+#include "sendbuffer.h"
 #include "spork.h"
 #include "sporkdb.h"
 #include "swifttx.h"
@@ -68,6 +74,7 @@ using namespace std;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+CBlockIndexArena blockIndexArena;
 map<uint256, uint256> mapProofOfStake;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
@@ -80,18 +87,20 @@ set<pair<COutPoint, unsigned int> > setStakeSeen;
 map<COutPoint, int> mapStakeSpent;
 map<unsigned int, unsigned int> mapHashedBlocks;
 CChain chainActive;
+CChainHashes chainActiveHashes;
 CBlockIndex* pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+unsigned int nMempoolParallelInputs = DEFAULT_MEMPOOL_PARALLEL_INPUTS;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 unsigned int nBytesPerSigOp = DEFAULT_BYTES_PER_SIGOP;
 bool fAlerts = DEFAULT_ALERTS;
 
@@ -157,6 +166,8 @@ CBlockIndex* pindexBestInvalid;
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexCandidates;
 /** Number of nodes with fSyncStarted. */
 int nSyncStarted = 0;
+/** Number of nodes asked to announce new blocks as cmpctblock messages. */
+int nCmpctBlockAnnouncers = 0;
 /** All pairs A->B, where A (or one if its ancestors) misses transactions, but B has transactions. */
 multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
 
@@ -249,6 +260,10 @@ struct CNodeState {
     bool fPreferredDownload;
     //! Whether this peer can give us witnesses
     bool fHaveWitness;
+    //! Whether we asked this peer to announce new blocks as cmpctblock messages.
+    bool fRequestedHeaderAndIDs;
+    //! A block from this peer's cmpctblock, waiting for the transactions asked for in a getblocktxn.
+    boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;
 
     CNodeState()
     {
@@ -263,6 +278,7 @@ struct CNodeState {
         nBlocksInFlight = 0;
         fPreferredDownload = false;
         fHaveWitness = false;
+        fRequestedHeaderAndIDs = false;
     }
 };
 
@@ -324,6 +340,7 @@ void FinalizeNode(NodeId nodeid)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    nCmpctBlockAnnouncers -= state->fRequestedHeaderAndIDs;
 
     mapNodeState.erase(nodeid);
 }
@@ -519,6 +536,7 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.connect(&GetHeight);
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
+    nodeSignals.ProcessMasternodeMessages.connect(&ProcessMasternodeMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
     nodeSignals.InitializeNode.connect(&InitializeNode);
     nodeSignals.FinalizeNode.connect(&FinalizeNode);
@@ -528,6 +546,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.disconnect(&GetHeight);
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
+    nodeSignals.ProcessMasternodeMessages.disconnect(&ProcessMasternodeMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
     nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
@@ -551,6 +570,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewDB* pcoinsdbview = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CSporkDB* pSporkDB = NULL;
 
@@ -838,16 +858,15 @@ int GetInputAge(CTxIn& vin)
     CCoinsView viewDummy;
     CCoinsViewCache view(&viewDummy);
     {
-        LOCK(mempool.cs);
+        LOCK2(cs_main, mempool.cs);
         CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
-        const CCoins* coins = view.AccessCoins(vin.prevout.hash);
+        const Coin& coin = view.AccessCoin(vin.prevout);
 
-        if (coins) {
-            if (coins->nHeight < 0) return 0;
-            return (chainActive.Tip()->nHeight + 1) - coins->nHeight;
-        } else
+        if (!coin.IsSpent())
+            return (chainActive.Tip()->nHeight + 1) - (int)coin.nHeight;
+        else
             return -1;
     }
 }
@@ -1082,8 +1101,33 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+/** CheckInputs for a transaction entering the mempool. The scripts of a transaction
+ *  with many inputs are checked on the script-checking threads, which are idle
+ *  then: blocks are connected under cs_main as well, so they never compete for
+ *  the queue. A failure is checked again serially, so that state says why exactly
+ *  as CheckInputs would. */
+static bool CheckMempoolInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags, PrecomputedTransactionData& txdata, bool& fParallel)
+{
+    AssertLockHeld(cs_main);
+    fParallel = nScriptCheckThreads && tx.vin.size() >= nMempoolParallelInputs;
+    if (!fParallel)
+        return CheckInputs(tx, state, view, true, flags, true, txdata);
+
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckInputs(tx, state, view, true, flags, true, txdata, &vChecks))
+        return false;
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    if (control.Wait())
+        return true;
+    return CheckInputs(tx, state, view, true, flags, true, txdata);
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
 {
+    int64_t nTimeStart = GetTimeMicros();
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -1152,15 +1196,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
-        // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
-
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // only helps filling in pfMissingInputs (to determine missing vs spent).
         for (const CTxIn txin : tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out)))
+                        return false;
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
@@ -1258,12 +1303,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true)) {
+        int64_t nTimeScripts = GetTimeMicros();
+        bool fParallel = false;
+        PrecomputedTransactionData txdata(tx);
+        if (!CheckMempoolInputs(tx, state, view, scriptVerifyFlags, txdata, fParallel)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
-            if (CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true) &&
-                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true)) {
+            if (CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, txdata) &&
+                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, txdata)) {
                 // Only the witness is wrong, so the transaction itself may be fine.
                 state.SetCorruptionPossible();
             }
@@ -1279,9 +1327,12 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
+        if (!CheckMempoolInputs(tx, state, view, MANDATORY_SCRIPT_VERIFY_FLAGS, txdata, fParallel)) {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+        int64_t nTimeEnd = GetTimeMicros();
+        LogPrint("bench", "    - Mempool scripts of %s: %u inputs %s in %.2fms, cs_main held %.2fms\n", hash.ToString(), tx.vin.size(),
+            fParallel ? "in parallel" : "serially", (nTimeEnd - nTimeScripts) * 0.001, (nTimeEnd - nTimeStart) * 0.001);
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry);
@@ -1355,15 +1406,16 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
             CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
             view.SetBackend(viewMemPool);
 
-            // do we already have it?
-            if (view.HaveCoins(hash))
-                return false;
-
             // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
             for (const CTxIn txin : tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
+                if (!view.HaveCoin(txin.prevout)) {
+                    // Are inputs missing because we already have the tx?
+                    for (size_t out = 0; out < tx.vout.size(); out++) {
+                        // Optimistically just do efficient check of cache for outputs
+                        if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out)))
+                            return false;
+                    }
+                    // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                     if (pfMissingInputs)
                         *pfMissingInputs = true;
                     return false;
@@ -1459,7 +1511,8 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
         // Ignore for block 300 (bug)
         if (hash.ToString() != "508256818225bcaa45c39027e9b563c270182e0fb877308dd8883106931ebeb0")
         {
-            if (!CheckInputs(tx, state, view, false, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
+            PrecomputedTransactionData txdata(tx);
+            if (!CheckInputs(tx, state, view, false, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata)) {
                 return error("AcceptableInputs: : ConnectInputs failed %s", hash.ToString());
             }
         }
@@ -1488,6 +1541,20 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
     return true;
 }
 
+/** Hash of the block stored at pos, from the block index if it has the block in
+ *  the active chain. Its parent is found by the header's hashPrevBlock, so the
+ *  header doesn't need to be hashed again. */
+static uint256 GetStoredBlockHash(const CDiskBlockPos& pos, const CBlockHeader& header)
+{
+    BlockMap::const_iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+    if (mi != mapBlockIndex.end()) {
+        const CBlockIndex* pindex = chainActive.Next(mi->second);
+        if (pindex && (pindex->nStatus & BLOCK_HAVE_DATA) && pindex->nFile == pos.nFile && pindex->nDataPos == pos.nPos)
+            return pindex->GetBlockHash();
+    }
+    return header.GetHash();
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock, bool fAllowSlow)
 {
@@ -1503,20 +1570,27 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                static int64_t nTimeTxIndexRead = 0;
+                static int64_t nTxIndexReads = 0;
+                int64_t nTimeStart = GetTimeMicros();
+                CBlockFileStream file(postx, SER_DISK, CLIENT_VERSION);
                 if (file.IsNull())
                     return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
                 try {
                     file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                    file.ignore(postx.nTxOffset);
                     file >> txOut;
                 } catch (std::exception& e) {
                     return error("%s : Deserialize or I/O error - %s", __func__, e.what());
                 }
-                hashBlock = header.GetHash();
+                hashBlock = GetStoredBlockHash(postx, header);
                 if (txOut.GetHash() != hash)
                     return error("%s : txid mismatch", __func__);
+                int64_t nTime = GetTimeMicros() - nTimeStart;
+                nTimeTxIndexRead += nTime;
+                nTxIndexReads++;
+                LogPrint("bench", "- Read tx from index: %.3fms [%.2fs, %.1fus/tx]\n", 0.001 * nTime, nTimeTxIndexRead * 0.000001, (double)nTimeTxIndexRead / nTxIndexReads);
                 return true;
             }
 
@@ -1528,9 +1602,9 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
             int nHeight = -1;
             {
                 CCoinsViewCache& view = *pcoinsTip;
-                const CCoins* coins = view.AccessCoins(hash);
-                if (coins)
-                    nHeight = coins->nHeight;
+                const Coin& coin = AccessByTxid(view, hash);
+                if (!coin.IsSpent())
+                    nHeight = coin.nHeight;
             }
             if (nHeight > 0)
                 pindexSlow = chainActive[nHeight];
@@ -1580,12 +1654,12 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+static bool ReadBlockDataFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    // Read through a shared handle to the history file
+    CBlockFileStream filein(pos, SER_DISK, CLIENT_VERSION, 1 << 16);
     if (filein.IsNull())
         return error("ReadBlockFromDisk : OpenBlockFile failed");
 
@@ -1596,6 +1670,14 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
 
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+{
+    if (!ReadBlockDataFromDisk(block, pos))
+        return false;
+
     // Check the header
     if (block.IsProofOfWork()) {
         if (!CheckProofOfWork(block.GetHash(), block.nBits))
@@ -1605,8 +1687,15 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, bool fCheckHash)
 {
+    if (!fCheckHash) {
+        if (!ReadBlockDataFromDisk(block, pindex->GetBlockPos()))
+            return false;
+        block.SetCachedHash(pindex->GetBlockHash());
+        return true;
+    }
+
     if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
         return false;
     if (block.GetHash() != pindex->GetBlockHash()) {
@@ -1616,6 +1705,47 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CBlockSpan& span, const CDiskBlockPos& pos)
+{
+    if (pos.IsNull() || pos.nPos < 8)
+        return error("%s : invalid block position", __func__);
+    boost::shared_ptr<CBlockFileHandle> handle = blockFileCache.Get(pos.nFile);
+    if (!handle)
+        return error("%s : OpenBlockFile failed", __func__);
+
+    // The index header written in front of the block gives its size
+    unsigned char buf[MESSAGE_START_SIZE + 4];
+    if (handle->Read(pos.nPos - sizeof(buf), (char*)buf, sizeof(buf)) != sizeof(buf))
+        return error("%s : I/O error reading index header", __func__);
+    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+        return error("%s : bad index header", __func__);
+    unsigned int nSize = ReadLE32(buf + MESSAGE_START_SIZE);
+    if (nSize < CBlockHeader::HEADER_SIZE || nSize > MAX_BLOCK_SIZE_CURRENT)
+        return error("%s : bad block size %u", __func__, nSize);
+
+    if (!span.Load(*handle, pos.nPos, nSize))
+        return error("%s : I/O error reading block", __func__);
+    return true;
+}
+
+bool ReadRawBlockFromDisk(CBlockSpan& span, const CDiskBlockPos& pos, const uint256& hashBlock, bool fAllowWitness, bool fCheckHash)
+{
+    if (!ReadRawBlockFromDisk(span, pos))
+        return false;
+
+    CLazyBlock lazy(span);
+    if (fCheckHash && lazy.GetHeader().GetHash() != hashBlock)
+        return error("%s : GetHash() doesn't match index", __func__);
+    if (!fAllowWitness && (!lazy.Parse() || lazy.HasWitness()))
+        return false;
+    return true;
+}
+
+bool ReadRawBlockFromDisk(CBlockSpan& span, const CBlockIndex* pindex, bool fAllowWitness, bool fCheckHash)
+{
+    return ReadRawBlockFromDisk(span, pindex->GetBlockPos(), pindex->GetBlockHash(), fAllowWitness, fCheckHash);
+}
+
 
 double ConvertBitsToDouble(unsigned int nBits)
 {
@@ -1842,27 +1972,27 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         for (const CTxIn& txin : tx.vin) {
-            txundo.vprevout.push_back(CTxInUndo());
-            bool ret = inputs.ModifyCoins(txin.prevout.hash)->Spend(txin.prevout, txundo.vprevout.back());
+            txundo.vprevout.push_back(Coin());
+            bool ret = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
             assert(ret);
         }
     }
 
     // add outputs
-    inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 bool CScriptCheck::operator()()
 {
     const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
     const CScriptWitness *witness = (nIn < ptxTo->wit.vtxinwit.size()) ? &ptxTo->wit.vtxinwit[nIn].scriptWitness : NULL;
-    if (!VerifyScript(scriptSig, scriptPubKey, witness, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, witness, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore, *txdata), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
     return true;
 }
 
-bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck>* pvChecks)
 {
     if (!tx.IsCoinBase()) {
         if (pvChecks)
@@ -1881,20 +2011,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         CAmount nFees = 0;
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase() || coins->IsCoinStake()) {
-                if (nSpendHeight - coins->nHeight < Params().COINBASE_MATURITY(tx.GetValueOut(), coins->nHeight))
+            if (coin.IsCoinBase() || coin.IsCoinStake()) {
+                if (nSpendHeight - (int)coin.nHeight < Params().COINBASE_MATURITY(tx.GetValueOut(), coin.nHeight))
                     return state.Invalid(
-                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - coins->nHeight, coins->IsCoinStake()),
+                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - (int)coin.nHeight, coin.IsCoinStake()),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs() : txin values out of range"),
                     REJECT_INVALID, "bad-txns-inputvalues-outofrange");
         }
@@ -1925,11 +2055,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1941,8 +2071,8 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
-                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                        CScriptCheck check2(coin.out, tx, i,
+                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1990,25 +2120,17 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
-        // exactly. Note that transactions with only provably unspendable outputs won't
-        // have outputs available even in the block itself, so we handle that case
-        // specially with outsEmpty.
-        {
-            CCoins outsEmpty;
-            CCoinsModifier outs = view.ModifyCoins(hash);
-            outs->ClearUnspendable();
-
-            CCoins outsBlock(tx, pindex->nHeight);
-            // The CCoins serialization does not serialize negative numbers.
-            // No network rules currently depend on the version here, so an inconsistency is harmless
-            // but it must be corrected before txout nversion ever influences a network rule.
-            if (outsBlock.nVersion < 0)
-                outs->nVersion = outsBlock.nVersion;
-            if (*outs != outsBlock)
-                fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-            // remove outputs
-            outs->Clear();
+        // exactly. Provably unspendable outputs never made it into the UTXO set, so
+        // they are skipped here.
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool fSpent = view.SpendCoin(out, &coin);
+                if (!fSpent || tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight ||
+                    tx.IsCoinBase() != coin.IsCoinBase() || tx.IsCoinStake() != coin.IsCoinStake())
+                    fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
+            }
         }
 
         // restore inputs
@@ -2018,25 +2140,22 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 return error("DisconnectBlock() : transaction and undo data inconsistent - txundo.vprevout.siz=%d tx.vin.siz=%d", txundo.vprevout.size(), tx.vin.size());
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint& out = tx.vin[j].prevout;
-                const CTxInUndo& undo = txundo.vprevout[j];
-                CCoinsModifier coins = view.ModifyCoins(out.hash);
-                if (undo.nHeight != 0) {
-                    // undo data contains height: this is the last output of the prevout tx being spent
-                    if (!coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                    coins->Clear();
-                    coins->fCoinBase = undo.fCoinBase;
-                    coins->nHeight = undo.nHeight;
-                    coins->nVersion = undo.nVersion;
-                } else {
-                    if (coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
-                }
-                if (coins->IsAvailable(out.n))
+                Coin undo = txundo.vprevout[j];
+                bool fOverwrite = view.HaveCoin(out);
+                if (fOverwrite)
                     fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
-                if (coins->vout.size() < out.n + 1)
-                    coins->vout.resize(out.n + 1);
-                coins->vout[out.n] = undo.txout;
+                if (undo.nHeight == 0) {
+                    // Undo files written before the per-outpoint UTXO set only stored the
+                    // metadata with the last spent output of a transaction. That one was
+                    // spent last, so it has been restored already and can be copied from.
+                    const Coin& alternate = AccessByTxid(view, out.hash);
+                    if (alternate.IsSpent())
+                        return error("DisconnectBlock() : undo data adding output to missing transaction");
+                    undo.nHeight = alternate.nHeight;
+                    undo.fCoinBase = alternate.fCoinBase;
+                    undo.fCoinStake = alternate.fCoinStake;
+                }
+                view.AddCoin(out, undo, fOverwrite);
 
                 // erase the spent input
                 mapStakeSpent.erase(out);
@@ -2080,8 +2199,6 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck()
 {
     RenameThread("stakecubecoin-scriptch");
@@ -2199,13 +2316,18 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // two in the chain that violate it. This prevents exploiting the issue against nodes in their
     if (!pindex->phashBlock) {
         for (const CTransaction& tx : block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
-                    REJECT_INVALID, "bad-txns-BIP30");
+            for (size_t o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                    return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
+                        REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
+    // Queued script checks hold pointers into txdata, so it must never reallocate
+    // and must outlive the queue control below.
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(block.vtx.size());
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
@@ -2253,7 +2375,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 return state.DoS(100, error("ConnectBlock(): too many sigops"),
                                 REJECT_INVALID, "bad-blk-sigops");
 
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            txdata.emplace_back(tx);
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, txdata.back(), nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
@@ -2392,23 +2515,28 @@ enum FlushStateMode {
 
 /**
  * Update the on-disk chain state.
- * The caches and indexes are flushed if either they're too large, forceWrite is set, or
- * fast is not set and it's been a while since the last write.
+ * The caches and indexes are written if either the coins cache is too large, the mode is
+ * FLUSH_STATE_ALWAYS, or the mode is FLUSH_STATE_PERIODIC and it's been a while since the
+ * last write. The coins cache keeps what it wrote and only evicts unmodified entries to
+ * get back under its limit. Except for FLUSH_STATE_ALWAYS, the coin database is written
+ * in the background.
  */
 bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 {
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
     try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+        // A batch still being written holds copies of entries the cache kept, so it counts against the limit too
+        bool fCacheFull = (mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) &&
+                          pcoinsTip->DynamicMemoryUsage() + pcoinsdbview->PendingMemoryUsage() > nCoinCacheUsage;
+        if ((mode == FLUSH_STATE_ALWAYS) || fCacheFull ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
-            // Typical CCoins structures on disk are around 100 bytes in size.
+            // Typical Coin structures on disk are around 50 bytes in size.
             // Pushing a new one to the database can cause it to be written
             // twice (once in the log, and once in the tables). This is already
             // an overestimation, as most will delete an existing entry or
             // overwrite one. Still, use a conservative safety factor of 2.
-            if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+            if (!CheckDiskSpace(50 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
             // First make sure all block and undo data is flushed to disk.
             FlushBlockFile();
@@ -2432,8 +2560,21 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             }
             pblocktree->Sync();
             // Finally flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            int64_t nStart = GetTimeMicros();
+            if (!pcoinsTip->Sync())
                 return state.Error("Failed to write to coin database");
+            if (mode == FLUSH_STATE_ALWAYS && !pcoinsdbview->WaitForWrites())
+                return state.Error("Failed to write to coin database");
+            if (fCacheFull) {
+                // Leave some room, so the next write isn't due right away, next
+                // to the batch just handed over.
+                size_t nTargetUsage = nCoinCacheUsage / 10 * 9;
+                size_t nPendingUsage = pcoinsdbview->PendingMemoryUsage();
+                size_t nEvicted = pcoinsTip->Trim(nTargetUsage > nPendingUsage ? nTargetUsage - nPendingUsage : 0);
+                LogPrint("coindb", "Evicted %u coins, cache is now %.1fMiB, %.1fMiB being written\n", (unsigned int)nEvicted,
+                    pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), nPendingUsage * (1.0 / (1 << 20)));
+            }
+            LogPrint("bench", "    - Flush coins cache: %.2fms\n", 0.001 * (GetTimeMicros() - nStart));
             // Update best block in wallet (so we can detect restored wallets).
             if (mode != FLUSH_STATE_IF_NEEDED) {
                 GetMainSignals().SetBestChain(chainActive.GetLocator());
@@ -2456,15 +2597,16 @@ void FlushStateToDisk()
 void static UpdateTip(CBlockIndex* pindexNew)
 {
     chainActive.SetTip(pindexNew);
+    chainActiveHashes.SetTip(pindexNew);
 
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utxo)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -2527,6 +2669,7 @@ bool static DisconnectTip(CValidationState& state, bool fBare)
 
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
+    stakeModifierIndex.BlockDisconnected(pindexDelete);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
     for (const CTransaction& tx : block.vtx) {
@@ -2602,6 +2745,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    stakeModifierIndex.BlockConnected(pindexNew);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     for (const CTransaction& tx : txConflicted) {
@@ -2847,6 +2991,22 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
     return true;
 }
 
+/** Make the cmpctblock message for a block, with witnesses or without for peers
+ *  that don't take them. The message with witnesses is the same for every peer,
+ *  so it is kept in the send buffer cache. */
+static CSendBuffer GetCompactBlockMessage(const CBlock& block, bool fWitness)
+{
+    CInv inv(MSG_CMPCT_BLOCK, block.GetHash());
+    CSendBuffer msg;
+    if (fWitness && sendBufferCache.Get(inv, msg))
+        return msg;
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    msg = MakeSendBuffer(NetMsgType::CMPCTBLOCK, SER_NETWORK, PROTOCOL_VERSION | (fWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS), cmpctblock);
+    if (fWitness)
+        sendBufferCache.Put(inv, msg);
+    return msg;
+}
+
 /**
  * Make the best chain active, in multiple steps. The result is either failure
  * or an activated best chain. pblock is either NULL or a pointer to a block
@@ -2887,11 +3047,29 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
+            // Peers that asked for it get the block we just connected as a cmpctblock
+            // straight away, rather than an inv they'd answer with a getdata
+            bool fCmpctBlock = pblock && pblock->GetHash() == hashNewTip;
             {
                 LOCK(cs_vNodes);
-                for (CNode* pnode : vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                for (CNode* pnode : vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    CInv inv(MSG_BLOCK, hashNewTip);
+                    if (fCmpctBlock && pnode->fPreferHeaderAndIDs) {
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = pnode->setInventoryKnown.count(inv);
+                        }
+                        if (!fKnown) {
+                            pnode->PushSendBuffer(GetCompactBlockMessage(*pblock, pnode->nServices & NODE_WITNESS));
+                            pnode->AddInventoryKnown(inv);
+                        }
+                        continue;
+                    }
+                    pnode->PushInventory(inv);
+                }
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
@@ -2999,8 +3177,7 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate(CBlockIndex(block));
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -3021,9 +3198,6 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
         // ppcoin: compute stake entropy bit for stake modifier
         if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
             LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
@@ -3041,6 +3215,7 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
             LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
         pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+        pindexNew->BuildStakeModifierLink();
         pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
         if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
             LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, std::to_string(nStakeModifier));
@@ -3195,7 +3370,10 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
 }
 
 static int GetWitnessCommitmentIndex(const CBlock& block);
-bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
+
+/** The checks of CheckBlock that look at nothing but the block and the adjusted
+ *  time, so they may run on any thread without cs_main. */
+static bool CheckBlockStructure(const CBlock& block, CValidationState& state, bool fCheckMerkleRoot, bool fCheckTransactions)
 {
     // These are checks that are independent of context.
 
@@ -3250,15 +3428,11 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     if (block.IsProofOfStake()) {
         int commitpos = GetWitnessCommitmentIndex(block);
         if (commitpos >= 0) {
-            if (IsSporkActive(SPORK_14_SEGWIT_ON_COINBASE)) {
-                if (block.vtx[0].vout.size() != 2)
-                    return state.DoS(100, error("CheckBlock() : coinbase output has wrong size for proof-of-stake block"));
-                if (!block.vtx[0].vout[1].scriptPubKey.IsUnspendable())
-                    return state.DoS(100, error("CheckBlock() : coinbase must be unspendable for proof-of-stake block"));
-            }
-            else {
-                return state.DoS(100, error("CheckBlock() : staking-on-segwit is not enabled"));
-            }
+            // whether staking on segwit is enabled at all is up to CheckBlockContext
+            if (block.vtx[0].vout.size() != 2)
+                return state.DoS(100, error("CheckBlock() : coinbase output has wrong size for proof-of-stake block"));
+            if (!block.vtx[0].vout[1].scriptPubKey.IsUnspendable())
+                return state.DoS(100, error("CheckBlock() : coinbase must be unspendable for proof-of-stake block"));
         }
         else {
             if (block.vtx[0].vout.size() != 1)
@@ -3276,6 +3450,32 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
                 return state.DoS(100, error("CheckBlock() : more than one coinstake"));
     }
 
+    // check transactions
+    if (fCheckTransactions) {
+        for (const CTransaction& tx : block.vtx) {
+            if (!CheckTransaction(tx, true, state, false))
+                return error("%s : CheckTransaction failed", __func__);
+        }
+    }
+
+    unsigned int nSigOps = 0;
+    for (const CTransaction& tx : block.vtx) {
+        nSigOps += GetLegacySigOpCount(tx);
+    }
+    if (nSigOps * WITNESS_SCALE_FACTOR > MAX_BLOCK_SIGOPS_COST)
+        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
+            REJECT_INVALID, "bad-blk-sigops", true);
+
+    return true;
+}
+
+/** The checks of CheckBlock that depend on sporks, SwiftTX locks, the chain and
+ *  masternode payments, and record rejected blocks. */
+static bool CheckBlockContext(const CBlock& block, CValidationState& state)
+{
+    if (block.IsProofOfStake() && GetWitnessCommitmentIndex(block) >= 0 && !IsSporkActive(SPORK_14_SEGWIT_ON_COINBASE))
+        return state.DoS(100, error("CheckBlock() : staking-on-segwit is not enabled"));
+
     // ----------- swiftTX transaction scanning -----------
     if (IsSporkActive(SPORK_3_SWIFTTX_BLOCK_FILTERING)) {
         for (const CTransaction& tx : block.vtx) {
@@ -3297,15 +3497,6 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         LogPrintf("CheckBlock() : skipping transaction locking checks\n");
     }
 
-    // check transactions
-    int blockHeight = chainActive.Height();
-    if (blockHeight >= 425000) {
-        for (const CTransaction& tx : block.vtx) {
-            if (!CheckTransaction(tx, true, state, false))
-                return error("%s : CheckTransaction failed", __func__);
-        }
-    }
-
     // masternode payments / budgets
     CBlockIndex* pindexPrev = chainActive.Tip();
     int nHeight = 0;
@@ -3336,18 +3527,18 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         }
     }
 
-
-    unsigned int nSigOps = 0;
-    for (const CTransaction& tx : block.vtx) {
-        nSigOps += GetLegacySigOpCount(tx);
-    }
-    if (nSigOps * WITNESS_SCALE_FACTOR > MAX_BLOCK_SIGOPS_COST)
-        return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
-            REJECT_INVALID, "bad-blk-sigops", true);
-
     return true;
 }
 
+bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
+{
+    return CheckBlockStructure(block, state, fCheckMerkleRoot, chainActive.Height() >= 425000) &&
+           CheckBlockContext(block, state);
+}
+
+static int64_t nTimeCheckPoS = 0;
+static unsigned int nCheckPoSBlocks = 0;
+
 // Modified according to Lux coin to make SegWit working
 bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
 {
@@ -3367,10 +3558,15 @@ bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
         uint256 hashProofOfStake;
         uint256 hash = block.GetHash();
 
+        int64_t nTimeStart = GetTimeMicros();
         if(!CheckProofOfStake(block, hashProofOfStake)) {
             LogPrintf("WARNING: ProcessBlock(): check proof-of-stake failed for block %s\n", hash.ToString().c_str());
             return false;
         }
+        int64_t nTime1 = GetTimeMicros();
+        nTimeCheckPoS += nTime1 - nTimeStart;
+        nCheckPoSBlocks++;
+        LogPrint("bench", "  - Check proof-of-stake: %.2fms (avg %.3fms over %u blocks) [%.2fs]\n", (nTime1 - nTimeStart) * 0.001, nTimeCheckPoS * 0.001 / nCheckPoSBlocks, nCheckPoSBlocks, nTimeCheckPoS * 0.000001);
         if(!mapProofOfStake.count(hash)) // add to mapProofOfStake
             mapProofOfStake.insert(make_pair(hash, hashProofOfStake));
     }
@@ -3892,6 +4088,8 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     if (!fLiteMode) {
         if (masternodeSync.RequestedMasternodeAssets > MASTERNODE_SYNC_LIST
             || Params().NetworkID() == CBaseChainParams::REGTEST) {
+            // the ranks below are taken from tables built for the new tip
+            mnodeman.Check();
             masternodePayments.ProcessBlock(GetHeight() + 10);
             budget.NewBlock();
         }
@@ -4009,9 +4207,7 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 
     //mark as PoS seen
@@ -4025,21 +4221,56 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
 
 bool static LoadBlockIndexDB(string& strError)
 {
+    int64_t nTimeStart = GetTimeMicros();
     if (!pblocktree->LoadBlockIndexGuts())
         return false;
+    int64_t nTimeLoaded = GetTimeMicros();
+    LogPrint("bench", "    - Load block index: %.2fms (%u entries, %.0f entries/s)\n", 0.001 * (nTimeLoaded - nTimeStart), mapBlockIndex.size(),
+        nTimeLoaded > nTimeStart ? 1000000.0 * mapBlockIndex.size() / (nTimeLoaded - nTimeStart) : 0.0);
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    for (const std::pair<const uint256, CBlockIndex*>& item : mapBlockIndex) {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    for (const PAIRTYPE(int, CBlockIndex*) & item : vSortedByHeight) {
-        CBlockIndex* pindex = item.second;
+    // Calculate nChainWork; heights are dense, so bucket the index by height instead of sorting it
+    vector<CBlockIndex*> vSortedByHeight(mapBlockIndex.size());
+    {
+        vector<size_t> vHeightStart;
+        for (const std::pair<const uint256, CBlockIndex*>& item : mapBlockIndex) {
+            // a height read from disk sizes the buckets, so don't trust one no chain of this index could reach
+            if (item.second->nHeight < 0 || (size_t)item.second->nHeight > mapBlockIndex.size())
+                return error("%s : corrupted block index, block %s at height %d", __func__, item.first.ToString(), item.second->nHeight);
+            size_t nHeight = item.second->nHeight;
+            if (vHeightStart.size() < nHeight + 2)
+                vHeightStart.resize(nHeight + 2, 0);
+            vHeightStart[nHeight + 1]++;
+        }
+        for (size_t i = 1; i < vHeightStart.size(); i++)
+            vHeightStart[i] += vHeightStart[i - 1];
+        for (const std::pair<const uint256, CBlockIndex*>& item : mapBlockIndex)
+            vSortedByHeight[vHeightStart[item.second->nHeight]++] = item.second;
+    }
+
+    // Entries were allocated in key (hash) order; copy them into a fresh arena in height
+    // order, so chain walks move through memory in order. Nothing but the index itself
+    // points at them yet, and pskip is only built below, so it maps old entries to new.
+    {
+        CBlockIndexArena arenaByHeight;
+        for (CBlockIndex*& pindex : vSortedByHeight) {
+            CBlockIndex* pindexNew = arenaByHeight.Allocate(*pindex);
+            pindex->pskip = pindexNew;
+            pindex = pindexNew;
+        }
+        for (CBlockIndex* pindex : vSortedByHeight) {
+            if (pindex->pprev)
+                pindex->pprev = pindex->pprev->pskip;
+            if (pindex->pnext)
+                pindex->pnext = pindex->pnext->pskip;
+        }
+        for (std::pair<const uint256, CBlockIndex*>& item : mapBlockIndex)
+            item.second = item.second->pskip;
+        blockIndexArena.Swap(arenaByHeight);
+    }
+    LogPrint("bench", "    - Block index arena: %u entries, %.2fMiB\n", blockIndexArena.size(), blockIndexArena.DynamicMemoryUsage() / 1048576.0);
+    for (CBlockIndex* pindex : vSortedByHeight) {
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
         if (pindex->nStatus & BLOCK_HAVE_DATA) {
             if (pindex->pprev) {
@@ -4059,10 +4290,13 @@ bool static LoadBlockIndexDB(string& strError)
             pindexBestInvalid = pindex;
         if (pindex->pprev)
             pindex->BuildSkip();
+        pindex->BuildStakeModifierLink();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
 
+    LogPrint("bench", "    - Compute chain work: %.2fms\n", 0.001 * (GetTimeMicros() - nTimeLoaded));
+
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     vinfoBlockFile.resize(nLastBlockFile + 1);
@@ -4118,6 +4352,8 @@ bool static LoadBlockIndexDB(string& strError)
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    chainActiveHashes.SetTip(it->second);
+    stakeModifierIndex.Rebuild(chainActive);
 
     PruneBlockIndexCandidates();
 
@@ -4139,47 +4375,181 @@ CVerifyDB::~CVerifyDB()
     uiInterface.ShowProgress("", 100);
 }
 
-bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth)
+/** Levels 0 to 2 of VerifyDB for one block: read it, run the checks of CheckBlock
+ *  that look at nothing but the block, and read its undo data. These need neither
+ *  other blocks nor cs_main, so they run on a pool of threads. The block is kept
+ *  for the rest of CheckBlock, which VerifyDB runs under cs_main. */
+class CVerifyBlockCheck
 {
-    LOCK(cs_main);
-    if (chainActive.Tip() == NULL || chainActive.Tip()->pprev == NULL)
-        return true;
+public:
+    /** What the checks of one VerifyDB run share */
+    struct CShared {
+        boost::mutex mutex;
+        int nCheckLevel;
+        //! whether CheckBlock checks each transaction, which depends on the chain height
+        bool fCheckTransactions;
+        //! the highest block that failed, and how
+        const CBlockIndex* pindexFailure;
+        std::string strFailure;
+        //! time spent at each level, summed over the threads
+        int64_t nReadMicros;
+        int64_t nCheckMicros;
+        int64_t nUndoMicros;
+
+        CShared(int nCheckLevelIn, bool fCheckTransactionsIn) : nCheckLevel(nCheckLevelIn), fCheckTransactions(fCheckTransactionsIn), pindexFailure(NULL), nReadMicros(0), nCheckMicros(0), nUndoMicros(0) {}
+    };
+
+private:
+    const CBlockIndex* pindex;
+    CBlock* pblock;
+    CShared* pshared;
 
-    // Verify blocks in the best chain
-    if (nCheckDepth <= 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > chainActive.Height())
-        nCheckDepth = chainActive.Height();
-    nCheckLevel = std::max(0, std::min(4, nCheckLevel));
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CCoinsViewCache coins(coinsview);
-    CBlockIndex* pindexState = chainActive.Tip();
-    CBlockIndex* pindexFailure = NULL;
-    int nGoodTransactions = 0;
-    CValidationState state;
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
-        boost::this_thread::interruption_point();
-        uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
-        if (pindex->nHeight < chainActive.Height() - nCheckDepth)
-            break;
-        CBlock block;
+public:
+    CVerifyBlockCheck() : pindex(NULL), pblock(NULL), pshared(NULL) {}
+    CVerifyBlockCheck(const CBlockIndex* pindexIn, CBlock* pblockIn, CShared* psharedIn) : pindex(pindexIn), pblock(pblockIn), pshared(psharedIn) {}
+
+    bool operator()()
+    {
+        std::string strFailure;
+        int64_t nTimeStart = GetTimeMicros();
+        CBlock& block = *pblock;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
-            return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !CheckBlock(block, state))
-            return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            strFailure = "ReadBlockFromDisk failed";
+        int64_t nTime1 = GetTimeMicros();
+        // check level 1: verify block validity, as far as it goes without cs_main
+        CValidationState state;
+        if (strFailure.empty() && pshared->nCheckLevel >= 1 && !CheckBlockStructure(block, state, true, pshared->fCheckTransactions))
+            strFailure = "found bad block";
+        int64_t nTime2 = GetTimeMicros();
         // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
+        if (strFailure.empty() && pshared->nCheckLevel >= 2) {
             CBlockUndo undo;
             CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            if (!pos.IsNull() && !undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+                strFailure = "found bad undo data";
+        }
+        int64_t nTime3 = GetTimeMicros();
+
+        boost::unique_lock<boost::mutex> lock(pshared->mutex);
+        pshared->nReadMicros += nTime1 - nTimeStart;
+        pshared->nCheckMicros += nTime2 - nTime1;
+        pshared->nUndoMicros += nTime3 - nTime2;
+        if (!strFailure.empty() && (!pshared->pindexFailure || pindex->nHeight > pshared->pindexFailure->nHeight)) {
+            pshared->pindexFailure = pindex;
+            pshared->strFailure = strFailure;
+        }
+        return strFailure.empty();
+    }
+
+    void swap(CVerifyBlockCheck& check)
+    {
+        std::swap(pindex, check.pindex);
+        std::swap(pblock, check.pblock);
+        std::swap(pshared, check.pshared);
+    }
+};
+
+bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth)
+{
+    std::vector<const CBlockIndex*> vIndex;
+    bool fCheckTransactions;
+    {
+        LOCK(cs_main);
+        if (chainActive.Tip() == NULL || chainActive.Tip()->pprev == NULL)
+            return true;
+
+        // Verify blocks in the best chain
+        if (nCheckDepth <= 0)
+            nCheckDepth = 1000000000; // suffices until the year 19000
+        if (nCheckDepth > chainActive.Height())
+            nCheckDepth = chainActive.Height();
+        nCheckLevel = std::max(0, std::min(4, nCheckLevel));
+        LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+        for (const CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev && pindex->nHeight >= chainActive.Height() - nCheckDepth; pindex = pindex->pprev)
+            vIndex.push_back(pindex);
+        fCheckTransactions = chainActive.Height() >= 425000;
+    }
+
+    // Progress is split between the parallel levels and the serial ones
+    const int nProgressParallel = nCheckLevel >= 4 ? 30 : (nCheckLevel == 3 ? 50 : 100);
+    const int nProgressLevel3 = nCheckLevel >= 4 ? 50 : 100;
+
+    // Levels 0 to 2, a chunk of blocks at a time: the workers do what needs no
+    // cs_main, then the rest of CheckBlock runs here under cs_main on the blocks
+    // they read, highest first
+    int64_t nTimeStart = GetTimeMicros();
+    int64_t nContextMicros = 0;
+    CVerifyBlockCheck::CShared shared(nCheckLevel, fCheckTransactions);
+    {
+        CCheckQueue<CVerifyBlockCheck> queue(16);
+        // the workers are interrupted and joined before the queue goes away, however this returns
+        struct CQueueThreads {
+            boost::thread_group group;
+            ~CQueueThreads()
+            {
+                group.interrupt_all();
+                group.join_all();
+            }
+        } threads;
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threads.group.create_thread(boost::bind(&CCheckQueue<CVerifyBlockCheck>::Thread, &queue));
+
+        // the blocks of a chunk stay in memory until the checks under cs_main
+        static const size_t VERIFY_CHUNK_SIZE = 128;
+        std::vector<CBlock> vBlocks;
+        for (size_t i = 0; i < vIndex.size(); i += VERIFY_CHUNK_SIZE) {
+            boost::this_thread::interruption_point();
+            uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)((double)i / vIndex.size() * nProgressParallel))));
+            const size_t nChunk = std::min(VERIFY_CHUNK_SIZE, vIndex.size() - i);
+            vBlocks.assign(nChunk, CBlock());
+            std::vector<CVerifyBlockCheck> vChecks;
+            for (size_t j = 0; j < nChunk; j++)
+                vChecks.push_back(CVerifyBlockCheck(vIndex[i + j], &vBlocks[j], &shared));
+            CCheckQueueControl<CVerifyBlockCheck> control(&queue);
+            control.Add(vChecks);
+            if (!control.Wait())
+                return error("VerifyDB() : *** %s at %d, hash=%s", shared.strFailure, shared.pindexFailure->nHeight, shared.pindexFailure->GetBlockHash().ToString());
+            if (ShutdownRequested())
+                return true;
+
+            if (nCheckLevel >= 1) {
+                int64_t nTimeContext = GetTimeMicros();
+                LOCK(cs_main);
+                for (size_t j = 0; j < nChunk; j++) {
+                    CValidationState state;
+                    if (!CheckBlockContext(vBlocks[j], state))
+                        return error("VerifyDB() : *** found bad block at %d, hash=%s", vIndex[i + j]->nHeight, vIndex[i + j]->GetBlockHash().ToString());
+                }
+                nContextMicros += GetTimeMicros() - nTimeContext;
             }
         }
-        // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+    }
+    int64_t nTimeParallel = GetTimeMicros() - nTimeStart;
+    LogPrintf("Verified %u blocks at levels 0-%d in %.2fms (%d threads): read %.2fms, CheckBlock %.2fms, undo %.2fms, CheckBlock under cs_main %.2fms\n",
+        vIndex.size(), std::min(nCheckLevel, 2), nTimeParallel * 0.001, std::max(nScriptCheckThreads, 1),
+        shared.nReadMicros * 0.001, shared.nCheckMicros * 0.001, shared.nUndoMicros * 0.001, nContextMicros * 0.001);
+
+    LOCK(cs_main);
+    CCoinsViewCache coins(coinsview);
+    CBlockIndex* pindexState = chainActive.Tip();
+    CBlockIndex* pindexFailure = NULL;
+    int nGoodTransactions = 0;
+    CValidationState state;
+
+    // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
+    if (nCheckLevel >= 3) {
+        nTimeStart = GetTimeMicros();
+        for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
+            boost::this_thread::interruption_point();
+            uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, nProgressParallel + (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nProgressLevel3 - nProgressParallel)))));
+            if (pindex->nHeight < chainActive.Height() - nCheckDepth)
+                break;
+            if (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage)
+                break;
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindex))
+                return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -4189,15 +4559,17 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
                 pindexFailure = pindex;
             } else
                 nGoodTransactions += block.vtx.size();
+            if (ShutdownRequested())
+                return true;
         }
-        if (ShutdownRequested())
-            return true;
+        if (pindexFailure)
+            return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
+        LogPrintf("Verified %i blocks at level 3 in %.2fms\n", chainActive.Height() - pindexState->nHeight, (GetTimeMicros() - nTimeStart) * 0.001);
     }
-    if (pindexFailure)
-        return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
 
     // check level 4: try reconnecting blocks
     if (nCheckLevel >= 4) {
+        nTimeStart = GetTimeMicros();
         CBlockIndex* pindex = pindexState;
         while (pindex != chainActive.Tip()) {
             boost::this_thread::interruption_point();
@@ -4209,6 +4581,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             if (!ConnectBlock(block, state, pindex, coins, false))
                 return error("VerifyDB() : *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
         }
+        LogPrintf("Verified %i blocks at level 4 in %.2fms\n", chainActive.Height() - pindexState->nHeight, (GetTimeMicros() - nTimeStart) * 0.001);
     }
 
     LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", chainActive.Height() - pindexState->nHeight, nGoodTransactions);
@@ -4289,9 +4662,14 @@ bool RewindBlockIndex(const CChainParams& params)
 void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
+    mapBlocksUnlinked.clear();
+    pindexBestHeader = NULL;
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    chainActiveHashes.SetTip(NULL);
+    stakeModifierIndex.Clear();
     pindexBestInvalid = NULL;
+    blockIndexArena.Clear();
 }
 
 bool LoadBlockIndex(string& strError)
@@ -4344,49 +4722,52 @@ bool InitBlockIndex()
 
 
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
+{
+    std::vector<CImportFile> vFiles;
+    vFiles.push_back(CImportFile(dbp ? GetBlockPosFilename(*dbp, "blk") : boost::filesystem::path(), fileIn, dbp ? dbp->nFile : -1));
+    return LoadExternalBlockFiles(vFiles);
+}
+
+bool LoadExternalBlockFiles(const std::vector<CImportFile>& vFiles)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
     static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
     int64_t nStart = GetTimeMillis();
 
+    // Reading the files and deserializing and hashing the blocks runs ahead on
+    // other threads; the blocks are connected here, in file order
+    CBlockImportPipeline pipeline(vFiles, (int)boost::thread::hardware_concurrency() - 1);
+
     int nLoaded = 0;
+    size_t nFileIndex = vFiles.size();
+    int64_t nLastProgress = GetTimeMillis();
+    boost::shared_ptr<CImportedBlock> imported;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        while (pipeline.Next(imported)) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
+            if (imported->nFileIndex != nFileIndex) {
+                nFileIndex = imported->nFileIndex;
+                if (vFiles[nFileIndex].nFile >= 0)
+                    LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)vFiles[nFileIndex].nFile);
+            }
+            if (GetTimeMillis() - nLastProgress >= 10000) {
+                nLastProgress = GetTimeMillis();
+                CBlockImportStats stats = pipeline.GetStats();
+                double dSeconds = std::max(nLastProgress - nStart, (int64_t)1) * 0.001;
+                LogPrintf("Block Import: %u blocks, %.1fMB in %.0fs (%.1f blocks/s, %.2fMB/s), height=%d\n",
+                    stats.nBlocks, stats.nBytes * 0.000001, dSeconds, stats.nBlocks / dSeconds, stats.nBytes * 0.000001 / dSeconds,
+                    chainActive.Height());
             }
+
+            if (!imported->strError.empty()) {
+                LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, imported->strError);
+                continue;
+            }
+
             try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+                CBlock& block = imported->block;
+                CDiskBlockPos* dbp = imported->pos.IsNull() ? NULL : &imported->pos;
 
                 // detect out of order blocks, and store them for later
                 uint256 hash = block.GetHash();
@@ -4435,9 +4816,17 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
         }
+        std::string strError = pipeline.GetError();
+        if (!strError.empty())
+            throw std::runtime_error(strError);
     } catch (std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
     }
+
+    CBlockImportStats stats = pipeline.GetStats();
+    LogPrint("bench", "    - Block import: %u blocks, %.1fMB, %u undecodable; read %.2fms, decode %.2fms (%d threads), waited %.2fms for decoding\n",
+        stats.nBlocks, stats.nBytes * 0.000001, stats.nErrors, stats.nReadMicros * 0.001, stats.nDecodeMicros * 0.001,
+        pipeline.GetWorkers(), stats.nWaitMicros * 0.001);
     if (nLoaded > 0)
         LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
@@ -4651,8 +5040,12 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_TX: {
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
+        // Only the cache is consulted for confirmed transactions: a database
+        // lookup per output for every announced transaction is too costly, and
+        // a miss just means the transaction is downloaded and then rejected.
         return txInMap || mapOrphanTransactions.count(inv.hash) ||
-               pcoinsTip->HaveCoins(inv.hash);
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
     }
     case MSG_BLOCK:
     case MSG_WITNESS_BLOCK:
@@ -4662,8 +5055,10 @@ bool static AlreadyHave(const CInv& inv)
                mapTxLockReqRejected.count(inv.hash);
     case MSG_TXLOCK_VOTE:
         return mapTxLockVote.count(inv.hash);
-    case MSG_SPORK:
+    case MSG_SPORK: {
+        LOCK(cs_mapSporks);
         return mapSporks.count(inv.hash);
+    }
     case MSG_MASTERNODE_WINNER:
         if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
             masternodeSync.AddedMasternodeWinner(inv.hash);
@@ -4708,14 +5103,140 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/** Send a block a peer asked for. Whether to send it and where it is stored are
+ *  looked up under cs_main, but it is read from disk and queued without the lock,
+ *  so peers syncing history don't hold up validation. */
+static void ProcessGetBlockData(CNode* pfrom, CInv inv)
+{
+    bool fWitness = pfrom->nServices & NODE_WITNESS;
+    CDiskBlockPos pos;
+    uint256 hashTip;
+    bool fContinue = false;
+    {
+        LOCK(cs_main);
+        bool send = false;
+        BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+        if (mi != mapBlockIndex.end()) {
+            if (chainActive.Contains(mi->second)) {
+                send = true;
+            } else {
+                // To prevent fingerprinting attacks, only send blocks outside of the active
+                // chain if they are valid, and no more than a max reorg depth than the best header
+                // chain we know about.
+                send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                       (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
+                if (!send) {
+                    LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                }
+            }
+        }
+        // Don't send not-validated blocks
+        if (!send || !(mi->second->nStatus & BLOCK_HAVE_DATA))
+            return;
+        // Stored blocks don't move, so the position stays good once the lock is released
+        pos = mi->second->GetBlockPos();
+        // The peer won't have the transactions of an old block in its mempool
+        if (inv.type == MSG_CMPCT_BLOCK && (!chainActive.Contains(mi->second) || chainActive.Height() - mi->second->nHeight > MAX_CMPCTBLOCK_DEPTH))
+            inv.type = fWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK;
+        if (inv.hash == pfrom->hashContinue) {
+            fContinue = true;
+            hashTip = chainActive.Tip()->GetBlockHash();
+        }
+    }
+
+    // Send block from disk
+    // The index hash was checked when the block was accepted and the
+    // peer verifies what we send, so skip recomputing it here.
+    // Full blocks go out as the bytes stored on disk, unless witness
+    // data has to be stripped for the peer first.
+    // Those bytes don't depend on the peer, so the message is made once and
+    // shared by every peer that asks for the block while it stays cached.
+    bool fSentRaw = false;
+    if (inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK) {
+        CSendBuffer msg;
+        if (!sendBufferCache.Get(inv, msg)) {
+            CBlockSpan span;
+            if (ReadRawBlockFromDisk(span, pos, inv.hash, inv.type == MSG_WITNESS_BLOCK, false)) {
+                msg = MakeSendBuffer(NetMsgType::BLOCK, SER_NETWORK, PROTOCOL_VERSION, span);
+                sendBufferCache.Put(inv, msg);
+            }
+        }
+        if (msg) {
+            pfrom->PushSendBuffer(msg);
+            fSentRaw = true;
+        }
+    } else if (inv.type == MSG_CMPCT_BLOCK && fWitness) {
+        CSendBuffer msg;
+        if (sendBufferCache.Get(inv, msg)) {
+            pfrom->PushSendBuffer(msg);
+            fSentRaw = true;
+        }
+    }
+    if (!fSentRaw) {
+        CBlock block;
+        if (!ReadBlockDataFromDisk(block, pos))
+            assert(!"cannot load block from disk");
+        block.SetCachedHash(inv.hash);
+        if (inv.type == MSG_CMPCT_BLOCK)
+            pfrom->PushSendBuffer(GetCompactBlockMessage(block, fWitness));
+        else if (inv.type == MSG_BLOCK)
+            pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
+        else if (inv.type == MSG_WITNESS_BLOCK)
+            pfrom->PushMessage(NetMsgType::BLOCK, block);
+        else // MSG_FILTERED_BLOCK)
+        {
+            LOCK(pfrom->cs_filter);
+            if (pfrom->pfilter) {
+                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
+                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                // This avoids hurting performance by pointlessly requiring a round-trip
+                // Note that there is currently no way for a node to request any single transactions we didnt send here -
+                // they must either disconnect and retry or request the full block.
+                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                // however we MUST always provide at least what the remote peer needs
+                typedef std::pair<unsigned int, uint256> PairType;
+                for (PairType& pair : merkleBlock.vMatchedTxn)
+                    if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
+            }
+            // else
+            // no response
+        }
+    }
+
+    // Trigger them to send a getblocks request for the next batch of inventory
+    if (fContinue) {
+        // Bypass PushInventory, this must send even if redundant,
+        // and we want it right after the last block so they don't
+        // wait for other stuff first.
+        vector<CInv> vInv;
+        vInv.push_back(CInv(MSG_BLOCK, hashTip));
+        pfrom->PushMessage(NetMsgType::INV, vInv);
+        pfrom->hashContinue = 0;
+    }
+}
+
+/** Send an item from relay memory or one of the maps of items seen. Its payload
+ *  is the same for every peer, so it is serialized once and shared with all of
+ *  those that ask for it while it stays cached. */
+template <typename T>
+static void PushRelayedItem(CNode* pfrom, const CInv& inv, const char* pszCommand, const T& item)
+{
+    CSendBuffer msg;
+    if (!sendBufferCache.Get(inv, msg)) {
+        msg = MakeSendBuffer(pszCommand, SER_NETWORK, PROTOCOL_VERSION, item);
+        sendBufferCache.Put(inv, msg);
+    }
+    pfrom->PushSendBuffer(msg);
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -4726,74 +5247,18 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_WITNESS_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_WITNESS_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
-                bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end()) {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a max reorg depth than the best header
-                        // chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                               (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
-                        if (!send) {
-                            LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
-                        }
-                    }
-                }
-                // Don't send not-validated blocks
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    else // MSG_FILTERED_BLOCK)
-                    {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter) {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didnt send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            for (PairType& pair : merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
-                        }
-                        // else
-                        // no response
-                    }
-
-                    // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue) {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage(NetMsgType::INV, vInv);
-                        pfrom->hashContinue = 0;
-                    }
-                }
+                ProcessGetBlockData(pfrom, inv);
             } else if (inv.IsKnownType()) {
+                LOCK(cs_main);
                 // Send stream from relay memory
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
                     map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessageWithFlag(inv.type == MSG_WITNESS_TX ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, inv.GetCommand(), (*mi).second);
+                        PushRelayedItem(pfrom, inv, inv.GetCommand(), (*mi).second);
                         pushed = true;
                     }
                 }
@@ -4807,82 +5272,65 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
                     if (mapTxLockVote.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockVote[inv.hash];
-                        pfrom->PushMessage(NetMsgType::TXLVOTE, ss);
+                        PushRelayedItem(pfrom, inv, NetMsgType::TXLVOTE, mapTxLockVote[inv.hash]);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
                     if (mapTxLockReq.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockReq[inv.hash];
-                        pfrom->PushMessage(NetMsgType::IX, ss);
+                        PushRelayedItem(pfrom, inv, NetMsgType::IX, mapTxLockReq[inv.hash]);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_SPORK) {
-                    if (mapSporks.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapSporks[inv.hash];
-                        pfrom->PushMessage(NetMsgType::SPORK, ss);
-                        pushed = true;
+                    CSporkMessage spork;
+                    {
+                        LOCK(cs_mapSporks);
+                        if (mapSporks.count(inv.hash)) {
+                            spork = mapSporks[inv.hash];
+                            pushed = true;
+                        }
                     }
+                    if (pushed)
+                        PushRelayedItem(pfrom, inv, NetMsgType::SPORK, spork);
                 }
                 if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
                     if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << masternodePayments.mapMasternodePayeeVotes[inv.hash];
-                        pfrom->PushMessage(NetMsgType::MNW, ss);
+                        PushRelayedItem(pfrom, inv, NetMsgType::MNW, masternodePayments.mapMasternodePayeeVotes[inv.hash]);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_BUDGET_VOTE) {
                     if (budget.mapSeenMasternodeBudgetVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenMasternodeBudgetVotes[inv.hash];
-                        pfrom->PushMessage(NetMsgType::MVOTE, ss);
+                        PushRelayedItem(pfrom, inv, NetMsgType::MVOTE, budget.mapSeenMasternodeBudgetVotes[inv.hash]);
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_BUDGET_PROPOSAL) {
                     if (budget.mapSeenMasternodeBudgetProposals.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenMasternodeBudgetProposals[inv.hash];
-                        pfrom->PushMessage(NetMsgType::MPROP, ss);
+                        PushRelayedItem(pfrom, inv, NetMsgType::MPROP, budget.mapSeenMasternodeBudgetProposals[inv.hash]);
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_BUDGET_FINALIZED_VOTE) {
                     if (budget.mapSeenFinalizedBudgetVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenFinalizedBudgetVotes[inv.hash];
-                        pfrom->PushMessage(NetMsgType::FBVOTE, ss);
+                        PushRelayedItem(pfrom, inv, NetMsgType::FBVOTE, budget.mapSeenFinalizedBudgetVotes[inv.hash]);
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_BUDGET_FINALIZED) {
                     if (budget.mapSeenFinalizedBudgets.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenFinalizedBudgets[inv.hash];
-                        pfrom->PushMessage(NetMsgType::FBS, ss);
+                        PushRelayedItem(pfrom, inv, NetMsgType::FBS, budget.mapSeenFinalizedBudgets[inv.hash]);
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_ANNOUNCE) {
                     if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
+                        // not shared: the ping of a seen broadcast is updated under the same hash
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
                         ss << mnodeman.mapSeenMasternodeBroadcast[inv.hash];
@@ -4893,10 +5341,7 @@ void static ProcessGetData(CNode* pfrom)
 
                 if (!pushed && inv.type == MSG_MASTERNODE_PING) {
                     if (mnodeman.mapSeenMasternodePing.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodePing[inv.hash];
-                        pfrom->PushMessage(NetMsgType::MNP, ss);
+                        PushRelayedItem(pfrom, inv, NetMsgType::MNP, mnodeman.mapSeenMasternodePing[inv.hash]);
                         pushed = true;
                     }
                 }
@@ -4909,7 +5354,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_WITNESS_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_WITNESS_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4928,6 +5373,61 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Accept a block a peer sent whole, or that was put together from its
+ *  cmpctblock, and let the peer know if it was rejected. */
+static void ProcessReceivedBlock(CNode* pfrom, CBlock& block, const std::string& strCommand)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    CValidationState state;
+    if (!mapBlockIndex.count(block.GetHash())) {
+        ProcessNewBlock(state, pfrom, &block);
+        int nDoS;
+        if(state.IsInvalid(nDoS)) {
+            pfrom->PushMessage(NetMsgType::REJECT, strCommand, state.GetRejectCode(),
+                            state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+            if(nDoS > 0) {
+                TRY_LOCK(cs_main, lockMain);
+                if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+        //disconnect this node if its old protocol version
+        pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+    } else {
+        LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+    }
+}
+
+/** Ask a peer for a block whole, when its cmpctblock can't be used. Requires cs_main. */
+static void RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    vector<CInv> vInv(1, CInv(State(pfrom->GetId())->fHaveWitness ? MSG_WITNESS_BLOCK : MSG_BLOCK, hash));
+    pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+}
+
+/** Check the header of a cmpctblock, as AcceptBlockHeader and AcceptBlock would,
+ *  before any work goes into putting the block together. The coinbase and the
+ *  coinstake come in full, so the proof of work or stake and the block signature
+ *  can be checked too. Requires cs_main. */
+static bool CheckCompactBlockHeader(const CBlockHeaderAndShortTxIDs& cmpctblock, CBlockIndex* pindexPrev, CValidationState& state)
+{
+    CBlock block;
+    cmpctblock.GetBlockStart(block);
+    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+        return state.DoS(100, error("%s : first tx is not coinbase", __func__), REJECT_INVALID, "bad-cb-missing");
+
+    if (!CheckBlockHeader(block, state, block.IsProofOfWork()))
+        return false;
+    if (!ContextualCheckBlockHeader(block, state, pindexPrev))
+        return false;
+    if (!CheckWork(block, pindexPrev))
+        return state.DoS(50, error("%s : proof of work or stake failed", __func__), REJECT_INVALID, "bad-work");
+    if (!block.CheckBlockSignature())
+        return state.DoS(100, error("%s : bad proof-of-stake block signature", __func__), REJECT_INVALID, "bad-blk-sig");
+    return true;
+}
+
 bool fRequestedSporksIDB = false;
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
@@ -5055,7 +5555,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         // Relay alerts
         {
-            LOCK(cs_mapAlerts);
+            LOCK2(cs_mapAlerts, cs_vNodes);
             for (PAIRTYPE(const uint256, CAlert) & item : mapAlerts)
                 item.second.RelayTo(pfrom);
         }
@@ -5093,6 +5593,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell the peer we take cmpctblock messages. Those that don't know the
+        // message ignore it, like any other they don't know.
+        pfrom->PushMessage(NetMsgType::SENDCMPCT, false, CMPCTBLOCKS_VERSION);
     }
 
 
@@ -5207,6 +5711,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                        (GetSporkValue(SPORK_13_SEGWIT_ACTIVATION) > chainActive.Tip()->nTime || State(pfrom->GetId())->fHaveWitness)) {
                         inv.type = MSG_WITNESS_BLOCK;
                     }
+                    // A new block is likely made of transactions we already have
+                    if (pfrom->fProvidesHeaderAndIDs && !IsInitialBlockDownload())
+                        inv.type = MSG_CMPCT_BLOCK;
                     vToFetch.push_back(inv);
                     LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
                 }
@@ -5488,6 +5995,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        int64_t nTimeHash = GetTimeMicros();
+        std::vector<uint256> vHashes;
+        CBlockHeader::GetHashes(headers, vHashes);
+        nTimeHash = GetTimeMicros() - nTimeHash;
+        if (nCount > 0)
+            LogPrint("bench", "    - Hash %u headers: %.2fms (%.0f headers/s)\n", nCount, 0.001 * nTimeHash, nCount * 1000000.0 / std::max<int64_t>(nTimeHash, 1));
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -5495,7 +6009,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
         CBlockIndex* pindexLast = NULL;
-        for (const CBlockHeader& header : headers) {
+        for (unsigned int n = 0; n < nCount; n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 LOCK(cs_main);
@@ -5511,7 +6026,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
                         Misbehaving(pfrom->GetId(), nDoS);
-                    std::string strError = "invalid header received " + header.GetHash().ToString();
+                    std::string strError = "invalid header received " + vHashes[n].ToString();
                     return error(strError.c_str());
                 }
             }
@@ -5552,26 +6067,167 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pfrom->vBlockRequested.push_back(block.GetHash());
             }
         } else {
-            pfrom->AddInventoryKnown(inv);
+            ProcessReceivedBlock(pfrom, block, strCommand);
+        }
+    }
+
+
+    else if (strCommand == NetMsgType::SENDCMPCT) {
+        bool fAnnounceUsingCmpctBlock = false;
+        uint64_t nCmpctBlockVersion = 0;
+        vRecv >> fAnnounceUsingCmpctBlock >> nCmpctBlockVersion;
+        // Other versions are ignored, as BIP 152 asks
+        if (nCmpctBlockVersion == CMPCTBLOCKS_VERSION) {
+            pfrom->fProvidesHeaderAndIDs = true;
+            pfrom->fPreferHeaderAndIDs = fAnnounceUsingCmpctBlock;
+
+            // Ask the first few outbound peers that speak it to announce new blocks
+            // as cmpctblock messages, which saves the inv/getdata round trip
+            LOCK(cs_main);
+            CNodeState* state = State(pfrom->GetId());
+            if (!pfrom->fInbound && !state->fRequestedHeaderAndIDs && nCmpctBlockAnnouncers < MAX_CMPCTBLOCK_ANNOUNCERS) {
+                state->fRequestedHeaderAndIDs = true;
+                nCmpctBlockAnnouncers++;
+                pfrom->PushMessage(NetMsgType::SENDCMPCT, true, CMPCTBLOCKS_VERSION);
+            }
+        }
+    }
+
+
+    else if (strCommand == NetMsgType::CMPCTBLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("net", "received cmpctblock %s peer=%d\n", hash.ToString(), pfrom->id);
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            if (mapBlockIndex.count(hash))
+                return true;
+            pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+
+            // A block that doesn't connect goes through the usual handling of blocks
+            // we can't connect yet, which wants the block whole. So does one on an
+            // invalid parent, which AcceptBlock may reconsider against the checkpoints.
+            BlockMap::iterator mi = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+            if (mi == mapBlockIndex.end() || (mi->second->nStatus & BLOCK_FAILED_MASK)) {
+                RequestFullBlock(pfrom, hash);
+                return true;
+            }
 
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+            if (!CheckCompactBlockHeader(cmpctblock, mi->second, state)) {
                 int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage(NetMsgType::REJECT, strCommand, state.GetRejectCode(),
-                                    state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
-                }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
-            } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("Peer %d sent us a compact block with an invalid header %s: %s", pfrom->id, hash.ToString(), state.GetRejectReason());
+            }
+
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us invalid compact block", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                RequestFullBlock(pfrom, hash);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < partialBlock->GetTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (!req.indexes.empty()) {
+                req.blockhash = hash;
+                State(pfrom->GetId())->partialBlock = partialBlock;
+                pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+                return true;
+            }
+
+            status = partialBlock->FillBlock(block, std::vector<CTransaction>());
+            if (status != READ_STATUS_OK) {
+                RequestFullBlock(pfrom, hash);
+                return true;
+            }
+        }
+        ProcessReceivedBlock(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == NetMsgType::GETBLOCKTXN) {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        CDiskBlockPos pos;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA) || !chainActive.Contains(mi->second)) {
+                LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                return true;
+            }
+            pos = mi->second->GetBlockPos();
+            // A block this old was never announced as a cmpctblock; send it whole
+            if (chainActive.Height() - mi->second->nHeight > MAX_BLOCKTXN_DEPTH)
+                pos.SetNull();
+        }
+        if (pos.IsNull()) {
+            pfrom->vRecvGetData.push_back(CInv(pfrom->nServices & NODE_WITNESS ? MSG_WITNESS_BLOCK : MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockDataFromDisk(block, pos))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        if (pfrom->nServices & NODE_WITNESS)
+            pfrom->PushMessage(NetMsgType::BLOCKTXN, resp);
+        else
+            pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCKTXN, resp);
+    }
+
+
+    else if (strCommand == NetMsgType::BLOCKTXN && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            CNodeState* state = State(pfrom->GetId());
+            if (!state->partialBlock || state->partialBlock->header.GetHash() != resp.blockhash) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock = state->partialBlock;
+            state->partialBlock.reset();
+
+            ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("Peer %d sent us invalid compact block/non-matching block transactions", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Probably a short ID collision: not the peer's fault
+                RequestFullBlock(pfrom, resp.blockhash);
+                return true;
             }
         }
+        ProcessReceivedBlock(pfrom, block, strCommand);
     }
 
 
@@ -5581,7 +6237,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     // Making users (which are behind NAT and can only make outgoing connections) ignore
     // getaddr message mitigates the attack.
     else if ((strCommand == NetMsgType::GETADDR) && (pfrom->fInbound)) {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         for (const CAddress& addr : vAddr)
             pfrom->PushAddress(addr);
@@ -5692,12 +6351,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0) {
+        bool fKnown;
+        {
+            // setKnown is relayed to from other peers' messages under cs_vNodes
+            LOCK(cs_vNodes);
+            fKnown = pfrom->setKnown.count(alertHash) != 0;
+        }
+        if (!fKnown) {
             if (alert.ProcessAlert()) {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
                 {
                     LOCK(cs_vNodes);
+                    pfrom->setKnown.insert(alertHash);
                     for (CNode* pnode : vNodes)
                         alert.RelayTo(pnode);
                 }
@@ -5818,6 +6483,41 @@ int ActiveProtocol()
     return MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT;
 }
 
+/** Process a message whose header and checksum passed, timing it for messageStats */
+static bool ProcessReceivedMessage(CNode* pfrom, const string& strCommand, CNetMessage& msg, MessageLane lane)
+{
+    unsigned int nMessageSize = msg.hdr.nMessageSize;
+    int64_t nTimeStart = GetTimeMicros();
+    bool fRet = false;
+    try {
+        fRet = ProcessMessage(pfrom, strCommand, msg.vRecv, msg.nTime);
+        boost::this_thread::interruption_point();
+    } catch (std::ios_base::failure& e) {
+        pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_MALFORMED, string("error parsing message"));
+        if (strstr(e.what(), "end of data")) {
+            // Allow exceptions from under-length message on vRecv
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
+        } else if (strstr(e.what(), "size too large")) {
+            // Allow exceptions from over-long size
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
+        } else {
+            PrintExceptionContinue(&e, "ProcessMessages()");
+        }
+    } catch (boost::thread_interrupted) {
+        throw;
+    } catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessMessages()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessMessages()");
+    }
+
+    if (!fRet)
+        LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
+    messageStats.Record(strCommand, lane, nTimeStart - msg.nTime, GetTimeMicros() - nTimeStart);
+
+    return fRet;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -5890,33 +6590,23 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Process message
-        bool fRet = false;
-        try {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
-            boost::this_thread::interruption_point();
-        } catch (std::ios_base::failure& e) {
-            pfrom->PushMessage(NetMsgType::REJECT, strCommand, REJECT_MALFORMED, string("error parsing message"));
-            if (strstr(e.what(), "end of data")) {
-                // Allow exceptions from under-length message on vRecv
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
-            } else if (strstr(e.what(), "size too large")) {
-                // Allow exceptions from over-long size
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
-            } else {
-                PrintExceptionContinue(&e, "ProcessMessages()");
+        // Masternode, budget and spork messages are processed in a lane of their
+        // own. They are moved there in the order they arrived, once the version
+        // handshake is done, and wait here while the lane is full.
+        if (pfrom->nVersion != 0 && GetMessageLane(strCommand) == LANE_MASTERNODE) {
+            LOCK(pfrom->cs_vRecvMnMsg);
+            if (pfrom->nRecvMnSize >= ReceiveFloodSize()) {
+                // keep it until there's room
+                it--;
+                break;
             }
-        } catch (boost::thread_interrupted) {
-            throw;
-        } catch (std::exception& e) {
-            PrintExceptionContinue(&e, "ProcessMessages()");
-        } catch (...) {
-            PrintExceptionContinue(NULL, "ProcessMessages()");
+            pfrom->nRecvMnSize += msg.vRecv.size() + 24;
+            pfrom->vRecvMnMsg.push_back(std::move(msg));
+            continue;
         }
 
-        if (!fRet)
-            LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
-
+        // Process message
+        ProcessReceivedMessage(pfrom, strCommand, msg, LANE_GENERAL);
         break;
     }
 
@@ -5927,6 +6617,22 @@ bool ProcessMessages(CNode* pfrom)
     return fOk;
 }
 
+void ProcessMasternodeMessages(CNode* pfrom)
+{
+    // Take one message at a time, so peers take turns in the lane, and process it
+    // without the lock, so messages can go on being moved in meanwhile
+    CNetMessage msg(SER_NETWORK, INIT_PROTO_VERSION);
+    {
+        LOCK(pfrom->cs_vRecvMnMsg);
+        if (pfrom->vRecvMnMsg.empty())
+            return;
+        msg = std::move(pfrom->vRecvMnMsg.front());
+        pfrom->vRecvMnMsg.pop_front();
+        pfrom->nRecvMnSize -= msg.vRecv.size() + 24;
+    }
+    ProcessReceivedMessage(pfrom, msg.hdr.GetCommand(), msg, LANE_MASTERNODE);
+}
+
 
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
@@ -5974,8 +6680,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             LOCK(cs_vNodes);
             for (CNode* pnode : vNodes) {
                 // Periodically clear setAddrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_vAddrToSend);
                     pnode->setAddrKnown.clear();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -5989,21 +6697,19 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle) {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            for (const CAddress& addr : pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000) {
-                        pto->PushMessage(NetMsgType::ADDR, vAddr);
-                        vAddr.clear();
-                    }
+            {
+                LOCK(pto->cs_vAddrToSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                for (const CAddress& addr : pto->vAddrToSend) {
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage(NetMsgType::ADDR, vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (size_t i = 0; i < vAddr.size(); i += 1000)
+                pto->PushMessage(NetMsgType::ADDR, vector<CAddress>(vAddr.begin() + i, vAddr.begin() + std::min(i + 1000, vAddr.size())));
         }
 
         CNodeState& state = *State(pto->GetId());
@@ -6223,10 +6929,8 @@ public:
     ~CMainCleanup()
     {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan transactions
         mapOrphanTransactions.clear();
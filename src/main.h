@@ -45,7 +45,9 @@
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
+class CBlockSpan;
 class CBlockTreeDB;
+class CCoinsViewDB;
 class CSporkDB;
 class CBloomFilter;
 class CInv;
@@ -53,6 +55,7 @@ class CScriptCheck;
 class CValidationInterface;
 
 struct CBlockTemplate;
+struct CImportFile;
 struct CNodeStateStats;
 
 /** Default for -blockmaxsize and -blockminsize, which control the range of sizes the mining code will create **/
@@ -94,6 +97,8 @@ static const int COINBASE_MATURITY = 50;
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** -parmempoolinputs default (transactions entering the mempool with at least this many inputs have their scripts checked on the script-checking threads) */
+static const unsigned int DEFAULT_MEMPOOL_PARALLEL_INPUTS = 8;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 1024;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -106,6 +111,12 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum depth of a block asked for as a cmpctblock; deeper ones are sent whole. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of a block whose transactions are sent in reply to getblocktxn; deeper ones are sent whole. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of outbound peers asked to announce new blocks to us as cmpctblock messages. */
+static const int MAX_CMPCTBLOCK_ANNOUNCERS = 3;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -140,10 +151,11 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern unsigned int nMempoolParallelInputs;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 extern bool fVerifyingBlocks;
@@ -202,6 +214,8 @@ FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL);
+/** Import blocks from a list of files, reading and deserializing ahead on other threads */
+bool LoadExternalBlockFiles(const std::vector<CImportFile>& vFiles);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -212,6 +226,8 @@ void UnloadBlockIndex();
 int ActiveProtocol();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** Process the next masternode, budget or spork message that ProcessMessages put aside for their lane */
+void ProcessMasternodeMessages(CNode* pfrom);
 /**
  * Send queued protocol messages to be sent to a give node.
  *
@@ -396,9 +412,9 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline; txdata must then outlive those checks.
  */
-bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks = NULL);
+bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, bool fScriptChecks, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck>* pvChecks = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCache& inputs, CTxUndo& txundo, int nHeight);
@@ -460,12 +476,13 @@ private:
     unsigned int nFlags;
     bool cacheStore;
     ScriptError error;
+    PrecomputedTransactionData *txdata;
 
 public:
-    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
+    CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(NULL) {}
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
 
@@ -478,6 +495,7 @@ public:
         std::swap(nFlags, check.nFlags);
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
+        std::swap(txdata, check.txdata);
     }
 
     ScriptError GetScriptError() const { return error; }
@@ -487,7 +505,18 @@ public:
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read a block and check it against its index entry. With fCheckHash false the
+ *  index hash is trusted and recorded as the block's hash instead of being recomputed. */
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, bool fCheckHash = true);
+/** Point span at the stored bytes of a block without deserializing it. The bytes
+ *  are mapped from the block file where possible, so they are only copied when sent. */
+bool ReadRawBlockFromDisk(CBlockSpan& span, const CDiskBlockPos& pos);
+/** As above, checking the header against the index entry unless fCheckHash is false.
+ *  Without fAllowWitness it also fails, quietly, for blocks that carry witness data,
+ *  so callers that must strip it fall back to ReadBlockFromDisk. */
+bool ReadRawBlockFromDisk(CBlockSpan& span, const CBlockIndex* pindex, bool fAllowWitness, bool fCheckHash = true);
+/** As above for a block found in the index earlier, so cs_main needn't be held while reading */
+bool ReadRawBlockFromDisk(CBlockSpan& span, const CDiskBlockPos& pos, const uint256& hashBlock, bool fAllowWitness, bool fCheckHash = true);
 bool ReadTransaction(CTransaction& tx, const CDiskTxPos &pos, uint256 &hashBlock);
 bool FindTransactionsByDestination(const CTxDestination &dest, std::set<CExtDiskTxPos> &setpos);
 
@@ -610,9 +639,15 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex);
 /** The currently-connected chain of blocks. */
 extern CChain chainActive;
 
+/** Block hashes of chainActive by height, readable without cs_main. */
+extern CChainHashes chainActiveHashes;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
+/** Global variable that points to the coin database pcoinsTip writes to (protected by cs_main) */
+extern CCoinsViewDB* pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
@@ -1037,7 +1037,9 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
     if (fLiteMode) return;
     if (!masternodeSync.IsBlockchainSynced()) return;
 
-    LOCK(cs_budget);
+    // budget messages are processed on the masternode message thread, which
+    // doesn't hold cs_main; the checks below read the chain
+    LOCK2(cs_main, cs_budget);
 
     if (strCommand == NetMsgType::MNVS) { //Masternode vote sync
         uint256 nProp;
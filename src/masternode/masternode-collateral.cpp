@@ -0,0 +1,84 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternode/masternode-collateral.h"
+
+#include "main.h"
+#include "txmempool.h"
+
+CMasternodeCollaterals mnCollaterals;
+
+// requires cs_main
+static bool IsCollateralSpent(const COutPoint& outpoint)
+{
+    {
+        LOCK(mempool.cs);
+        if (mempool.mapNextTx.count(outpoint))
+            return true;
+    }
+
+    return !pcoinsTip->HaveCoin(outpoint);
+}
+
+CMasternodeCollaterals::State CMasternodeCollaterals::GetState(const COutPoint& outpoint)
+{
+    {
+        LOCK(cs);
+        std::map<COutPoint, bool>::const_iterator it = mapWatched.find(outpoint);
+        if (it != mapWatched.end())
+            return it->second ? COLLATERAL_SPENT : COLLATERAL_UNSPENT;
+    }
+
+    // Spends are announced under cs_main, so holding it across the lookup and
+    // the insert means none can slip in between.
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain) return COLLATERAL_UNKNOWN;
+
+    bool fSpent = IsCollateralSpent(outpoint);
+    LOCK(cs);
+    fSpent = mapWatched.insert(std::make_pair(outpoint, fSpent)).first->second;
+    return fSpent ? COLLATERAL_SPENT : COLLATERAL_UNSPENT;
+}
+
+void CMasternodeCollaterals::Watch(const COutPoint& outpoint, bool fSpent)
+{
+    LOCK(cs);
+    mapWatched[outpoint] = fSpent;
+}
+
+void CMasternodeCollaterals::Forget(const COutPoint& outpoint)
+{
+    LOCK(cs);
+    mapWatched.erase(outpoint);
+}
+
+void CMasternodeCollaterals::Clear()
+{
+    LOCK(cs);
+    mapWatched.clear();
+}
+
+size_t CMasternodeCollaterals::size() const
+{
+    LOCK(cs);
+    return mapWatched.size();
+}
+
+void CMasternodeCollaterals::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    if (tx.IsCoinBase()) return;
+
+    // A transaction reported here spent its inputs in the mempool or in a block,
+    // and conflicts are only reported alongside the transaction that won. Like
+    // the old mempool check, a spend is final even if it is later evicted.
+    LOCK(cs);
+    if (mapWatched.empty()) return;
+    for (const CTxIn& txin : tx.vin) {
+        std::map<COutPoint, bool>::iterator it = mapWatched.find(txin.prevout);
+        if (it != mapWatched.end() && !it->second) {
+            it->second = true;
+            LogPrint("masternode", "CMasternodeCollaterals::SyncTransaction -- collateral %s spent by %s\n", txin.prevout.ToString(), tx.GetHash().ToString());
+        }
+    }
+}
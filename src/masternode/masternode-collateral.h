@@ -0,0 +1,57 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef MASTERNODE_COLLATERAL_H
+#define MASTERNODE_COLLATERAL_H
+
+#include "primitives/transaction.h"
+#include "sync.h"
+#include "validationinterface.h"
+
+#include <map>
+
+class CMasternodeCollaterals;
+
+extern CMasternodeCollaterals mnCollaterals;
+
+/** Tracks whether the collateral outpoints of known masternodes are still unspent.
+ *
+ * An outpoint is looked up in the UTXO set and the mempool the first time it is
+ * asked about. From then on spends are picked up from SyncTransaction, which is
+ * raised for mempool acceptance, connected blocks and conflicts, so masternode
+ * checks no longer need cs_main.
+ */
+class CMasternodeCollaterals : public CValidationInterface
+{
+public:
+    enum State {
+        COLLATERAL_UNKNOWN,
+        COLLATERAL_UNSPENT,
+        COLLATERAL_SPENT
+    };
+
+private:
+    // leaf lock: never take cs_main or mempool.cs while holding it
+    mutable CCriticalSection cs;
+
+    // watched outpoint -> spent
+    std::map<COutPoint, bool> mapWatched;
+
+public:
+    /** Return the state of a collateral, watching it from now on. The first
+     *  lookup of an outpoint needs cs_main and returns COLLATERAL_UNKNOWN if
+     *  it is not available. */
+    State GetState(const COutPoint& outpoint);
+
+    /** Watch an outpoint whose state the caller already knows */
+    void Watch(const COutPoint& outpoint, bool fSpent);
+    void Forget(const COutPoint& outpoint);
+    void Clear();
+    size_t size() const;
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+};
+
+#endif
@@ -138,6 +138,7 @@ CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments&
     LogPrint("mnpayments","Loaded info from mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("mnpayments","  %s\n", objToLoad.ToString());
     if (!fDryRun) {
+        objToLoad.RebuildPayeeIndex();
         LogPrint("mnpayments","Masternode payments manager - cleaning....\n");
         objToLoad.CleanPaymentList();
         LogPrint("mnpayments","Masternode payments manager - result:\n");
@@ -419,6 +420,7 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
         if (Params().NetworkID() == CBaseChainParams::MAIN) {
             if (pfrom->HasFulfilledRequest(NetMsgType::MNGET)) {
                 LogPrintf("CMasternodePayments::ProcessMessageMasternodePayments() : mnget - peer already asked me for the list\n");
+                LOCK(cs_main);
                 Misbehaving(pfrom->GetId(), 20);
                 return;
             }
@@ -467,6 +469,7 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
         if (!winner.CheckSignature()) {
             if (masternodeSync.IsSynced()) {
                 LogPrintf("CMasternodePayments::ProcessMessageMasternodePayments() : mnw - invalid signature\n");
+                LOCK(cs_main);
                 Misbehaving(pfrom->GetId(), 20);
             }
             // it could just be a non-synced masternode
@@ -541,18 +544,76 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
         }
 
         mapMasternodePayeeVotes[winnerIn.GetHash()] = winnerIn;
-
-        if (!mapMasternodeBlocks.count(winnerIn.nBlockHeight)) {
-            CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
-            mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
-        }
     }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+    AddBlockPayeeVote(winnerIn.nBlockHeight, winnerIn.payee);
 
     return true;
 }
 
+void CMasternodePayments::AddBlockPayeeVote(int nBlockHeight, const CScript& payee)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if (it == mapMasternodeBlocks.end())
+        it = mapMasternodeBlocks.insert(std::make_pair(nBlockHeight, CMasternodeBlockPayees(nBlockHeight))).first;
+
+    it->second.AddPayee(payee, 1);
+    if (it->second.HasPayeeWithVotes(payee, MNPAYMENTS_LASTPAID_VOTES))
+        mapPayeeVoteHeights[payee].insert(nBlockHeight);
+}
+
+void CMasternodePayments::IndexPayeeVotes(const CMasternodeBlockPayees& blockPayees)
+{
+    for (const CMasternodePayee& payee : blockPayees.vecPayments) {
+        if (payee.nVotes >= MNPAYMENTS_LASTPAID_VOTES)
+            mapPayeeVoteHeights[payee.scriptPubKey].insert(blockPayees.nBlockHeight);
+    }
+}
+
+void CMasternodePayments::UnindexPayeeVotes(const CMasternodeBlockPayees& blockPayees)
+{
+    for (const CMasternodePayee& payee : blockPayees.vecPayments) {
+        std::map<CScript, std::set<int> >::iterator it = mapPayeeVoteHeights.find(payee.scriptPubKey);
+        if (it == mapPayeeVoteHeights.end())
+            continue;
+        it->second.erase(blockPayees.nBlockHeight);
+        if (it->second.empty())
+            mapPayeeVoteHeights.erase(it);
+    }
+}
+
+void CMasternodePayments::RebuildPayeeIndex()
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    mapPayeeVoteHeights.clear();
+    for (const PAIRTYPE(const int, CMasternodeBlockPayees) & entry : mapMasternodeBlocks) {
+        LOCK(cs_vecPayments);
+        IndexPayeeVotes(entry.second);
+    }
+}
+
+int CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nHeight, int nDepth)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<CScript, std::set<int> >::const_iterator it = mapPayeeVoteHeights.find(payee);
+    if (it == mapPayeeVoteHeights.end())
+        return 0;
+
+    // Latest voted height not above nHeight
+    std::set<int>::const_iterator itHeight = it->second.upper_bound(nHeight);
+    if (itHeight == it->second.begin())
+        return 0;
+    --itHeight;
+
+    if (*itHeight <= std::max(0, nHeight - nDepth))
+        return 0;
+    return *itHeight;
+}
+
 bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
 {
     LOCK(cs_vecPayments);
@@ -664,7 +725,12 @@ void CMasternodePayments::CleanPaymentList()
             LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
             masternodeSync.mapSeenSyncMNW.erase((*it).first);
             mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
+            std::map<int, CMasternodeBlockPayees>::iterator itBlock = mapMasternodeBlocks.find(winner.nBlockHeight);
+            if (itBlock != mapMasternodeBlocks.end()) {
+                LOCK(cs_vecPayments);
+                UnindexPayeeVotes(itBlock->second);
+                mapMasternodeBlocks.erase(itBlock);
+            }
         } else {
             ++it;
         }
@@ -700,7 +766,9 @@ bool CMasternodePayments::ProcessBlock(int nBlockHeight)
 
         // pay to the oldest MN that still had no payment but its input is old enough and it was active long enough
         int nCount = 0;
+        int64_t nTimeStart = GetTimeMicros();
         CMasternode* pmn = mnodeman.GetNextMasternodeInQueueForPayment(nBlockHeight, true, nCount);
+        LogPrint("bench", "    - Masternode winner selection for height %d: %.2fms (%d eligible)\n", nBlockHeight, 0.001 * (GetTimeMicros() - nTimeStart), nCount);
 
         if (pmn != NULL) {
             LogPrint("mnpayments","CMasternodePayments::ProcessBlock() Found by FindOldestNotInVec \n");
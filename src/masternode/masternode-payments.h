@@ -25,6 +25,8 @@ extern CMasternodePayments masternodePayments;
 
 #define MNPAYMENTS_SIGNATURES_REQUIRED 6
 #define MNPAYMENTS_SIGNATURES_TOTAL 10
+// votes a payee needs at a height before that block counts as its last payment
+#define MNPAYMENTS_LASTPAID_VOTES 2
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight);
@@ -234,6 +236,12 @@ private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    // memory only: payee -> heights in mapMasternodeBlocks where it has MNPAYMENTS_LASTPAID_VOTES votes
+    std::map<CScript, std::set<int> > mapPayeeVoteHeights;
+
+    void IndexPayeeVotes(const CMasternodeBlockPayees& blockPayees);
+    void UnindexPayeeVotes(const CMasternodeBlockPayees& blockPayees);
+
 public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
@@ -250,9 +258,15 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeeVoteHeights.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
+    void AddBlockPayeeVote(int nBlockHeight, const CScript& payee);
+    /** Rebuild the last-paid index from mapMasternodeBlocks, e.g. after loading mnpayments.dat */
+    void RebuildPayeeIndex();
+    /** Highest height in (nHeight - nDepth, nHeight] with enough votes for payee, or 0 if none */
+    int GetLastPaidHeight(const CScript& payee, int nHeight, int nDepth);
     bool ProcessBlock(int nBlockHeight);
 
     void Sync(CNode* node, int nCountNeeded);
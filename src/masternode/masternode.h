@@ -28,7 +28,6 @@
 class CMasternode;
 class CMasternodeBroadcast;
 class CMasternodePing;
-extern std::map<int64_t, uint256> mapCacheBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
@@ -196,6 +195,8 @@ public:
     }
 
     uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0);
+    /// Score against an already looked up GetBlockHash() result; for loops over the whole list
+    uint256 CalculateScore(const uint256& hash) const;
 
     ADD_SERIALIZE_METHODS;
 
@@ -222,7 +223,8 @@ public:
         READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    // nMnCount is the number of enabled masternodes; callers looping over all of them should pass it once
+    int64_t SecondsSincePayment(int nMnCount = -1);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -277,7 +279,7 @@ public:
         return strStatus;
     }
 
-    int64_t GetLastPaid();
+    int64_t GetLastPaid(int nMnCount = -1);
     bool IsValidNetAddr();
 
     /// Is the input associated with collateral public key? (and there is 1000 SCC - checking if valid masternode)
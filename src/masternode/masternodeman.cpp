@@ -8,6 +8,7 @@
 
 #include "addrman.h"
 #include "fs.h"
+#include "masternode/masternode-collateral.h"
 #include "masternode/masternode-payments.h"
 #include "masternode/masternode-sync.h"
 #include "masternode/masternode.h"
@@ -40,9 +41,9 @@ struct CompareScoreTxIn {
     }
 };
 
-struct CompareScoreMN {
-    bool operator()(const std::pair<int64_t, CMasternode>& t1,
-        const std::pair<int64_t, CMasternode>& t2) const
+struct CompareScorePosition {
+    bool operator()(const std::pair<int64_t, size_t>& t1,
+        const std::pair<int64_t, size_t>& t2) const
     {
         return t1.first < t2.first;
     }
@@ -199,7 +200,7 @@ void DumpMasternodes()
     LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
-CMasternodeMan::CMasternodeMan()
+CMasternodeMan::CMasternodeMan() : nListVersion(0), nRankAgeCheckTime(0), fRankAgeSporkActive(false), nRankCacheListVersion(0), nRankCacheHits(0)
 {
     nDsqCount = 0;
 }
@@ -215,6 +216,7 @@ bool CMasternodeMan::Add(CMasternode& mn)
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
         vMasternodes.push_back(mn);
+        InvalidateRankCache();
         return true;
     }
 
@@ -241,9 +243,24 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
+    // Entries expire, or come of age for ranking, without anything telling the
+    // list; notice it here so rank lookups can trust their cached tables
+    const bool fSporkActive = IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT);
+    const int64_t nNow = GetAdjustedTime();
+    if (fSporkActive != fRankAgeSporkActive)
+        InvalidateRankCache();
+
     for (CMasternode& mn : vMasternodes) {
+        int nState = mn.activeState;
         mn.Check();
+        if (mn.activeState != nState)
+            InvalidateRankCache();
+        // reached MN_WINNER_MINIMUM_AGE since the last look
+        if (fSporkActive && mn.sigTime > nRankAgeCheckTime - MN_WINNER_MINIMUM_AGE && mn.sigTime <= nNow - MN_WINNER_MINIMUM_AGE)
+            InvalidateRankCache();
     }
+    fRankAgeSporkActive = fSporkActive;
+    nRankAgeCheckTime = nNow;
 }
 
 void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
@@ -284,7 +301,9 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
                 }
             }
 
+            mnCollaterals.Forget((*it).vin.prevout);
             it = vMasternodes.erase(it);
+            InvalidateRankCache();
         } else {
             ++it;
         }
@@ -346,6 +365,8 @@ void CMasternodeMan::Clear()
 {
     LOCK(cs);
     vMasternodes.clear();
+    InvalidateRankCache();
+    mnCollaterals.Clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -508,7 +529,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(std::make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(std::make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -526,11 +547,13 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     int nTenthNetwork = CountEnabled() / 10;
     int nCountTenth = 0;
     uint256 nHigh;
+    uint256 hashScore;
+    const bool fHaveScoreHash = GetBlockHash(hashScore, nBlockHeight - 100);
     for (PAIRTYPE(int64_t, CTxIn) & s : vecMasternodeLastPaid) {
         CMasternode* pmn = Find(s.second);
         if (!pmn) break;
 
-        uint256 n = pmn->CalculateScore(1, nBlockHeight - 100);
+        uint256 n = fHaveScoreHash ? pmn->CalculateScore(hashScore) : uint256();
         if (n > nHigh) {
             nHigh = n;
             pBestMasternode = pmn;
@@ -577,6 +600,8 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
 {
     int64_t score = 0;
     CMasternode* winner = NULL;
+    uint256 hashScore;
+    const bool fHaveScoreHash = GetBlockHash(hashScore, nBlockHeight);
 
     // scan for winner
     for (CMasternode& mn : vMasternodes) {
@@ -584,7 +609,7 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
 
         // calculate the score for each Masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
+        uint256 n = fHaveScoreHash ? mn.CalculateScore(hashScore) : uint256();
         int64_t n2 = n.GetCompact(false);
 
         // determine the winner
@@ -597,16 +622,62 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
+// The tip the rank cache is kept for; read from chainActiveHashes, as the masternode
+// message thread doesn't hold cs_main
+static uint256 GetRankCacheTip()
+{
+    uint256 hashTip;
+    chainActiveHashes.GetHash(-1, hashTip);
+    return hashTip;
+}
+
+void CMasternodeMan::ResetStaleRankCache(const uint256& hashTip, int nVersion)
+{
+    AssertLockHeld(cs_rankCache);
+    if (hashRankCacheTip == hashTip && nRankCacheListVersion == nVersion)
+        return;
+
+    mapRankCache.clear();
+    mapRanksCache.clear();
+    hashRankCacheTip = hashTip;
+    nRankCacheListVersion = nVersion;
+}
+
+uint64_t CMasternodeMan::GetRankCacheHits() const
+{
+    LOCK(cs_rankCache);
+    return nRankCacheHits;
+}
+
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
     std::vector<std::pair<int64_t, CTxIn> > vecMasternodeScores;
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
+    // the table only depends on the active list, so it can be reused until the tip or the list changes
+    const std::pair<int64_t, int> key(nBlockHeight, minProtocol);
+    const uint256 hashTip = GetRankCacheTip();
+    if (fOnlyActive) {
+        LOCK(cs_rankCache);
+        ResetStaleRankCache(hashTip, nListVersion);
+        std::map<std::pair<int64_t, int>, std::map<COutPoint, int> >::const_iterator it = mapRankCache.find(key);
+        if (it != mapRankCache.end()) {
+            nRankCacheHits++;
+            std::map<COutPoint, int>::const_iterator itRank = it->second.find(vin.prevout);
+            return itRank == it->second.end() ? -1 : itRank->second;
+        }
+    }
+
     //make sure we know about this block
     uint256 hash;
     if (!GetBlockHash(hash, nBlockHeight)) return -1;
 
+    // bring every entry's state up to date first, so the table is built from the same list it is kept for
+    if (fOnlyActive)
+        Check();
+    const int nVersion = nListVersion;
+
     // scan for winner
     for (CMasternode& mn : vMasternodes) {
         if (mn.protocolVersion < minProtocol) {
@@ -625,7 +696,7 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
+        uint256 n = mn.CalculateScore(hash);
         int64_t n2 = n.GetCompact(false);
 
         vecMasternodeScores.push_back(std::make_pair(n2, mn.vin));
@@ -634,48 +705,93 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
     sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
 
     int rank = 0;
+    int nRankFound = -1;
+    std::map<COutPoint, int> mapRanks;
     for (PAIRTYPE(int64_t, CTxIn) & s : vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
+        if (nRankFound == -1 && s.second.prevout == vin.prevout)
+            nRankFound = rank;
+        if (fOnlyActive)
+            mapRanks.insert(std::make_pair(s.second.prevout, rank));
+    }
+
+    if (fOnlyActive) {
+        LOCK(cs_rankCache);
+        // don't store a table built while the tip or the list moved on
+        if (hashTip == GetRankCacheTip() && nVersion == nListVersion) {
+            ResetStaleRankCache(hashTip, nVersion);
+            mapRankCache[key].swap(mapRanks);
         }
     }
 
-    return -1;
+    return nRankFound;
 }
 
 std::vector<std::pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<std::pair<int64_t, CMasternode> > vecMasternodeScores;
+    std::vector<std::pair<int64_t, size_t> > vecMasternodeScores;
     std::vector<std::pair<int, CMasternode> > vecMasternodeRanks;
 
     //make sure we know about this block
     uint256 hash;
     if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
 
-    // scan for winner
-    for (CMasternode& mn : vMasternodes) {
-        mn.Check();
+    // reuse the cached order, but report each masternode's current details; entries
+    // only move in vMasternodes when one is added or removed, which changes the list version
+    const std::pair<int64_t, int> key(nBlockHeight, minProtocol);
+    const uint256 hashTip = GetRankCacheTip();
+    {
+        LOCK(cs_rankCache);
+        ResetStaleRankCache(hashTip, nListVersion);
+        std::map<std::pair<int64_t, int>, std::vector<size_t> >::const_iterator it = mapRanksCache.find(key);
+        if (it != mapRanksCache.end()) {
+            int rank = 0;
+            for (size_t nPos : it->second) {
+                rank++;
+                if (nPos < vMasternodes.size())
+                    vecMasternodeRanks.push_back(std::make_pair(rank, vMasternodes[nPos]));
+            }
+            nRankCacheHits++;
+            return vecMasternodeRanks;
+        }
+    }
+
+    Check();
+    const int nVersion = nListVersion;
 
+    // scan for winner
+    for (size_t nPos = 0; nPos < vMasternodes.size(); nPos++) {
+        CMasternode& mn = vMasternodes[nPos];
         if (mn.protocolVersion < minProtocol) continue;
 
         if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(std::make_pair(9999, mn));
+            vecMasternodeScores.push_back(std::make_pair(9999, nPos));
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
+        uint256 n = mn.CalculateScore(hash);
         int64_t n2 = n.GetCompact(false);
 
-        vecMasternodeScores.push_back(std::make_pair(n2, mn));
+        vecMasternodeScores.push_back(std::make_pair(n2, nPos));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScorePosition());
 
     int rank = 0;
-    for (PAIRTYPE(int64_t, CMasternode) & s : vecMasternodeScores) {
+    std::vector<size_t> vecOrder;
+    vecOrder.reserve(vecMasternodeScores.size());
+    for (PAIRTYPE(int64_t, size_t) & s : vecMasternodeScores) {
         rank++;
-        vecMasternodeRanks.push_back(std::make_pair(rank, s.second));
+        vecMasternodeRanks.push_back(std::make_pair(rank, vMasternodes[s.second]));
+        vecOrder.push_back(s.second);
+    }
+
+    {
+        LOCK(cs_rankCache);
+        if (hashTip == GetRankCacheTip() && nVersion == nListVersion) {
+            ResetStaleRankCache(hashTip, nVersion);
+            mapRanksCache[key].swap(vecOrder);
+        }
     }
 
     return vecMasternodeRanks;
@@ -684,6 +800,8 @@ std::vector<std::pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
     std::vector<std::pair<int64_t, CTxIn> > vecMasternodeScores;
+    uint256 hashScore;
+    const bool fHaveScoreHash = GetBlockHash(hashScore, nBlockHeight);
 
     // scan for winner
     for (CMasternode& mn : vMasternodes) {
@@ -693,7 +811,7 @@ CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
+        uint256 n = fHaveScoreHash ? mn.CalculateScore(hashScore) : uint256();
         int64_t n2 = n.GetCompact(false);
 
         vecMasternodeScores.push_back(std::make_pair(n2, mn.vin));
@@ -731,8 +849,10 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         int nDoS = 0;
         if (!mnb.CheckAndUpdate(nDoS)) {
-            if (nDoS > 0)
+            if (nDoS > 0) {
+                LOCK(cs_main);
                 Misbehaving(pfrom->GetId(), nDoS);
+            }
 
             //failed
             return;
@@ -742,6 +862,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         //  - this is expensive, so it's only done once per Masternode
         if (!mnb.IsInputAssociatedWithPubkey()) {
             LogPrintf("CMasternodeMan::ProcessMessage() : mnb - Got mismatched pubkey and vin\n");
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 33);
             return;
         }
@@ -755,8 +876,10 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         } else {
             LogPrint("masternode","mnb - Rejected Masternode entry %s\n", mnb.vin.prevout.hash.ToString());
 
-            if (nDoS > 0)
+            if (nDoS > 0) {
+                LOCK(cs_main);
                 Misbehaving(pfrom->GetId(), nDoS);
+            }
         }
     }
 
@@ -774,6 +897,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         if (nDoS > 0) {
             // if anything significant failed, mark that node
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), nDoS);
         } else {
             // if nothing significant failed, search existing Masternode list
@@ -801,6 +925,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     int64_t t = (*i).second;
                     if (GetTime() < t) {
                         LogPrintf("CMasternodeMan::ProcessMessage() : dseg - peer already asked me for the list\n");
+                        LOCK(cs_main);
                         Misbehaving(pfrom->GetId(), 34);
                         return;
                     }
@@ -849,7 +974,9 @@ void CMasternodeMan::Remove(CTxIn vin)
     while (it != vMasternodes.end()) {
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
+            mnCollaterals.Forget((*it).vin.prevout);
             vMasternodes.erase(it);
+            InvalidateRankCache();
             break;
         }
         ++it;
@@ -870,6 +997,7 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
         Add(mn);
     } else {
         pmn->UpdateFromNewBroadcast(mnb);
+        InvalidateRankCache();
     }
 }
 
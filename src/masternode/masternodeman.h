@@ -17,6 +17,8 @@
 #include "sync.h"
 #include "util.h"
 
+#include <atomic>
+
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
 
@@ -72,6 +74,26 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    // bumped whenever an entry is added, removed or changes state; invalidates the rank cache
+    std::atomic<int> nListVersion;
+
+    // when Check last looked for masternodes coming of age, and whether SPORK_8 had
+    // them wait; the ranks change when either moves on
+    int64_t nRankAgeCheckTime;
+    bool fRankAgeSporkActive;
+
+    // rank tables keyed by (block height, minimum protocol), valid for one tip and list version;
+    // GetMasternodeRanks keeps the order as positions in vMasternodes
+    mutable CCriticalSection cs_rankCache;
+    uint256 hashRankCacheTip;
+    int nRankCacheListVersion;
+    std::map<std::pair<int64_t, int>, std::map<COutPoint, int> > mapRankCache;
+    std::map<std::pair<int64_t, int>, std::vector<size_t> > mapRanksCache;
+    uint64_t nRankCacheHits;
+
+    /// Drop cached rank tables built for another tip or list version; requires cs_rankCache
+    void ResetStaleRankCache(const uint256& hashTip, int nVersion);
+
 public:
     // Keep track of all broadcasts I've seen
     std::map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
@@ -96,6 +118,8 @@ public:
 
         READWRITE(mapSeenMasternodeBroadcast);
         READWRITE(mapSeenMasternodePing);
+        if (ser_action.ForRead())
+            InvalidateRankCache();
     }
 
     CMasternodeMan();
@@ -107,7 +131,7 @@ public:
     /// Ask (source) node for mnb
     void AskForMN(CNode* pnode, CTxIn& vin);
 
-    /// Check all Masternodes
+    /// Check all Masternodes, marking the rank tables stale if one changed state or came of age
     void Check();
 
     /// Check all Masternodes and remove inactive
@@ -143,6 +167,8 @@ public:
     }
 
     std::vector<std::pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
+    /// Rank of vin among active masternodes; tables are cached per (height, minProtocol) until the tip
+    /// or list changes, with expiry noticed by the periodic and new-tip Check
     int GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
     CMasternode* GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
 
@@ -158,6 +184,12 @@ public:
 
     void Remove(CTxIn vin);
 
+    /// Mark cached rank tables stale after a change to an entry made outside this class
+    void InvalidateRankCache() { nListVersion++; }
+
+    /// Number of rank lookups answered from a cached table
+    uint64_t GetRankCacheHits() const;
+
     int GetEstimatedMasternodes(int nBlock);
 
     /// Update masternode list and maps using provided CMasternodeBroadcast
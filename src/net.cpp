@@ -19,16 +19,21 @@
 #include "chainparams.h"
 #include "clientversion.h"
 #include "miner.h"
+#include "netpoll.h"
+#include "netscheduler.h"
 #include "obfuscation.h"
 #include "primitives/transaction.h"
 #include "protocol.h"
 #include "scheduler.h"
 #include "ui_interface.h"
 
+#include <atomic>
+
 #ifdef WIN32
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -82,6 +87,7 @@ uint64_t nRelevantServices = NODE_NETWORK;
 //
 bool fDiscover = true;
 bool fListen = true;
+bool fNetEpoll = DEFAULT_EPOLL;
 uint64_t nLocalServices = NODE_NETWORK | NODE_WITNESS;
 CCriticalSection cs_mapLocalHost;
 map<CNetAddr, LocalServiceInfo> mapLocalHost;
@@ -89,6 +95,8 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+//! what the socket thread waits for sockets with; created by StartNode
+static CSocketPoller* pSocketPoller = NULL;
 CAddrMan addrman;
 int nMaxConnections = 125;
 bool fAddressesInitialized = false;
@@ -113,12 +121,41 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore* semOutbound = NULL;
-boost::condition_variable messageHandlerCondition;
+
+//! peers with general messages to process, or due to send theirs
+static CPeerScheduler schedulerGeneral;
+//! peers with messages waiting in the masternode lane
+static CPeerScheduler schedulerMasternode;
+//! the peer to send trickled inventory and addresses to next; -1 once done
+static std::atomic<NodeId> nodeTrickle(-1);
 
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+static bool IsWatchableSocket(SOCKET hSocket)
+{
+    return pSocketPoller ? pSocketPoller->CanWatch(hSocket) : IsSelectableSocket(hSocket);
+}
+
+/** Have an edge-triggered poller watch the socket of a new node for as long as it
+ *  is open. Level-triggered ones are told about it on every pass instead. */
+static void WatchNodeSocket(CNode* pnode)
+{
+    if (!pSocketPoller || !pSocketPoller->IsEdgeTriggered())
+        return;
+    if (!pSocketPoller->Watch(pnode->hSocket, CSocketPoller::POLL_RECV | CSocketPoller::POLL_SEND, pnode)) {
+        LogPrintf("Unable to watch the socket of peer=%d: %s\n", pnode->id, NetworkErrorString(WSAGetLastError()));
+        pnode->fDisconnect = true;
+    }
+}
+
+static void UnwatchSocket(SOCKET hSocket)
+{
+    if (pSocketPoller)
+        pSocketPoller->Unwatch(hSocket);
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -432,7 +469,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest)
     bool proxyConnectionFailed = false;
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
         ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed)) {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsWatchableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -443,6 +480,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        WatchNodeSocket(pnode);
 
         {
             LOCK(cs_vNodes);
@@ -467,6 +505,7 @@ void CNode::CloseSocketDisconnect()
     fDisconnect = true;
     if (hSocket != INVALID_SOCKET) {
         LogPrint("net", "disconnecting peer=%d\n", id);
+        UnwatchSocket(hSocket);
         CloseSocket(hSocket);
     }
 
@@ -474,6 +513,11 @@ void CNode::CloseSocketDisconnect()
     TRY_LOCK(cs_vRecvMsg, lockRecv);
     if (lockRecv)
         vRecvMsg.clear();
+    TRY_LOCK(cs_vRecvMnMsg, lockRecvMn);
+    if (lockRecvMn) {
+        vRecvMnMsg.clear();
+        nRecvMnSize = 0;
+    }
 }
 
 bool CNode::DisconnectOldProtocol(int nVersionRequired, string strLastCommand)
@@ -754,7 +798,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            schedulerGeneral.Schedule(id);
         }
     }
 
@@ -808,26 +852,55 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 }
 
 
+/** How many queued messages SocketSendData hands to the kernel in one call */
+static const int MAX_SEND_IOV = 64;
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendBuffer>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData& data = **it;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        size_t nWanted = data.size() - pnode->nSendOffset;
+#else
+        // Gather the queued messages straight from their shared buffers, so
+        // several go out in one call without being copied together first
+        struct iovec vIov[MAX_SEND_IOV];
+        int nIov = 0;
+        size_t nWanted = 0;
+        for (std::deque<CSendBuffer>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; ++itIov, ++nIov) {
+            size_t nOffset = nIov == 0 ? pnode->nSendOffset : 0;
+            vIov[nIov].iov_base = (void*)&(**itIov)[nOffset];
+            vIov[nIov].iov_len = (*itIov)->size() - nOffset;
+            nWanted += vIov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vIov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            for (size_t nLeft = nBytes; nLeft > 0;) {
+                size_t nRest = (*it)->size() - pnode->nSendOffset;
+                if (nLeft < nRest) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRest;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nWanted) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -853,101 +926,224 @@ void SocketSendData(CNode* pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+/** How often the socket thread looks over every node, in milliseconds */
+static const int SOCKET_HOUSEKEEPING_INTERVAL = 50;
+
+/** Accept one connection on a listening socket; false if there was none */
+static bool AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes)
+        if (pnode->fInbound)
+            nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+        return false;
+    } else if (!IsWatchableSocket(hSocket)) {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+        WatchNodeSocket(pnode);
+
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+    return true;
+}
+
+/** Receive from a node's socket. With fDrain, receive until the socket runs dry or
+ *  the receive buffer is full, as an edge-triggered poller won't report the socket
+ *  again before; fRecvReady stays set if it may have more. */
+static void SocketRecvData(CNode* pnode, bool fDrain)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return;
+
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    do {
+        // leave the rest in the socket while a complete message waits in a full buffer
+        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() && pnode->GetTotalRecvSize() > ReceiveFloodSize())
+            return;
+        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        if (nBytes > 0) {
+            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                pnode->CloseSocketDisconnect();
+            pnode->nLastRecv = GetTime();
+            pnode->nRecvBytes += nBytes;
+            pnode->RecordBytesRecv(nBytes);
+            // less than asked for means the socket ran dry
+            if (nBytes < (int)sizeof(pchBuf))
+                pnode->fRecvReady = false;
+        } else if (nBytes == 0) {
+            // socket closed gracefully
+            if (!pnode->fDisconnect)
+                LogPrint("net", "socket closed\n");
+            pnode->CloseSocketDisconnect();
+        } else if (nBytes < 0) {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+                if (!pnode->fDisconnect)
+                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                pnode->CloseSocketDisconnect();
+            }
+            pnode->fRecvReady = false;
+        }
+    } while (fDrain && pnode->fRecvReady && pnode->hSocket != INVALID_SOCKET);
+}
+
+/** Receive and send on a node's socket as far as the poller found it ready */
+static void SocketServiceNode(CNode* pnode, bool fEdge)
+{
+    //
+    // Receive
+    //
+    if (pnode->hSocket != INVALID_SOCKET && pnode->fRecvReady)
+        SocketRecvData(pnode, fEdge);
+
+    //
+    // Send
+    //
+    if (pnode->hSocket != INVALID_SOCKET && pnode->fSendReady) {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty()) {
+            SocketSendData(pnode);
+            // what is left has to wait for the socket to drain
+            if (!pnode->vSendMsg.empty())
+                pnode->fSendReady = false;
+        }
+    }
+
+    // a level-triggered poller reports the socket again on the next pass if it is still ready
+    if (!fEdge) {
+        pnode->fRecvReady = false;
+        pnode->fSendReady = false;
+    }
+}
+
 void ThreadSocketHandler()
 {
+    // An edge-triggered poller watches each socket from when it is opened, and its
+    // events drive receiving and sending. The nodes are looked over every
+    // SOCKET_HOUSEKEEPING_INTERVAL only, to disconnect them, time them out and
+    // serve those whose readiness couldn't be used up when it was reported.
+    // select() is told about every socket on every pass instead.
+    const bool fEdge = pSocketPoller->IsEdgeTriggered();
+    if (fEdge) {
+        for (ListenSocket& hListenSocket : vhListenSocket)
+            pSocketPoller->Watch(hListenSocket.socket, CSocketPoller::POLL_RECV, &hListenSocket);
+    }
+
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastHousekeeping = 0;
+    std::vector<CSocketPoller::CEvent> vEvents;
     while (true) {
-        //
-        // Disconnect nodes
-        //
-        {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
-
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+        bool fHousekeeping = !fEdge || GetTimeMillis() - nLastHousekeeping >= SOCKET_HOUSEKEEPING_INTERVAL;
+        if (fHousekeeping) {
+            nLastHousekeeping = GetTimeMillis();
+
+            //
+            // Disconnect nodes
+            //
+            {
+                LOCK(cs_vNodes);
+                // Disconnect unused nodes
+                vector<CNode*> vNodesCopy = vNodes;
+                for (CNode* pnode : vNodesCopy) {
+                    if (pnode->fDisconnect ||
+                        (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
+                        // remove from vNodes
+                        vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                        // release outbound grant (if any)
+                        pnode->grantOutbound.Release();
+
+                        // close socket and cleanup
+                        pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+                        // hold in disconnected pool until all refs are released
+                        if (pnode->fNetworkNode || pnode->fInbound)
+                            pnode->Release();
+                        vNodesDisconnected.push_back(pnode);
+                    }
                 }
             }
-        }
-        {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            for (CNode* pnode : vNodesDisconnectedCopy) {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend) {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv) {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
+            {
+                // Delete disconnected nodes
+                list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+                for (CNode* pnode : vNodesDisconnectedCopy) {
+                    // wait until threads are done using it
+                    if (pnode->GetRefCount() <= 0) {
+                        bool fDelete = false;
+                        {
+                            TRY_LOCK(pnode->cs_vSend, lockSend);
+                            if (lockSend) {
+                                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                                if (lockRecv) {
+                                    TRY_LOCK(pnode->cs_inventory, lockInv);
+                                    if (lockInv)
+                                        fDelete = true;
+                                }
                             }
                         }
-                    }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        if (fDelete) {
+                            vNodesDisconnected.remove(pnode);
+                            delete pnode;
+                        }
                     }
                 }
             }
-        }
-        size_t vNodesSize;
-        {
-            LOCK(cs_vNodes);
-            vNodesSize = vNodes.size();
-        }
-        if(vNodesSize != nPrevNodeCount) {
-            nPrevNodeCount = vNodesSize;
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+            size_t vNodesSize;
+            {
+                LOCK(cs_vNodes);
+                vNodesSize = vNodes.size();
+            }
+            if(vNodesSize != nPrevNodeCount) {
+                nPrevNodeCount = vNodesSize;
+                uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+            }
         }
 
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        for (const ListenSocket& hListenSocket : vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
+        if (!fEdge) {
+            for (ListenSocket& hListenSocket : vhListenSocket)
+                pSocketPoller->Watch(hListenSocket.socket, CSocketPoller::POLL_RECV, &hListenSocket);
 
-        {
             LOCK(cs_vNodes);
             for (CNode* pnode : vNodes) {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
 
                 // Implement the following logic:
                 // * If there is data to send, select() for sending data. As this only
@@ -964,90 +1160,63 @@ void ThreadSocketHandler()
                 // * We send some data.
                 // * We wait for data to be received (and disconnect after timeout).
                 // * We process a message in the buffer (message handler thread).
+                int nEvents = 0;
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
+                    if (lockSend && !pnode->vSendMsg.empty())
+                        nEvents = CSocketPoller::POLL_SEND;
                 }
-                {
+                if (!nEvents) {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                     if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
                                      pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                        nEvents = CSocketPoller::POLL_RECV;
                 }
+                pSocketPoller->Watch(pnode->hSocket, nEvents, pnode);
             }
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
+        int nTimeout = SOCKET_HOUSEKEEPING_INTERVAL; // frequency to poll pnode->vSend
+        if (fEdge)
+            nTimeout = std::max((int64_t)0, nLastHousekeeping + SOCKET_HOUSEKEEPING_INTERVAL - GetTimeMillis());
+        vEvents.clear();
+        if (!pSocketPoller->Wait(nTimeout, vEvents)) {
+            LogPrintf("socket %s error %s\n", pSocketPoller->GetName(), NetworkErrorString(WSAGetLastError()));
+            MilliSleep(nTimeout);
         }
+        boost::this_thread::interruption_point();
 
         //
-        // Accept new connections
+        // Accept new connections, and service each socket that is ready
         //
-        for (const ListenSocket& hListenSocket : vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    for (CNode* pnode : vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-                }
+        // The nodes reported are alive: only this thread deletes nodes, and not
+        // before their sockets are closed and no longer watched.
+        for (const CSocketPoller::CEvent& event : vEvents) {
+            boost::this_thread::interruption_point();
 
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
+            const ListenSocket* pListenSocket = NULL;
+            for (const ListenSocket& hListenSocket : vhListenSocket) {
+                if (event.pData == &hListenSocket)
+                    pListenSocket = &hListenSocket;
+            }
+            if (pListenSocket) {
+                // an edge-triggered poller reports connections that are already waiting only once
+                if (pListenSocket->socket != INVALID_SOCKET)
+                    while (AcceptConnection(*pListenSocket) && fEdge) {}
+                continue;
             }
+
+            CNode* pnode = (CNode*)event.pData;
+            if (event.nEvents & (CSocketPoller::POLL_RECV | CSocketPoller::POLL_ERROR))
+                pnode->fRecvReady = true;
+            if (event.nEvents & CSocketPoller::POLL_SEND)
+                pnode->fSendReady = true;
+            SocketServiceNode(pnode, fEdge);
         }
 
-        //
-        // Service each socket
-        //
+        if (!fHousekeeping)
+            continue;
+
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
@@ -1058,52 +1227,12 @@ void ThreadSocketHandler()
         for (CNode* pnode : vNodesCopy) {
             boost::this_thread::interruption_point();
 
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+            // readiness that was reported but couldn't be used up then
+            if (fEdge && (pnode->fRecvReady || pnode->fSendReady))
+                SocketServiceNode(pnode, fEdge);
 
-            //
-            // Send
-            //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
-            }
 
             //
             // Inactivity checking
@@ -1518,67 +1647,109 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 }
 
 
-void ThreadMessageHandler()
+/** Find a connected peer by id and take a reference to it */
+static CNode* FindNodeRef(NodeId id)
+{
+    LOCK(cs_vNodes);
+    for (CNode* pnode : vNodes) {
+        if (pnode->GetId() == id)
+            return pnode->AddRef();
+    }
+    return NULL;
+}
+
+static void ReleaseNodeRef(CNode* pnode)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
+    LOCK(cs_vNodes);
+    pnode->Release();
+}
 
+void ThreadMessageHandler()
+{
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true) {
-        vector<CNode*> vNodesCopy;
+        // Peers are scheduled as their messages come in. Every so often all of
+        // them get a turn as well, to send pings, inventory and addresses, and
+        // to go on with messages that were waiting for room.
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
-                pnode->AddRef();
+            if (!vNodes.empty())
+                nodeTrickle = vNodes[GetRand(vNodes.size())]->GetId();
+            for (CNode* pnode : vNodes) {
+                if (pnode->fDisconnect)
+                    continue;
+                schedulerGeneral.Schedule(pnode->GetId());
+                TRY_LOCK(pnode->cs_vRecvMnMsg, lockRecvMn);
+                if (lockRecvMn && !pnode->vRecvMnMsg.empty())
+                    schedulerMasternode.Schedule(pnode->GetId());
             }
         }
+        MilliSleep(100);
+    }
+}
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
-        bool fSleep = true;
-
-        for (CNode* pnode : vNodesCopy) {
-            if (pnode->fDisconnect)
-                continue;
-
+void ThreadMessageWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    NodeId id;
+    while (schedulerGeneral.Take(id)) {
+        bool fMore = false;
+        CNode* pnode = FindNodeRef(id);
+        if (pnode && !pnode->fDisconnect) {
             // Receive messages
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
+                LOCK(pnode->cs_vRecvMsg);
+                if (!g_signals.ProcessMessages(pnode))
+                    pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize()) {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
-                            fSleep = false;
-                        }
-                    }
-                }
+                if (pnode->nSendSize < SendBufferSize())
+                    fMore = !pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete());
+            }
+            {
+                LOCK(pnode->cs_vRecvMnMsg);
+                if (!pnode->vRecvMnMsg.empty())
+                    schedulerMasternode.Schedule(id);
+                // the messages behind wait for the lane to catch up
+                if (pnode->nRecvMnSize >= ReceiveFloodSize())
+                    fMore = false;
             }
             boost::this_thread::interruption_point();
 
             // Send messages
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                if (lockSend) {
+                    NodeId idTrickle = id;
+                    bool fTrickle = nodeTrickle.compare_exchange_strong(idTrickle, -1);
+                    g_signals.SendMessages(pnode, fTrickle || pnode->fWhitelisted);
+                }
             }
             boost::this_thread::interruption_point();
         }
+        if (pnode)
+            ReleaseNodeRef(pnode);
+        schedulerGeneral.Done(id, fMore);
+    }
+}
 
+void ThreadMasternodeMessageHandler()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    NodeId id;
+    while (schedulerMasternode.Take(id)) {
+        bool fMore = false;
+        CNode* pnode = FindNodeRef(id);
+        // Don't bother if send buffer is too full to respond anyway
+        if (pnode && !pnode->fDisconnect && pnode->nSendSize < SendBufferSize()) {
+            g_signals.ProcessMasternodeMessages(pnode);
+            boost::this_thread::interruption_point();
 
-        {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodesCopy)
-            pnode->Release();
+            LOCK(pnode->cs_vRecvMnMsg);
+            fMore = !pnode->vRecvMnMsg.empty() && pnode->nSendSize < SendBufferSize();
         }
-
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        if (pnode)
+            ReleaseNodeRef(pnode);
+        schedulerMasternode.Done(id, fMore);
     }
 }
 
@@ -1762,6 +1933,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
     // Send and receive from sockets, accept connections
+    if (pSocketPoller == NULL)
+        pSocketPoller = CreateSocketPoller(fNetEpoll);
+    LogPrintf("Waiting for peer sockets with %s\n", pSocketPoller->GetName());
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1770,8 +1944,13 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Initiate outbound connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
-    // Process messages
+    // Process messages on a pool of threads, and masternode messages on one of their own
+    int nMessageThreads = std::max(1, std::min((int)GetArg("-msgthreads", DEFAULT_MESSAGE_THREADS), MAX_MESSAGE_THREADS));
+    LogPrintf("Using %d threads for processing messages\n", nMessageThreads);
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgwork", &ThreadMessageWorker));
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgmnode", &ThreadMasternodeMessageHandler));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -1781,6 +1960,8 @@ bool StopNode()
 {
     LogPrintf("StopNode()\n");
     MapPort(false);
+    schedulerGeneral.Stop();
+    schedulerMasternode.Stop();
     if (semOutbound)
         for (int i = 0; i < MAX_OUTBOUND_CONNECTIONS; i++)
             semOutbound->post();
@@ -1821,6 +2002,8 @@ public:
         semOutbound = NULL;
         delete pnodeLocalHost;
         pnodeLocalHost = NULL;
+        delete pSocketPoller;
+        pSocketPoller = NULL;
 
 #ifdef WIN32
         // Shutdown Windows Sockets
@@ -1877,13 +2060,18 @@ void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
 {
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
 
-    //broadcast the new lock
+    //broadcast the new lock, serialized once for each send version among the peers
+    std::map<int, CSendBuffer> mapMsg;
     LOCK(cs_vNodes);
     for (CNode* pnode : vNodes) {
         if (!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage(NetMsgType::IX, tx);
+        int nSendVersion = pnode->GetSendVersion();
+        CSendBuffer& msg = mapMsg[nSendVersion];
+        if (!msg)
+            msg = MakeSendBuffer(NetMsgType::IX, SER_NETWORK, nSendVersion, tx);
+        pnode->PushSendBuffer(msg);
     }
 }
 
@@ -2057,11 +2245,14 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nServices = 0;
     nServicesExpected = 0;
     hSocket = hSocketIn;
+    fRecvReady = false;
+    fSendReady = false;
     nRecvVersion = INIT_PROTO_VERSION;
     nLastSend = 0;
     nLastRecv = 0;
     nSendBytes = 0;
     nRecvBytes = 0;
+    nRecvMnSize = 0;
     nTimeConnected = GetTime();
     nTimeOffset = 0;
     addr = addrIn;
@@ -2082,6 +2273,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
+    fProvidesHeaderAndIDs = false;
+    fPreferHeaderAndIDs = false;
     setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
@@ -2108,6 +2301,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
 
 CNode::~CNode()
 {
+    if (hSocket != INVALID_SOCKET)
+        UnwatchSocket(hSocket);
     CloseSocket(hSocket);
 
     if (pfilter)
@@ -2181,28 +2376,39 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         return;
     }
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+    LogPrint("net", "(%d bytes) peer=%d\n", ssSend.size() - CMessageHeader::HEADER_SIZE, id);
+
+    vSendMsg.push_back(FinishSendBuffer(ssSend));
+    nSendSize += vSendMsg.back()->size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+void CNode::PushSendBuffer(const CSendBuffer& msg)
+{
+    LOCK(cs_vSend);
+    if (mapArgs.count("-dropmessagestest") && GetRand(GetArg("-dropmessagestest", 2)) == 0) {
+        LogPrint("net", "dropmessages DROPPING SEND MESSAGE\n");
+        return;
+    }
+    LogPrint("net", "sending: shared message (%d bytes) peer=%d\n", msg->size() - CMessageHeader::HEADER_SIZE, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
+}
 
-    LEAVE_CRITICAL_SECTION(cs_vSend);
+int CNode::GetSendVersion()
+{
+    LOCK(cs_vSend);
+    return ssSend.GetVersion();
 }
 
 //
@@ -16,6 +16,7 @@
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
+#include "sendbuffer.h"
 #include "streams.h"
 #include "sync.h"
 #include "uint256.h"
@@ -57,6 +58,8 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** -epoll default: wait for peer sockets with epoll instead of select(), where the system has it */
+static const bool DEFAULT_EPOLL = true;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -84,6 +87,7 @@ typedef int NodeId;
 struct CNodeSignals {
     boost::signals2::signal<int()> GetHeight;
     boost::signals2::signal<bool(CNode*)> ProcessMessages;
+    boost::signals2::signal<void(CNode*)> ProcessMasternodeMessages;
     boost::signals2::signal<bool(CNode*, bool)> SendMessages;
     boost::signals2::signal<void(NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void(NodeId)> FinalizeNode;
@@ -121,6 +125,7 @@ CAddress GetLocalAddress(const CNetAddr* paddrPeer = NULL);
 
 extern bool fDiscover;
 extern bool fListen;
+extern bool fNetEpoll;
 extern uint64_t nLocalServices;
 extern uint64_t nRelevantServices;
 extern uint64_t nLocalHostNonce;
@@ -282,16 +287,24 @@ public:
     uint64_t nServices;
     uint64_t nServicesExpected;
     SOCKET hSocket;
+    //! readiness of the socket that the socket thread was told about and hasn't used up yet
+    bool fRecvReady;
+    bool fSendReady;
     CDataStream ssSend;
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    //! whole messages, which may be shared with the send queues of other peers
+    std::deque<CSendBuffer> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    //! masternode, budget and spork messages, moved here in order from vRecvMsg for their own lane
+    std::deque<CNetMessage> vRecvMnMsg;
+    size_t nRecvMnSize;
+    CCriticalSection cs_vRecvMnMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -320,6 +333,10 @@ public:
     // b) the peer may tell us in their version message that we should not relay tx invs
     //    until they have initialized their bloom filter.
     bool fRelayTxes;
+    //! the peer sent a sendcmpct we understand, so it can be sent cmpctblock messages
+    bool fProvidesHeaderAndIDs;
+    //! the peer asked for new blocks to be announced to it as cmpctblock messages rather than inv
+    bool fPreferHeaderAndIDs;
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
@@ -350,6 +367,8 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
+    //! guards vAddrToSend and setAddrKnown, which other peers' messages relay to
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
@@ -401,7 +420,8 @@ public:
         unsigned int total = 0;
         for (const CNetMessage& msg : vRecvMsg)
             total += msg.vRecv.size() + 24;
-        return total;
+        LOCK(cs_vRecvMnMsg);
+        return total + nRecvMnSize;
     }
 
     // requires LOCK(cs_vRecvMsg)
@@ -429,6 +449,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -437,6 +458,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr)) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -476,6 +498,12 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a message serialized once for many peers, without copying it */
+    void PushSendBuffer(const CSendBuffer& msg);
+
+    /** The version messages to this peer are serialized with, for MakeSendBuffer */
+    int GetSendVersion();
+
     void PushVersion();
 
 
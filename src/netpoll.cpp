@@ -0,0 +1,200 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netpoll.h"
+
+#include "util.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+const int CSocketPoller::POLL_RECV;
+const int CSocketPoller::POLL_SEND;
+const int CSocketPoller::POLL_ERROR;
+
+namespace
+{
+/** Level-triggered, and limited to descriptors below FD_SETSIZE */
+class CSelectPoller : public CSocketPoller
+{
+private:
+    struct CWatch {
+        SOCKET hSocket;
+        int nEvents;
+        void* pData;
+    };
+
+    std::vector<CWatch> vWatches;
+
+public:
+    const char* GetName() const { return "select"; }
+
+    bool IsEdgeTriggered() const { return false; }
+
+    bool CanWatch(SOCKET hSocket) const { return IsSelectableSocket(hSocket); }
+
+    bool Watch(SOCKET hSocket, int nEvents, void* pData)
+    {
+        if (!CanWatch(hSocket))
+            return false;
+        CWatch watch;
+        watch.hSocket = hSocket;
+        watch.nEvents = nEvents;
+        watch.pData = pData;
+        vWatches.push_back(watch);
+        return true;
+    }
+
+    // sockets are forgotten after every Wait anyway
+    void Unwatch(SOCKET hSocket) {}
+
+    bool Wait(int nTimeoutMillis, std::vector<CEvent>& vEvents)
+    {
+        struct timeval timeout;
+        timeout.tv_sec = nTimeoutMillis / 1000;
+        timeout.tv_usec = (nTimeoutMillis % 1000) * 1000;
+
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        fd_set fdsetError;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        SOCKET hSocketMax = 0;
+        for (std::vector<CWatch>::const_iterator it = vWatches.begin(); it != vWatches.end(); ++it) {
+            if (it->nEvents & POLL_RECV)
+                FD_SET(it->hSocket, &fdsetRecv);
+            if (it->nEvents & POLL_SEND)
+                FD_SET(it->hSocket, &fdsetSend);
+            FD_SET(it->hSocket, &fdsetError);
+            hSocketMax = std::max(hSocketMax, it->hSocket);
+        }
+
+        int nSelect = select(vWatches.empty() ? 0 : hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        if (nSelect == SOCKET_ERROR) {
+            // Report every socket as readable, so a broken one shows up when it is received from
+            for (std::vector<CWatch>::const_iterator it = vWatches.begin(); it != vWatches.end(); ++it) {
+                CEvent event;
+                event.pData = it->pData;
+                event.nEvents = POLL_RECV;
+                vEvents.push_back(event);
+            }
+            vWatches.clear();
+            return false;
+        }
+
+        for (std::vector<CWatch>::const_iterator it = vWatches.begin(); nSelect > 0 && it != vWatches.end(); ++it) {
+            CEvent event;
+            event.pData = it->pData;
+            event.nEvents = 0;
+            if (FD_ISSET(it->hSocket, &fdsetRecv))
+                event.nEvents |= POLL_RECV;
+            if (FD_ISSET(it->hSocket, &fdsetSend))
+                event.nEvents |= POLL_SEND;
+            if (FD_ISSET(it->hSocket, &fdsetError))
+                event.nEvents |= POLL_ERROR;
+            if (event.nEvents)
+                vEvents.push_back(event);
+        }
+        vWatches.clear();
+        return true;
+    }
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+/** Edge-triggered, with no limit on descriptors */
+class CEpollPoller : public CSocketPoller
+{
+private:
+    //! how many events one Wait returns at most
+    static const int MAX_EVENTS = 1024;
+
+    int fdEpoll;
+    std::vector<struct epoll_event> vBuffer;
+
+public:
+    CEpollPoller() : fdEpoll(epoll_create1(EPOLL_CLOEXEC)), vBuffer(MAX_EVENTS) {}
+
+    ~CEpollPoller()
+    {
+        if (fdEpoll >= 0)
+            close(fdEpoll);
+    }
+
+    bool IsValid() const { return fdEpoll >= 0; }
+
+    const char* GetName() const { return "epoll"; }
+
+    bool IsEdgeTriggered() const { return true; }
+
+    bool CanWatch(SOCKET hSocket) const { return hSocket != INVALID_SOCKET; }
+
+    bool Watch(SOCKET hSocket, int nEvents, void* pData)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = pData;
+        if (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, hSocket, &ev) == 0)
+            return true;
+        return errno == EEXIST && epoll_ctl(fdEpoll, EPOLL_CTL_MOD, hSocket, &ev) == 0;
+    }
+
+    void Unwatch(SOCKET hSocket)
+    {
+        // kernels before 2.6.9 want an event even though it is ignored
+        struct epoll_event ev;
+        epoll_ctl(fdEpoll, EPOLL_CTL_DEL, hSocket, &ev);
+    }
+
+    bool Wait(int nTimeoutMillis, std::vector<CEvent>& vEvents)
+    {
+        int nEvents = epoll_wait(fdEpoll, &vBuffer[0], vBuffer.size(), nTimeoutMillis);
+        if (nEvents < 0)
+            return errno == EINTR;
+        for (int i = 0; i < nEvents; i++) {
+            CEvent event;
+            event.pData = vBuffer[i].data.ptr;
+            event.nEvents = 0;
+            // a peer that hung up is found out by receiving from it
+            if (vBuffer[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                event.nEvents |= POLL_RECV;
+            if (vBuffer[i].events & EPOLLOUT)
+                event.nEvents |= POLL_SEND;
+            if (vBuffer[i].events & (EPOLLHUP | EPOLLERR))
+                event.nEvents |= POLL_ERROR;
+            vEvents.push_back(event);
+        }
+        return true;
+    }
+};
+#endif
+}
+
+bool HaveEpoll()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return true;
+#else
+    return false;
+#endif
+}
+
+CSocketPoller* CreateSocketPoller(bool fEpoll)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (fEpoll) {
+        CEpollPoller* poller = new CEpollPoller();
+        if (poller->IsValid())
+            return poller;
+        LogPrintf("%s : epoll_create1 failed: %s; falling back to select\n", __func__, strerror(errno));
+        delete poller;
+    }
+#endif
+    return new CSelectPoller();
+}
@@ -0,0 +1,64 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NETPOLL_H
+#define BITCOIN_NETPOLL_H
+
+#if defined(HAVE_CONFIG_H)
+#include "config/stakecubecoin-config.h"
+#endif
+
+#include "compat.h"
+
+#include <vector>
+
+/** Waits until sockets can be received from or sent to */
+class CSocketPoller
+{
+public:
+    static const int POLL_RECV = 1;
+    static const int POLL_SEND = 2;
+    static const int POLL_ERROR = 4;
+
+    struct CEvent {
+        //! what the socket was watched with
+        void* pData;
+        int nEvents;
+    };
+
+    virtual ~CSocketPoller() {}
+
+    virtual const char* GetName() const = 0;
+
+    /** An edge-triggered poller watches a socket from the first Watch until it is
+     *  unwatched, for receiving and sending alike. It reports a socket when it
+     *  becomes ready, not for as long as it is, so the caller has to receive or
+     *  send until that would block, or remember that it didn't. A level-triggered
+     *  poller forgets its sockets after every Wait, and reports each of them for
+     *  as long as it is ready. */
+    virtual bool IsEdgeTriggered() const = 0;
+
+    /** Whether hSocket can be watched at all */
+    virtual bool CanWatch(SOCKET hSocket) const = 0;
+
+    /** Watch hSocket for nEvents, to be reported with pData. Edge-triggered pollers
+     *  can be told from any thread, level-triggered ones only from the one waiting. */
+    virtual bool Watch(SOCKET hSocket, int nEvents, void* pData) = 0;
+
+    /** Stop watching hSocket, before it is closed. A socket that is still open in
+     *  a child process would go on being reported otherwise. */
+    virtual void Unwatch(SOCKET hSocket) = 0;
+
+    /** Wait up to nTimeoutMillis for watched sockets to be ready, appending them
+     *  to vEvents; false on error */
+    virtual bool Wait(int nTimeoutMillis, std::vector<CEvent>& vEvents) = 0;
+};
+
+/** Whether this system has epoll */
+bool HaveEpoll();
+
+/** Create an epoll poller if fEpoll and the system has epoll, a select() one otherwise */
+CSocketPoller* CreateSocketPoller(bool fEpoll);
+
+#endif // BITCOIN_NETPOLL_H
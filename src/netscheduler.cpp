@@ -0,0 +1,162 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netscheduler.h"
+
+#include "protocol.h"
+
+#include <algorithm>
+
+const int CLatencyHistogram::BUCKETS;
+const std::string CMessageStats::COMMAND_OTHER = "*other*";
+
+CMessageStats messageStats;
+
+MessageLane GetMessageLane(const std::string& strCommand)
+{
+    static const char* vMasternodeCommands[] = {
+        NetMsgType::MNW, NetMsgType::MPROP, NetMsgType::MVOTE, NetMsgType::FBS, NetMsgType::FBVOTE,
+        NetMsgType::MNB, NetMsgType::MNP, NetMsgType::MNGET, NetMsgType::MNVS, NetMsgType::DSEEP,
+        NetMsgType::DSEE, NetMsgType::DSEG, NetMsgType::SSC, NetMsgType::SPORK, NetMsgType::GETSPORKS,
+        NetMsgType::GETSPORK};
+    for (const char* pszCommand : vMasternodeCommands) {
+        if (strCommand == pszCommand)
+            return LANE_MASTERNODE;
+    }
+    return LANE_GENERAL;
+}
+
+const char* GetMessageLaneName(MessageLane lane)
+{
+    switch (lane) {
+    case LANE_GENERAL:
+        return "general";
+    case LANE_MASTERNODE:
+        return "masternode";
+    default:
+        return "unknown";
+    }
+}
+
+void CPeerScheduler::Schedule(NodeId id)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<NodeId, bool>::iterator it = mapRunning.find(id);
+    if (it != mapRunning.end()) {
+        it->second = true;
+        return;
+    }
+    if (setReady.insert(id).second) {
+        queueReady.push_back(id);
+        cond.notify_one();
+    }
+}
+
+bool CPeerScheduler::Take(NodeId& id)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!fStop && queueReady.empty())
+        cond.wait(lock);
+    if (fStop)
+        return false;
+    id = queueReady.front();
+    queueReady.pop_front();
+    setReady.erase(id);
+    mapRunning[id] = false;
+    return true;
+}
+
+void CPeerScheduler::Done(NodeId id, bool fMore)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<NodeId, bool>::iterator it = mapRunning.find(id);
+    if (it == mapRunning.end())
+        return;
+    fMore |= it->second;
+    mapRunning.erase(it);
+    if (fMore && setReady.insert(id).second) {
+        queueReady.push_back(id);
+        cond.notify_one();
+    }
+}
+
+void CPeerScheduler::Stop()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fStop = true;
+    cond.notify_all();
+}
+
+size_t CPeerScheduler::GetReadyCount()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return queueReady.size();
+}
+
+CLatencyHistogram::CLatencyHistogram() : nCount(0), nTotalMicros(0), nMaxMicros(0)
+{
+    std::fill(vCount, vCount + BUCKETS, 0);
+}
+
+int CLatencyHistogram::GetBucket(int64_t nMicros)
+{
+    int n = 0;
+    while (nMicros > 0 && n < BUCKETS - 1) {
+        nMicros >>= 1;
+        n++;
+    }
+    return n;
+}
+
+int64_t CLatencyHistogram::GetBucketEnd(int n)
+{
+    return (int64_t)1 << n;
+}
+
+void CLatencyHistogram::Add(int64_t nMicros)
+{
+    // the clock may step back
+    nMicros = std::max(nMicros, (int64_t)0);
+    vCount[GetBucket(nMicros)]++;
+    nCount++;
+    nTotalMicros += nMicros;
+    nMaxMicros = std::max(nMaxMicros, nMicros);
+}
+
+int64_t CLatencyHistogram::GetPercentile(double dFraction) const
+{
+    uint64_t nSeen = 0;
+    for (int n = 0; n < BUCKETS - 1; n++) {
+        nSeen += vCount[n];
+        if (nSeen > 0 && nSeen >= dFraction * nCount)
+            return std::min(GetBucketEnd(n), nMaxMicros);
+    }
+    return nMaxMicros;
+}
+
+void CMessageStats::Record(const std::string& strCommand, MessageLane lane, int64_t nWaitMicros, int64_t nProcessMicros)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    // filled here rather than on construction, which may come before that of the list
+    if (setKnownCommands.empty()) {
+        const std::vector<std::string>& vCommands = getAllNetMessageTypes();
+        setKnownCommands.insert(vCommands.begin(), vCommands.end());
+    }
+    CMessageCommandStats& stats = mapCommands[setKnownCommands.count(strCommand) ? strCommand : COMMAND_OTHER];
+    stats.lane = lane;
+    stats.histWait.Add(nWaitMicros);
+    stats.histProcess.Add(nProcessMicros);
+}
+
+std::map<std::string, CMessageCommandStats> CMessageStats::GetStats()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return mapCommands;
+}
+
+void CMessageStats::Clear()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    mapCommands.clear();
+}
@@ -0,0 +1,128 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NETSCHEDULER_H
+#define BITCOIN_NETSCHEDULER_H
+
+#include "net.h"
+
+#include <deque>
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <string>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** -msgthreads default: threads processing block, transaction and other general messages */
+static const int DEFAULT_MESSAGE_THREADS = 2;
+static const int MAX_MESSAGE_THREADS = 16;
+
+/** The lanes messages are processed in. Masternode, budget and spork messages
+ *  have a lane and a thread of their own, so a flood of them can't hold up
+ *  block and transaction relay. */
+enum MessageLane {
+    LANE_GENERAL = 0,
+    LANE_MASTERNODE,
+
+    LANE_MAX
+};
+
+MessageLane GetMessageLane(const std::string& strCommand);
+const char* GetMessageLaneName(MessageLane lane);
+
+/** Hands out peers with work to do to a pool of threads. A peer is given to one
+ *  thread at a time, so its messages are still processed in the order they
+ *  arrived, and ready peers take turns in the order they became ready. */
+class CPeerScheduler
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<NodeId> queueReady;
+    //! the peers in queueReady
+    std::set<NodeId> setReady;
+    //! peers a thread is working on, and whether they were scheduled again meanwhile
+    std::map<NodeId, bool> mapRunning;
+    bool fStop;
+
+public:
+    CPeerScheduler() : fStop(false) {}
+
+    /** Queue a peer unless it's queued already. A peer a thread is working on
+     *  is queued again once the thread is done with it. */
+    void Schedule(NodeId id);
+
+    /** Wait for a peer to work on; false once stopped */
+    bool Take(NodeId& id);
+
+    /** Done with a peer taken before; fMore queues it again behind the peers
+     *  that are ready already */
+    void Done(NodeId id, bool fMore);
+
+    /** Make Take return false, now and from then on */
+    void Stop();
+
+    size_t GetReadyCount();
+};
+
+/** Counts durations in buckets that double in width. Bucket 0 holds those under
+ *  a microsecond, bucket n those from 2^(n-1) up to 2^n microseconds, and the
+ *  last one everything longer. */
+class CLatencyHistogram
+{
+public:
+    static const int BUCKETS = 28;
+
+    uint64_t vCount[BUCKETS];
+    uint64_t nCount;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+
+    CLatencyHistogram();
+
+    void Add(int64_t nMicros);
+
+    static int GetBucket(int64_t nMicros);
+    //! the duration bucket n ends at, in microseconds; the last one has no end
+    static int64_t GetBucketEnd(int n);
+
+    /** The end of the bucket that a fraction dFraction of the durations fall
+     *  into or below, or nMaxMicros if that's the last one */
+    int64_t GetPercentile(double dFraction) const;
+};
+
+struct CMessageCommandStats {
+    MessageLane lane;
+    //! from when a message was received until it was processed
+    CLatencyHistogram histWait;
+    //! time spent processing it
+    CLatencyHistogram histProcess;
+
+    CMessageCommandStats() : lane(LANE_GENERAL) {}
+};
+
+/** Latencies of processing messages, by command. Unknown commands are counted
+ *  together, so peers can't make the table grow. */
+class CMessageStats
+{
+private:
+    boost::mutex mutex;
+    std::set<std::string> setKnownCommands;
+    std::map<std::string, CMessageCommandStats> mapCommands;
+
+public:
+    static const std::string COMMAND_OTHER;
+
+    void Record(const std::string& strCommand, MessageLane lane, int64_t nWaitMicros, int64_t nProcessMicros);
+
+    std::map<std::string, CMessageCommandStats> GetStats();
+
+    void Clear();
+};
+
+extern CMessageStats messageStats;
+
+#endif // BITCOIN_NETSCHEDULER_H
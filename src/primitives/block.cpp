@@ -14,9 +14,109 @@
 #include "utilstrencodings.h"
 #include "util.h"
 
+#include <atomic>
+
+static std::atomic<uint64_t> nHashCacheHits(0);
+
+namespace
+{
+/** Holds a header's hash cache lock; it is only ever held to copy the cache, so it spins. */
+class CHashCacheLock
+{
+    std::atomic_flag& flag;
+
+public:
+    explicit CHashCacheLock(std::atomic_flag& flagIn) : flag(flagIn)
+    {
+        while (flag.test_and_set(std::memory_order_acquire)) {
+        }
+    }
+    ~CHashCacheLock() { flag.clear(std::memory_order_release); }
+};
+}
+
+CBlockHeader& CBlockHeader::operator=(const CBlockHeader& other)
+{
+    if (this == &other)
+        return *this;
+    nVersion = other.nVersion;
+    hashPrevBlock = other.hashPrevBlock;
+    hashMerkleRoot = other.hashMerkleRoot;
+    nTime = other.nTime;
+    nBits = other.nBits;
+    nNonce = other.nNonce;
+
+    // Take the cache over one lock at a time, so two headers copied into each
+    // other from different threads can't deadlock
+    bool fCached;
+    uint256 hash;
+    unsigned char vchHeader[HEADER_SIZE];
+    {
+        CHashCacheLock lock(other.fHashCacheLock);
+        fCached = other.fHashCached;
+        if (fCached) {
+            hash = other.hashCached;
+            memcpy(vchHeader, other.vchHashedHeader, HEADER_SIZE);
+        }
+    }
+    if (fCached) {
+        StoreHash(vchHeader, hash);
+    } else {
+        CHashCacheLock lock(fHashCacheLock);
+        fHashCached = false;
+    }
+    return *this;
+}
+
+void CBlockHeader::StoreHash(const unsigned char* pheader, const uint256& hash) const
+{
+    CHashCacheLock lock(fHashCacheLock);
+    memcpy(vchHashedHeader, pheader, HEADER_SIZE);
+    hashCached = hash;
+    fHashCached = true;
+}
+
 uint256 CBlockHeader::GetHash() const
 {
-    return HashQuark(BEGIN(nVersion), END(nNonce));
+    // Hash a copy of the fields, so the cache records exactly the bytes hashed
+    unsigned char vchHeader[HEADER_SIZE];
+    memcpy(vchHeader, BEGIN(nVersion), HEADER_SIZE);
+    {
+        CHashCacheLock lock(fHashCacheLock);
+        if (fHashCached && memcmp(vchHashedHeader, vchHeader, HEADER_SIZE) == 0) {
+            nHashCacheHits++;
+            return hashCached;
+        }
+    }
+    const uint256 hash = HashQuark(vchHeader, vchHeader + HEADER_SIZE);
+    StoreHash(vchHeader, hash);
+    return hash;
+}
+
+void CBlockHeader::SetCachedHash(const uint256& hash) const
+{
+    StoreHash((const unsigned char*)BEGIN(nVersion), hash);
+}
+
+uint64_t CBlockHeader::GetHashCacheHits()
+{
+    return nHashCacheHits;
+}
+
+void CBlockHeader::GetHashes(const std::vector<CBlockHeader>& headers, std::vector<uint256>& hashes)
+{
+    hashes.resize(headers.size());
+    if (headers.empty())
+        return;
+
+    // GetHash() hashes the fields in place, so they must be laid out back to back
+    assert(END(headers[0].nNonce) - BEGIN(headers[0].nVersion) == (ptrdiff_t)HEADER_SIZE);
+    std::vector<unsigned char> vData(headers.size() * HEADER_SIZE);
+    for (size_t i = 0; i < headers.size(); i++)
+        memcpy(&vData[i * HEADER_SIZE], BEGIN(headers[i].nVersion), HEADER_SIZE);
+    HashQuarkBatch(&vData[0], HEADER_SIZE, headers.size(), &hashes[0]);
+    for (size_t i = 0; i < headers.size(); i++)
+        headers[i].StoreHash(&vData[i * HEADER_SIZE], hashes[i]);
 }
 
 uint256 CBlock::BuildMerkleTree(bool* fMutated) const
@@ -12,6 +12,8 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <atomic>
+
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 static const unsigned int MAX_BLOCK_SIZE_CURRENT = 2000000;
 static const unsigned int MAX_BLOCK_SIZE_LEGACY = 1000000;
@@ -28,6 +30,7 @@ class CBlockHeader
 public:
     // header
     static const int32_t CURRENT_VERSION=4;
+    static const size_t HEADER_SIZE=80;
     int32_t nVersion;
     uint256 hashPrevBlock;
     uint256 hashMerkleRoot;
@@ -35,11 +38,32 @@ public:
     uint32_t nBits;
     uint32_t nNonce;
 
-    CBlockHeader()
+private:
+    // memory only: the last hash computed and the header bytes it was computed
+    // from, so GetHash() notices direct writes to the public fields. Guarded by
+    // fHashCacheLock, as a block shared between threads is hashed from several.
+    mutable std::atomic_flag fHashCacheLock;
+    mutable bool fHashCached;
+    mutable uint256 hashCached;
+    mutable unsigned char vchHashedHeader[HEADER_SIZE];
+
+    void StoreHash(const unsigned char* pheader, const uint256& hash) const;
+
+public:
+    CBlockHeader() : fHashCached(false)
     {
+        fHashCacheLock.clear();
         SetNull();
     }
 
+    CBlockHeader(const CBlockHeader& other) : fHashCached(false)
+    {
+        fHashCacheLock.clear();
+        *this = other;
+    }
+
+    CBlockHeader& operator=(const CBlockHeader& other);
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
@@ -70,6 +94,15 @@ public:
 
     uint256 GetHash() const;
 
+    /** Hash a run of headers in one batch; equivalent to calling GetHash() on each, and primes their caches. */
+    static void GetHashes(const std::vector<CBlockHeader>& headers, std::vector<uint256>& hashes);
+
+    /** Record a hash obtained elsewhere (e.g. from the block index) for the current header fields. */
+    void SetCachedHash(const uint256& hash) const;
+
+    /** Number of Quark evaluations GetHash() avoided by returning a cached hash. */
+    static uint64_t GetHashCacheHits();
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -122,14 +155,8 @@ public:
 
     CBlockHeader GetBlockHeader() const
     {
-        CBlockHeader block;
-        block.nVersion       = nVersion;
-        block.hashPrevBlock  = hashPrevBlock;
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.nNonce         = nNonce;
-        return block;
+        // Copies the header fields together with any cached hash
+        return CBlockHeader(*this);
     }
 
     // ppcoin: two types of block: proof-of-work or proof-of-stake
@@ -129,6 +129,7 @@ const static std::string allNetMessageTypes[] = {
     NetMsgType::GETBLOCKTXN,
     NetMsgType::BLOCKTXN
 };
+const static std::vector<std::string> allNetMessageTypesVec(allNetMessageTypes, allNetMessageTypes + ARRAYLEN(allNetMessageTypes));
 
 static const char* ppszTypeName[] =
     {
@@ -148,7 +149,8 @@ static const char* ppszTypeName[] =
         "mn quorum",
         "mn announce",
         "mn ping",
-        "dstx"};
+        "dstx",
+        "compact block"};
 
 CMessageHeader::CMessageHeader()
 {
@@ -273,3 +275,8 @@ std::string CInv::ToString() const
 {
     return strprintf("%s %s", GetCommand(), hash.ToString());
 }
+
+const std::vector<std::string>& getAllNetMessageTypes()
+{
+    return allNetMessageTypesVec;
+}
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #define MESSAGE_START_SIZE 4
 
@@ -259,6 +260,9 @@ extern const char *GETBLOCKTXN;
 extern const char *BLOCKTXN;
 };
 
+/* Get a vector of all valid message types (see above) */
+const std::vector<std::string>& getAllNetMessageTypes();
+
 
 /** Message header.
  * (4) message start.
@@ -415,11 +419,13 @@ enum GetDataMsg {
     MSG_MASTERNODE_ANNOUNCE,
     MSG_MASTERNODE_PING,
     MSG_DSTX,
+    //! only in getdata: ask for a block as a cmpctblock message
+    MSG_CMPCT_BLOCK,
     MSG_WITNESS_BLOCK = MSG_BLOCK | MSG_WITNESS_FLAG,
     MSG_WITNESS_TX = MSG_TX | MSG_WITNESS_FLAG,
     MSG_FILTERED_WITNESS_BLOCK = MSG_FILTERED_BLOCK | MSG_WITNESS_FLAG,
 };
 
-const int MSG_TYPE_MAX = MSG_DSTX;
+const int MSG_TYPE_MAX = MSG_CMPCT_BLOCK;
 
 #endif // BITCOIN_PROTOCOL_H
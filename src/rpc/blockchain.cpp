@@ -7,6 +7,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "base58.h"
+#include "blockstorage.h"
 #include "checkpoints.h"
 #include "clientversion.h"
 #include "consensus/validation.h"
@@ -322,6 +323,13 @@ UniValue getblock(const UniValue& params, bool fHelp)
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
+    if (!fVerbose) {
+        // Hand out the stored bytes unless witness data has to be stripped from them
+        CBlockSpan span;
+        if (ReadRawBlockFromDisk(span, pblockindex, !(RPCSerializationFlags() & SERIALIZE_TRANSACTION_NO_WITNESS)))
+            return HexStr(span.begin(), span.end());
+    }
+
     if (!ReadBlockFromDisk(block, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -425,6 +433,61 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue getcoincacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcoincacheinfo\n"
+            "\nReturns counters of the in-memory coins cache and of the writes to the coin database,\n"
+            "to help tuning -dbcache. Counters start at zero when the node starts.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"entries\": n,             (numeric) The number of transaction outputs in the cache\n"
+            "  \"usage\": n,               (numeric) The memory used by the cache, in bytes\n"
+            "  \"pending_usage\": n,       (numeric) The memory used by the batch being written, in bytes\n"
+            "  \"limit\": n,               (numeric) The memory the cache and the batch being written may use, in bytes\n"
+            "  \"hits\": n,                (numeric) Lookups answered by the cache\n"
+            "  \"misses\": n,              (numeric) Lookups passed on to the coin database\n"
+            "  \"hitrate\": x.xxx,         (numeric) hits / (hits + misses)\n"
+            "  \"evicted\": n,             (numeric) Unmodified entries evicted to stay under the limit\n"
+            "  \"writing\": true|false,    (boolean) Whether a write to the coin database is in progress\n"
+            "  \"writes\": n,              (numeric) The number of batches written to the coin database\n"
+            "  \"written_txouts\": n,      (numeric) The number of transaction outputs written or erased\n"
+            "  \"written_bytes\": n,       (numeric) The approximate size of the batches written, in bytes\n"
+            "  \"last_write_ms\": n,       (numeric) How long the last write took\n"
+            "  \"max_write_ms\": n,        (numeric) How long the slowest write took\n"
+            "  \"total_write_ms\": n,      (numeric) How long all writes took\n"
+            "  \"write_wait_ms\": n        (numeric) How long validation waited for a previous write to finish\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getcoincacheinfo", "") + HelpExampleRpc("getcoincacheinfo", ""));
+
+    LOCK(cs_main);
+
+    UniValue ret(UniValue::VOBJ);
+    const CCoinsCacheCounters& counters = pcoinsTip->GetCounters();
+    uint64_t nLookups = counters.nHits + counters.nMisses;
+    ret.push_back(make_pair("entries", (int64_t)pcoinsTip->GetCacheSize()));
+    ret.push_back(make_pair("usage", (int64_t)pcoinsTip->DynamicMemoryUsage()));
+    ret.push_back(make_pair("pending_usage", (int64_t)pcoinsdbview->PendingMemoryUsage()));
+    ret.push_back(make_pair("limit", (int64_t)nCoinCacheUsage));
+    ret.push_back(make_pair("hits", (int64_t)counters.nHits));
+    ret.push_back(make_pair("misses", (int64_t)counters.nMisses));
+    ret.push_back(make_pair("hitrate", nLookups ? (double)counters.nHits / nLookups : 0.0));
+    ret.push_back(make_pair("evicted", (int64_t)counters.nEvicted));
+
+    CCoinsDBWriteStats writeStats = pcoinsdbview->GetWriteStats();
+    ret.push_back(make_pair("writing", pcoinsdbview->IsWriting()));
+    ret.push_back(make_pair("writes", (int64_t)writeStats.nBatches));
+    ret.push_back(make_pair("written_txouts", (int64_t)writeStats.nEntries));
+    ret.push_back(make_pair("written_bytes", (int64_t)writeStats.nBytes));
+    ret.push_back(make_pair("last_write_ms", writeStats.nLastMicros / 1000));
+    ret.push_back(make_pair("max_write_ms", writeStats.nMaxMicros / 1000));
+    ret.push_back(make_pair("total_write_ms", writeStats.nTotalMicros / 1000));
+    ret.push_back(make_pair("write_wait_ms", writeStats.nWaitMicros / 1000));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -450,8 +513,8 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
+            "  \"coinstake\" : true|false  (boolean) Coinstake or not\n"
             "}\n"
 
             "\nExamples:\n"
@@ -471,33 +534,34 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out))
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n < 0 || (unsigned int)n >= coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex* pindex = it->second;
     ret.push_back(make_pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(make_pair("confirmations", 0));
     else
-        ret.push_back(make_pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(make_pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(make_pair("confirmations", pindex->nHeight - (int)coin.nHeight + 1));
+    ret.push_back(make_pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(make_pair("scriptPubKey", o));
-    ret.push_back(make_pair("version", coins.nVersion));
-    ret.push_back(make_pair("coinbase", coins.fCoinBase));
+    ret.push_back(make_pair("coinbase", (bool)coin.fCoinBase));
+    ret.push_back(make_pair("coinstake", (bool)coin.fCoinStake));
 
     return ret;
 }
@@ -515,6 +579,7 @@ UniValue verifychain(const UniValue& params, bool fHelp)
             "\nExamples:\n" +
             HelpExampleCli("verifychain", "") + HelpExampleRpc("verifychain", ""));
 
+    // The chain stays put for the whole check; VerifyDB's workers never take cs_main
     LOCK(cs_main);
 
     int nCheckLevel = 4;
@@ -544,7 +609,8 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
-            "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"chainwork\": \"xxxx\",    (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"hashcachehits\": xxxxxx,  (numeric) block hash computations avoided by the header hash cache\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getblockchaininfo", "") + HelpExampleRpc("getblockchaininfo", ""));
@@ -559,6 +625,7 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(make_pair("difficulty",           (double)GetDifficulty()));
     obj.push_back(make_pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(make_pair("chainwork",            chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(make_pair("hashcachehits",        CBlockHeader::GetHashCacheHits()));
     return obj;
 }
 
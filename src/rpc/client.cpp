@@ -31,6 +31,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"stop", 0},
         {"setmocktime", 0},
         {"getaddednodeinfo", 0},
+        {"getmessagestats", 0},
         {"setgenerate", 0},
         {"setgenerate", 1},
         {"getnetworkhashps", 0},
@@ -826,8 +826,10 @@ UniValue getmasternodescores (const UniValue& params, bool fHelp)
     for (int nHeight = chainActive.Tip()->nHeight - nLast; nHeight < chainActive.Tip()->nHeight + 20; nHeight++) {
         uint256 nHigh = 0;
         CMasternode* pBestMasternode = NULL;
+        uint256 hashScore;
+        if (!GetBlockHash(hashScore, nHeight - 100)) continue;
         for (CMasternode& mn : vMasternodes) {
-            uint256 n = mn.CalculateScore(1, nHeight - 100);
+            uint256 n = mn.CalculateScore(hashScore);
             if (n > nHigh) {
                 nHigh = n;
                 pBestMasternode = &mn;
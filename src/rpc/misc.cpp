@@ -19,6 +19,7 @@
 #include "timedata.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
+#include "kernel.h"
 #include "wallet/wallet.h"
 #include "wallet/walletdb.h"
 #endif
@@ -623,6 +624,7 @@ UniValue getstakingstatus(const UniValue& params, bool fHelp)
             "  \"enoughcoins\": true|false,        (boolean) if available coins are greater than reserve balance\n"
             "  \"mnsync\": true|false,             (boolean) if masternode data is synced\n"
             "  \"staking status\": true|false,     (boolean) if the wallet is staking or not\n"
+            "  \"kernelhashrate\": n,              (numeric) kernels hashed per second by the last stake search\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getstakingstatus", "") + HelpExampleRpc("getstakingstatus", ""));
@@ -649,6 +651,7 @@ UniValue getstakingstatus(const UniValue& params, bool fHelp)
     else if (mapHashedBlocks.count(chainActive.Tip()->nHeight - 1) && nLastCoinStakeSearchInterval)
         nStaking = true;
     obj.push_back(make_pair("staking status", nStaking));
+    obj.push_back(make_pair("kernelhashrate", GetStakeKernelHashRate()));
 
     return obj;
 }
@@ -11,6 +11,7 @@
 #include "main.h"
 #include "net.h"
 #include "netbase.h"
+#include "netscheduler.h"
 #include "protocol.h"
 #include "sync.h"
 #include "timedata.h"
@@ -353,6 +354,75 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+static UniValue LatencyToJSON(const CLatencyHistogram& hist)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(make_pair("avg", hist.nCount ? hist.nTotalMicros / (int64_t)hist.nCount : 0));
+    obj.push_back(make_pair("p50", hist.GetPercentile(0.5)));
+    obj.push_back(make_pair("p99", hist.GetPercentile(0.99)));
+    obj.push_back(make_pair("max", hist.nMaxMicros));
+    UniValue buckets(UniValue::VOBJ);
+    for (int n = 0; n < CLatencyHistogram::BUCKETS; n++) {
+        if (!hist.vCount[n])
+            continue;
+        if (n < CLatencyHistogram::BUCKETS - 1)
+            buckets.push_back(make_pair(strprintf("<%d", CLatencyHistogram::GetBucketEnd(n)), hist.vCount[n]));
+        else
+            buckets.push_back(make_pair(strprintf(">=%d", CLatencyHistogram::GetBucketEnd(n - 1)), hist.vCount[n]));
+    }
+    obj.push_back(make_pair("histogram", buckets));
+    return obj;
+}
+
+UniValue getmessagestats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getmessagestats ( reset )\n"
+            "\nReturns how long messages from peers waited to be processed, and how long\n"
+            "processing them took, by command. Times are in microseconds.\n"
+            "\nArguments:\n"
+            "1. reset    (boolean, optional, default=false) Start counting anew afterwards\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {          (json object) A command that was received, or \"*other*\" for unknown ones\n"
+            "    \"lane\": \"xxxx\",     (string) The lane it is processed in, \"general\" or \"masternode\"\n"
+            "    \"count\": n,         (numeric) How many were processed\n"
+            "    \"wait\": {           (json object) Time from when one was received until it was processed\n"
+            "      \"avg\": n,         (numeric) The average\n"
+            "      \"p50\": n,         (numeric) The median, rounded up to the end of its histogram bucket\n"
+            "      \"p99\": n,         (numeric) The 99th percentile, likewise\n"
+            "      \"max\": n,         (numeric) The longest\n"
+            "      \"histogram\": {    (json object) How many took less than the given time, down to the bucket before\n"
+            "        \"<n\": n,\n"
+            "        ...\n"
+            "      }\n"
+            "    },\n"
+            "    \"process\": {        (json object) Time spent processing, as for wait\n"
+            "      ...\n"
+            "    }\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getmessagestats", "") + HelpExampleRpc("getmessagestats", ""));
+
+    std::map<std::string, CMessageCommandStats> mapStats = messageStats.GetStats();
+    if (params.size() > 0 && params[0].get_bool())
+        messageStats.Clear();
+
+    UniValue ret(UniValue::VOBJ);
+    for (const PAIRTYPE(const std::string, CMessageCommandStats) & item : mapStats) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(make_pair("lane", GetMessageLaneName(item.second.lane)));
+        obj.push_back(make_pair("count", item.second.histProcess.nCount));
+        obj.push_back(make_pair("wait", LatencyToJSON(item.second.histWait)));
+        obj.push_back(make_pair("process", LatencyToJSON(item.second.histProcess)));
+        ret.push_back(make_pair(item.first, obj));
+    }
+    return ret;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -10,81 +10,146 @@
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <algorithm>
+#include <limits>
+#include <string.h>
 
-namespace {
+const size_t CSignatureCache::BUCKET_SIZE;
+const size_t CSignatureCache::ENTRY_WORDS;
 
-/**
- * Valid signature cache, to avoid doing expensive ECDSA signature checking
- * twice for every transaction (once when accepted into memory pool, and
- * again when accepted into the block chain)
- */
-class CSignatureCache
+CSignatureCache::CSignatureCache(size_t nMaxBytes) : nBuckets(nMaxBytes / (BUCKET_SIZE * ENTRY_WORDS * sizeof(uint64_t))), nHits(0), nMisses(0), nInserts(0)
 {
-private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    // The salt fills the first SHA256 block, so every entry starts from the
+    // same midstate and the salt costs nothing per lookup
+    uint256 salt = GetRandHash();
+    hasherSalted.Write(salt.begin(), 32).Write(salt.begin(), 32);
+
+    // value-initialized, so every slot starts out empty (all zero)
+    if (nBuckets > 0)
+        table.reset(new std::atomic<uint64_t>[nBuckets * BUCKET_SIZE * ENTRY_WORDS]());
+}
+
+void CSignatureCache::ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
+{
+    CSHA256 hasher(hasherSalted);
+    hasher.Write(hash.begin(), 32).Write(pubkey.begin(), pubkey.size());
+    if (!vchSig.empty())
+        hasher.Write(&vchSig[0], vchSig.size());
+    hasher.Finalize(entry.begin());
+}
+
+void CSignatureCache::GetBuckets(const uint256& entry, size_t& nBucket1, size_t& nBucket2) const
+{
+    // the entry is uniformly distributed, so any of its bits make good indexes
+    uint32_t n1, n2;
+    memcpy(&n1, entry.begin(), 4);
+    memcpy(&n2, entry.begin() + 4, 4);
+    nBucket1 = ((uint64_t)n1 * nBuckets) >> 32;
+    nBucket2 = ((uint64_t)n2 * nBuckets) >> 32;
+}
+
+bool CSignatureCache::Matches(size_t nSlot, const uint64_t* pwords) const
+{
+    for (size_t i = 0; i < ENTRY_WORDS; i++) {
+        if (table[nSlot * ENTRY_WORDS + i].load(std::memory_order_relaxed) != pwords[i])
+            return false;
     }
+    return true;
+}
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+bool CSignatureCache::Get(const uint256& entry) const
+{
+    if (nBuckets > 0) {
+        uint64_t words[ENTRY_WORDS];
+        memcpy(words, entry.begin(), sizeof(words));
+        size_t nBucket1, nBucket2;
+        GetBuckets(entry, nBucket1, nBucket2);
+        for (size_t i = 0; i < BUCKET_SIZE; i++) {
+            if (Matches(nBucket1 * BUCKET_SIZE + i, words) || Matches(nBucket2 * BUCKET_SIZE + i, words)) {
+                nHits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
         }
+    }
+    nMisses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+void CSignatureCache::Set(const uint256& entry)
+{
+    if (nBuckets == 0)
+        return;
+    uint64_t words[ENTRY_WORDS];
+    memcpy(words, entry.begin(), sizeof(words));
+    size_t nBucket1, nBucket2;
+    GetBuckets(entry, nBucket1, nBucket2);
+
+    // Take the first empty slot of either bucket. With both full, overwrite one
+    // picked by bits of the entry that aren't used for the buckets, so an
+    // attacker can't tell which entry goes.
+    size_t nSlot = (words[1] % 2 ? nBucket2 : nBucket1) * BUCKET_SIZE + (words[1] >> 1) % BUCKET_SIZE;
+    for (size_t i = 0; i < 2 * BUCKET_SIZE; i++) {
+        size_t n = (i < BUCKET_SIZE ? nBucket1 : nBucket2) * BUCKET_SIZE + i % BUCKET_SIZE;
+        if (Matches(n, words))
+            return;
+        if (table[n * ENTRY_WORDS].load(std::memory_order_relaxed) == 0) {
+            nSlot = n;
+            break;
+        }
     }
-};
+    for (size_t i = 0; i < ENTRY_WORDS; i++)
+        table[nSlot * ENTRY_WORDS + i].store(words[i], std::memory_order_relaxed);
+    nInserts.fetch_add(1, std::memory_order_relaxed);
+}
+
+CSignatureCacheStats CSignatureCache::GetStats() const
+{
+    CSignatureCacheStats stats;
+    stats.nHits = nHits.load(std::memory_order_relaxed);
+    stats.nMisses = nMisses.load(std::memory_order_relaxed);
+    stats.nInserts = nInserts.load(std::memory_order_relaxed);
+    stats.nCapacity = nBuckets * BUCKET_SIZE;
+    stats.nBytes = stats.nCapacity * ENTRY_WORDS * sizeof(uint64_t);
+    return stats;
+}
 
+// -sigcachesize is in megabytes. Without it, the deprecated -maxsigcachesize still
+// counts entries, as it always has. 0 turns the cache off.
+static size_t GetSignatureCacheBytes()
+{
+    static const int64_t nEntryBytes = CSignatureCache::ENTRY_WORDS * sizeof(uint64_t);
+    uint64_t nBytes;
+    if (mapArgs.count("-sigcachesize") || !mapArgs.count("-maxsigcachesize"))
+        nBytes = (uint64_t)std::max((int64_t)0, std::min(GetArg("-sigcachesize", DEFAULT_SIG_CACHE_SIZE), MAX_SIG_CACHE_SIZE)) << 20;
+    else
+        nBytes = (uint64_t)std::max((int64_t)0, std::min(GetArg("-maxsigcachesize", 0), (MAX_SIG_CACHE_SIZE << 20) / nEntryBytes)) * nEntryBytes;
+    return std::min(nBytes, (uint64_t)std::numeric_limits<size_t>::max() / 2);
+}
+
+static CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache(GetSignatureCacheBytes());
+    return signatureCache;
+}
+
+CSignatureCacheStats GetSignatureCacheStats()
+{
+    return GetSignatureCache().GetStats();
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
+    if (signatureCache.Get(entry))
         return true;
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
 
     if (store)
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
     return true;
 }
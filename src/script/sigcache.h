@@ -6,19 +6,95 @@
 #ifndef BITCOIN_SCRIPT_SIGCACHE_H
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
+#include "crypto/sha256.h"
 #include "script/interpreter.h"
 
+#include <atomic>
+#include <stdint.h>
 #include <vector>
 
+#include <boost/scoped_array.hpp>
+
+/** -sigcachesize default, in megabytes */
+static const int64_t DEFAULT_SIG_CACHE_SIZE = 32;
+/** Largest -sigcachesize accepted, in megabytes */
+static const int64_t MAX_SIG_CACHE_SIZE = 16384;
+
 class CPubKey;
 
+struct CSignatureCacheStats {
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    //! how many entries the table holds at most, and the memory it takes
+    size_t nCapacity;
+    size_t nBytes;
+
+    CSignatureCacheStats() : nHits(0), nMisses(0), nInserts(0), nCapacity(0), nBytes(0) {}
+};
+
+/**
+ * Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain)
+ *
+ * An entry is a salted hash of (signature hash, public key, signature), so it
+ * takes 32 bytes whatever the signature, and nobody who doesn't know the salt
+ * can aim entries at a part of the table. The table has a fixed size. Each
+ * entry can live in one of two buckets of BUCKET_SIZE slots; when both are
+ * full, a slot picked by the entry's hash is overwritten, which evicts a
+ * random entry as far as an attacker can tell.
+ *
+ * Slots are read and written word by word with atomic operations and no lock.
+ * A lookup that races with an insert into the same slot may miss, which only
+ * costs a signature check. It can't find an entry that isn't there, as a slot
+ * caught halfway through being overwritten matches neither the old nor the new
+ * entry, let alone another one.
+ */
+class CSignatureCache
+{
+public:
+    static const size_t BUCKET_SIZE = 4;
+    static const size_t ENTRY_WORDS = 4;
+
+private:
+    //! salted hasher that the entries are computed with
+    CSHA256 hasherSalted;
+    size_t nBuckets;
+    boost::scoped_array<std::atomic<uint64_t> > table;
+    mutable std::atomic<uint64_t> nHits;
+    mutable std::atomic<uint64_t> nMisses;
+    std::atomic<uint64_t> nInserts;
+
+    CSignatureCache(const CSignatureCache&);
+    void operator=(const CSignatureCache&);
+
+    void GetBuckets(const uint256& entry, size_t& nBucket1, size_t& nBucket2) const;
+    bool Matches(size_t nSlot, const uint64_t* pwords) const;
+
+public:
+    /** A cache that takes at most nMaxBytes of memory */
+    explicit CSignatureCache(size_t nMaxBytes);
+
+    void ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const;
+
+    bool Get(const uint256& entry) const;
+
+    void Set(const uint256& entry);
+
+    CSignatureCacheStats GetStats() const;
+};
+
+/** The counters of the cache shared by CachingTransactionSignatureCheckers */
+CSignatureCacheStats GetSignatureCacheStats();
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
     bool store;
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amount, bool storeIn) : TransactionSignatureChecker(txToIn, nInIn, amount), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amount, bool storeIn, const PrecomputedTransactionData& txdataIn) : TransactionSignatureChecker(txToIn, nInIn, amount, txdataIn), store(storeIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
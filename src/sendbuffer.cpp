@@ -0,0 +1,97 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sendbuffer.h"
+
+#include "hash.h"
+
+#include <assert.h>
+#include <string.h>
+
+const size_t CSendBufferCache::DEFAULT_MAX_BYTES;
+
+CSendBufferCache sendBufferCache;
+
+CSendBuffer FinishSendBuffer(CDataStream& ss)
+{
+    assert(ss.size() >= CMessageHeader::HEADER_SIZE);
+
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    boost::shared_ptr<CSerializeData> data(new CSerializeData());
+    ss.GetAndClear(*data);
+    return data;
+}
+
+bool CSendBufferCache::Get(const CInv& inv, CSendBuffer& msg)
+{
+    LOCK(cs);
+    std::map<CInv, list_type::iterator>::iterator it = mapEntries.find(inv);
+    if (it == mapEntries.end()) {
+        nMisses++;
+        return false;
+    }
+    nHits++;
+    listEntries.splice(listEntries.begin(), listEntries, it->second);
+    msg = it->second->second;
+    return true;
+}
+
+void CSendBufferCache::Put(const CInv& inv, const CSendBuffer& msg)
+{
+    if (!msg || msg->size() > nMaxBytes)
+        return;
+
+    LOCK(cs);
+    std::map<CInv, list_type::iterator>::iterator it = mapEntries.find(inv);
+    if (it != mapEntries.end()) {
+        nBytes -= it->second->second->size();
+        listEntries.erase(it->second);
+        mapEntries.erase(it);
+    }
+    listEntries.push_front(std::make_pair(inv, msg));
+    mapEntries[inv] = listEntries.begin();
+    nBytes += msg->size();
+
+    while (nBytes > nMaxBytes) {
+        nBytes -= listEntries.back().second->size();
+        mapEntries.erase(listEntries.back().first);
+        listEntries.pop_back();
+    }
+}
+
+void CSendBufferCache::Clear()
+{
+    LOCK(cs);
+    listEntries.clear();
+    mapEntries.clear();
+    nBytes = 0;
+}
+
+size_t CSendBufferCache::size() const
+{
+    LOCK(cs);
+    return mapEntries.size();
+}
+
+size_t CSendBufferCache::GetBytes() const
+{
+    LOCK(cs);
+    return nBytes;
+}
+
+void CSendBufferCache::GetCounters(uint64_t& nHitsOut, uint64_t& nMissesOut) const
+{
+    LOCK(cs);
+    nHitsOut = nHits;
+    nMissesOut = nMisses;
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SENDBUFFER_H
+#define BITCOIN_SENDBUFFER_H
+
+#include "protocol.h"
+#include "streams.h"
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <utility>
+
+#include <boost/shared_ptr.hpp>
+
+class CSendBufferCache;
+
+extern CSendBufferCache sendBufferCache;
+
+/** A message as it goes on the wire: the header, with the payload's size and
+ *  checksum filled in, followed by the payload. It is never changed once made,
+ *  so the send queues of any number of peers can share it. */
+typedef boost::shared_ptr<const CSerializeData> CSendBuffer;
+
+/** Turn a stream holding a message header and the payload behind it into a
+ *  send buffer, filling in the size and checksum. The stream is left empty. */
+CSendBuffer FinishSendBuffer(CDataStream& ss);
+
+/** Serialize a message once, for any number of peers to be sent. nVersion is
+ *  the send version of the peers it is for. */
+template <typename T>
+CSendBuffer MakeSendBuffer(const char* pszCommand, int nType, int nVersion, const T& payload)
+{
+    CDataStream ss(nType, nVersion);
+    ss << CMessageHeader(pszCommand, 0) << payload;
+    return FinishSendBuffer(ss);
+}
+
+/** Keeps the messages most recently sent in reply to getdata, so one that many
+ *  peers ask for, as a new block or a relayed transaction or masternode ping
+ *  is, is serialized and checksummed only once. Only payloads that don't
+ *  depend on the peer's version belong here. */
+class CSendBufferCache
+{
+public:
+    static const size_t DEFAULT_MAX_BYTES = 16 * 1000 * 1000;
+
+private:
+    typedef std::list<std::pair<CInv, CSendBuffer> > list_type;
+
+    mutable CCriticalSection cs;
+    size_t nMaxBytes;
+    size_t nBytes;
+    //! most recently used first
+    list_type listEntries;
+    std::map<CInv, list_type::iterator> mapEntries;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+public:
+    explicit CSendBufferCache(size_t nMaxBytesIn = DEFAULT_MAX_BYTES) : nMaxBytes(nMaxBytesIn), nBytes(0), nHits(0), nMisses(0) {}
+
+    bool Get(const CInv& inv, CSendBuffer& msg);
+
+    /** Remember msg as the reply to inv, dropping the least recently used
+     *  messages to stay within the limit. One larger than that isn't kept. */
+    void Put(const CInv& inv, const CSendBuffer& msg);
+
+    void Clear();
+
+    size_t size() const;
+    size_t GetBytes() const;
+
+    //! How many lookups found a message, and how many didn't
+    void GetCounters(uint64_t& nHitsOut, uint64_t& nMissesOut) const;
+};
+
+#endif // BITCOIN_SENDBUFFER_H
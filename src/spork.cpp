@@ -24,6 +24,7 @@ class CSporkManager;
 
 CSporkManager sporkManager;
 
+CCriticalSection cs_mapSporks;
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
 
@@ -43,8 +44,11 @@ void LoadSporksFromDB()
         }
 
         // add spork to memory
-        mapSporks[spork.GetHash()] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        {
+            LOCK(cs_mapSporks);
+            mapSporks[spork.GetHash()] = spork;
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         std::time_t result = spork.nValue;
         // If SPORK Value is greater than 1,000,000 assume it's actually a Date and then convert to a more readable format
         if (spork.nValue > 1000000) {
@@ -68,44 +72,62 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         CSporkMessage spork;
         vRecv >> spork;
 
-        if (chainActive.Tip() == NULL) return;
+        int nHeight;
+        {
+            LOCK(cs_main);
+            if (chainActive.Tip() == NULL) return;
+            nHeight = chainActive.Height();
+        }
 
         // Ignore spork messages about unknown/deleted sporks
         std::string strSpork = sporkManager.GetSporkNameByID(spork.nSporkID);
         if (strSpork == "Unknown") return;
 
         uint256 hash = spork.GetHash();
-        if (mapSporksActive.count(spork.nSporkID)) {
-            if (mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned) {
-                if (fDebug) LogPrintf("spork - seen %s block %d \n", hash.ToString(), chainActive.Tip()->nHeight);
-                return;
-            } else {
-                if (fDebug) LogPrintf("spork - got updated spork %s block %d \n", hash.ToString(), chainActive.Tip()->nHeight);
+        {
+            LOCK(cs_mapSporks);
+            if (mapSporksActive.count(spork.nSporkID)) {
+                if (mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned) {
+                    if (fDebug) LogPrintf("spork - seen %s block %d \n", hash.ToString(), nHeight);
+                    return;
+                } else {
+                    if (fDebug) LogPrintf("spork - got updated spork %s block %d \n", hash.ToString(), nHeight);
+                }
             }
         }
 
-        LogPrintf("spork - new %s ID %d Time %d bestHeight %d\n", hash.ToString(), spork.nSporkID, spork.nValue, chainActive.Tip()->nHeight);
+        LogPrintf("spork - new %s ID %d Time %d bestHeight %d\n", hash.ToString(), spork.nSporkID, spork.nValue, nHeight);
 
         if (!sporkManager.CheckSignature(spork)) {
             LogPrintf("spork - invalid signature\n");
+            LOCK(cs_main);
             Misbehaving(pfrom->GetId(), 100);
             return;
         }
 
-        mapSporks[hash] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        {
+            LOCK(cs_mapSporks);
+            // another thread may have taken a newer one while the signature was checked
+            if (mapSporksActive.count(spork.nSporkID) && mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned)
+                return;
+            mapSporks[hash] = spork;
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         sporkManager.Relay(spork);
 
         // StakeCubeCoin: add to spork database.
         pSporkDB->WriteSpork(spork.nSporkID, spork);
     }
     if (strCommand == NetMsgType::GETSPORKS) {
-        std::map<int, CSporkMessage>::iterator it = mapSporksActive.begin();
-
-        while (it != mapSporksActive.end()) {
-            pfrom->PushMessage(NetMsgType::SPORK, it->second);
-            it++;
+        std::vector<CSporkMessage> vSporks;
+        {
+            LOCK(cs_mapSporks);
+            for (const std::pair<const int, CSporkMessage>& item : mapSporksActive)
+                vSporks.push_back(item.second);
         }
+
+        for (const CSporkMessage& spork : vSporks)
+            pfrom->PushMessage(NetMsgType::SPORK, spork);
     }
 }
 
@@ -115,6 +137,7 @@ int64_t GetSporkValue(int nSporkID)
 {
     int64_t r = -1;
 
+    LOCK(cs_mapSporks);
     if (mapSporksActive.count(nSporkID)) {
         r = mapSporksActive[nSporkID].nValue;
     } else {
@@ -238,6 +261,7 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
 
     if (Sign(msg)) {
         Relay(msg);
+        LOCK(cs_mapSporks);
         mapSporks[msg.GetHash()] = msg;
         mapSporksActive[nSporkID] = msg;
         return true;
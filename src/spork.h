@@ -63,6 +63,8 @@ using namespace boost;
 class CSporkMessage;
 class CSporkManager;
 
+/** Guards mapSporks and mapSporksActive, which the message handler threads share */
+extern CCriticalSection cs_mapSporks;
 extern std::map<uint256, CSporkMessage> mapSporks;
 extern std::map<int, CSporkMessage> mapSporksActive;
 extern CSporkManager sporkManager;
@@ -0,0 +1,406 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "chainparams.h"
+#include "main.h"
+#include "net.h"
+#include "pow.h"
+#include "protocol.h"
+#include "sendbuffer.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CTransaction BuildTransaction(int n, bool fWitness = false)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(uint256(1000 + n), n % 3);
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, n & 0xff) << std::vector<unsigned char>(33, 2);
+    tx.vout.push_back(CTxOut(n * CENT, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, n & 0xff) << OP_EQUALVERIFY << OP_CHECKSIG));
+    tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    if (fWitness) {
+        tx.wit.vtxinwit.resize(1);
+        tx.wit.vtxinwit[0].scriptWitness.stack.push_back(std::vector<unsigned char>(72, 0x30));
+    }
+    return CTransaction(tx);
+}
+
+/** A proof-of-stake block: coinbase, coinstake, nTx transactions and a block signature */
+static CBlock BuildStakeBlock(int nTx)
+{
+    CBlock block;
+    block.nVersion = 5;
+    block.hashPrevBlock = uint256(42);
+    block.nTime = 1600000000;
+    block.nBits = 0x1e0fffff;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << 1234 << OP_0;
+    coinbase.vout.push_back(CTxOut(0, CScript()));
+    block.vtx.push_back(CTransaction(coinbase));
+
+    CMutableTransaction coinstake;
+    coinstake.vin.resize(1);
+    coinstake.vin[0].prevout = COutPoint(uint256(7), 1);
+    coinstake.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30);
+    coinstake.vout.push_back(CTxOut(0, CScript()));
+    coinstake.vout.push_back(CTxOut(1000 * COIN, CScript() << std::vector<unsigned char>(33, 2) << OP_CHECKSIG));
+    coinstake.vout.push_back(CTxOut(10 * COIN, CScript() << OP_TRUE));
+    block.vtx.push_back(CTransaction(coinstake));
+
+    for (int i = 0; i < nTx; i++)
+        block.vtx.push_back(BuildTransaction(i, i % 4 == 0));
+    block.vchBlockSig.assign(71, 0x30);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    BOOST_REQUIRE(block.IsProofOfStake());
+    return block;
+}
+
+template <typename T>
+static T RoundTrip(const T& obj, size_t* pnBytes = NULL)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    if (pnBytes)
+        *pnBytes = ss.size();
+    T objOut;
+    ss >> objOut;
+    BOOST_CHECK(ss.empty());
+    return objOut;
+}
+
+static void AddToMempool(CTxMemPool& pool, const CTransaction& tx)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, 0, 0.0, 1));
+}
+
+static BlockTransactionsRequest GetMissing(const PartiallyDownloadedBlock& partialBlock, const uint256& hash)
+{
+    BlockTransactionsRequest req;
+    req.blockhash = hash;
+    for (size_t i = 0; i < partialBlock.GetTxCount(); i++) {
+        if (!partialBlock.IsTxAvailable(i))
+            req.indexes.push_back(i);
+    }
+    return req;
+}
+
+static BlockTransactions Answer(const CBlock& block, const BlockTransactionsRequest& req)
+{
+    BlockTransactions resp(req);
+    for (size_t i = 0; i < req.indexes.size(); i++)
+        resp.txn[i] = block.vtx[req.indexes[i]];
+    return resp;
+}
+
+BOOST_AUTO_TEST_CASE(stake_block_reconstruction)
+{
+    CBlock block = BuildStakeBlock(20);
+    CTxMemPool pool(CFeeRate(0));
+    // Every other transaction is in the mempool, and one with a different
+    // witness than the block has, which mustn't be taken for it
+    for (size_t i = 2; i < block.vtx.size(); i += 2) {
+        if (i != 6)
+            AddToMempool(pool, block.vtx[i]);
+    }
+    CMutableTransaction txMalleated(block.vtx[6]);
+    txMalleated.wit.vtxinwit[0].scriptWitness.stack[0][0] = 0x31;
+    BOOST_REQUIRE(CTransaction(txMalleated).GetHash() == block.vtx[6].GetHash());
+    AddToMempool(pool, CTransaction(txMalleated));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+    // the coinbase and the coinstake
+    BOOST_CHECK_EQUAL(cmpctblock.GetPrefilledCount(), 2U);
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblock.vchBlockSig == block.vchBlockSig);
+
+    // what the header is checked with before the block is put together
+    CBlock blockStart;
+    cmpctblock.GetBlockStart(blockStart);
+    BOOST_CHECK(blockStart.GetHash() == block.GetHash());
+    BOOST_REQUIRE_EQUAL(blockStart.vtx.size(), 2U);
+    BOOST_CHECK(blockStart.IsProofOfStake());
+    BOOST_CHECK(blockStart.vtx[1].GetHash() == block.vtx[1].GetHash());
+    BOOST_CHECK(blockStart.vchBlockSig == block.vchBlockSig);
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_REQUIRE_EQUAL(partialBlock.InitData(cmpctblock), READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 2U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 9U);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(3));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(6));
+
+    BlockTransactionsRequest req = RoundTrip(GetMissing(partialBlock, block.GetHash()));
+    BOOST_CHECK(req.blockhash == block.GetHash());
+    BOOST_REQUIRE_EQUAL(req.indexes.size(), 11U);
+    BOOST_CHECK_EQUAL(req.indexes[0], 3);
+    BOOST_CHECK_EQUAL(req.indexes[1], 5);
+    BOOST_CHECK_EQUAL(req.indexes[2], 6);
+    BlockTransactions resp = RoundTrip(Answer(block, req));
+
+    CBlock blockOut;
+    BOOST_REQUIRE_EQUAL(partialBlock.FillBlock(blockOut, resp.txn), READ_STATUS_OK);
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK(blockOut.hashMerkleRoot == block.BuildMerkleTree());
+    BOOST_CHECK(blockOut.IsProofOfStake());
+    BOOST_CHECK(blockOut.vchBlockSig == block.vchBlockSig);
+    BOOST_CHECK(blockOut.vtx[6].GetWitnessHash() == block.vtx[6].GetWitnessHash());
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION), ssBlockOut(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    ssBlockOut << blockOut;
+    BOOST_CHECK(ssBlock.str() == ssBlockOut.str());
+}
+
+BOOST_AUTO_TEST_CASE(block_from_mempool_alone)
+{
+    CBlock block = BuildStakeBlock(10);
+    CTxMemPool pool(CFeeRate(0));
+    for (size_t i = 2; i < block.vtx.size(); i++)
+        AddToMempool(pool, block.vtx[i]);
+    // unrelated transactions don't get in the way
+    for (int i = 100; i < 150; i++)
+        AddToMempool(pool, BuildTransaction(i));
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_REQUIRE_EQUAL(partialBlock.InitData(RoundTrip(CBlockHeaderAndShortTxIDs(block))), READ_STATUS_OK);
+    BOOST_CHECK(GetMissing(partialBlock, block.GetHash()).indexes.empty());
+    CBlock blockOut;
+    BOOST_REQUIRE_EQUAL(partialBlock.FillBlock(blockOut, std::vector<CTransaction>()), READ_STATUS_OK);
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK(blockOut.vchBlockSig == block.vchBlockSig);
+
+    // a proof-of-work block has only its coinbase sent in full
+    CBlock blockWork = block;
+    blockWork.vtx.erase(blockWork.vtx.begin() + 1);
+    blockWork.vchBlockSig.clear();
+    blockWork.hashMerkleRoot = blockWork.BuildMerkleTree();
+    CBlockHeaderAndShortTxIDs cmpctWork(blockWork);
+    BOOST_CHECK_EQUAL(cmpctWork.GetPrefilledCount(), 1U);
+    PartiallyDownloadedBlock partialWork(&pool);
+    BOOST_REQUIRE_EQUAL(partialWork.InitData(RoundTrip(cmpctWork)), READ_STATUS_OK);
+    BOOST_REQUIRE_EQUAL(partialWork.FillBlock(blockOut, std::vector<CTransaction>()), READ_STATUS_OK);
+    BOOST_CHECK(blockOut.GetHash() == blockWork.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(bad_block_transactions)
+{
+    CBlock block = BuildStakeBlock(6);
+    CTxMemPool pool(CFeeRate(0));
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+
+    // too few, and too many
+    PartiallyDownloadedBlock partialShort(&pool);
+    BOOST_REQUIRE_EQUAL(partialShort.InitData(cmpctblock), READ_STATUS_OK);
+    BlockTransactions resp = Answer(block, GetMissing(partialShort, block.GetHash()));
+    resp.txn.pop_back();
+    CBlock blockOut;
+    BOOST_CHECK_EQUAL(partialShort.FillBlock(blockOut, resp.txn), READ_STATUS_INVALID);
+    PartiallyDownloadedBlock partialLong(&pool);
+    BOOST_REQUIRE_EQUAL(partialLong.InitData(cmpctblock), READ_STATUS_OK);
+    resp = Answer(block, GetMissing(partialLong, block.GetHash()));
+    resp.txn.push_back(block.vtx[2]);
+    BOOST_CHECK_EQUAL(partialLong.FillBlock(blockOut, resp.txn), READ_STATUS_INVALID);
+
+    // the wrong transaction, as after a short ID collision: ask for the full block
+    PartiallyDownloadedBlock partialWrong(&pool);
+    BOOST_REQUIRE_EQUAL(partialWrong.InitData(cmpctblock), READ_STATUS_OK);
+    resp = Answer(block, GetMissing(partialWrong, block.GetHash()));
+    resp.txn[0] = BuildTransaction(99);
+    BOOST_CHECK_EQUAL(partialWrong.FillBlock(blockOut, resp.txn), READ_STATUS_FAILED);
+
+    // nothing at all
+    PartiallyDownloadedBlock partialEmpty(&pool);
+    BOOST_CHECK_EQUAL(partialEmpty.InitData(CBlockHeaderAndShortTxIDs()), READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_CASE(differential_indexes)
+{
+    BlockTransactionsRequest req;
+    req.blockhash = uint256(5);
+    req.indexes.push_back(0);
+    req.indexes.push_back(1);
+    req.indexes.push_back(7);
+    req.indexes.push_back(300);
+    size_t nBytes;
+    BlockTransactionsRequest reqOut = RoundTrip(req, &nBytes);
+    BOOST_CHECK(reqOut.indexes == req.indexes);
+    // hash, count, then 0, 0, 5 and 292, the last taking three bytes
+    BOOST_CHECK_EQUAL(nBytes, 32U + 1 + 1 + 1 + 1 + 3);
+
+    // an index past 16 bits is refused
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << uint256(5);
+    WriteCompactSize(ss, 2);
+    WriteCompactSize(ss, 65000);
+    WriteCompactSize(ss, 1000);
+    BOOST_CHECK_THROW(ss >> reqOut, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_relay_benchmark)
+{
+    // Relay PoS blocks of 100 to 2000 transactions to a peer with all, 95% or
+    // 50% of them in its mempool. Whole, a block costs an inv, a getdata and the
+    // block: one round trip after the announcement. A peer that asked for
+    // cmpctblock announcements needs none when its mempool has every
+    // transaction, and one getblocktxn/blocktxn round trip otherwise.
+    for (int nTx = 100; nTx <= 2000; nTx *= 20) {
+        CBlock block = BuildStakeBlock(nTx);
+        size_t nBlockBytes = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+        size_t nFullBytes = nBlockBytes + ::GetSerializeSize(std::vector<CInv>(1), SER_NETWORK, PROTOCOL_VERSION) * 2 + CMessageHeader::HEADER_SIZE * 3;
+        const int vPercent[] = {100, 95, 50};
+        for (int p = 0; p < 3; p++) {
+            CTxMemPool pool(CFeeRate(0));
+            for (int i = 0; i < nTx; i++) {
+                if (i * 100 < vPercent[p] * nTx)
+                    AddToMempool(pool, block.vtx[2 + i]);
+            }
+
+            int64_t nStart = GetTimeMicros();
+            size_t nBytes;
+            CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block), &nBytes);
+            nBytes += CMessageHeader::HEADER_SIZE;
+            int nRoundTrips = 0;
+            PartiallyDownloadedBlock partialBlock(&pool);
+            BOOST_REQUIRE_EQUAL(partialBlock.InitData(cmpctblock), READ_STATUS_OK);
+            BlockTransactionsRequest req = GetMissing(partialBlock, block.GetHash());
+            BlockTransactions resp;
+            if (!req.indexes.empty()) {
+                size_t nReqBytes, nRespBytes;
+                req = RoundTrip(req, &nReqBytes);
+                resp = RoundTrip(Answer(block, req), &nRespBytes);
+                nBytes += nReqBytes + nRespBytes + CMessageHeader::HEADER_SIZE * 2;
+                nRoundTrips++;
+            }
+            CBlock blockOut;
+            BOOST_REQUIRE_EQUAL(partialBlock.FillBlock(blockOut, resp.txn), READ_STATUS_OK);
+            BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+            int64_t nElapsed = GetTimeMicros() - nStart;
+            BOOST_CHECK(nBytes < nFullBytes);
+            BOOST_CHECK_EQUAL(nRoundTrips, vPercent[p] == 100 ? 0 : 1);
+
+            BOOST_TEST_MESSAGE(strprintf("relay of a %d-transaction PoS block, %d%% in mempool: whole %u bytes, 1 round trip; compact %u bytes (%.1f%%), %d round trip(s), %u requested, rebuilt in %.2fms",
+                nTx, vPercent[p], nFullBytes, nBytes, 100.0 * nBytes / nFullBytes, nRoundTrips, req.indexes.size(), nElapsed * 0.001));
+        }
+    }
+}
+
+/** A proof-of-work block on top of genesis, with nTx transactions behind the coinbase */
+static CBlock BuildNextBlock(int nTx)
+{
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    CBlock block;
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    block.nTime = pindexPrev->GetMedianTimePast() + 60;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << (pindexPrev->nHeight + 1) << OP_0;
+    coinbase.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    block.vtx.push_back(CTransaction(coinbase));
+    for (int i = 0; i < nTx; i++)
+        block.vtx.push_back(BuildTransaction(i));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.nBits = GetNextWorkRequired(pindexPrev, &block);
+    BOOST_REQUIRE(block.IsProofOfWork());
+    return block;
+}
+
+/** Hand pto a message as it would come off the wire and let it handle it.
+ *  Returns the commands of what pto sent back; the payload of a getblocktxn
+ *  among them goes to *preq. */
+template <typename T>
+static std::vector<std::string> Deliver(CNode& pto, const char* pszCommand, const T& payload, BlockTransactionsRequest* preq = NULL)
+{
+    CSendBuffer msg = MakeSendBuffer(pszCommand, SER_NETWORK, PROTOCOL_VERSION, payload);
+    {
+        LOCK(pto.cs_vRecvMsg);
+        BOOST_REQUIRE(pto.ReceiveMsgBytes(&(*msg)[0], msg->size()));
+        ProcessMessages(&pto);
+    }
+
+    std::vector<std::string> vCommands;
+    LOCK(pto.cs_vSend);
+    for (const CSendBuffer& reply : pto.vSendMsg) {
+        CDataStream ss(reply->begin(), reply->end(), SER_NETWORK, PROTOCOL_VERSION);
+        CMessageHeader hdr;
+        ss >> hdr;
+        vCommands.push_back(hdr.GetCommand());
+        if (hdr.GetCommand() == NetMsgType::GETBLOCKTXN && preq)
+            ss >> *preq;
+    }
+    pto.vSendMsg.clear();
+    pto.nSendSize = 0;
+    return vCommands;
+}
+
+static int GetMisbehavior(const CNode& node)
+{
+    CNodeStateStats stats;
+    BOOST_REQUIRE(GetNodeStateStats(node.GetId(), stats));
+    return stats.nMisbehavior;
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_header_checked_first)
+{
+    // Blocks with one of their two transactions in the mempool, so a good
+    // header gets a getblocktxn for the other
+    ModifiableParams()->setSkipProofOfWorkCheck(true);
+    CBlock block = BuildNextBlock(2);
+    AddToMempool(mempool, block.vtx[1]);
+
+    CNode nodeGood(INVALID_SOCKET, CAddress(CService("127.0.0.1", 11000)), "", true);
+    nodeGood.nVersion = PROTOCOL_VERSION;
+    BlockTransactionsRequest req;
+    std::vector<std::string> vCommands = Deliver(nodeGood, NetMsgType::CMPCTBLOCK, CBlockHeaderAndShortTxIDs(block), &req);
+    BOOST_CHECK(vCommands == std::vector<std::string>(1, NetMsgType::GETBLOCKTXN));
+    BOOST_CHECK(req.blockhash == block.GetHash());
+    BOOST_CHECK(req.indexes == std::vector<uint16_t>(1, 2));
+    BOOST_CHECK_EQUAL(GetMisbehavior(nodeGood), 0);
+
+    // A header that does not have the work asked for is turned down before
+    // anything is looked up for the transactions
+    CBlock blockBadWork = block;
+    blockBadWork.nBits = block.nBits - 1;
+    CNode nodeBadWork(INVALID_SOCKET, CAddress(CService("127.0.0.1", 11001)), "", true);
+    nodeBadWork.nVersion = PROTOCOL_VERSION;
+    BOOST_CHECK(Deliver(nodeBadWork, NetMsgType::CMPCTBLOCK, CBlockHeaderAndShortTxIDs(blockBadWork)).empty());
+    BOOST_CHECK_EQUAL(GetMisbehavior(nodeBadWork), 50);
+
+    // So is a proof-of-work block that carries a block signature
+    CBlock blockBadSig = block;
+    blockBadSig.vchBlockSig.assign(71, 0x30);
+    CNode nodeBadSig(INVALID_SOCKET, CAddress(CService("127.0.0.1", 11002)), "", true);
+    nodeBadSig.nVersion = PROTOCOL_VERSION;
+    BOOST_CHECK(Deliver(nodeBadSig, NetMsgType::CMPCTBLOCK, CBlockHeaderAndShortTxIDs(blockBadSig)).empty());
+    BOOST_CHECK_EQUAL(GetMisbehavior(nodeBadSig), 100);
+
+    // One that doesn't connect is asked for whole
+    CBlock blockOrphan = block;
+    blockOrphan.hashPrevBlock = uint256(42);
+    CNode nodeOrphan(INVALID_SOCKET, CAddress(CService("127.0.0.1", 11003)), "", true);
+    nodeOrphan.nVersion = PROTOCOL_VERSION;
+    vCommands = Deliver(nodeOrphan, NetMsgType::CMPCTBLOCK, CBlockHeaderAndShortTxIDs(blockOrphan));
+    BOOST_CHECK(vCommands == std::vector<std::string>(1, NetMsgType::GETDATA));
+    BOOST_CHECK_EQUAL(GetMisbehavior(nodeOrphan), 0);
+
+    mempool.clear();
+    CNode::ClearBanned();
+    ModifiableParams()->setSkipProofOfWorkCheck(false);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,152 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockimport_tests)
+
+/** A chain of blocks on top of the genesis block, nTx transactions each */
+static std::vector<CBlock> BuildChain(int nBlocks, int nTx)
+{
+    std::vector<CBlock> vBlocks;
+    uint256 hashPrev = Params().HashGenesisBlock();
+    for (int i = 0; i < nBlocks; i++) {
+        CBlock block;
+        block.nVersion = 1;
+        block.hashPrevBlock = hashPrev;
+        block.nTime = Params().GenesisBlock().nTime + (i + 1) * 60;
+        block.nBits = Params().GenesisBlock().nBits;
+        for (int j = 0; j < nTx; j++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            if (j > 0)
+                tx.vin[0].prevout = COutPoint(uint256(i * nTx + j), j);
+            tx.vin[0].scriptSig = CScript() << i << j << std::vector<unsigned char>(72, j);
+            tx.vout.push_back(CTxOut((j + 1) * COIN, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG));
+            block.vtx.push_back(CTransaction(tx));
+        }
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        hashPrev = block.GetHash();
+        vBlocks.push_back(block);
+    }
+    return vBlocks;
+}
+
+/** Write blocks as they are stored in block files, returning where each one starts */
+static std::vector<unsigned int> WriteBlocks(const boost::filesystem::path& path, const std::vector<CBlock>& vBlocks, bool fGarbage)
+{
+    std::vector<unsigned int> vPos;
+    CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!fileout.IsNull());
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        if (fGarbage && i % 3 == 1) {
+            // bytes that aren't a block, and a header whose block doesn't deserialize
+            fileout << std::vector<unsigned char>(17, 0xab);
+            unsigned int nSize = 200;
+            fileout << FLATDATA(Params().MessageStart()) << nSize << std::vector<unsigned char>(nSize - 1, 0x01);
+        }
+        unsigned int nSize = fileout.GetSerializeSize(vBlocks[i]);
+        fileout << FLATDATA(Params().MessageStart()) << nSize;
+        vPos.push_back(ftell(fileout.Get()));
+        fileout << vBlocks[i];
+    }
+    return vPos;
+}
+
+BOOST_AUTO_TEST_CASE(import_pipeline_order)
+{
+    std::vector<CBlock> vBlocks = BuildChain(60, 3);
+    std::vector<CBlock> vFirst(vBlocks.begin(), vBlocks.begin() + 25);
+    std::vector<CBlock> vSecond(vBlocks.begin() + 25, vBlocks.end());
+    boost::filesystem::path pathFirst = GetDataDir() / "import0.dat";
+    boost::filesystem::path pathSecond = GetDataDir() / "import1.dat";
+    WriteBlocks(pathFirst, vFirst, true);
+    std::vector<unsigned int> vPosSecond = WriteBlocks(pathSecond, vSecond, false);
+
+    // a tiny queue makes the reader wait for every block
+    const size_t vMaxQueuedBytes[] = {1, CBlockImportPipeline::DEFAULT_MAX_QUEUED_BYTES};
+    for (size_t nMaxQueuedBytes : vMaxQueuedBytes) {
+        std::vector<CImportFile> vFiles;
+        vFiles.push_back(CImportFile(pathFirst));
+        vFiles.push_back(CImportFile(GetDataDir() / "missing.dat"));
+        vFiles.push_back(CImportFile(pathSecond, fopen(pathSecond.string().c_str(), "rb"), 7));
+        CBlockImportPipeline pipeline(vFiles, 4, nMaxQueuedBytes);
+
+        boost::shared_ptr<CImportedBlock> imported;
+        size_t n = 0;
+        while (pipeline.Next(imported)) {
+            BOOST_REQUIRE(n < vBlocks.size());
+            BOOST_CHECK(imported->strError.empty());
+            BOOST_CHECK(imported->block.GetHash() == vBlocks[n].GetHash());
+            BOOST_CHECK_EQUAL(imported->block.vtx.size(), 3U);
+            if (n < vFirst.size()) {
+                BOOST_CHECK_EQUAL(imported->nFileIndex, 0U);
+                BOOST_CHECK(imported->pos.IsNull());
+            } else {
+                BOOST_CHECK_EQUAL(imported->nFileIndex, 2U);
+                BOOST_CHECK_EQUAL(imported->pos.nFile, 7);
+                BOOST_CHECK_EQUAL(imported->pos.nPos, vPosSecond[n - vFirst.size()]);
+            }
+            n++;
+        }
+        BOOST_CHECK_EQUAL(n, vBlocks.size());
+
+        CBlockImportStats stats = pipeline.GetStats();
+        BOOST_CHECK_EQUAL(stats.nBlocks, vBlocks.size());
+        BOOST_CHECK_EQUAL(stats.nErrors, 0U);
+        BOOST_CHECK(pipeline.GetError().empty());
+    }
+
+    // stopping halfway closes the files the reader didn't get to
+    std::vector<CImportFile> vFiles;
+    vFiles.push_back(CImportFile(pathFirst));
+    vFiles.push_back(CImportFile(pathSecond, fopen(pathSecond.string().c_str(), "rb"), 7));
+    {
+        CBlockImportPipeline pipeline(vFiles, 2, 1);
+        boost::shared_ptr<CImportedBlock> imported;
+        BOOST_CHECK(pipeline.Next(imported));
+        BOOST_CHECK(imported->block.GetHash() == vBlocks[0].GetHash());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(import_pipeline_benchmark)
+{
+    // Reindex a synthetic chain through the reading and decoding stages, with
+    // one worker and with several, and report the throughput of each
+    std::vector<CBlock> vBlocks = BuildChain(400, 40);
+    boost::filesystem::path path = GetDataDir() / "importbench.dat";
+    WriteBlocks(path, vBlocks, false);
+
+    for (int nWorkers = 1; nWorkers <= 4; nWorkers *= 4) {
+        int64_t nStart = GetTimeMicros();
+        std::vector<CImportFile> vFiles;
+        vFiles.push_back(CImportFile(path, NULL, 0));
+        CBlockImportPipeline pipeline(vFiles, nWorkers);
+        boost::shared_ptr<CImportedBlock> imported;
+        size_t n = 0;
+        while (pipeline.Next(imported)) {
+            BOOST_CHECK(imported->block.hashPrevBlock == (n ? vBlocks[n - 1].GetHash() : Params().HashGenesisBlock()));
+            n++;
+        }
+        BOOST_CHECK_EQUAL(n, vBlocks.size());
+
+        int64_t nElapsed = std::max(GetTimeMicros() - nStart, (int64_t)1);
+        CBlockImportStats stats = pipeline.GetStats();
+        BOOST_TEST_MESSAGE(strprintf("import with %d worker(s): %u blocks, %.1fMB in %.2fms (%.0f blocks/s); read %.2fms, decode %.2fms, waited %.2fms",
+            nWorkers, stats.nBlocks, stats.nBytes * 0.000001, nElapsed * 0.001, stats.nBlocks * 1000000.0 / nElapsed,
+            stats.nReadMicros * 0.001, stats.nDecodeMicros * 0.001, stats.nWaitMicros * 0.001));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,100 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "main.h"
+#include "txdb.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+extern CBlockIndexArena blockIndexArena;
+
+BOOST_AUTO_TEST_SUITE(blockindex_tests)
+
+BOOST_AUTO_TEST_CASE(load_block_index_guts)
+{
+    // A chain long enough to span many decoder batches, stored under hashes that
+    // can't be rebuilt from the headers, so loading must take them from the keys.
+    const int nBlocks = 20000;
+    std::vector<uint256> vHashes(nBlocks);
+    std::vector<CBlockIndex> vBlocks(nBlocks);
+    CBlockTreeDB blocktree(1 << 20, true);
+    for (int i = 0; i < nBlocks; i++) {
+        vHashes[i] = (uint256(1) << 200) + i;
+        vBlocks[i].phashBlock = &vHashes[i];
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].nHeight = i;
+        vBlocks[i].nTime = 1000 + i;
+        vBlocks[i].nBits = Params().ProofOfWorkLimit().GetCompact();
+        vBlocks[i].nTx = 1 + i % 7;
+        vBlocks[i].nStatus = BLOCK_VALID_TRANSACTIONS;
+        BOOST_CHECK(blocktree.WriteBlockIndex(CDiskBlockIndex(&vBlocks[i])));
+    }
+
+    {
+        LOCK(cs_main);
+        // the test setup turns -checkblockindex on; load as a node does by default
+        const bool fCheckBlockIndexSaved = fCheckBlockIndex;
+        fCheckBlockIndex = false;
+        // load into an arena of its own so the entries can be freed afterwards
+        CBlockIndexArena arenaSaved;
+        arenaSaved.Swap(blockIndexArena);
+        BOOST_CHECK(blocktree.LoadBlockIndexGuts());
+        for (int i = 0; i < nBlocks; i++) {
+            BlockMap::iterator mi = mapBlockIndex.find(vHashes[i]);
+            BOOST_REQUIRE(mi != mapBlockIndex.end());
+            const CBlockIndex* pindex = mi->second;
+            BOOST_CHECK(pindex->GetBlockHash() == vHashes[i]);
+            BOOST_CHECK_EQUAL(pindex->nHeight, i);
+            BOOST_CHECK_EQUAL(pindex->nTime, 1000U + i);
+            BOOST_CHECK_EQUAL(pindex->nTx, 1U + i % 7);
+            BOOST_CHECK(i ? pindex->pprev->GetBlockHash() == vHashes[i - 1] : pindex->pprev == NULL);
+        }
+
+        // -checkblockindex rebuilds the hashes from the headers and notices they don't match
+        fCheckBlockIndex = true;
+        BOOST_CHECK(!blocktree.LoadBlockIndexGuts());
+        fCheckBlockIndex = fCheckBlockIndexSaved;
+
+        for (int i = 0; i < nBlocks; i++)
+            mapBlockIndex.erase(vHashes[i]);
+        blockIndexArena.Clear();
+        blockIndexArena.Swap(arenaSaved);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(block_index_arena)
+{
+    CBlockIndexArena arena;
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+
+    // entries keep their address and contents as the arena grows over several chunks
+    std::vector<CBlockIndex*> vEntries;
+    for (int i = 0; i < 10000; i++) {
+        CBlockIndex index;
+        index.nHeight = i;
+        index.pprev = i ? vEntries.back() : NULL;
+        vEntries.push_back(arena.Allocate(index));
+        vEntries.back()->BuildSkip();
+    }
+    BOOST_CHECK_EQUAL(arena.size(), 10000U);
+    BOOST_CHECK(arena.DynamicMemoryUsage() >= 10000 * sizeof(CBlockIndex));
+    for (int i = 0; i < 10000; i++) {
+        BOOST_CHECK_EQUAL(vEntries[i]->nHeight, i);
+        BOOST_CHECK(vEntries[9999]->GetAncestor(i) == vEntries[i]);
+    }
+
+    CBlockIndexArena other;
+    other.Swap(arena);
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+    BOOST_CHECK_EQUAL(other.size(), 10000U);
+    BOOST_CHECK_EQUAL(vEntries[5000]->nHeight, 5000);
+
+    other.Clear();
+    BOOST_CHECK_EQUAL(other.size(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
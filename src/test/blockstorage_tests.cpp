@@ -0,0 +1,324 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstorage.h"
+#include "clientversion.h"
+#include "main.h"
+#include "net.h"
+#include "netscheduler.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <atomic>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockstorage_tests)
+
+static CBlock BuildBlock()
+{
+    CBlock block;
+    block.nVersion = 1;
+    block.nTime = 1234567;
+    for (int i = 0; i < 3; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(i + 1), i);
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(100, i);
+        tx.vout.push_back(CTxOut((i + 1) * COIN, CScript() << OP_TRUE));
+        block.vtx.push_back(CTransaction(tx));
+    }
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(block_file_stream)
+{
+    CBlock block = BuildBlock();
+    blockFileCache.Clear();
+    uint64_t nUses, nOpenedBefore, nOpened;
+    blockFileCache.GetCounters(nUses, nOpenedBefore);
+
+    // more files than the cache keeps open at once
+    std::vector<CDiskBlockPos> vPos;
+    for (unsigned int i = 0; i < CBlockFileCache::MAX_OPEN_FILES + 4; i++) {
+        CDiskBlockPos pos(1000 + i, 0);
+        BOOST_REQUIRE(WriteBlockToDisk(block, pos));
+        vPos.push_back(pos);
+    }
+
+    for (unsigned int i = 0; i < vPos.size(); i++) {
+        CBlockFileStream filein(vPos[i], SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!filein.IsNull());
+        CBlock blockRead;
+        filein >> blockRead;
+        BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+        BOOST_CHECK_EQUAL(blockRead.vtx.size(), 3U);
+    }
+    BOOST_CHECK_EQUAL(blockFileCache.size(), CBlockFileCache::MAX_OPEN_FILES);
+    blockFileCache.GetCounters(nUses, nOpened);
+    BOOST_CHECK_EQUAL(nOpened - nOpenedBefore, vPos.size());
+
+    // the most recently used files stay open
+    for (unsigned int i = 4; i < vPos.size(); i++)
+        BOOST_CHECK(!CBlockFileStream(vPos[i], SER_DISK, CLIENT_VERSION).IsNull());
+    blockFileCache.GetCounters(nUses, nOpened);
+    BOOST_CHECK_EQUAL(nOpened - nOpenedBefore, vPos.size());
+
+    // a transaction is read at its offset behind the header, as the tx index stores it
+    unsigned int nTxOffset = GetSizeOfCompactSize(block.vtx.size()) + ::GetSerializeSize(block.vtx[0], SER_DISK, CLIENT_VERSION);
+    CBlockFileStream filein(vPos[0], SER_DISK, CLIENT_VERSION, 16);
+    CBlockHeader header;
+    CTransaction tx;
+    filein >> header;
+    filein.ignore(nTxOffset);
+    filein >> tx;
+    BOOST_CHECK(tx.GetHash() == block.vtx[1].GetHash());
+    BOOST_CHECK(header.GetHash() == block.GetHash());
+
+    // and the data ends where the file does
+    filein.ignore(::GetSerializeSize(block.vtx[2], SER_DISK, CLIENT_VERSION) - 1);
+    char ch[2];
+    BOOST_CHECK_THROW(filein.read(ch, 2), std::ios_base::failure);
+
+    BOOST_CHECK(CBlockFileStream(CDiskBlockPos(999999, 0), SER_DISK, CLIENT_VERSION).IsNull());
+    blockFileCache.Clear();
+    BOOST_CHECK_EQUAL(blockFileCache.size(), 0U);
+}
+
+static std::vector<char> SerializeBlock(const CBlock& block)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    return std::vector<char>(ss.begin(), ss.end());
+}
+
+BOOST_AUTO_TEST_CASE(raw_block_span)
+{
+    CBlock block = BuildBlock();
+    blockFileCache.Clear();
+    CDiskBlockPos pos(2000, 0);
+    BOOST_REQUIRE(WriteBlockToDisk(block, pos));
+
+    // the stored bytes are exactly what a peer is sent
+    CBlockSpan span;
+    BOOST_REQUIRE(ReadRawBlockFromDisk(span, pos));
+    std::vector<char> vch = SerializeBlock(block);
+    BOOST_CHECK(std::vector<char>(span.begin(), span.end()) == vch);
+    if (sizeof(void*) == 8)
+        BOOST_CHECK(span.IsMapped());
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << span;
+    BOOST_CHECK(std::vector<char>(ss.begin(), ss.end()) == vch);
+
+    CLazyBlock lazy(span);
+    BOOST_REQUIRE(lazy.Parse());
+    BOOST_CHECK_EQUAL(lazy.GetTxCount(), block.vtx.size());
+    BOOST_CHECK(!lazy.HasWitness());
+    BOOST_CHECK(lazy.GetHeader().GetHash() == block.GetHash());
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        CTransaction tx;
+        lazy.GetTransaction(i, tx);
+        BOOST_CHECK(tx.GetHash() == block.vtx[i].GetHash());
+    }
+
+    // the index overload checks the header against the index entry
+    CBlockIndex index(block);
+    uint256 hash = block.GetHash();
+    index.phashBlock = &hash;
+    index.nFile = pos.nFile;
+    index.nDataPos = pos.nPos;
+    index.nStatus |= BLOCK_HAVE_DATA;
+    CBlockSpan spanIndexed;
+    BOOST_CHECK(ReadRawBlockFromDisk(spanIndexed, &index, false));
+    uint256 hashOther = uint256(1);
+    index.phashBlock = &hashOther;
+    BOOST_CHECK(!ReadRawBlockFromDisk(spanIndexed, &index, true));
+    BOOST_CHECK(ReadRawBlockFromDisk(spanIndexed, &index, true, false));
+
+    // a block with witness data is only handed out raw where witnesses are allowed
+    CBlock blockWitness = BuildBlock();
+    CMutableTransaction txWitness(blockWitness.vtx[2]);
+    txWitness.wit.vtxinwit.resize(1);
+    txWitness.wit.vtxinwit[0].scriptWitness.stack.push_back(std::vector<unsigned char>(72, 0x30));
+    blockWitness.vtx[2] = CTransaction(txWitness);
+    CDiskBlockPos posWitness(2001, 0);
+    BOOST_REQUIRE(WriteBlockToDisk(blockWitness, posWitness));
+    CBlockSpan spanWitness;
+    BOOST_REQUIRE(ReadRawBlockFromDisk(spanWitness, posWitness));
+    CLazyBlock lazyWitness(spanWitness);
+    BOOST_REQUIRE(lazyWitness.Parse());
+    BOOST_CHECK(lazyWitness.HasWitness());
+    CTransaction tx;
+    lazyWitness.GetTransaction(2, tx);
+    BOOST_CHECK(tx.GetHash() == txWitness.GetHash());
+    BOOST_CHECK(!tx.wit.IsNull());
+    CBlockIndex indexWitness(blockWitness);
+    uint256 hashWitness = blockWitness.GetHash();
+    indexWitness.phashBlock = &hashWitness;
+    indexWitness.nFile = posWitness.nFile;
+    indexWitness.nDataPos = posWitness.nPos;
+    indexWitness.nStatus |= BLOCK_HAVE_DATA;
+    BOOST_CHECK(ReadRawBlockFromDisk(spanWitness, &indexWitness, true));
+    BOOST_CHECK(!ReadRawBlockFromDisk(spanWitness, &indexWitness, false));
+
+    // a truncated block doesn't parse
+    boost::shared_ptr<CBlockFileHandle> handle = blockFileCache.Get(pos.nFile);
+    BOOST_REQUIRE(handle);
+    CBlockSpan spanShort;
+    BOOST_REQUIRE(spanShort.Load(*handle, pos.nPos, vch.size() - 1));
+    CLazyBlock lazyShort(spanShort);
+    BOOST_CHECK(!lazyShort.Parse());
+    BOOST_CHECK_EQUAL(lazyShort.GetTxCount(), 0U);
+
+    // nor does one read from the wrong offset
+    BOOST_CHECK(!ReadRawBlockFromDisk(span, CDiskBlockPos(pos.nFile, pos.nPos + 1)));
+    blockFileCache.Clear();
+}
+
+BOOST_AUTO_TEST_CASE(lazy_block_signature)
+{
+    // a proof-of-stake block ends with the signature behind the coinstake
+    CBlock block = BuildBlock();
+    CMutableTransaction txStake(block.vtx[1]);
+    txStake.vout.insert(txStake.vout.begin(), CTxOut());
+    txStake.vout[0].SetEmpty();
+    txStake.vout.push_back(CTxOut(2 * COIN, CScript() << OP_TRUE));
+    block.vtx[1] = CTransaction(txStake);
+    BOOST_REQUIRE(block.vtx[1].IsCoinStake());
+    block.vchBlockSig = std::vector<unsigned char>(71, 0x42);
+
+    blockFileCache.Clear();
+    CDiskBlockPos pos(2002, 0);
+    BOOST_REQUIRE(WriteBlockToDisk(block, pos));
+    CBlockSpan span;
+    BOOST_REQUIRE(ReadRawBlockFromDisk(span, pos));
+    BOOST_CHECK_EQUAL(span.size(), SerializeBlock(block).size());
+    CLazyBlock lazy(span);
+    BOOST_CHECK(lazy.Parse());
+    BOOST_CHECK_EQUAL(lazy.GetTxCount(), 3U);
+    blockFileCache.Clear();
+}
+
+/** A peer downloading the same block over and over, as one syncing from us would */
+static void RequestBlocks(CNode* pnode, uint256 hash, int nRequests, bool fHoldMain, int* pnServed, std::atomic<int>* pnDone)
+{
+    for (int i = 0; i < nRequests; i++) {
+        // read the block from disk every time, as the first request for it does
+        sendBufferCache.Clear();
+        {
+            LOCK(pnode->cs_vRecvMsg);
+            pnode->vRecvGetData.push_back(CInv(MSG_BLOCK, hash));
+            if (fHoldMain) {
+                // as serving did before: cs_main held across the disk read
+                LOCK(cs_main);
+                ProcessMessages(pnode);
+            } else {
+                ProcessMessages(pnode);
+            }
+        }
+        LOCK(pnode->cs_vSend);
+        if (!pnode->vSendMsg.empty())
+            (*pnServed)++;
+        pnode->vSendMsg.clear();
+        pnode->nSendSize = 0;
+        pnode->nSendOffset = 0;
+    }
+    (*pnDone)++;
+}
+
+BOOST_AUTO_TEST_CASE(getdata_cs_main_contention)
+{
+    // A large block, stored and indexed as one we have validated
+    CBlock block = BuildBlock();
+    for (int i = 0; i < 3000; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(i + 100), 0);
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(150, i & 0xff);
+        tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+        block.vtx.push_back(CTransaction(tx));
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    blockFileCache.Clear();
+    CDiskBlockPos pos(2003, 0);
+    BOOST_REQUIRE(WriteBlockToDisk(block, pos));
+
+    uint256 hash = block.GetHash();
+    CBlockIndex* pindex = new CBlockIndex(block);
+    {
+        LOCK(cs_main);
+        BOOST_REQUIRE(pindexBestHeader != NULL);
+        BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(hash, pindex)).first;
+        pindex->phashBlock = &mi->first;
+        pindex->nHeight = chainActive.Height();
+        pindex->nFile = pos.nFile;
+        pindex->nDataPos = pos.nPos;
+        pindex->nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA;
+    }
+
+    // Several peers download it while another thread, standing in for
+    // validation, keeps taking cs_main. Measure how long that thread waits,
+    // with cs_main held across serving as before and without.
+    const int nPeers = 6;
+    const int nRequests = 20;
+    int64_t nWaitHeld = 0, nWaitFree = 0;
+    for (int nHoldMain = 1; nHoldMain >= 0; nHoldMain--) {
+        std::vector<CNode*> vNodes;
+        std::vector<int> vServed(nPeers, 0);
+        for (int i = 0; i < nPeers; i++) {
+            vNodes.push_back(new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 10000 + i)), "", true));
+            vNodes.back()->nVersion = PROTOCOL_VERSION;
+        }
+
+        std::atomic<int> nDone(0);
+        int64_t nStart = GetTimeMicros();
+        boost::thread_group threads;
+        for (int i = 0; i < nPeers; i++)
+            threads.create_thread(boost::bind(&RequestBlocks, vNodes[i], hash, nRequests, nHoldMain != 0, &vServed[i], &nDone));
+
+        CLatencyHistogram histWait;
+        do {
+            int64_t nBefore = GetTimeMicros();
+            {
+                LOCK(cs_main);
+                histWait.Add(GetTimeMicros() - nBefore);
+            }
+            MilliSleep(1);
+        } while (nDone < nPeers);
+        threads.join_all();
+        int64_t nElapsed = GetTimeMicros() - nStart;
+
+        for (int i = 0; i < nPeers; i++) {
+            BOOST_CHECK_EQUAL(vServed[i], nRequests);
+            BOOST_CHECK(vNodes[i]->vRecvGetData.empty());
+            delete vNodes[i];
+        }
+        BOOST_TEST_MESSAGE(strprintf("serving a %uKB block to %d peers %s cs_main: cs_main waited avg %dus, p99 %dus, max %dus; served in %.2fms",
+            ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) / 1000, nPeers, nHoldMain ? "holding" : "without",
+            histWait.nTotalMicros / (int64_t)histWait.nCount, histWait.GetPercentile(0.99), histWait.nMaxMicros, nElapsed * 0.001));
+        BOOST_CHECK(histWait.nCount >= 10);
+        if (nHoldMain)
+            nWaitHeld = histWait.GetPercentile(0.99);
+        else
+            nWaitFree = histWait.GetPercentile(0.99);
+    }
+    // Serving only looks the block up under cs_main now, so validation is not
+    // kept waiting behind the disk reads
+    BOOST_TEST_MESSAGE(strprintf("cs_main p99 wait: %dus holding it across the reads, %dus without", nWaitHeld, nWaitFree));
+    BOOST_CHECK(nWaitFree < nWaitHeld);
+
+    {
+        LOCK(cs_main);
+        mapBlockIndex.erase(hash);
+    }
+    delete pindex;
+    blockFileCache.Clear();
+    sendBufferCache.Clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
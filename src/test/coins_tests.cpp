@@ -2,9 +2,17 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "coins.h"
+#include "memusage.h"
 #include "random.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "undo.h"
+#include "utilstrencodings.h"
+#include "version.h"
 
 #include <vector>
 #include <map>
@@ -16,27 +24,27 @@ namespace
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin) && !coin.IsSpent();
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
@@ -44,8 +52,8 @@ public:
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
-            map_[it->first] = it->second.coins;
-            if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+            map_[it->first] = it->second.coin;
+            if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                 // Randomly delete empty entries on write.
                 map_.erase(it->first);
             }
@@ -58,6 +66,43 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coin.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+};
+
+/** Writes the bytes of a record as they are, to store records in old formats */
+struct CRawRecord {
+    std::vector<unsigned char> vch;
+    CRawRecord(const std::string& strHex) : vch(ParseHex(strHex)) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const { return vch.size(); }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        s.write((const char*)&vch[0], vch.size());
+    }
+};
+
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+    CLevelDBWrapper& GetDB() { return db; }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -67,8 +112,8 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
-// txids picked from a limited list of random 256-bit hashes. Occasionally, a
+// It will randomly create/update/delete Coin entries to a tip of caches, with
+// outpoints picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
 // During the process, booleans are kept to make sure that the randomized
@@ -83,58 +128,76 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool evicted_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
-
-    // Use a limited set of random transaction ids, so we do test overwriting entries.
-    std::vector<uint256> txids;
-    txids.resize(NUM_SIMULATION_ITERATIONS / 8);
-    for (unsigned int i = 0; i < txids.size(); i++) {
-        txids[i] = GetRandHash();
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
+
+    // Use a limited set of random outpoints, several per transaction id, so we
+    // do test overwriting entries and neighbouring outputs.
+    std::vector<COutPoint> outpoints;
+    outpoints.resize(NUM_SIMULATION_ITERATIONS / 8);
+    for (unsigned int i = 0; i < outpoints.size(); i++) {
+        outpoints[i] = COutPoint(i % 4 ? outpoints[i - 1].hash : GetRandHash(), i % 4);
     }
 
     for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS; i++) {
         // Do a random modification.
         {
-            uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
+            const COutPoint& outpoint = outpoints[insecure_rand() % outpoints.size()]; // outpoint we're going to modify in this iteration.
+            Coin& coin = result[outpoint];
+            const Coin& entry = stack.back()->AccessCoin(outpoint);
+            BOOST_CHECK(coin == entry);
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                if (coin.IsSpent()) {
                     added_an_entry = true;
                 } else {
                     updated_an_entry = true;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1 + insecure_rand() % 100000;
+                newcoin.fCoinStake = insecure_rand() % 2;
+                newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+                stack.back()->AddCoin(outpoint, newcoin, !coin.IsSpent() || insecure_rand() % 2);
+                coin = newcoin;
             } else {
-                coins.Clear();
-                entry->Clear();
+                BOOST_CHECK(stack.back()->SpendCoin(outpoint));
+                coin.Clear();
                 removed_an_entry = true;
             }
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
+            for (unsigned int j = 0; j < stack.size(); j++)
+                stack[j]->SelfTest();
+        }
+
+        if (insecure_rand() % 100 == 0 && stack.size() > 0) {
+            // Every 100 iterations, write the tip cache out to its base but keep
+            // it, and evict some of what is unmodified now.
+            BOOST_CHECK(stack.back()->Sync());
+            if (stack.back()->Trim(stack.back()->DynamicMemoryUsage() * (insecure_rand() % 4) / 4) > 0)
+                evicted_an_entry = true;
+            stack.back()->SelfTest();
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -151,7 +214,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -173,6 +236,174 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(evicted_an_entry);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_trim)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    std::vector<COutPoint> outpoints;
+    for (unsigned int i = 0; i < 1000; i++) {
+        outpoints.push_back(COutPoint(GetRandHash(), i % 3));
+        cache.AddCoin(outpoints.back(), Coin(CTxOut(i, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i % 256) << OP_EQUALVERIFY << OP_CHECKSIG), 1, false, false), false);
+    }
+    cache.SelfTest();
+
+    // modified entries are never evicted
+    BOOST_CHECK_EQUAL(cache.Trim(0), 0U);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1000U);
+
+    // once written out they are, and lookups go to the base again
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1000U);
+    size_t nFullUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK_EQUAL(cache.Trim(0), 1000U);
+    BOOST_CHECK_EQUAL(cache.GetCounters().nEvicted, 1000U);
+    BOOST_CHECK(cache.DynamicMemoryUsage() < nFullUsage / 10);
+    cache.SelfTest();
+    uint64_t nMisses = cache.GetCounters().nMisses;
+    for (unsigned int i = 0; i < outpoints.size(); i++)
+        BOOST_CHECK_EQUAL(cache.AccessCoin(outpoints[i]).out.nValue, i);
+    BOOST_CHECK_EQUAL(cache.GetCounters().nMisses, nMisses + 1000);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1000U);
+
+    // entries used since the last sweep get a second chance
+    cache.Trim(cache.DynamicMemoryUsage() - 1);
+    uint64_t nHits = cache.GetCounters().nHits;
+    for (unsigned int i = 0; i < 500; i++)
+        cache.AccessCoin(outpoints[i]);
+    BOOST_CHECK(cache.GetCounters().nHits >= nHits + 499);
+    cache.Trim(cache.DynamicMemoryUsage() * 3 / 4);
+    cache.SelfTest();
+    BOOST_CHECK(cache.GetCacheSize() < 900U);
+    unsigned int nKept = 0;
+    for (unsigned int i = 0; i < 500; i++) {
+        if (cache.HaveCoinInCache(outpoints[i]))
+            nKept++;
+    }
+    BOOST_CHECK(nKept >= 499);
+
+    // spending an unmodified entry frees its memory once written out
+    BOOST_CHECK(cache.SpendCoin(outpoints[0]));
+    cache.SelfTest();
+    BOOST_CHECK(cache.Sync());
+    BOOST_CHECK(!cache.HaveCoinInCache(outpoints[0]));
+    BOOST_CHECK(!cache.HaveCoin(outpoints[0]));
+    cache.SelfTest();
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_background_write)
+{
+    CCoinsViewDBTest view;
+    uint256 hashBlock = GetRandHash();
+    std::vector<COutPoint> outpoints;
+    CCoinsMap mapCoins;
+    for (unsigned int i = 0; i < 1000; i++) {
+        outpoints.push_back(COutPoint(GetRandHash(), i));
+        CCoinsCacheEntry& entry = mapCoins[outpoints.back()];
+        entry.coin = Coin(CTxOut(i + 1, CScript() << OP_TRUE), 1, false, false);
+        entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+    }
+    BOOST_CHECK(view.BatchWrite(mapCoins, hashBlock));
+    BOOST_CHECK(mapCoins.empty());
+
+    // the batch is visible while it is being written
+    BOOST_CHECK(view.GetBestBlock() == hashBlock);
+    for (unsigned int i = 0; i < outpoints.size(); i++)
+        BOOST_CHECK(view.HaveCoin(outpoints[i]));
+
+    // spending waits for the first batch to finish
+    mapCoins[outpoints[0]].flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(view.BatchWrite(mapCoins, uint256(0)));
+    BOOST_CHECK(!view.HaveCoin(outpoints[0]));
+    BOOST_CHECK(view.WaitForWrites());
+    BOOST_CHECK(!view.IsWriting());
+    BOOST_CHECK_EQUAL(view.PendingMemoryUsage(), 0U);
+    BOOST_CHECK(!view.HaveCoin(outpoints[0]));
+    BOOST_CHECK(view.GetBestBlock() == hashBlock);
+    Coin coin;
+    BOOST_CHECK(view.GetCoin(outpoints[999], coin));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 1000);
+
+    CCoinsDBWriteStats stats = view.GetWriteStats();
+    BOOST_CHECK_EQUAL(stats.nBatches, 2U);
+    BOOST_CHECK_EQUAL(stats.nEntries, 1001U);
+    BOOST_CHECK(stats.nBytes > 1000 * 36);
+    BOOST_CHECK(stats.nTotalMicros >= stats.nMaxMicros);
+}
+
+BOOST_AUTO_TEST_CASE(coin_serialization)
+{
+    // A coinstake output at height 203998 paying to a key hash
+    Coin coin(CTxOut(60000000000LL, GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))), 203998, false, true);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << coin;
+    BOOST_CHECK_EQUAL(HexStr(ss.begin(), ss.end()), "b0e579835800816115944e077fe7c803cfa57f29b36bf87c1d35");
+
+    Coin coin2;
+    ss >> coin2;
+    BOOST_CHECK(coin2 == coin);
+    BOOST_CHECK(coin2.IsCoinStake());
+    BOOST_CHECK(!coin2.IsCoinBase());
+    BOOST_CHECK_EQUAL(coin2.nHeight, 203998U);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade)
+{
+    CCoinsViewDBTest view;
+    uint256 txid1 = GetRandHash(), txid2 = GetRandHash();
+    // version 1, vout[0] unspent, height 203998
+    BOOST_CHECK(view.GetDB().Write(std::make_pair('c', txid1), CRawRecord("0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e")));
+    // version 1, coinstake, vout[1] and vout[4] unspent, height 120891
+    BOOST_CHECK(view.GetDB().Write(std::make_pair('c', txid2), CRawRecord("011a04835800816115944e077fe7c803cfa57f29b36bf87c1d35835800816115944e077fe7c803cfa57f29b36bf87c1d3586af3b")));
+
+    BOOST_CHECK(view.Upgrade());
+    BOOST_CHECK(!view.GetDB().Exists(std::make_pair('c', txid1)));
+    BOOST_CHECK(!view.GetDB().Exists(std::make_pair('c', txid2)));
+
+    Coin coin;
+    BOOST_CHECK(view.GetCoin(COutPoint(txid1, 0), coin));
+    BOOST_CHECK_EQUAL(coin.nHeight, 203998U);
+    BOOST_CHECK(!coin.IsCoinBase() && !coin.IsCoinStake());
+    BOOST_CHECK_EQUAL(coin.out.nValue, 60000000000LL);
+    BOOST_CHECK(!view.HaveCoin(COutPoint(txid1, 1)));
+
+    BOOST_CHECK(!view.HaveCoin(COutPoint(txid2, 0)));
+    BOOST_CHECK(view.GetCoin(COutPoint(txid2, 1), coin));
+    BOOST_CHECK_EQUAL(coin.nHeight, 120891U);
+    BOOST_CHECK(coin.IsCoinStake());
+    BOOST_CHECK(!view.HaveCoin(COutPoint(txid2, 2)));
+    BOOST_CHECK(view.HaveCoin(COutPoint(txid2, 4)));
+
+    // nothing left to do the second time
+    BOOST_CHECK(view.Upgrade());
+}
+
+BOOST_AUTO_TEST_CASE(undo_legacy_format)
+{
+    // Undo records written before the per-outpoint UTXO set: the first carries
+    // the metadata and a transaction version, the second only the output.
+    CDataStream ss(ParseHex("02"
+                            "b0e57901835800816115944e077fe7c803cfa57f29b36bf87c1d35"
+                            "00835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    CTxUndo undo;
+    ss >> undo;
+    BOOST_REQUIRE_EQUAL(undo.vprevout.size(), 2U);
+    BOOST_CHECK_EQUAL(undo.vprevout[0].nHeight, 203998U);
+    BOOST_CHECK(undo.vprevout[0].IsCoinStake());
+    BOOST_CHECK_EQUAL(undo.vprevout[0].out.nValue, 60000000000LL);
+    BOOST_CHECK_EQUAL(undo.vprevout[1].nHeight, 0U);
+    BOOST_CHECK(undo.vprevout[1].out == undo.vprevout[0].out);
+
+    // New records always carry the metadata, with a zero in place of the version
+    undo.vprevout[1] = undo.vprevout[0];
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << undo;
+    BOOST_CHECK_EQUAL(HexStr(ss2.begin(), ss2.end()), "02"
+                                                      "b0e57900835800816115944e077fe7c803cfa57f29b36bf87c1d35"
+                                                      "b0e57900835800816115944e077fe7c803cfa57f29b36bf87c1d35");
+    BOOST_CHECK_EQUAL(ss2.size(), ::GetSerializeSize(undo, SER_DISK, CLIENT_VERSION));
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,16 +3,202 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "crypto/quark_avx2.h"
+#include "crypto/sph_blake.h"
+#include "crypto/sph_keccak.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "tinyformat.h"
+#include "utiltime.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
+#include <string.h>
 #include <vector>
 
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
 
+// Quark hash as implemented before HashQuarkBatch, one freshly initialised context per round
+template <typename T1>
+static uint256 HashQuarkOld(const T1 pbegin, const T1 pend)
+{
+    sph_blake512_context ctx_blake;
+    sph_bmw512_context ctx_bmw;
+    sph_groestl512_context ctx_groestl;
+    sph_jh512_context ctx_jh;
+    sph_keccak512_context ctx_keccak;
+    sph_skein512_context ctx_skein;
+    static unsigned char pblank[1];
+
+    uint512 mask = 8;
+    uint512 zero = 0;
+    uint512 hash[9];
+
+    sph_blake512_init(&ctx_blake);
+    sph_blake512(&ctx_blake, (pbegin == pend ? pblank : static_cast<const void*>(&pbegin[0])), (pend - pbegin) * sizeof(pbegin[0]));
+    sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[0]));
+
+    sph_bmw512_init(&ctx_bmw);
+    sph_bmw512(&ctx_bmw, static_cast<const void*>(&hash[0]), 64);
+    sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[1]));
+
+    if ((hash[1] & mask) != zero) {
+        sph_groestl512_init(&ctx_groestl);
+        sph_groestl512(&ctx_groestl, static_cast<const void*>(&hash[1]), 64);
+        sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[2]));
+    } else {
+        sph_skein512_init(&ctx_skein);
+        sph_skein512(&ctx_skein, static_cast<const void*>(&hash[1]), 64);
+        sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[2]));
+    }
+
+    sph_groestl512_init(&ctx_groestl);
+    sph_groestl512(&ctx_groestl, static_cast<const void*>(&hash[2]), 64);
+    sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[3]));
+
+    sph_jh512_init(&ctx_jh);
+    sph_jh512(&ctx_jh, static_cast<const void*>(&hash[3]), 64);
+    sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[4]));
+
+    if ((hash[4] & mask) != zero) {
+        sph_blake512_init(&ctx_blake);
+        sph_blake512(&ctx_blake, static_cast<const void*>(&hash[4]), 64);
+        sph_blake512_close(&ctx_blake, static_cast<void*>(&hash[5]));
+    } else {
+        sph_bmw512_init(&ctx_bmw);
+        sph_bmw512(&ctx_bmw, static_cast<const void*>(&hash[4]), 64);
+        sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[5]));
+    }
+
+    sph_keccak512_init(&ctx_keccak);
+    sph_keccak512(&ctx_keccak, static_cast<const void*>(&hash[5]), 64);
+    sph_keccak512_close(&ctx_keccak, static_cast<void*>(&hash[6]));
+
+    sph_skein512_init(&ctx_skein);
+    sph_skein512(&ctx_skein, static_cast<const void*>(&hash[6]), 64);
+    sph_skein512_close(&ctx_skein, static_cast<void*>(&hash[7]));
+
+    if ((hash[7] & mask) != zero) {
+        sph_keccak512_init(&ctx_keccak);
+        sph_keccak512(&ctx_keccak, static_cast<const void*>(&hash[7]), 64);
+        sph_keccak512_close(&ctx_keccak, static_cast<void*>(&hash[8]));
+    } else {
+        sph_jh512_init(&ctx_jh);
+        sph_jh512(&ctx_jh, static_cast<const void*>(&hash[7]), 64);
+        sph_jh512_close(&ctx_jh, static_cast<void*>(&hash[8]));
+    }
+    return hash[8].trim256();
+}
+
 BOOST_AUTO_TEST_SUITE(hash_tests)
 
+BOOST_AUTO_TEST_CASE(quark_batch)
+{
+    seed_insecure_rand(false);
+
+    // Empty and odd-sized inputs go through the single-item path
+    for (size_t nLen = 0; nLen < 200; nLen++) {
+        std::vector<unsigned char> vData(nLen);
+        for (size_t i = 0; i < nLen; i++)
+            vData[i] = insecure_rand();
+        BOOST_CHECK(HashQuark(vData.begin(), vData.end()) == HashQuarkOld(vData.begin(), vData.end()));
+    }
+
+    // Header batches spanning several internal passes, including a partial last one
+    std::vector<CBlockHeader> headers(100);
+    for (CBlockHeader& header : headers) {
+        header.nVersion = insecure_rand();
+        header.hashPrevBlock = GetRandHash();
+        header.hashMerkleRoot = GetRandHash();
+        header.nTime = insecure_rand();
+        header.nBits = insecure_rand();
+        header.nNonce = insecure_rand();
+    }
+    std::vector<uint256> hashes;
+    CBlockHeader::GetHashes(headers, hashes);
+    BOOST_CHECK_EQUAL(hashes.size(), headers.size());
+    for (size_t i = 0; i < headers.size(); i++) {
+        BOOST_CHECK(hashes[i] == headers[i].GetHash());
+        BOOST_CHECK(hashes[i] == HashQuarkOld(BEGIN(headers[i].nVersion), END(headers[i].nNonce)));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(quark_avx2_kernels)
+{
+    if (!QuarkAVX2Available()) {
+        BOOST_TEST_MESSAGE("no AVX2 on this CPU, skipping the 4-way kernels");
+        return;
+    }
+    seed_insecure_rand(false);
+
+    unsigned char vIn[QUARK_AVX2_LANES][QUARK_AVX2_BLAKE_MAX_LEN];
+    unsigned char vOut[QUARK_AVX2_LANES][64];
+    const unsigned char* vpIn[QUARK_AVX2_LANES];
+    unsigned char* vpOut[QUARK_AVX2_LANES];
+    for (size_t l = 0; l < QUARK_AVX2_LANES; l++) {
+        vpIn[l] = vIn[l];
+        vpOut[l] = vOut[l];
+    }
+
+    for (int nRun = 0; nRun < 20; nRun++) {
+        for (size_t l = 0; l < QUARK_AVX2_LANES; l++)
+            for (size_t i = 0; i < QUARK_AVX2_BLAKE_MAX_LEN; i++)
+                vIn[l][i] = insecure_rand();
+
+        // Every length that fits one block, the 80-byte header and 64-byte results included
+        for (size_t nLen = 0; nLen <= QUARK_AVX2_BLAKE_MAX_LEN; nLen++) {
+            Blake512_4way_AVX2(vpIn, nLen, vpOut);
+            for (size_t l = 0; l < QUARK_AVX2_LANES; l++) {
+                unsigned char vExpected[64];
+                sph_blake512_context ctx;
+                sph_blake512_init(&ctx);
+                sph_blake512(&ctx, vIn[l], nLen);
+                sph_blake512_close(&ctx, vExpected);
+                BOOST_CHECK(memcmp(vOut[l], vExpected, 64) == 0);
+            }
+        }
+
+        Keccak512_64_4way_AVX2(vpIn, vpOut);
+        for (size_t l = 0; l < QUARK_AVX2_LANES; l++) {
+            unsigned char vExpected[64];
+            sph_keccak512_context ctx;
+            sph_keccak512_init(&ctx);
+            sph_keccak512(&ctx, vIn[l], 64);
+            sph_keccak512_close(&ctx, vExpected);
+            BOOST_CHECK(memcmp(vOut[l], vExpected, 64) == 0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(quark_batch_throughput)
+{
+    seed_insecure_rand(false);
+    std::vector<CBlockHeader> headers(2000);
+    for (CBlockHeader& header : headers) {
+        header.hashPrevBlock = GetRandHash();
+        header.nNonce = insecure_rand();
+    }
+
+    int64_t nStart = GetTimeMicros();
+    std::vector<uint256> hashesOld;
+    for (const CBlockHeader& header : headers)
+        hashesOld.push_back(HashQuarkOld(BEGIN(header.nVersion), END(header.nNonce)));
+    int64_t nTimeOld = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    std::vector<uint256> hashes;
+    CBlockHeader::GetHashes(headers, hashes);
+    int64_t nTimeBatch = GetTimeMicros() - nStart;
+
+    BOOST_CHECK(hashes == hashesOld);
+    BOOST_TEST_MESSAGE(strprintf("quark of %u headers: one at a time %.2fms, batched%s %.2fms (%.2fx)",
+        headers.size(), nTimeOld * 0.001, QuarkAVX2Available() ? " with AVX2" : "", nTimeBatch * 0.001, (double)nTimeOld / std::max(nTimeBatch, (int64_t)1)));
+}
+
 BOOST_AUTO_TEST_CASE(murmurhash3)
 {
 
@@ -46,4 +232,90 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Test vectors from the SipHash-2-4 reference, for 0, 8, 16, 24 and 32 bytes
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ull);
+    hasher.Write(0x0706050403020100ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ull);
+    hasher.Write(0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x3f2acc7f57c29bdbull);
+    hasher.Write(0x1716151413121110ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0xb8ad50c6f649af94ull);
+    hasher.Write(0x1F1E1D1C1B1A1918ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x7127512f72f27cceull);
+
+    // The same 32 bytes as a uint256
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL,
+                          uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")),
+        0x7127512f72f27cceull);
+}
+
+BOOST_AUTO_TEST_CASE(blockheader_hash_cache)
+{
+    CBlockHeader header;
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = 1500000000;
+    header.nBits = 0x1e0ffff0;
+    header.nNonce = 1;
+
+    const uint256 hash = header.GetHash();
+    const uint64_t nHits = CBlockHeader::GetHashCacheHits();
+    BOOST_CHECK(header.GetHash() == hash);
+    BOOST_CHECK_EQUAL(CBlockHeader::GetHashCacheHits(), nHits + 1);
+
+    // Writing a field directly must invalidate the cached hash
+    header.nNonce++;
+    const uint256 hashNext = header.GetHash();
+    BOOST_CHECK(hashNext != hash);
+    BOOST_CHECK(hashNext == HashQuarkOld(BEGIN(header.nVersion), END(header.nNonce)));
+    BOOST_CHECK_EQUAL(CBlockHeader::GetHashCacheHits(), nHits + 1);
+
+    // Copies carry the cache along with the fields
+    CBlock block(header);
+    BOOST_CHECK(block.GetHash() == hashNext);
+    BOOST_CHECK(block.GetBlockHeader().GetHash() == hashNext);
+    BOOST_CHECK_EQUAL(CBlockHeader::GetHashCacheHits(), nHits + 3);
+
+    // A seeded hash is only trusted for the fields it was recorded against
+    block.SetCachedHash(hash);
+    BOOST_CHECK(block.GetHash() == hash);
+    block.nTime++;
+    BOOST_CHECK(block.GetHash() == HashQuarkOld(BEGIN(block.nVersion), END(block.nNonce)));
+}
+
+static void HashSharedHeader(const CBlock* pblock, const uint256* phashExpected, std::atomic<int>* pnWrong)
+{
+    for (int i = 0; i < 500; i++) {
+        // Alternate cache hits with misses that rewrite the shared cache
+        if (i % 10 == 0)
+            pblock->SetCachedHash(*phashExpected);
+        if (pblock->GetHash() != *phashExpected)
+            (*pnWrong)++;
+        CBlockHeader header = pblock->GetBlockHeader();
+        if (header.GetHash() != *phashExpected)
+            (*pnWrong)++;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blockheader_hash_cache_threads)
+{
+    CBlock block;
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = GetRandHash();
+    block.nBits = 0x1e0ffff0;
+    const uint256 hashExpected = HashQuarkOld(BEGIN(block.nVersion), END(block.nNonce));
+
+    // A block handed to several validation or relay threads is hashed from all of them at once
+    std::atomic<int> nWrong(0);
+    boost::thread_group threads;
+    for (int i = 0; i < 4; i++)
+        threads.create_thread(boost::bind(&HashSharedHeader, &block, &hashExpected, &nWrong));
+    threads.join_all();
+    BOOST_CHECK_EQUAL(nWrong, 0);
+    BOOST_CHECK(block.GetHash() == hashExpected);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
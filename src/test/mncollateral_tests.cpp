@@ -0,0 +1,67 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "masternode/masternode-collateral.h"
+#include "validationinterface.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(mncollateral_tests)
+
+BOOST_AUTO_TEST_CASE(collateral_tracking)
+{
+    CMasternodeCollaterals collaterals;
+    RegisterValidationInterface(&collaterals);
+
+    // a confirmed transaction with two collateral outputs
+    uint256 hashFunding = uint256(123456);
+    {
+        LOCK(cs_main);
+        pcoinsTip->AddCoin(COutPoint(hashFunding, 0), Coin(CTxOut(10000 * COIN, CScript() << OP_TRUE), 1, false, false), false);
+        pcoinsTip->AddCoin(COutPoint(hashFunding, 1), Coin(CTxOut(10000 * COIN, CScript() << OP_TRUE), 1, false, false), false);
+    }
+
+    COutPoint collateral0(hashFunding, 0), collateral1(hashFunding, 1), missing(uint256(654321), 0);
+    BOOST_CHECK_EQUAL(collaterals.GetState(collateral0), CMasternodeCollaterals::COLLATERAL_UNSPENT);
+    BOOST_CHECK_EQUAL(collaterals.GetState(missing), CMasternodeCollaterals::COLLATERAL_SPENT);
+    BOOST_CHECK_EQUAL(collaterals.size(), 2U);
+
+    // an unrelated transaction changes nothing
+    CMutableTransaction txUnrelated;
+    txUnrelated.vin.resize(1);
+    txUnrelated.vin[0].prevout = COutPoint(uint256(42), 0);
+    txUnrelated.vout.push_back(CTxOut(1 * COIN, CScript() << OP_TRUE));
+    SyncWithWallets(CTransaction(txUnrelated), NULL);
+    BOOST_CHECK_EQUAL(collaterals.GetState(collateral0), CMasternodeCollaterals::COLLATERAL_UNSPENT);
+
+    // spending the first collateral is picked up without another UTXO lookup
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = collateral0;
+    txSpend.vout.push_back(CTxOut(9999 * COIN, CScript() << OP_TRUE));
+    SyncWithWallets(CTransaction(txSpend), NULL);
+    BOOST_CHECK_EQUAL(collaterals.GetState(collateral0), CMasternodeCollaterals::COLLATERAL_SPENT);
+
+    // the second one is still looked up in, and found unspent in, the UTXO set
+    BOOST_CHECK_EQUAL(collaterals.GetState(collateral1), CMasternodeCollaterals::COLLATERAL_UNSPENT);
+    BOOST_CHECK_EQUAL(collaterals.size(), 3U);
+
+    // a watched outpoint keeps its state even once it disappears from the UTXO set
+    {
+        LOCK(cs_main);
+        pcoinsTip->SpendCoin(COutPoint(hashFunding, 0));
+        pcoinsTip->SpendCoin(COutPoint(hashFunding, 1));
+    }
+    BOOST_CHECK_EQUAL(collaterals.GetState(collateral1), CMasternodeCollaterals::COLLATERAL_UNSPENT);
+    collaterals.Forget(collateral1);
+    BOOST_CHECK_EQUAL(collaterals.GetState(collateral1), CMasternodeCollaterals::COLLATERAL_SPENT);
+
+    collaterals.Clear();
+    BOOST_CHECK_EQUAL(collaterals.size(), 0U);
+
+    UnregisterValidationInterface(&collaterals);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,86 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternode/masternode-payments.h"
+#include "random.h"
+#include "tinyformat.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(mnpayments_tests)
+
+static CScript PayeeScript(int n)
+{
+    return CScript() << OP_DUP << OP_HASH160 << n << OP_EQUALVERIFY << OP_CHECKSIG;
+}
+
+// The chain walk GetLastPaid used before the payee index
+static int WalkLastPaidHeight(CMasternodePayments& payments, const CScript& payee, int nHeight, int nDepth)
+{
+    for (int h = nHeight, n = 0; h > 0 && n < nDepth; h--, n++) {
+        if (payments.mapMasternodeBlocks.count(h) && payments.mapMasternodeBlocks[h].HasPayeeWithVotes(payee, MNPAYMENTS_LASTPAID_VOTES))
+            return h;
+    }
+    return 0;
+}
+
+BOOST_AUTO_TEST_CASE(last_paid_index)
+{
+    seed_insecure_rand(false);
+
+    // 5,000 simulated masternodes voted over a little more than one 1.25 cycle
+    const int nMasternodes = 5000;
+    const int nDepth = nMasternodes * 1.25;
+    const int nTip = nDepth + 500;
+
+    CMasternodePayments payments;
+    for (int h = 1; h <= nTip; h++) {
+        // one winner with a full quorum, one runner-up that stays below the threshold
+        const CScript winner = PayeeScript(insecure_rand() % nMasternodes);
+        for (int i = 0; i < MNPAYMENTS_SIGNATURES_REQUIRED; i++)
+            payments.AddBlockPayeeVote(h, winner);
+        payments.AddBlockPayeeVote(h, PayeeScript(insecure_rand() % nMasternodes));
+    }
+
+    std::vector<CScript> vPayees;
+    for (int n = 0; n < nMasternodes; n++)
+        vPayees.push_back(PayeeScript(n));
+
+    // The walk costs O(depth) per masternode, so only time it on a sample
+    const int nSample = 250;
+    int64_t nTimeWalk = GetTimeMicros();
+    std::vector<int> vWalk;
+    for (int n = 0; n < nSample; n++)
+        vWalk.push_back(WalkLastPaidHeight(payments, vPayees[n], nTip, nDepth));
+    nTimeWalk = GetTimeMicros() - nTimeWalk;
+
+    int64_t nTimeIndex = GetTimeMicros();
+    std::vector<int> vIndex;
+    for (const CScript& payee : vPayees)
+        vIndex.push_back(payments.GetLastPaidHeight(payee, nTip, nDepth));
+    nTimeIndex = GetTimeMicros() - nTimeIndex;
+
+    BOOST_TEST_MESSAGE(strprintf("last paid for %d masternodes: chain walk ~%.2fms, index %.2fms",
+        nMasternodes, 0.001 * nTimeWalk * nMasternodes / nSample, 0.001 * nTimeIndex));
+    for (int n = 0; n < nSample; n++)
+        BOOST_CHECK_EQUAL(vIndex[n], vWalk[n]);
+
+    // Heights above the queried tip and outside the window are ignored
+    for (int n = 0; n < 100; n++) {
+        const int nHeight = 1 + insecure_rand() % nTip;
+        const int nWindow = insecure_rand() % 100;
+        BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(vPayees[n], nHeight, nWindow), WalkLastPaidHeight(payments, vPayees[n], nHeight, nWindow));
+    }
+
+    // A rebuilt index answers the same
+    payments.RebuildPayeeIndex();
+    for (int n = 0; n < nMasternodes; n++)
+        BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(vPayees[n], nTip, nDepth), vIndex[n]);
+
+    payments.Clear();
+    BOOST_CHECK_EQUAL(payments.GetLastPaidHeight(vPayees[0], nTip, nDepth), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,179 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "masternode/masternodeman.h"
+#include "random.h"
+#include "spork.h"
+#include "utiltime.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(mnrank_tests)
+
+static CMasternode EnabledMasternode(int64_t nNow)
+{
+    CMasternode mn;
+    mn.vin = CTxIn(COutPoint(GetRandHash(), 0));
+    mn.protocolVersion = PROTOCOL_VERSION;
+    mn.sigTime = nNow - 3 * 60 * 60;
+    mn.lastPing.vin = mn.vin;
+    mn.lastPing.sigTime = nNow;
+    mn.unitTest = true;
+    mn.Check(true);
+    return mn;
+}
+
+/** A few blocks on top of genesis, so there are block hashes to score against */
+struct RankTestChain {
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vIndex;
+
+    explicit RankTestChain(size_t nBlocks) : vHashes(nBlocks), vIndex(nBlocks)
+    {
+        for (size_t i = 0; i < vIndex.size(); i++) {
+            vHashes[i] = GetRandHash();
+            vIndex[i].phashBlock = &vHashes[i];
+            vIndex[i].pprev = i == 0 ? chainActive.Genesis() : &vIndex[i - 1];
+            vIndex[i].nHeight = i + 1;
+        }
+        SetTip(&vIndex.back());
+    }
+    ~RankTestChain() { SetTip(chainActive.Genesis()); }
+
+    static void SetTip(CBlockIndex* pindex)
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(pindex);
+        chainActiveHashes.SetTip(pindex);
+    }
+};
+
+// Ranks as GetMasternodeByRank works them out, scanning the list every time
+static int UncachedRank(CMasternodeMan& man, const CTxIn& vin, int nHeight)
+{
+    for (int nRank = 1; nRank <= man.size(); nRank++) {
+        CMasternode* pmn = man.GetMasternodeByRank(nRank, nHeight);
+        if (pmn == NULL)
+            return -1;
+        if (pmn->vin == vin)
+            return nRank;
+    }
+    return -1;
+}
+
+BOOST_AUTO_TEST_CASE(rank_cache)
+{
+    int64_t nNow = GetTime();
+    SetMockTime(nNow);
+
+    RankTestChain chain(10);
+    const int nHeight = chain.vIndex.size();
+
+    CMasternodeMan man;
+    std::vector<CTxIn> vVins;
+    for (int i = 0; i < 20; i++) {
+        CMasternode mn = EnabledMasternode(nNow);
+        vVins.push_back(mn.vin);
+        man.Add(mn);
+    }
+
+    // The first lookup builds the table, the rest are answered from it
+    const uint64_t nHits = man.GetRankCacheHits();
+    std::vector<int> vRanks;
+    for (const CTxIn& vin : vVins)
+        vRanks.push_back(man.GetMasternodeRank(vin, nHeight));
+    BOOST_CHECK_EQUAL(man.GetRankCacheHits(), nHits + vVins.size() - 1);
+    for (size_t i = 0; i < vVins.size(); i++)
+        BOOST_CHECK_EQUAL(vRanks[i], UncachedRank(man, vVins[i], nHeight));
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(CTxIn(COutPoint(GetRandHash(), 0)), nHeight), -1);
+
+    // Another height, or another tip, is a miss
+    uint64_t nHitsBefore = man.GetRankCacheHits();
+    man.GetMasternodeRank(vVins[0], nHeight - 1);
+    BOOST_CHECK_EQUAL(man.GetRankCacheHits(), nHitsBefore);
+    chain.SetTip(&chain.vIndex[nHeight - 2]);
+    nHitsBefore = man.GetRankCacheHits();
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(vVins[0], nHeight - 1), UncachedRank(man, vVins[0], nHeight - 1));
+    BOOST_CHECK_EQUAL(man.GetRankCacheHits(), nHitsBefore);
+    chain.SetTip(&chain.vIndex.back());
+
+    // A new entry invalidates the table
+    CMasternode mnNew = EnabledMasternode(nNow);
+    man.Add(mnNew);
+    vVins.push_back(mnNew.vin);
+    man.GetMasternodeRank(vVins[0], nHeight);
+    nHitsBefore = man.GetRankCacheHits();
+    for (const CTxIn& vin : vVins)
+        BOOST_CHECK_EQUAL(man.GetMasternodeRank(vin, nHeight), UncachedRank(man, vin, nHeight));
+    BOOST_CHECK_EQUAL(man.GetRankCacheHits(), nHitsBefore + vVins.size());
+
+    // An entry that stops pinging expires without the list being told; the
+    // tables stand until the periodic check notices, then neither ranks it
+    man.GetMasternodeRanks(nHeight);
+    const CTxIn vinExpired = vVins[3];
+    man.Find(vinExpired)->lastPing.sigTime = nNow - MASTERNODE_EXPIRATION_SECONDS - 1;
+    BOOST_CHECK(man.GetMasternodeRank(vinExpired, nHeight) > 0);
+    nNow += MASTERNODE_CHECK_SECONDS + 1;
+    SetMockTime(nNow);
+    BOOST_CHECK(man.GetMasternodeRank(vinExpired, nHeight) > 0);
+    man.Check();
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(vinExpired, nHeight), -1);
+    BOOST_CHECK(!man.Find(vinExpired)->IsEnabled());
+    for (const CTxIn& vin : vVins)
+        BOOST_CHECK_EQUAL(man.GetMasternodeRank(vin, nHeight), UncachedRank(man, vin, nHeight));
+
+    // GetMasternodeRanks orders disabled entries last
+    std::vector<std::pair<int, CMasternode> > vRanks1 = man.GetMasternodeRanks(nHeight);
+    nHitsBefore = man.GetRankCacheHits();
+    std::vector<std::pair<int, CMasternode> > vRanks2 = man.GetMasternodeRanks(nHeight);
+    BOOST_CHECK_EQUAL(man.GetRankCacheHits(), nHitsBefore + 1);
+    BOOST_CHECK_EQUAL(vRanks1.size(), vVins.size());
+    BOOST_CHECK_EQUAL(vRanks2.size(), vVins.size());
+    BOOST_CHECK(vRanks1.back().second.vin == vinExpired);
+    BOOST_CHECK(vRanks2.back().second.vin == vinExpired);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(rank_cache_coming_of_age)
+{
+    // SPORK_8 holds masternodes back from the ranks until they are old enough;
+    // its default switches it on in 2099
+    int64_t nNow = SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT_DEFAULT + 24 * 60 * 60;
+    SetMockTime(nNow);
+    BOOST_REQUIRE(IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT));
+    RankTestChain chain(10);
+    const int nHeight = chain.vIndex.size();
+
+    CMasternodeMan man;
+    for (int i = 0; i < 5; i++) {
+        CMasternode mn = EnabledMasternode(nNow);
+        man.Add(mn);
+    }
+    // enabled, but a little short of the minimum age
+    CMasternode mnYoung = EnabledMasternode(nNow);
+    mnYoung.sigTime = nNow - 2 * 60 * 60;
+    mnYoung.Check(true);
+    BOOST_REQUIRE(mnYoung.IsEnabled());
+    man.Add(mnYoung);
+    man.Check();
+
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(mnYoung.vin, nHeight), -1);
+
+    // coming of age changes nothing in the list; the check after it drops the tables
+    nNow += 20 * 60;
+    SetMockTime(nNow);
+    uint64_t nHitsBefore = man.GetRankCacheHits();
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(mnYoung.vin, nHeight), -1);
+    BOOST_CHECK_EQUAL(man.GetRankCacheHits(), nHitsBefore + 1);
+    man.Check();
+    nHitsBefore = man.GetRankCacheHits();
+    BOOST_CHECK(man.GetMasternodeRank(mnYoung.vin, nHeight) > 0);
+    BOOST_CHECK_EQUAL(man.GetRankCacheHits(), nHitsBefore);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,198 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netbase.h"
+#include "netpoll.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <string.h>
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(netpoll_tests)
+
+/** Local connections, as peers that connected and the sockets the node accepted them on */
+struct CLoopbackPeers {
+    SOCKET hListenSocket;
+    std::vector<SOCKET> vClient;
+    std::vector<SOCKET> vServer;
+
+    explicit CLoopbackPeers(size_t nPeers)
+    {
+        hListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        BOOST_REQUIRE(hListenSocket != INVALID_SOCKET);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        BOOST_REQUIRE(bind(hListenSocket, (struct sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR);
+        BOOST_REQUIRE(listen(hListenSocket, SOMAXCONN) != SOCKET_ERROR);
+        socklen_t len = sizeof(addr);
+        BOOST_REQUIRE(getsockname(hListenSocket, (struct sockaddr*)&addr, &len) != SOCKET_ERROR);
+
+        for (size_t i = 0; i < nPeers; i++) {
+            SOCKET hClient = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            BOOST_REQUIRE(hClient != INVALID_SOCKET);
+            BOOST_REQUIRE(connect(hClient, (struct sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR);
+            SOCKET hServer = accept(hListenSocket, NULL, NULL);
+            BOOST_REQUIRE(hServer != INVALID_SOCKET);
+            BOOST_REQUIRE(SetSocketNonBlocking(hServer, true));
+            vClient.push_back(hClient);
+            vServer.push_back(hServer);
+        }
+    }
+
+    ~CLoopbackPeers()
+    {
+        for (size_t i = 0; i < vClient.size(); i++) {
+            CloseSocket(vClient[i]);
+            CloseSocket(vServer[i]);
+        }
+        CloseSocket(hListenSocket);
+    }
+
+    void Send(size_t n, size_t nBytes)
+    {
+        std::vector<char> vch(nBytes, 'x');
+        BOOST_REQUIRE_EQUAL(send(vClient[n], &vch[0], nBytes, MSG_NOSIGNAL), (ssize_t)nBytes);
+    }
+
+    /** Receive what peer n sent until the socket would block */
+    size_t Drain(size_t n)
+    {
+        size_t nTotal = 0;
+        char pchBuf[4096];
+        ssize_t nBytes;
+        while ((nBytes = recv(vServer[n], pchBuf, sizeof(pchBuf), MSG_DONTWAIT)) > 0)
+            nTotal += nBytes;
+        return nTotal;
+    }
+
+    void WatchAll(CSocketPoller& poller)
+    {
+        for (size_t i = 0; i < vServer.size(); i++)
+            BOOST_REQUIRE(poller.Watch(vServer[i], CSocketPoller::POLL_RECV, &vServer[i]));
+    }
+};
+
+/** The pollers to test: select() always, and epoll where the system has it */
+static std::vector<bool> GetPollerKinds()
+{
+    std::vector<bool> vfEpoll(1, false);
+    if (HaveEpoll())
+        vfEpoll.push_back(true);
+    return vfEpoll;
+}
+
+static std::vector<CSocketPoller::CEvent> WaitForEvents(CSocketPoller& poller, int nTimeoutMillis, int nEvents)
+{
+    std::vector<CSocketPoller::CEvent> vEvents, vResult;
+    BOOST_CHECK(poller.Wait(nTimeoutMillis, vEvents));
+    for (size_t i = 0; i < vEvents.size(); i++) {
+        if (vEvents[i].nEvents & nEvents)
+            vResult.push_back(vEvents[i]);
+    }
+    return vResult;
+}
+
+BOOST_AUTO_TEST_CASE(poller_reports_ready_sockets)
+{
+    std::vector<bool> vfEpoll = GetPollerKinds();
+    for (size_t k = 0; k < vfEpoll.size(); k++) {
+        boost::scoped_ptr<CSocketPoller> poller(CreateSocketPoller(vfEpoll[k]));
+        BOOST_CHECK_EQUAL(poller->IsEdgeTriggered(), vfEpoll[k]);
+        CLoopbackPeers peers(3);
+        const bool fEdge = poller->IsEdgeTriggered();
+
+        // nothing to receive yet
+        peers.WatchAll(*poller);
+        BOOST_CHECK(WaitForEvents(*poller, 0, CSocketPoller::POLL_RECV).empty());
+
+        peers.Send(1, 10);
+        if (!fEdge)
+            peers.WatchAll(*poller);
+        std::vector<CSocketPoller::CEvent> vEvents = WaitForEvents(*poller, 1000, CSocketPoller::POLL_RECV);
+        BOOST_REQUIRE_EQUAL(vEvents.size(), 1U);
+        BOOST_CHECK(vEvents[0].pData == &peers.vServer[1]);
+
+        // Left unread, the socket is reported again by a level-triggered poller,
+        // but not by an edge-triggered one until more arrives
+        if (!fEdge)
+            peers.WatchAll(*poller);
+        BOOST_CHECK_EQUAL(WaitForEvents(*poller, 0, CSocketPoller::POLL_RECV).size(), fEdge ? 0U : 1U);
+        peers.Send(1, 10);
+        if (!fEdge)
+            peers.WatchAll(*poller);
+        BOOST_CHECK_EQUAL(WaitForEvents(*poller, 1000, CSocketPoller::POLL_RECV).size(), 1U);
+
+        BOOST_CHECK_EQUAL(peers.Drain(1), 20U);
+        if (!fEdge)
+            peers.WatchAll(*poller);
+        BOOST_CHECK(WaitForEvents(*poller, 0, CSocketPoller::POLL_RECV).empty());
+
+        // a peer hanging up shows up as something to receive
+        CloseSocket(peers.vClient[2]);
+        if (!fEdge)
+            peers.WatchAll(*poller);
+        vEvents = WaitForEvents(*poller, 1000, CSocketPoller::POLL_RECV);
+        BOOST_REQUIRE_EQUAL(vEvents.size(), 1U);
+        BOOST_CHECK(vEvents[0].pData == &peers.vServer[2]);
+
+        // an unwatched socket isn't reported
+        if (fEdge) {
+            poller->Unwatch(peers.vServer[0]);
+            peers.Send(0, 10);
+            BOOST_CHECK(WaitForEvents(*poller, 100, CSocketPoller::POLL_RECV).empty());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(poller_loopback_benchmark)
+{
+    // Open many local peers and time how long it takes to find the ones with
+    // something to receive, as ThreadSocketHandler does: first with a single
+    // peer sending at a time, the common case on a node with many quiet
+    // connections, then with every peer sending at once
+    const size_t nPeers = 400;
+    const int nQuietRounds = 200;
+    const int nBusyRounds = 10;
+    std::vector<bool> vfEpoll = GetPollerKinds();
+    for (size_t k = 0; k < vfEpoll.size(); k++) {
+        boost::scoped_ptr<CSocketPoller> poller(CreateSocketPoller(vfEpoll[k]));
+        CLoopbackPeers peers(nPeers);
+        const bool fEdge = poller->IsEdgeTriggered();
+        if (fEdge)
+            peers.WatchAll(*poller);
+
+        int64_t nQuietMicros = 0, nBusyMicros = 0;
+        size_t nReceived = 0;
+        for (int nRound = 0; nRound < nQuietRounds + nBusyRounds; nRound++) {
+            bool fBusy = nRound >= nQuietRounds;
+            size_t nSenders = fBusy ? nPeers : 1;
+            for (size_t i = 0; i < nSenders; i++)
+                peers.Send(fBusy ? i : nRound % nPeers, 100);
+
+            int64_t nStart = GetTimeMicros();
+            size_t nExpected = nReceived + nSenders * 100;
+            while (nReceived < nExpected) {
+                if (!fEdge)
+                    peers.WatchAll(*poller);
+                std::vector<CSocketPoller::CEvent> vEvents = WaitForEvents(*poller, 1000, CSocketPoller::POLL_RECV);
+                BOOST_REQUIRE(!vEvents.empty());
+                for (size_t i = 0; i < vEvents.size(); i++)
+                    nReceived += peers.Drain((SOCKET*)vEvents[i].pData - &peers.vServer[0]);
+            }
+            (fBusy ? nBusyMicros : nQuietMicros) += GetTimeMicros() - nStart;
+        }
+        BOOST_CHECK_EQUAL(nReceived, (nQuietRounds + nBusyRounds * nPeers) * 100);
+        BOOST_TEST_MESSAGE(strprintf("%s with %u peers: %.1fus per round with one sending, %.1fus per round with all sending",
+            poller->GetName(), nPeers, (double)nQuietMicros / nQuietRounds, (double)nBusyMicros / nBusyRounds));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
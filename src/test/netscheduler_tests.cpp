@@ -0,0 +1,245 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netscheduler.h"
+#include "protocol.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(netscheduler_tests)
+
+BOOST_AUTO_TEST_CASE(message_lanes)
+{
+    BOOST_CHECK_EQUAL(GetMessageLane(NetMsgType::MNB), LANE_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetMessageLane(NetMsgType::MNP), LANE_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetMessageLane(NetMsgType::MVOTE), LANE_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetMessageLane(NetMsgType::FBVOTE), LANE_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetMessageLane(NetMsgType::SPORK), LANE_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetMessageLane(NetMsgType::GETSPORKS), LANE_MASTERNODE);
+    BOOST_CHECK_EQUAL(GetMessageLane(NetMsgType::VERSION), LANE_GENERAL);
+    BOOST_CHECK_EQUAL(GetMessageLane(NetMsgType::TX), LANE_GENERAL);
+    BOOST_CHECK_EQUAL(GetMessageLane(NetMsgType::IX), LANE_GENERAL);
+    BOOST_CHECK_EQUAL(GetMessageLane(NetMsgType::BLOCK), LANE_GENERAL);
+    BOOST_CHECK_EQUAL(GetMessageLane(NetMsgType::GETDATA), LANE_GENERAL);
+    BOOST_CHECK_EQUAL(GetMessageLane("nonsense"), LANE_GENERAL);
+}
+
+BOOST_AUTO_TEST_CASE(latency_histogram)
+{
+    BOOST_CHECK_EQUAL(CLatencyHistogram::GetBucket(0), 0);
+    BOOST_CHECK_EQUAL(CLatencyHistogram::GetBucket(1), 1);
+    BOOST_CHECK_EQUAL(CLatencyHistogram::GetBucket(2), 2);
+    BOOST_CHECK_EQUAL(CLatencyHistogram::GetBucket(3), 2);
+    BOOST_CHECK_EQUAL(CLatencyHistogram::GetBucket(1000), 10);
+    BOOST_CHECK_EQUAL(CLatencyHistogram::GetBucket((int64_t)1 << 40), CLatencyHistogram::BUCKETS - 1);
+    for (int64_t n = 1; n < 100000; n = n * 3 + 1) {
+        int nBucket = CLatencyHistogram::GetBucket(n);
+        BOOST_CHECK(n < CLatencyHistogram::GetBucketEnd(nBucket));
+        BOOST_CHECK(n >= CLatencyHistogram::GetBucketEnd(nBucket - 1));
+    }
+
+    CLatencyHistogram hist;
+    BOOST_CHECK_EQUAL(hist.GetPercentile(0.5), 0);
+    for (int i = 0; i < 98; i++)
+        hist.Add(100);
+    hist.Add(5000);
+    hist.Add(-3);
+    BOOST_CHECK_EQUAL(hist.nCount, 100U);
+    BOOST_CHECK_EQUAL(hist.nTotalMicros, 98 * 100 + 5000);
+    BOOST_CHECK_EQUAL(hist.nMaxMicros, 5000);
+    BOOST_CHECK_EQUAL(hist.vCount[0], 1U);
+    BOOST_CHECK_EQUAL(hist.vCount[CLatencyHistogram::GetBucket(100)], 98U);
+    BOOST_CHECK_EQUAL(hist.GetPercentile(0.5), 128);
+    BOOST_CHECK_EQUAL(hist.GetPercentile(0.99), 128);
+    BOOST_CHECK_EQUAL(hist.GetPercentile(1), 5000);
+
+    CMessageStats stats;
+    stats.Record(NetMsgType::TX, LANE_GENERAL, 10, 20);
+    stats.Record(NetMsgType::MNB, LANE_MASTERNODE, 10, 20);
+    stats.Record("junk1", LANE_GENERAL, 1, 2);
+    stats.Record("junk2", LANE_GENERAL, 1, 2);
+    std::map<std::string, CMessageCommandStats> mapStats = stats.GetStats();
+    BOOST_CHECK_EQUAL(mapStats.size(), 3U);
+    BOOST_CHECK_EQUAL(mapStats[NetMsgType::MNB].lane, LANE_MASTERNODE);
+    BOOST_CHECK_EQUAL(mapStats[NetMsgType::TX].histProcess.nTotalMicros, 20);
+    BOOST_CHECK_EQUAL(mapStats[CMessageStats::COMMAND_OTHER].histWait.nCount, 2U);
+    stats.Clear();
+    BOOST_CHECK(stats.GetStats().empty());
+}
+
+/** Peers with queues of messages, processed by a pool of threads through a scheduler */
+struct CTestPeers {
+    CPeerScheduler scheduler;
+    boost::mutex mutex;
+    //! numbers of the messages each peer sent, and when each arrived
+    std::vector<std::deque<std::pair<int, int64_t> > > vQueue;
+    std::vector<int> vSent;
+    std::vector<int> vNextExpected;
+    std::vector<int> vRunning;
+    //! how long processing a message of each peer takes
+    std::vector<int64_t> vCostMicros;
+    bool fOrderBroken;
+    bool fOverlap;
+    CLatencyHistogram histFast;
+
+    explicit CTestPeers(size_t nPeers) : vQueue(nPeers), vSent(nPeers, 0), vNextExpected(nPeers, 0), vRunning(nPeers, 0), vCostMicros(nPeers, 0), fOrderBroken(false), fOverlap(false) {}
+
+    void Send(NodeId id, int nMessages)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            for (int i = 0; i < nMessages; i++)
+                vQueue[id].push_back(std::make_pair(vSent[id]++, GetTimeMicros()));
+        }
+        scheduler.Schedule(id);
+    }
+
+    void Worker()
+    {
+        NodeId id;
+        while (scheduler.Take(id)) {
+            std::pair<int, int64_t> msg;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (vRunning[id]++)
+                    fOverlap = true;
+                if (vQueue[id].empty()) {
+                    vRunning[id]--;
+                    scheduler.Done(id, false);
+                    continue;
+                }
+                msg = vQueue[id].front();
+                vQueue[id].pop_front();
+            }
+            if (vCostMicros[id])
+                MilliSleep(vCostMicros[id] / 1000);
+            bool fMore;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (msg.first != vNextExpected[id]++)
+                    fOrderBroken = true;
+                if (!vCostMicros[id])
+                    histFast.Add(GetTimeMicros() - msg.second);
+                vRunning[id]--;
+                fMore = !vQueue[id].empty();
+            }
+            scheduler.Done(id, fMore);
+        }
+    }
+
+    bool Drained()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (size_t i = 0; i < vQueue.size(); i++) {
+            if (!vQueue[i].empty() || vRunning[i])
+                return false;
+        }
+        return true;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(scheduler_keeps_peer_order)
+{
+    CTestPeers peers(20);
+    boost::thread_group threads;
+    for (int i = 0; i < 4; i++)
+        threads.create_thread(boost::bind(&CTestPeers::Worker, &peers));
+
+    for (int nRound = 0; nRound < 50; nRound++) {
+        for (NodeId id = 0; id < 20; id++)
+            peers.Send(id, 1 + (id + nRound) % 4);
+    }
+    while (!peers.Drained())
+        MilliSleep(1);
+    peers.scheduler.Stop();
+    threads.join_all();
+
+    BOOST_CHECK(!peers.fOrderBroken);
+    BOOST_CHECK(!peers.fOverlap);
+    for (NodeId id = 0; id < 20; id++)
+        BOOST_CHECK(peers.vQueue[id].empty());
+    BOOST_CHECK_EQUAL(peers.scheduler.GetReadyCount(), 0U);
+
+    // taking after stopping fails at once
+    NodeId id;
+    BOOST_CHECK(!peers.scheduler.Take(id));
+}
+
+BOOST_AUTO_TEST_CASE(scheduler_done_requeues)
+{
+    CPeerScheduler scheduler;
+    scheduler.Schedule(1);
+    scheduler.Schedule(2);
+    scheduler.Schedule(1);
+    BOOST_CHECK_EQUAL(scheduler.GetReadyCount(), 2U);
+
+    NodeId id;
+    BOOST_CHECK(scheduler.Take(id));
+    BOOST_CHECK_EQUAL(id, 1);
+    // scheduled while running: not handed out twice, but queued again when done
+    scheduler.Schedule(1);
+    BOOST_CHECK_EQUAL(scheduler.GetReadyCount(), 1U);
+    scheduler.Done(1, false);
+    BOOST_CHECK_EQUAL(scheduler.GetReadyCount(), 2U);
+
+    BOOST_CHECK(scheduler.Take(id));
+    BOOST_CHECK_EQUAL(id, 2);
+    scheduler.Done(2, false);
+    BOOST_CHECK(scheduler.Take(id));
+    BOOST_CHECK_EQUAL(id, 1);
+    // more to do: behind the peers that are ready already
+    scheduler.Schedule(3);
+    scheduler.Done(1, true);
+    BOOST_CHECK(scheduler.Take(id));
+    BOOST_CHECK_EQUAL(id, 3);
+    scheduler.Done(3, false);
+    BOOST_CHECK(scheduler.Take(id));
+    BOOST_CHECK_EQUAL(id, 1);
+    scheduler.Done(1, false);
+    BOOST_CHECK_EQUAL(scheduler.GetReadyCount(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(scheduler_slow_peer_benchmark)
+{
+    // One peer's messages take 20ms each to process, as a large block or a
+    // long wait for a lock would. Report how long the messages of 40 other
+    // peers wait behind it, with a single thread as before and with a pool.
+    for (int nThreads = 1; nThreads <= 4; nThreads *= 4) {
+        CTestPeers peers(41);
+        peers.vCostMicros[40] = 20000;
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CTestPeers::Worker, &peers));
+
+        int64_t nStart = GetTimeMicros();
+        peers.Send(40, 10);
+        for (int nRound = 0; nRound < 20; nRound++) {
+            for (NodeId id = 0; id < 40; id++)
+                peers.Send(id, 1);
+            MilliSleep(5);
+        }
+        while (!peers.Drained())
+            MilliSleep(1);
+        int64_t nElapsed = GetTimeMicros() - nStart;
+        peers.scheduler.Stop();
+        threads.join_all();
+
+        BOOST_CHECK(!peers.fOrderBroken);
+        BOOST_CHECK(!peers.fOverlap);
+        BOOST_CHECK_EQUAL(peers.histFast.nCount, 800U);
+        BOOST_TEST_MESSAGE(strprintf("message scheduler with %d thread(s): fast peers waited avg %dus, p99 %dus, max %dus; all done in %.2fms",
+            nThreads, peers.histFast.nTotalMicros / (int64_t)peers.histFast.nCount, peers.histFast.GetPercentile(0.99),
+            peers.histFast.nMaxMicros, nElapsed * 0.001));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,251 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sendbuffer.h"
+#include "hash.h"
+#include "net.h"
+#include "primitives/transaction.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <set>
+#include <string.h>
+#include <vector>
+
+#ifndef WIN32
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(sendbuffer_tests)
+
+static CTransaction BuildTransaction(int nScriptSize)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(uint256(7), 1);
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(nScriptSize, 0x5a);
+    tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    return CTransaction(tx);
+}
+
+BOOST_AUTO_TEST_CASE(send_buffer_format)
+{
+    CTransaction tx = BuildTransaction(100);
+    CSendBuffer msg = MakeSendBuffer(NetMsgType::TX, SER_NETWORK, PROTOCOL_VERSION, tx);
+    BOOST_REQUIRE(msg);
+
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << tx;
+    BOOST_REQUIRE_EQUAL(msg->size(), CMessageHeader::HEADER_SIZE + ssPayload.size());
+    BOOST_CHECK(std::equal(ssPayload.begin(), ssPayload.end(), msg->begin() + CMessageHeader::HEADER_SIZE));
+
+    // the header reads back as a peer would read it
+    CDataStream ssHeader(msg->begin(), msg->begin() + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr;
+    ssHeader >> hdr;
+    BOOST_CHECK(hdr.IsValid());
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), NetMsgType::TX);
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    BOOST_CHECK_EQUAL(hdr.nChecksum, nChecksum);
+
+    // a message without a payload
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(NetMsgType::VERACK, 0);
+    CSendBuffer msgEmpty = FinishSendBuffer(ss);
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK_EQUAL(msgEmpty->size(), CMessageHeader::HEADER_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(send_buffer_cache)
+{
+    CSendBuffer msgSmall = MakeSendBuffer(NetMsgType::TX, SER_NETWORK, PROTOCOL_VERSION, BuildTransaction(100));
+    CSendBuffer msgLarge = MakeSendBuffer(NetMsgType::TX, SER_NETWORK, PROTOCOL_VERSION, BuildTransaction(5000));
+    CSendBufferCache cache(msgSmall->size() * 3 + msgLarge->size());
+
+    CSendBuffer msg;
+    BOOST_CHECK(!cache.Get(CInv(MSG_TX, 1), msg));
+    for (int i = 1; i <= 3; i++)
+        cache.Put(CInv(MSG_TX, i), msgSmall);
+    cache.Put(CInv(MSG_BLOCK, 1), msgLarge);
+    BOOST_CHECK_EQUAL(cache.size(), 4U);
+    BOOST_CHECK_EQUAL(cache.GetBytes(), msgSmall->size() * 3 + msgLarge->size());
+
+    // the very buffer put in comes back, and the lookup keeps it from being dropped
+    BOOST_CHECK(cache.Get(CInv(MSG_TX, 1), msg));
+    BOOST_CHECK(msg == msgSmall);
+    BOOST_CHECK(!cache.Get(CInv(MSG_WITNESS_TX, 1), msg));
+
+    // over the limit: the least recently used go first
+    cache.Put(CInv(MSG_TX, 4), msgSmall);
+    BOOST_CHECK(!cache.Get(CInv(MSG_TX, 2), msg));
+    BOOST_CHECK(cache.Get(CInv(MSG_TX, 1), msg));
+    BOOST_CHECK(cache.Get(CInv(MSG_TX, 4), msg));
+    BOOST_CHECK(cache.GetBytes() <= msgSmall->size() * 3 + msgLarge->size());
+
+    // putting one again replaces it rather than counting it twice
+    size_t nBytes = cache.GetBytes();
+    cache.Put(CInv(MSG_TX, 4), msgSmall);
+    BOOST_CHECK_EQUAL(cache.GetBytes(), nBytes);
+
+    // a message larger than the whole cache isn't kept
+    CSendBufferCache cacheTiny(msgSmall->size());
+    cacheTiny.Put(CInv(MSG_BLOCK, 1), msgLarge);
+    BOOST_CHECK_EQUAL(cacheTiny.size(), 0U);
+    BOOST_CHECK(!cacheTiny.Get(CInv(MSG_BLOCK, 1), msg));
+
+    uint64_t nHits, nMisses;
+    cache.GetCounters(nHits, nMisses);
+    BOOST_CHECK_EQUAL(nHits, 3U);
+    BOOST_CHECK_EQUAL(nMisses, 3U);
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+    BOOST_CHECK_EQUAL(cache.GetBytes(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(send_buffer_shared_by_peers)
+{
+    CSendBuffer msg = MakeSendBuffer(NetMsgType::TX, SER_NETWORK, PROTOCOL_VERSION, BuildTransaction(100));
+    CNode node1(INVALID_SOCKET, CAddress(CService("127.0.0.1", 10001)), "", true);
+    CNode node2(INVALID_SOCKET, CAddress(CService("127.0.0.1", 10002)), "", true);
+    node1.PushSendBuffer(msg);
+    node2.PushSendBuffer(msg);
+
+    // both queues hold the one buffer; the send to the unconnected socket fails
+    LOCK2(node1.cs_vSend, node2.cs_vSend);
+    BOOST_REQUIRE_EQUAL(node1.vSendMsg.size(), 1U);
+    BOOST_REQUIRE_EQUAL(node2.vSendMsg.size(), 1U);
+    BOOST_CHECK(node1.vSendMsg[0].get() == msg.get());
+    BOOST_CHECK(node2.vSendMsg[0].get() == msg.get());
+    BOOST_CHECK_EQUAL(node1.nSendSize, msg->size());
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(send_buffer_gathered_write)
+{
+    int sv[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    // a small socket buffer, so messages go out in pieces
+    int nSendBuf = 4096;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &nSendBuf, sizeof(nSendBuf));
+
+    std::vector<CSendBuffer> vMsg;
+    std::vector<char> vExpected;
+    for (int i = 0; i < 100; i++) {
+        vMsg.push_back(MakeSendBuffer(NetMsgType::TX, SER_NETWORK, PROTOCOL_VERSION, BuildTransaction(1 + i * 97 % 3000)));
+        vExpected.insert(vExpected.end(), vMsg.back()->begin(), vMsg.back()->end());
+    }
+
+    CNode node(sv[0], CAddress(CService("127.0.0.1", 10003)), "", true);
+    for (size_t i = 0; i < vMsg.size(); i++)
+        node.PushSendBuffer(vMsg[i]);
+
+    std::vector<char> vReceived;
+    while (vReceived.size() < vExpected.size()) {
+        {
+            LOCK(node.cs_vSend);
+            SocketSendData(&node);
+        }
+        char buf[8192];
+        int nBytes = recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT);
+        BOOST_REQUIRE(nBytes > 0 || (nBytes < 0 && errno == EAGAIN));
+        if (nBytes > 0)
+            vReceived.insert(vReceived.end(), buf, buf + nBytes);
+    }
+    BOOST_CHECK(vReceived == vExpected);
+    BOOST_CHECK(!node.fDisconnect);
+    LOCK(node.cs_vSend);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+    BOOST_CHECK_EQUAL(node.nSendBytes, vExpected.size());
+    close(sv[1]);
+}
+
+BOOST_AUTO_TEST_CASE(send_buffer_partial_write)
+{
+    int sv[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    int nSendBuf = 4096;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &nSendBuf, sizeof(nSendBuf));
+
+    // Queued behind each other without an optimistic write, so one sendmsg
+    // gets both; the socket takes all of the first and part of the second
+    CSendBuffer msgShort = MakeSendBuffer(NetMsgType::TX, SER_NETWORK, PROTOCOL_VERSION, BuildTransaction(100));
+    CSendBuffer msgLong = MakeSendBuffer(NetMsgType::TX, SER_NETWORK, PROTOCOL_VERSION, BuildTransaction(1000 * 1000));
+    std::vector<char> vExpected(msgShort->begin(), msgShort->end());
+    vExpected.insert(vExpected.end(), msgLong->begin(), msgLong->end());
+
+    CNode node(sv[0], CAddress(CService("127.0.0.1", 10004)), "", true);
+    LOCK(node.cs_vSend);
+    node.vSendMsg.push_back(msgShort);
+    node.vSendMsg.push_back(msgLong);
+    node.nSendSize = msgShort->size() + msgLong->size();
+    SocketSendData(&node);
+    BOOST_REQUIRE(node.nSendBytes > msgShort->size());
+    BOOST_REQUIRE(node.nSendBytes < vExpected.size());
+
+    // the first message is done with, and the second is sent up to where the write ended
+    BOOST_REQUIRE_EQUAL(node.vSendMsg.size(), 1U);
+    BOOST_CHECK(node.vSendMsg[0] == msgLong);
+    BOOST_CHECK_EQUAL(node.nSendOffset, node.nSendBytes - msgShort->size());
+    BOOST_CHECK_EQUAL(node.nSendSize, msgLong->size());
+
+    // and the rest follows from there
+    std::vector<char> vReceived;
+    while (vReceived.size() < vExpected.size()) {
+        char buf[8192];
+        int nBytes = recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT);
+        BOOST_REQUIRE(nBytes > 0 || (nBytes < 0 && errno == EAGAIN));
+        if (nBytes > 0)
+            vReceived.insert(vReceived.end(), buf, buf + nBytes);
+        SocketSendData(&node);
+    }
+    BOOST_CHECK(vReceived == vExpected);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+    BOOST_CHECK_EQUAL(node.nSendBytes, vExpected.size());
+    close(sv[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(send_buffer_relay_benchmark)
+{
+    // Relay a 1MB message to a growing number of peers: serialized and
+    // checksummed for each peer, as every message was before, and once for all
+    CTransaction tx = BuildTransaction(1000 * 1000);
+    for (int nPeers = 10; nPeers <= 100; nPeers *= 10) {
+        int64_t nStart = GetTimeMicros();
+        std::vector<CSendBuffer> vQueued;
+        for (int i = 0; i < nPeers; i++)
+            vQueued.push_back(MakeSendBuffer(NetMsgType::TX, SER_NETWORK, PROTOCOL_VERSION, tx));
+        int64_t nPerPeer = GetTimeMicros() - nStart;
+        size_t nBytesPerPeer = 0;
+        for (size_t i = 0; i < vQueued.size(); i++)
+            nBytesPerPeer += vQueued[i]->size();
+
+        vQueued.clear();
+        nStart = GetTimeMicros();
+        CSendBuffer msg = MakeSendBuffer(NetMsgType::TX, SER_NETWORK, PROTOCOL_VERSION, tx);
+        for (int i = 0; i < nPeers; i++)
+            vQueued.push_back(msg);
+        int64_t nShared = GetTimeMicros() - nStart;
+        std::set<const CSerializeData*> setDistinct;
+        for (size_t i = 0; i < vQueued.size(); i++)
+            setDistinct.insert(vQueued[i].get());
+        BOOST_CHECK_EQUAL(setDistinct.size(), 1U);
+
+        BOOST_TEST_MESSAGE(strprintf("relay of a %uKB message to %d peers: per peer %.2fms, %uKB queued; shared %.2fms, %uKB queued",
+            msg->size() / 1000, nPeers, nPerPeer * 0.001, nBytesPerPeer / 1000, nShared * 0.001, msg->size() / 1000));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,139 @@
+// Copyright (c) 2020 The StakeCubeCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "key.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_get_set)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    std::vector<unsigned char> vchSig(72, 0x30);
+    uint256 hash = GetRandHash();
+
+    CSignatureCache cache(1 << 16);
+    uint256 entry;
+    cache.ComputeEntry(entry, hash, vchSig, pubkey);
+    BOOST_CHECK(!cache.Get(entry));
+    cache.Set(entry);
+    BOOST_CHECK(cache.Get(entry));
+
+    // every part of the key to an entry counts
+    uint256 entryOther;
+    cache.ComputeEntry(entryOther, GetRandHash(), vchSig, pubkey);
+    BOOST_CHECK(!cache.Get(entryOther));
+    vchSig.back() ^= 1;
+    cache.ComputeEntry(entryOther, hash, vchSig, pubkey);
+    BOOST_CHECK(!cache.Get(entryOther));
+
+    // entries are salted per cache
+    CSignatureCache cacheOther(1 << 16);
+    cacheOther.ComputeEntry(entryOther, hash, std::vector<unsigned char>(72, 0x30), pubkey);
+    BOOST_CHECK(entryOther != entry);
+
+    CSignatureCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nHits, 1U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 3U);
+    BOOST_CHECK_EQUAL(stats.nInserts, 1U);
+    BOOST_CHECK_EQUAL(stats.nCapacity, 2048U);
+    BOOST_CHECK_EQUAL(stats.nBytes, 1U << 16);
+
+    // a cache of no size never holds anything
+    CSignatureCache cacheNone(0);
+    cacheNone.Set(entry);
+    BOOST_CHECK(!cacheNone.Get(entry));
+    BOOST_CHECK_EQUAL(cacheNone.GetStats().nCapacity, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_bounded)
+{
+    CSignatureCache cache(1 << 16);
+    const size_t nCapacity = cache.GetStats().nCapacity;
+
+    std::vector<uint256> vEntries;
+    for (size_t i = 0; i < 8 * nCapacity; i++) {
+        vEntries.push_back(GetRandHash());
+        cache.Set(vEntries.back());
+    }
+    size_t nFound = 0;
+    for (size_t i = 0; i < vEntries.size(); i++)
+        nFound += cache.Get(vEntries[i]);
+    BOOST_CHECK(nFound <= nCapacity);
+    // most of the table is in use, not just a corner of it
+    BOOST_CHECK(nFound > nCapacity / 2);
+    // the newest entry survives
+    BOOST_CHECK(cache.Get(vEntries.back()));
+}
+
+static void LookupSignatures(const std::vector<uint256>* pvHash, const std::vector<std::vector<unsigned char> >* pvSig, const CPubKey* ppubkey, int nRounds, bool* pfOk)
+{
+    CMutableTransaction txTmp;
+    txTmp.vin.resize(1);
+    CTransaction tx(txTmp);
+    PrecomputedTransactionData txdata(tx);
+    CachingTransactionSignatureChecker checker(&tx, 0, 0, true, txdata);
+    for (int n = 0; n < nRounds; n++) {
+        for (size_t i = 0; i < pvHash->size(); i++) {
+            if (!checker.VerifySignature((*pvSig)[i], *ppubkey, (*pvHash)[i]))
+                *pfOk = false;
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_concurrent_benchmark)
+{
+    // Look up the same cached signatures from several threads at once, as the
+    // script-checking threads do when a block's transactions are already in
+    // the mempool, and report the throughput
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    std::vector<uint256> vHash;
+    std::vector<std::vector<unsigned char> > vSig;
+    for (int i = 0; i < 200; i++) {
+        vHash.push_back(GetRandHash());
+        vSig.push_back(std::vector<unsigned char>());
+        BOOST_CHECK(key.Sign(vHash.back(), vSig.back()));
+    }
+
+    // the first pass verifies and stores them
+    bool fOk = true;
+    LookupSignatures(&vHash, &vSig, &pubkey, 1, &fOk);
+    BOOST_CHECK(fOk);
+
+    const int nRounds = 50;
+    for (int nThreads = 1; nThreads <= 4; nThreads *= 2) {
+        CSignatureCacheStats statsBefore = GetSignatureCacheStats();
+        int64_t nStart = GetTimeMicros();
+        bool afOk[4] = {true, true, true, true};
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&LookupSignatures, &vHash, &vSig, &pubkey, nRounds, &afOk[i]));
+        threads.join_all();
+        int64_t nElapsed = std::max(GetTimeMicros() - nStart, (int64_t)1);
+        CSignatureCacheStats stats = GetSignatureCacheStats();
+
+        for (int i = 0; i < nThreads; i++)
+            BOOST_CHECK(afOk[i]);
+        uint64_t nLookups = (uint64_t)nThreads * nRounds * vHash.size();
+        BOOST_CHECK_EQUAL(stats.nHits - statsBefore.nHits, nLookups);
+        BOOST_TEST_MESSAGE(strprintf("sigcache lookups with %d thread(s): %u in %.2fms (%.0f/s)",
+            nThreads, nLookups, nElapsed * 0.001, nLookups * 1000000.0 / nElapsed));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
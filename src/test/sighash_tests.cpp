@@ -161,6 +161,29 @@ BOOST_AUTO_TEST_CASE(sighash_test)
     #endif
 }
 
+// Goal: check that the precomputed witness sighash parts give the same result as hashing from scratch
+BOOST_AUTO_TEST_CASE(sighash_precomputed)
+{
+    seed_insecure_rand(false);
+
+    for (int i=0; i<1000; i++) {
+        int nHashType = insecure_rand();
+        CMutableTransaction txMut;
+        RandomTransaction(txMut, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        const CTransaction txTo(txMut);
+        const PrecomputedTransactionData txdata(txTo);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        CAmount amount = insecure_rand() % 100000000;
+
+        for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++) {
+            uint256 sh = SignatureHash(scriptCode, txTo, nIn, nHashType, amount, SIGVERSION_WITNESS_V0);
+            uint256 shc = SignatureHash(scriptCode, txTo, nIn, nHashType, amount, SIGVERSION_WITNESS_V0, &txdata);
+            BOOST_CHECK(sh == shc);
+        }
+    }
+}
+
 // Goal: check that SignatureHash generates correct hash
 BOOST_AUTO_TEST_CASE(sighash_from_data)
 {
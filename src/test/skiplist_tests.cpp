@@ -99,4 +99,52 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(chainhashes_test)
+{
+    // A main chain and a side branch forking off at height 500
+    std::vector<uint256> vHashMain(1000), vHashSide(1000);
+    std::vector<CBlockIndex> vBlocksMain(1000), vBlocksSide(1000);
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        vHashMain[i] = i;
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].phashBlock = &vHashMain[i];
+    }
+    for (unsigned int i=0; i<vBlocksSide.size(); i++) {
+        vHashSide[i] = i + 1000000;
+        vBlocksSide[i].nHeight = i + 500;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[499];
+        vBlocksSide[i].phashBlock = &vHashSide[i];
+    }
+
+    CChain chain;
+    CChainHashes hashes;
+    uint256 hash;
+    int nHeight;
+    BOOST_CHECK_EQUAL(hashes.Height(), -1);
+    BOOST_CHECK(!hashes.GetHash(0, hash));
+    BOOST_CHECK(!hashes.GetHash(-1, hash));
+
+    for (int nStep = 0; nStep < 3; nStep++) {
+        CBlockIndex* pindexTip = (nStep == 1) ? &vBlocksSide.back() : &vBlocksMain[700 + nStep];
+        chain.SetTip(pindexTip);
+        hashes.SetTip(pindexTip);
+        BOOST_CHECK_EQUAL(hashes.Height(), chain.Height());
+        for (int h = 0; h <= chain.Height(); h++) {
+            BOOST_CHECK(hashes.GetHash(h, hash));
+            BOOST_CHECK(hash == chain[h]->GetBlockHash());
+        }
+        BOOST_CHECK(!hashes.GetHash(chain.Height() + 1, hash));
+        BOOST_CHECK(hashes.GetHash(-1, hash, &nHeight));
+        BOOST_CHECK(hash == pindexTip->GetBlockHash());
+        BOOST_CHECK_EQUAL(nHeight, chain.Height());
+        BOOST_CHECK(hashes.GetHash(-2, hash, &nHeight));
+        BOOST_CHECK(hash == pindexTip->pprev->GetBlockHash());
+        BOOST_CHECK(!hashes.GetHash(-chain.Height() - 2, hash));
+    }
+
+    hashes.SetTip(NULL);
+    BOOST_CHECK_EQUAL(hashes.Height(), -1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
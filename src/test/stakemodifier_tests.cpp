@@ -0,0 +1,93 @@
+// Copyright (c) 2020 StakeCubeCoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "kernel.h"
+#include "main.h"
+#include "random.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#define CHAIN_LENGTH 5000
+
+BOOST_AUTO_TEST_SUITE(stakemodifier_tests)
+
+// Reference lookup: walk forward from nHeightFrom like GetKernelStakeModifier used to
+static const CBlockIndex* WalkToModifierBlock(const std::vector<CBlockIndex>& vIndex, int nHeightTip, int nHeightFrom, int64_t nTimeTarget)
+{
+    for (int i = nHeightFrom + 1; i <= nHeightTip; i++) {
+        if (vIndex[i].GeneratedStakeModifier() && vIndex[i].GetBlockTime() >= nTimeTarget)
+            return &vIndex[i];
+    }
+    return NULL;
+}
+
+BOOST_AUTO_TEST_CASE(stakemodifier_index_lookup)
+{
+    CBlockIndex* pindexOldTip = chainActive.Tip();
+
+    std::vector<uint256> vHash(CHAIN_LENGTH);
+    std::vector<CBlockIndex> vIndex(CHAIN_LENGTH);
+    int64_t nTime = 1500000000;
+    for (int i = 0; i < CHAIN_LENGTH; i++) {
+        // mostly increasing timestamps with some jitter backwards
+        nTime += 60 - (insecure_rand() % 90);
+        vHash[i] = i;
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].nHeight = i;
+        vIndex[i].nTime = nTime;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].BuildSkip();
+        vIndex[i].SetStakeModifier(i, i == 0 || insecure_rand() % 3 == 0);
+        vIndex[i].BuildStakeModifierLink();
+        BOOST_CHECK(vIndex[i].pstakeModifier && vIndex[i].pstakeModifier->GeneratedStakeModifier());
+    }
+
+    chainActive.SetTip(&vIndex[CHAIN_LENGTH - 1]);
+    stakeModifierIndex.Rebuild(chainActive);
+
+    int nAnswered = 0;
+    for (int i = 0; i < 2000; i++) {
+        int nHeightFrom = insecure_rand() % CHAIN_LENGTH;
+        int64_t nTimeTarget = vIndex[nHeightFrom].GetBlockTime() + insecure_rand() % 3000;
+        const CBlockIndex* pindexFound = NULL;
+        if (stakeModifierIndex.FindModifierBlock(nHeightFrom, nTimeTarget, pindexFound)) {
+            BOOST_CHECK(pindexFound == WalkToModifierBlock(vIndex, chainActive.Height(), nHeightFrom, nTimeTarget));
+            nAnswered++;
+        }
+    }
+    BOOST_CHECK(nAnswered > 0);
+
+    // Disconnecting and reconnecting tips keeps the index in step with chainActive
+    for (int i = 0; i < 100; i++) {
+        CBlockIndex* pindexDelete = chainActive.Tip();
+        chainActive.SetTip(pindexDelete->pprev);
+        stakeModifierIndex.BlockDisconnected(pindexDelete);
+    }
+    for (int i = 0; i < 200; i++) {
+        int nHeightFrom = chainActive.Height() - 1 - insecure_rand() % 300;
+        int64_t nTimeTarget = vIndex[nHeightFrom].GetBlockTime() + insecure_rand() % 3000;
+        const CBlockIndex* pindexFound = NULL;
+        if (stakeModifierIndex.FindModifierBlock(nHeightFrom, nTimeTarget, pindexFound))
+            BOOST_CHECK(pindexFound == WalkToModifierBlock(vIndex, chainActive.Height(), nHeightFrom, nTimeTarget));
+    }
+    while (chainActive.Height() < CHAIN_LENGTH - 1) {
+        CBlockIndex* pindexNew = &vIndex[chainActive.Height() + 1];
+        chainActive.SetTip(pindexNew);
+        stakeModifierIndex.BlockConnected(pindexNew);
+    }
+    for (int i = 0; i < 200; i++) {
+        int nHeightFrom = chainActive.Height() - 1 - insecure_rand() % 300;
+        int64_t nTimeTarget = vIndex[nHeightFrom].GetBlockTime() + insecure_rand() % 3000;
+        const CBlockIndex* pindexFound = NULL;
+        if (stakeModifierIndex.FindModifierBlock(nHeightFrom, nTimeTarget, pindexFound))
+            BOOST_CHECK(pindexFound == WalkToModifierBlock(vIndex, chainActive.Height(), nHeightFrom, nTimeTarget));
+    }
+
+    chainActive.SetTip(pindexOldTip);
+    stakeModifierIndex.Rebuild(chainActive);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
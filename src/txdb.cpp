@@ -7,23 +7,93 @@
 
 #include "txdb.h"
 
+#include "init.h"
 #include "main.h"
+#include "memusage.h"
 #include "pow.h"
 #include "random.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
 
+#include <deque>
+#include <map>
 #include <stdint.h>
 
 #include <boost/thread.hpp>
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+static const char DB_COIN = 'C';
+static const char DB_COINS = 'c';
+
+namespace
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+/** Key of a 'C' record: the outpoint, with its index as a VARINT. */
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(key);
+        READWRITE(outpoint->hash);
+        READWRITE(VARINT(outpoint->n));
+    }
+};
+
+/** A whole transaction's unspent outputs as stored under 'c' keys before the
+ *  per-outpoint layout. Only read back, by CCoinsViewDB::Upgrade. */
+class CLegacyCoins
+{
+public:
+    bool fCoinBase;
+    bool fCoinStake;
+    std::vector<CTxOut> vout;
+    int nHeight;
+    int nVersion;
+
+    CLegacyCoins() : fCoinBase(false), fCoinStake(false), nHeight(0), nVersion(0) {}
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned int nCode = 0;
+        // version
+        ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
+        // header code
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;         //0001 - means coinbase
+        fCoinStake = (nCode & 2) != 0; //0010 coinstake
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 4) != 0; // 0100
+        vAvail[1] = (nCode & 8) != 0; // 1000
+        unsigned int nMaskCode = (nCode / 16) + ((nCode & 12) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
@@ -31,22 +101,57 @@ void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), nPendingUsage(0), fPending(false), fStop(false)
 {
+    threadWriter = boost::thread(boost::bind(&CCoinsViewDB::ThreadWrite, this));
 }
 
-bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
+CCoinsViewDB::~CCoinsViewDB()
 {
-    return db.Read(make_pair('c', txid), coins);
+    {
+        boost::unique_lock<boost::mutex> lock(mutexPending);
+        fStop = true;
+        condPending.notify_all();
+    }
+    // the writer finishes the batch in flight before it stops
+    threadWriter.join();
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256& txid) const
+bool CCoinsViewDB::GetCoin(const COutPoint& outpoint, Coin& coin) const
 {
-    return db.Exists(make_pair('c', txid));
+    {
+        boost::unique_lock<boost::mutex> lock(mutexPending);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(outpoint);
+            if (it != mapPending.end()) {
+                coin = it->second.coin;
+                return !coin.IsSpent();
+            }
+        }
+    }
+    return db.Read(CoinEntry(&outpoint), coin);
+}
+
+bool CCoinsViewDB::HaveCoin(const COutPoint& outpoint) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexPending);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(outpoint);
+            if (it != mapPending.end())
+                return !it->second.coin.IsSpent();
+        }
+    }
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
 {
+    {
+        boost::unique_lock<boost::mutex> lock(mutexPending);
+        if (fPending && hashPending != uint256(0))
+            return hashPending;
+    }
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return uint256(0);
@@ -55,23 +160,178 @@ uint256 CCoinsViewDB::GetBestBlock() const
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
 {
+    int64_t nStart = GetTimeMicros();
+    boost::unique_lock<boost::mutex> lock(mutexPending);
+    while (fPending)
+        condPending.wait(lock);
+    writeStats.nWaitMicros += GetTimeMicros() - nStart;
+    if (!strWriteError.empty())
+        return error("%s : previous write to the coin database failed - %s", __func__, strWriteError);
+
+    mapPending.swap(mapCoins);
+    mapCoins.clear();
+    nPendingUsage = memusage::DynamicUsage(mapPending);
+    for (CCoinsMap::const_iterator it = mapPending.begin(); it != mapPending.end(); ++it)
+        nPendingUsage += it->second.coin.DynamicMemoryUsage();
+    hashPending = hashBlock;
+    fPending = true;
+    condPending.notify_all();
+    return true;
+}
+
+bool CCoinsViewDB::WaitForWrites() const
+{
+    boost::unique_lock<boost::mutex> lock(mutexPending);
+    while (fPending)
+        condPending.wait(lock);
+    return strWriteError.empty();
+}
+
+bool CCoinsViewDB::IsWriting() const
+{
+    boost::unique_lock<boost::mutex> lock(mutexPending);
+    return fPending;
+}
+
+size_t CCoinsViewDB::PendingMemoryUsage() const
+{
+    boost::unique_lock<boost::mutex> lock(mutexPending);
+    return fPending ? nPendingUsage : 0;
+}
+
+CCoinsDBWriteStats CCoinsViewDB::GetWriteStats() const
+{
+    boost::unique_lock<boost::mutex> lock(mutexPending);
+    return writeStats;
+}
+
+void CCoinsViewDB::ThreadWrite()
+{
+    RenameThread("stakecubecoin-coindb");
+    boost::unique_lock<boost::mutex> lock(mutexPending);
+    while (true) {
+        while (!fPending && !fStop)
+            condPending.wait(lock);
+        if (!fPending)
+            return;
+
+        // Nothing else changes mapPending while fPending is set, and lookups
+        // only read it, so it can be written out without holding the lock.
+        lock.unlock();
+        std::string strError;
+        try {
+            WriteCoins(mapPending, hashPending);
+        } catch (const std::exception& e) {
+            strError = e.what();
+            LogPrintf("%s : failed to write to coin database - %s\n", __func__, strError);
+        }
+        lock.lock();
+
+        if (!strError.empty())
+            strWriteError = strError;
+        mapPending.clear();
+        nPendingUsage = 0;
+        hashPending = uint256(0);
+        fPending = false;
+        condPending.notify_all();
+    }
+}
+
+void CCoinsViewDB::WriteCoins(const CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    int64_t nStart = GetTimeMicros();
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
+            else
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    db.WriteBatch(batch);
+
+    int64_t nTime = GetTimeMicros() - nStart;
+    LogPrint("bench", "    - Write coin database: %.2fms (%u KiB)\n", 0.001 * nTime, (unsigned int)(batch.SizeEstimate() >> 10));
+    boost::unique_lock<boost::mutex> lock(mutexPending);
+    writeStats.nBatches++;
+    writeStats.nEntries += changed;
+    writeStats.nBytes += batch.SizeEstimate();
+    writeStats.nLastMicros = nTime;
+    writeStats.nMaxMicros = std::max(writeStats.nMaxMicros, nTime);
+    writeStats.nTotalMicros += nTime;
+}
+
+bool CCoinsViewDB::Upgrade()
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << DB_COINS;
+    pcursor->Seek(ssKeySet.str());
+    if (!pcursor->Valid() || pcursor->key()[0] != DB_COINS)
+        return true;
+
+    LogPrintf("Upgrading coin database to the per-output format...\n");
+    uiInterface.InitMessage(_("Upgrading coin database..."));
+    int64_t nStart = GetTimeMillis();
+    size_t nTxs = 0, nOutputs = 0;
+    CLevelDBBatch batch;
+    size_t nBatch = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != DB_COINS)
+                break;
+            uint256 txhash;
+            ssKey >> txhash;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CLegacyCoins coins;
+            ssValue >> coins;
+            // Each record is rewritten and erased in the same batch, so an
+            // interrupted upgrade resumes with the records that are left.
+            COutPoint outpoint(txhash, 0);
+            for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                if (!coins.vout[i].IsNull() && !coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    outpoint.n = i;
+                    batch.Write(CoinEntry(&outpoint), Coin(coins.vout[i], coins.nHeight, coins.fCoinBase, coins.fCoinStake));
+                    nOutputs++;
+                    nBatch++;
+                }
+            }
+            batch.Erase(make_pair(DB_COINS, txhash));
+            nTxs++;
+            nBatch++;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+        if (nBatch >= 100000) {
+            if (!db.WriteBatch(batch))
+                return false;
+            batch = CLevelDBBatch();
+            nBatch = 0;
+        }
+        pcursor->Next();
+    }
+    if (!db.WriteBatch(batch))
+        return false;
+    LogPrintf("Upgraded %u transactions into %u transaction outputs in %dms\n", (unsigned int)nTxs, (unsigned int)nOutputs, GetTimeMillis() - nStart);
+    return !ShutdownRequested();
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
@@ -121,57 +381,71 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
+static void ApplyStats(CCoinsStats& stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    const Coin& first = outputs.begin()->second;
+    ss << hash;
+    ss << VARINT(first.nHeight * 4 + (first.fCoinBase ? 2 : 0) + (first.fCoinStake ? 1 : 0));
+    stats.nTransactions++;
+    for (std::map<uint32_t, Coin>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        ss << VARINT(it->first + 1);
+        ss << it->second.out;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += it->second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
 {
+    if (!WaitForWrites())
+        return false;
+
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << DB_COIN;
+    pcursor->Seek(ssKeySet.str());
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    // outputs are stored in key order, so those of one transaction are adjacent
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+            COutPoint outpoint;
+            CoinEntry entry(&outpoint);
+            ssKey >> entry;
+            if (entry.key != DB_COIN)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            Coin coin;
+            ssValue >> coin;
+            if (!outputs.empty() && outpoint.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs);
+                outputs.clear();
             }
+            prevkey = outpoint.hash;
+            outputs[outpoint.n] = coin;
+            stats.nSerializedSize += 32 + slValue.size();
             pcursor->Next();
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
+    if (!outputs.empty())
+        ApplyStats(stats, ss, prevkey, outputs);
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -261,6 +535,128 @@ bool CBlockTreeDB::ReadInt(const std::string& name, int& nValue)
     return Read(std::make_pair('I', name), nValue);
 }
 
+namespace
+{
+/**
+ * Decodes the 'b' entries of a block tree cursor on a worker thread and hands
+ * them over in batches, so LevelDB iteration and deserialization overlap with
+ * linking the index on the loading thread. The block hash is taken from the
+ * key it was stored under instead of being recomputed from the header.
+ */
+class CBlockIndexDecoder
+{
+public:
+    typedef std::vector<std::pair<uint256, CDiskBlockIndex> > Batch;
+
+private:
+    static const size_t BATCH_SIZE = 1024;
+    static const size_t MAX_QUEUED_BATCHES = 16;
+
+    leveldb::Iterator* pcursor;
+    bool fCheckHashes;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<Batch> queue;
+    bool fDone;
+    bool fStop;
+    std::string strError;
+    boost::thread thread;
+
+    bool Push(Batch& batch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && queue.size() >= MAX_QUEUED_BATCHES)
+            cond.wait(lock);
+        if (fStop)
+            return false;
+        queue.push_back(Batch());
+        queue.back().swap(batch);
+        cond.notify_all();
+        return true;
+    }
+
+    void Run()
+    {
+        Batch batch;
+        batch.reserve(BATCH_SIZE);
+        std::string strErr;
+        try {
+            while (pcursor->Valid()) {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType != 'b')
+                    break;
+                uint256 hash;
+                ssKey >> hash;
+
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                batch.push_back(std::make_pair(hash, CDiskBlockIndex()));
+                ssValue >> batch.back().second;
+                if (fCheckHashes && batch.back().second.ConstructBlockHash() != hash)
+                    throw std::runtime_error(strprintf("block index entry %s does not match its header", hash.ToString()));
+
+                pcursor->Next();
+                if (batch.size() == BATCH_SIZE) {
+                    if (!Push(batch))
+                        return;
+                    batch.reserve(BATCH_SIZE);
+                }
+            }
+        } catch (const std::exception& e) {
+            strErr = e.what();
+        }
+
+        if (strErr.empty() && !batch.empty() && !Push(batch))
+            return;
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        strError = strErr;
+        fDone = true;
+        cond.notify_all();
+    }
+
+public:
+    CBlockIndexDecoder(leveldb::Iterator* pcursorIn, bool fCheckHashesIn) : pcursor(pcursorIn), fCheckHashes(fCheckHashesIn), fDone(false), fStop(false)
+    {
+        thread = boost::thread(boost::bind(&CBlockIndexDecoder::Run, this));
+    }
+
+    ~CBlockIndexDecoder()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            cond.notify_all();
+        }
+        thread.join();
+    }
+
+    //! Wait for the next batch; false once the cursor is exhausted or failed
+    bool Next(Batch& batch)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty() && !fDone)
+            cond.wait(lock);
+        if (queue.empty())
+            return false;
+        batch.swap(queue.front());
+        queue.pop_front();
+        cond.notify_all();
+        return true;
+    }
+
+    std::string GetError()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return strError;
+    }
+};
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
@@ -269,23 +665,17 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    uint256 nPreviousCheckpoint;
-    while (pcursor->Valid()) {
+    // Load mapBlockIndex; -checkblockindex still rebuilds every hash from its header
+    CBlockIndexDecoder decoder(pcursor.get(), fCheckBlockIndex);
+    CBlockIndexDecoder::Batch batch;
+    while (decoder.Next(batch)) {
         boost::this_thread::interruption_point();
         try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
+            for (const std::pair<uint256, CDiskBlockIndex>& entry : batch) {
+                const CDiskBlockIndex& diskindex = entry.second;
 
                 // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
+                CBlockIndex* pindexNew = InsertBlockIndex(entry.first);
                 pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
                 pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
                 pindexNew->nHeight = diskindex.nHeight;
@@ -316,15 +706,15 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 // ppcoin: build setStakeSeen
                 if (pindexNew->IsProofOfStake())
                     setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
             }
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
 
+    std::string strError = decoder.GetError();
+    if (!strError.empty())
+        return error("%s : Deserialize or I/O error - %s", __func__, strError);
+
     return true;
-}
\ No newline at end of file
+}
@@ -16,7 +16,10 @@
 #include <utility>
 #include <vector>
 
-class CCoins;
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
 class uint256;
 
 //! -dbcache default (MiB)
@@ -26,20 +29,74 @@ static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/** Counters for the writes to the coin database */
+struct CCoinsDBWriteStats {
+    uint64_t nBatches;     //! batches written
+    uint64_t nEntries;     //! outputs written or erased
+    uint64_t nBytes;       //! approximate size of the batches
+    int64_t nLastMicros;   //! duration of the last write
+    int64_t nMaxMicros;    //! duration of the slowest write
+    int64_t nTotalMicros;  //! duration of all writes
+    int64_t nWaitMicros;   //! time BatchWrite waited for the previous batch to finish
+
+    CCoinsDBWriteStats() : nBatches(0), nEntries(0), nBytes(0), nLastMicros(0), nMaxMicros(0), nTotalMicros(0), nWaitMicros(0) {}
+};
+
+/** CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ * BatchWrite hands the batch to a writer thread and returns, so validation
+ * goes on while the database is written. Lookups see the batch in flight
+ * before the database, and the next BatchWrite waits for it to finish.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
 
+private:
+    mutable boost::mutex mutexPending;
+    mutable boost::condition_variable condPending;
+    //! batch being written, only changed by BatchWrite and the writer thread while fPending is false
+    CCoinsMap mapPending;
+    uint256 hashPending;
+    //! memory used by mapPending and its coins
+    size_t nPendingUsage;
+    bool fPending;
+    bool fStop;
+    //! what went wrong with the last failed write
+    std::string strWriteError;
+    CCoinsDBWriteStats writeStats;
+    boost::thread threadWriter;
+
+    void ThreadWrite();
+    void WriteCoins(const CCoinsMap& mapCoins, const uint256& hashBlock);
+
+    CCoinsViewDB(const CCoinsViewDB&);
+    void operator=(const CCoinsViewDB&);
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
-    bool GetCoins(const uint256& txid, CCoins& coins) const;
-    bool HaveCoins(const uint256& txid) const;
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+
+    //! Wait until the batch handed to BatchWrite is on disk; false if writing it failed
+    bool WaitForWrites() const;
+
+    //! Whether a batch is being written right now
+    bool IsWriting() const;
+
+    //! Memory held by the batch being written, in bytes; it counts against the coins cache limit
+    size_t PendingMemoryUsage() const;
+
+    CCoinsDBWriteStats GetWriteStats() const;
+
+    //! Rewrite coins stored per transaction into one record per unspent output
+    bool Upgrade();
 };
 
 /** Access to the block database (blocks/index/) */
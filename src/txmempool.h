@@ -30,8 +30,9 @@ inline bool AllowFree(double dPriority)
 }
 
 
-/** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
-static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
+/** Fake height value used in Coin to signify they are only in the memory pool (since 0.8);
+ *  the largest value that fits the 30-bit Coin::nHeight */
+static const unsigned int MEMPOOL_HEIGHT = 0x3FFFFFFF;
 
 /**
  * CTxMemPool stores these:
@@ -136,7 +137,7 @@ public:
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void getTransactions(std::set<uint256>& setTxid);
-    void pruneSpent(const uint256& hash, CCoins& coins);
+    bool isSpent(const COutPoint& outpoint);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
@@ -186,8 +187,8 @@ protected:
 
 public:
     CCoinsViewMemPool(CCoinsView* baseIn, CTxMemPool& mempoolIn);
-    bool GetCoins(const uint256& txid, CCoins& coins) const;
-    bool HaveCoins(const uint256& txid) const;
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
 };
 
 #endif // BITCOIN_TXMEMPOOL_H
@@ -6,71 +6,110 @@
 #ifndef BITCOIN_UNDO_H
 #define BITCOIN_UNDO_H
 
+#include "coins.h"
 #include "compressor.h"
+#include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "serialize.h"
+#include "version.h"
 
 /** Undo information for a CTxIn
  *
- *  Contains the prevout's CTxOut being spent, and if this was the
- *  last output of the affected transaction, its metadata as well
- *  (coinbase or not, height, transaction version)
+ *  Contains the prevout's CTxOut being spent, and its metadata as well
+ *  (coinbase or not, coinstake or not, height). The serialization contains
+ *  a dummy value of zero in the place the transaction version used to be,
+ *  so undo files written before the per-outpoint UTXO set stay readable.
+ *  Entries from those files only carry the metadata for the last spent
+ *  output of a transaction; the others are read back with nHeight == 0.
  */
-class CTxInUndo
+class CTxInUndoSerializer
 {
-public:
-    CTxOut txout;   // the txout data before being spent
-    bool fCoinBase; // if the outpoint was the last unspent: whether it belonged to a coinbase
-    bool fCoinStake;
-    unsigned int nHeight; // if the outpoint was the last unspent: its height
-    int nVersion;         // if the outpoint was the last unspent: its version
-
-    CTxInUndo() : txout(), fCoinBase(false), fCoinStake(false), nHeight(0), nVersion(0) {}
-    CTxInUndo(const CTxOut& txoutIn, bool fCoinBaseIn = false, bool fCoinStakeIn = false, unsigned int nHeightIn = 0, int nVersionIn = 0) : txout(txoutIn), fCoinBase(fCoinBaseIn), fCoinStake(fCoinStakeIn), nHeight(nHeightIn), nVersion(nVersionIn) {}
+    const Coin* txout;
 
+public:
     unsigned int GetSerializeSize(int nType, int nVersion) const
     {
-        return ::GetSerializeSize(VARINT(nHeight * 4 + (fCoinBase ? 2 : 0) + (fCoinStake ? 1 : 0)), nType, nVersion) +
-               (nHeight > 0 ? ::GetSerializeSize(VARINT(this->nVersion), nType, nVersion) : 0) +
-               ::GetSerializeSize(CTxOutCompressor(REF(txout)), nType, nVersion);
+        return ::GetSerializeSize(VARINT(txout->nHeight * 4 + (txout->fCoinBase ? 2 : 0) + (txout->fCoinStake ? 1 : 0)), nType, nVersion) +
+               (txout->nHeight > 0 ? 1 : 0) +
+               ::GetSerializeSize(CTxOutCompressor(REF(txout->out)), nType, nVersion);
     }
 
     template <typename Stream>
     void Serialize(Stream& s, int nType, int nVersion) const
     {
-        ::Serialize(s, VARINT(nHeight * 4 + (fCoinBase ? 2 : 0) + (fCoinStake ? 1 : 0)), nType, nVersion);
-        if (nHeight > 0)
-            ::Serialize(s, VARINT(this->nVersion), nType, nVersion);
-        ::Serialize(s, CTxOutCompressor(REF(txout)), nType, nVersion);
+        ::Serialize(s, VARINT(txout->nHeight * 4 + (txout->fCoinBase ? 2 : 0) + (txout->fCoinStake ? 1 : 0)), nType, nVersion);
+        if (txout->nHeight > 0) {
+            // Required to maintain compatibility with older undo format.
+            ::Serialize(s, (unsigned char)0, nType, nVersion);
+        }
+        ::Serialize(s, CTxOutCompressor(REF(txout->out)), nType, nVersion);
     }
 
+    CTxInUndoSerializer(const Coin* coin) : txout(coin) {}
+};
+
+class CTxInUndoDeserializer
+{
+    Coin* txout;
+
+public:
     template <typename Stream>
     void Unserialize(Stream& s, int nType, int nVersion)
     {
         unsigned int nCode = 0;
         ::Unserialize(s, VARINT(nCode), nType, nVersion);
-        nHeight = nCode >> 2;
-        fCoinBase = nCode & 2;
-        fCoinStake = nCode & 1;
-        if (nHeight > 0)
-            ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
-        ::Unserialize(s, REF(CTxOutCompressor(REF(txout))), nType, nVersion);
+        txout->nHeight = nCode >> 2;
+        txout->fCoinBase = (nCode & 2) != 0;
+        txout->fCoinStake = (nCode & 1) != 0;
+        if (txout->nHeight > 0) {
+            // Old versions stored the version number for the last spend of
+            // a transaction's outputs. Non-final spends were indicated with
+            // height = 0.
+            int nVersionDummy;
+            ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        }
+        ::Unserialize(s, REF(CTxOutCompressor(REF(txout->out))), nType, nVersion);
     }
+
+    CTxInUndoDeserializer(Coin* coin) : txout(coin) {}
 };
 
+static const size_t MAX_INPUTS_PER_BLOCK = MAX_BLOCK_SIZE_CURRENT / ::GetSerializeSize(CTxIn(), SER_NETWORK, PROTOCOL_VERSION);
+
 /** Undo information for a CTransaction */
 class CTxUndo
 {
 public:
     // undo information for all txins
-    std::vector<CTxInUndo> vprevout;
+    std::vector<Coin> vprevout;
 
-    ADD_SERIALIZE_METHODS;
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = GetSizeOfCompactSize(vprevout.size());
+        for (const Coin& prevout : vprevout)
+            nSize += ::GetSerializeSize(CTxInUndoSerializer(&prevout), nType, nVersion);
+        return nSize;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, vprevout.size());
+        for (const Coin& prevout : vprevout)
+            ::Serialize(s, CTxInUndoSerializer(&prevout), nType, nVersion);
+    }
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
     {
-        READWRITE(vprevout);
+        uint64_t count = ReadCompactSize(s);
+        if (count > MAX_INPUTS_PER_BLOCK)
+            throw std::ios_base::failure("Too many input undo records");
+        vprevout.resize(count);
+        for (Coin& prevout : vprevout) {
+            CTxInUndoDeserializer deserializer(&prevout);
+            ::Unserialize(s, deserializer, nType, nVersion);
+        }
     }
 };
 
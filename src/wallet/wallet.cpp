@@ -3148,12 +3148,13 @@ bool CWallet::CreateTransactionHelper(const std::vector<std::pair<CScript, CAmou
                 // Sign
                 int nIn = 0;
                 CTransaction txNewConst(txNew);
+                PrecomputedTransactionData txdata(txNewConst);
                 for (const PAIRTYPE(const CWalletTx*,unsigned int)& coin : setCoins)
                 {
                     const CScript& scriptPubKey = coin.first->vout[coin.second].scriptPubKey;
                     SignatureData sigdata;
 
-                    if (!ProduceSignature(TransactionSignatureCreator(this, &txNewConst, nIn, coin.first->vout[coin.second].nValue, SIGHASH_ALL), scriptPubKey, sigdata))
+                    if (!ProduceSignature(TransactionSignatureCreator(this, &txNewConst, nIn, coin.first->vout[coin.second].nValue, SIGHASH_ALL, txdata), scriptPubKey, sigdata))
                     {
                         strFailReason = _("Signing transaction failed");
                         return false;
@@ -3270,8 +3271,10 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (GetAdjustedTime() <= chainActive.Tip()->nTime)
         MilliSleep(10000);
 
+    // Resolve the block each stake input came from, then let the kernel search engine hash them
+    vector<const CWalletTx*> vKernelTx;
+    vector<CStakeKernelInput> vKernelInputs;
     for (PAIRTYPE(const CWalletTx*, unsigned int) pcoin : setStakeCoins) {
-        //make sure that enough time has elapsed between
         CBlockIndex* pindex = NULL;
         BlockMap::iterator it = mapBlockIndex.find(pcoin.first->hashBlock);
         if (it != mapBlockIndex.end())
@@ -3282,74 +3285,67 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
             continue;
         }
 
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
+        vKernelTx.push_back(pcoin.first);
+        vKernelInputs.push_back(CStakeKernelInput(COutPoint(pcoin.first->GetHash(), pcoin.second), pcoin.first->vout[pcoin.second].nValue, pindex));
+    }
 
-        uint256 hashProofOfStake = 0;
-        COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-        nTxNewTime = GetAdjustedTime();
+    //only accept kernels that will pass time requirements
+    uint256 hashProofOfStake = 0;
+    nTxNewTime = GetAdjustedTime();
+    int nKernel = SearchStakeKernels(nBits, vKernelInputs, nTxNewTime, nHashDrift, chainActive.Tip()->GetMedianTimePast(), hashProofOfStake);
+    if (nKernel >= 0) {
+        const CWalletTx* pcoinKernel = vKernelTx[nKernel];
+        unsigned int nKernelOut = vKernelInputs[nKernel].prevout.n;
 
-        //iterates each utxo inside of CheckStakeKernelHash()
-        if (CheckStakeKernelHash(nBits, block, *pcoin.first, prevoutStake, nTxNewTime, nHashDrift, false, hashProofOfStake, true)) {
-            //Double check that this will pass time requirements
-            if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
-                LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
-                continue;
-            }
+        // Found a kernel
+        if (fDebug && GetBoolArg("-printcoinstake", false))
+            LogPrintf("CreateCoinStake : kernel found\n");
 
-            // Found a kernel
-            if (fDebug && GetBoolArg("-printcoinstake", false))
-                LogPrintf("CreateCoinStake : kernel found\n");
-
-            vector<valtype> vSolutions;
-            txnouttype whichType;
-            CScript scriptPubKeyOut;
-            scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-            if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
-                LogPrintf("CreateCoinStake : failed to parse kernel\n");
-                break;
-            }
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoinKernel->vout[nKernelOut].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
+            LogPrintf("CreateCoinStake : failed to parse kernel\n");
+            return false;
+        }
+        if (fDebug && GetBoolArg("-printcoinstake", false))
+            LogPrintf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH && whichType != TX_WITNESS_V0_KEYHASH) {
             if (fDebug && GetBoolArg("-printcoinstake", false))
-                LogPrintf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-            if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH && whichType != TX_WITNESS_V0_KEYHASH) {
+                LogPrintf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+            return false; // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            //convert to pay to public key type
+            CKey key;
+            if (!keystore.GetKey(uint160(vSolutions[0]), key)) {
                 if (fDebug && GetBoolArg("-printcoinstake", false))
-                    LogPrintf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                break; // only support pay to public key and pay to address
+                    LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                return false; // unable to find corresponding public key
             }
-            if (whichType == TX_PUBKEYHASH) // pay to address type
-            {
-                //convert to pay to public key type
-                CKey key;
-                if (!keystore.GetKey(uint160(vSolutions[0]), key)) {
-                    if (fDebug && GetBoolArg("-printcoinstake", false))
-                        LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                    break; // unable to find corresponding public key
-                }
 
-                scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-            } else
-                scriptPubKeyOut = scriptPubKeyKernel;
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        } else
+            scriptPubKeyOut = scriptPubKeyKernel;
 
-            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-            nCredit += pcoin.first->vout[pcoin.second].nValue;
-            vwtxPrev.push_back(pcoin.first);
-            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        txNew.vin.push_back(CTxIn(vKernelInputs[nKernel].prevout));
+        nCredit += pcoinKernel->vout[nKernelOut].nValue;
+        vwtxPrev.push_back(pcoinKernel);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
 
-            //presstab HyperStake - calculate the total size of our new output including the stake reward so that we can use it to decide whether to split the stake outputs
-            const CBlockIndex* pIndex0 = chainActive.Tip();
-            uint64_t nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetBlockValue(pIndex0->nHeight);
+        //presstab HyperStake - calculate the total size of our new output including the stake reward so that we can use it to decide whether to split the stake outputs
+        const CBlockIndex* pIndex0 = chainActive.Tip();
+        uint64_t nTotalSize = pcoinKernel->vout[nKernelOut].nValue + GetBlockValue(pIndex0->nHeight);
 
-            //presstab HyperStake - if MultiSend is set to send in coinstake we will add our outputs here (values asigned further down)
-            if (nTotalSize / 2 > nStakeSplitThreshold * COIN)
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        //presstab HyperStake - if MultiSend is set to send in coinstake we will add our outputs here (values asigned further down)
+        if (nTotalSize / 2 > nStakeSplitThreshold * COIN)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
 
-            if (fDebug && GetBoolArg("-printcoinstake", false))
-                LogPrintf("CreateCoinStake : added kernel type=%d\n", whichType);
-            fKernelFound = true;
-            break;
-        }
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        if (fDebug && GetBoolArg("-printcoinstake", false))
+            LogPrintf("CreateCoinStake : added kernel type=%d\n", whichType);
+        fKernelFound = true;
     }
     if (!fKernelFound)
         return false;
@@ -3392,8 +3388,9 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 
     // Sign
     int nIn = 0;
+    const PrecomputedTransactionData txdata((CTransaction(txNew)));
     for (const CWalletTx* pcoin : vwtxPrev) {
-        if (!SignSignature(*this, *pcoin, txNew, nIn++, SIGHASH_ALL))
+        if (!SignSignature(*this, *pcoin, txNew, nIn++, SIGHASH_ALL, &txdata))
             return error("CreateCoinStake : failed to sign coinstake");
     }
 